@@ -39,6 +39,8 @@ RSA_get0_key(const RSA *r, const BIGNUM **n, const BIGNUM **e, const BIGNUM **d)
     }
 }
 
+#define X509_up_ref(x) CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+
 #endif
 
 static int 
@@ -108,6 +110,53 @@ add_key_value( char * key, char * value, char buffer[] ) {
 }
 
 
+/*
+ * Run a CA call-out with one of its persistent helpers, if it has
+ * some, giving it input and, if request is set, the PEM request after
+ * it.  On success, *output holds what the helper returned.
+ * Returns 0 on success, -1 on error, or 1 if the program should be
+ * run directly.
+ */
+static int
+callout_helper(int pool, const char *input, X509_REQ *request, BIO **output)
+{
+  BIO    *bio;
+  char   *data, *response = NULL;
+  long    len;
+  size_t  response_len;
+  int     rc;
+
+  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    verror_put_string("BIO_new() failed");
+    ssl_error_to_verror();
+    return -1;
+  }
+  BIO_puts(bio, input);
+  if (request) {
+    BIO_puts(bio, "\n");
+    PEM_write_bio_X509_REQ(bio, request);
+  }
+  len = BIO_get_mem_data(bio, &data);
+  rc = myproxy_coproc_call(pool, data, len, &response, &response_len);
+  OPENSSL_cleanse(data, len);       /* may hold the passphrase */
+  BIO_free(bio);
+  if (rc != 0) {
+    return rc;
+  }
+
+  if ((*output = BIO_new(BIO_s_mem())) == NULL ||
+      BIO_write(*output, response, response_len) != (int)response_len) {
+    verror_put_string("Failed to buffer call-out helper output");
+    ssl_error_to_verror();
+    if (*output) BIO_free(*output);
+    *output = NULL;
+    rc = -1;
+  }
+  free(response);
+
+  return rc;
+}
+
 static int 
 external_callout( X509_REQ                 *request, 
 		  X509                     **cert,
@@ -125,6 +174,7 @@ external_callout( X509_REQ                 *request,
 
   FILE * pipestream = NULL;
   X509 * certificate = NULL;
+  BIO  * output = NULL;
 
   memset(buffer, '\0', BUF_SIZE);
   memset(intbuf, '\0', 128);
@@ -132,20 +182,6 @@ external_callout( X509_REQ                 *request,
   myproxy_debug("callout using: %s", 
 		server_context->certificate_issuer_program);
 
-  if ((pid = myproxy_popen(fds,
-			   server_context->certificate_issuer_program,
-			   NULL)) < 0) {
-    return -1; /* myproxy_popen will set verror */
-  }
-
-  /* writing to program */
-  pipestream = fdopen( fds[0], "w" );
-
-  if ( pipestream == NULL ) {
-    verror_put_string("File stream to stdin pipe creation problem.");
-    return 1;
-  }
-
   add_key_value( "username", client_request->username, buffer );
   add_key_value( "passphrase", client_request->passphrase, buffer );
 
@@ -166,6 +202,38 @@ external_callout( X509_REQ                 *request,
   add_key_value( "max_cert_lifetime", (char*)intbuf, buffer );
   memset(intbuf, '\0', 128);
 
+  /* a persistent helper gets what the program reads from stdin */
+  switch (callout_helper(MYPROXY_COPROC_ISSUER, buffer, request, &output)) {
+  case 0:
+    certificate = PEM_read_bio_X509( output, NULL, NULL, NULL );
+    BIO_free( output );
+    if (certificate == NULL) {
+      verror_put_string("Error reading certificate from external program.");
+      ssl_error_to_verror();
+      goto error;
+    }
+    myproxy_debug("Received certificate from call-out helper.");
+    *cert = certificate;
+    return_value = 0;
+    goto error;
+  case -1:
+    goto error;
+  }
+
+  if ((pid = myproxy_popen(fds,
+			   server_context->certificate_issuer_program,
+			   NULL)) < 0) {
+    return -1; /* myproxy_popen will set verror */
+  }
+
+  /* writing to program */
+  pipestream = fdopen( fds[0], "w" );
+
+  if ( pipestream == NULL ) {
+    verror_put_string("File stream to stdin pipe creation problem.");
+    return 1;
+  }
+
   fprintf( pipestream, "%s\n", buffer );
 
   PEM_write_X509_REQ( pipestream, request );
@@ -259,6 +327,152 @@ lock_file(int fd)
     return 0;
 }
 
+/*
+ * Serial numbers reserved from the serial file a block at a time, and
+ * handed out from memory shared by the server processes after
+ * certauth_serial_init().  The serial file always holds the first
+ * serial number not yet reserved, and is synced to disk before any
+ * number from a block is used, so numbers are never reused after a
+ * crash; the rest of a block in use at the time is skipped.  The block
+ * is locked by storing the holder's pid, so if a process dies holding
+ * it, the next one takes the lock over and likewise skips the rest of
+ * the block, which may have been half updated.
+ */
+#define SERIAL_MAX_BYTES 64     /* RFC 5280 allows 20 */
+
+typedef struct serial_block_s {
+  volatile pid_t holder;                 /* process holding the lock, or 0 */
+  int           valid;
+  char          serialfile[MAXPATHLEN];  /* reserved from this file */
+  int           skip;                    /* with this increment */
+  unsigned char next[SERIAL_MAX_BYTES];  /* next serial to hand out */
+  int           next_len;
+  unsigned char end[SERIAL_MAX_BYTES];   /* first serial not reserved */
+  int           end_len;
+} serial_block_t;
+
+static serial_block_t *serial_block = NULL;
+
+int
+certauth_serial_init()
+{
+  if (serial_block) {
+    return 0;
+  }
+  serial_block = mmap(NULL, sizeof(serial_block_t), PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (serial_block == MAP_FAILED) {
+    serial_block = NULL;
+    verror_put_errno(errno);
+    verror_put_string("Failed to map shared serial number block");
+    return -1;
+  }
+  memset(serial_block, 0, sizeof(serial_block_t));
+
+  return 0;
+}
+
+/* Returns with the block locked, taking the lock over from a holder
+   that died, in which case the block is discarded. */
+static void
+serial_block_lock()
+{
+  pid_t me = getpid(), holder;
+
+  while (!__sync_bool_compare_and_swap(&serial_block->holder, 0, me)) {
+    holder = serial_block->holder;
+    if (holder != 0 && kill(holder, 0) < 0 && errno == ESRCH &&
+        __sync_bool_compare_and_swap(&serial_block->holder, holder, me)) {
+      myproxy_log("Process %ld died holding the serial number block; "
+                  "skipping the rest of the block", (long)holder);
+      serial_block->valid = 0;
+      return;
+    }
+    usleep(100);
+  }
+}
+
+static void
+serial_block_unlock()
+{
+  __sync_lock_release(&serial_block->holder);
+}
+
+/*
+ * serial_block_take()
+ *
+ * Take the next serial number in the current block into serial.
+ *
+ * Returns 1 on success, 0 if the block is used up or was reserved
+ * from another file or with another increment, -1 on error.
+ */
+static int
+serial_block_take(const char *serialfile, int skip, BIGNUM *serial)
+{
+  BIGNUM *end = NULL;
+  int retval = -1;
+
+  serial_block_lock();
+  if (!serial_block->valid || serial_block->skip != skip ||
+      strcmp(serial_block->serialfile, serialfile) != 0) {
+    retval = 0;
+    goto done;
+  }
+  if ((end = BN_bin2bn(serial_block->end, serial_block->end_len,
+                       NULL)) == NULL ||
+      BN_bin2bn(serial_block->next, serial_block->next_len,
+                serial) == NULL) {
+    verror_put_string("Error converting to bignum\n");
+    ssl_error_to_verror();
+    goto done;
+  }
+  if (BN_cmp(serial, end) >= 0) {
+    serial_block->valid = 0;
+    retval = 0;
+    goto done;
+  }
+  if (!BN_add_word(serial, skip) ||
+      BN_num_bytes(serial) > SERIAL_MAX_BYTES) {
+    verror_put_string("Error incrementing serial number\n");
+    ssl_error_to_verror();
+    goto done;
+  }
+  serial_block->next_len = BN_bn2bin(serial, serial_block->next);
+  if (!BN_sub_word(serial, skip)) {
+    goto done;
+  }
+  retval = 1;
+
+ done:
+  serial_block_unlock();
+  if (end)
+    BN_free(end);
+
+  return retval;
+}
+
+/*
+ * serial_block_set()
+ *
+ * Start handing out serial numbers from next up to (not including) end.
+ */
+static void
+serial_block_set(const char *serialfile, int skip, const BIGNUM *next,
+                 const BIGNUM *end)
+{
+  if (strlen(serialfile) >= sizeof(serial_block->serialfile) ||
+      BN_num_bytes(end) > SERIAL_MAX_BYTES) {
+    return;
+  }
+  serial_block_lock();
+  strcpy(serial_block->serialfile, serialfile);
+  serial_block->skip = skip;
+  serial_block->next_len = BN_bn2bin(next, serial_block->next);
+  serial_block->end_len = BN_bn2bin(end, serial_block->end);
+  serial_block->valid = 1;
+  serial_block_unlock();
+}
+
 /*
  * serial number handling liberally borrowed from KCA with the addition
  * of file locking
@@ -270,9 +484,10 @@ assign_serial_number( X509 *cert,
 
   int retval = 1;
   long serialset;
+  int skip, block = 1;
 
-  BIGNUM       * serial = NULL;
-  ASN1_INTEGER * current = NULL, * next = NULL;
+  BIGNUM       * serial = NULL, * next = NULL;
+  ASN1_INTEGER * current = NULL, * reserved = NULL;
   char buf[1024];
   char *serialfile = NULL;
 
@@ -294,7 +509,7 @@ assign_serial_number( X509 *cert,
   }
 
   if (server_context->certificate_serialfile) {
-      serialfile = server_context->certificate_serialfile;
+      serialfile = strdup(server_context->certificate_serialfile);
   } else {
       const char *sdir;
       sdir = myproxy_get_storage_dir();
@@ -305,6 +520,21 @@ assign_serial_number( X509 *cert,
       sprintf(serialfile, "%s/serial", sdir);
   }
 
+  skip = server_context->certificate_serial_skip;
+  if (serial_block) {
+      block = server_context->certificate_serial_block;
+  }
+
+  /* use the reserved block, if any is left */
+  if (block > 1) {
+      switch (serial_block_take(serialfile, skip, serial)) {
+      case 1:
+	  goto assign;
+      case -1:
+	  goto error;
+      }
+  }
+
   /* open(), lock, open stream and create BIO */
 
   fd = open( serialfile, O_RDWR|O_CREAT, 0600 );
@@ -318,6 +548,7 @@ assign_serial_number( X509 *cert,
   if ( lock_file(fd) == -1 ) {
     verror_put_string("Failed to get lock on file descriptor\n");
     verror_put_errno(errno);
+    close(fd);
     goto error;
   }
 
@@ -326,9 +557,22 @@ assign_serial_number( X509 *cert,
   if ( serialstream == NULL ) {
     verror_put_string("Unable to open file stream\n");
     verror_put_errno(errno);
+    close(fd);
     goto error;
   }
 
+  /* another process may have reserved a block while we waited */
+  if (block > 1) {
+      switch (serial_block_take(serialfile, skip, serial)) {
+      case 1:
+	  fclose(serialstream);
+	  serialstream = NULL;
+	  goto assign;
+      case -1:
+	  goto error;
+      }
+  }
+
   /* check if file is empty, and if so, initialize with 1 */
   if (fseek(serialstream, 0L, SEEK_END) < 0) {
     verror_put_string("Unable to seek file stream\n");
@@ -356,23 +600,25 @@ assign_serial_number( X509 *cert,
 	  myproxy_debug("Loaded serial number 0x%s from %s", buf, serialfile);
       }
   } else {
-      ASN1_INTEGER_set(current, server_context->certificate_serial_skip);
+      ASN1_INTEGER_set(current, skip);
   }
 
-  serial = BN_bin2bn( current->data, current->length, serial );
-  if ( serial == NULL ) {
+  serial = ASN1_INTEGER_to_BN( current, serial );
+  next = BN_dup( serial );
+  if ( serial == NULL || next == NULL ) {
     verror_put_string("Error converting to bignum\n");
     ssl_error_to_verror();
     goto error;
   }
 
-  if (!BN_add_word(serial, server_context->certificate_serial_skip)) {
+  /* reserve block serial numbers at once */
+  if (!BN_add_word(next, (BN_ULONG)skip * block)) {
     verror_put_string("Error incrementing serial number\n");
     ssl_error_to_verror();
     goto error;
   }
 
-  if (!(next = BN_to_ASN1_INTEGER(serial, NULL))) {
+  if (!(reserved = BN_to_ASN1_INTEGER(next, NULL))) {
     verror_put_string("Error converting new serial to ASN1\n");
     ssl_error_to_verror();
     goto error;
@@ -383,9 +629,25 @@ assign_serial_number( X509 *cert,
     ssl_error_to_verror();
     goto error;
   }
-  i2a_ASN1_INTEGER(serialbio, next);
+  i2a_ASN1_INTEGER(serialbio, reserved);
   BIO_puts(serialbio, "\n");
 
+  /* the reservation must be on disk before we use any of it */
+  if (BIO_flush(serialbio) != 1 || fsync(fileno(serialstream)) < 0) {
+    verror_put_string("Error writing %s\n", serialfile);
+    verror_put_errno(errno);
+    goto error;
+  }
+
+  if (block > 1) {
+      BIGNUM *first;
+
+      if ((first = BN_dup(serial)) != NULL && BN_add_word(first, skip)) {
+	  serial_block_set(serialfile, skip, first, next);
+      }
+      if (first)
+	BN_free(first);
+  }
 
   /* the call to BIO_free with the CLOSE flags will take care of
    * the underlying file stream and close()ing the file descriptor,
@@ -396,7 +658,9 @@ assign_serial_number( X509 *cert,
   serialbio    = NULL;
   serialstream = NULL;
 
-  if (!X509_set_serialNumber(cert, current)) {
+ assign:
+  if (!BN_to_ASN1_INTEGER(serial, current) ||
+      !X509_set_serialNumber(cert, current)) {
     verror_put_string("Error assigning serialnumber\n");
     ssl_error_to_verror();
     goto error;
@@ -409,15 +673,18 @@ assign_serial_number( X509 *cert,
  error:
   if (serial)
     BN_free(serial);
+  if (next)
+    BN_free(next);
   if (current)
     ASN1_INTEGER_free(current);
-  if(next)
-    ASN1_INTEGER_free(next);
+  if(reserved)
+    ASN1_INTEGER_free(reserved);
   if(serialbio)
     BIO_free(serialbio);
-  if(serialstream)
-    serialstream = NULL;
-
+  else if(serialstream)
+    fclose(serialstream);
+  if (serialfile)
+    free(serialfile);
 
   return(retval);
 
@@ -457,101 +724,843 @@ write_certificate(X509 *cert, const char serial[], const char dir[]) {
     X509_print(bp, cert);
     PEM_write_bio_X509(bp, cert);
 
-    rval = 0;
+    rval = 0;
+
+ error:
+    free(path);
+	BIO_free_all(bp);
+
+    return rval;
+}
+
+/*
+ * FROM: https://github.com/openssl/openssl/blob/master/apps/apps.c
+ *
+ * name is expected to be in the format /type0=value0/type1=value1/type2=...
+ * where characters may be escaped by \
+ */
+X509_NAME *parse_name(const char *cp, long chtype, int canmulti)
+{
+    int nextismulti = 0;
+    char *work;
+    X509_NAME *n;
+
+    if (*cp++ != '/')
+        return NULL;
+
+    n = X509_NAME_new();
+    if (n == NULL)
+        return NULL;
+    work = OPENSSL_strdup(cp);
+    if (work == NULL)
+        goto err;
+
+    while (*cp) {
+        char *bp = work;
+        char *typestr = bp;
+        unsigned char *valstr;
+        int nid;
+        int ismulti = nextismulti;
+        nextismulti = 0;
+
+        /* Collect the type */
+        while (*cp && *cp != '=')
+            *bp++ = *cp++;
+        if (*cp == '\0') {
+            verror_put_string(
+                    "parse_name: Hit end of string before finding the equals.");
+            goto err;
+        }
+        *bp++ = '\0';
+        ++cp;
+
+        /* Collect the value. */
+        valstr = (unsigned char *)bp;
+        for (; *cp && *cp != '/'; *bp++ = *cp++) {
+            if (canmulti && *cp == '+') {
+                nextismulti = 1;
+                break;
+            }
+            if (*cp == '\\' && *++cp == '\0') {
+                verror_put_string(
+                        "parse_name: escape character at end of string\n");
+                goto err;
+            }
+        }
+        *bp++ = '\0';
+
+        /* If not at EOS (must be + or /), move forward. */
+        if (*cp)
+            ++cp;
+
+        /* Parse */
+        nid = OBJ_txt2nid(typestr);
+        if (nid == NID_undef) {
+            verror_put_string("parse_name: Skipping unknown attribute \"%s\"\n",
+                      typestr);
+            continue;
+        }
+        if (!X509_NAME_add_entry_by_NID(n, nid, chtype,
+                                        valstr, strlen((char *)valstr),
+                                        -1, ismulti ? -1 : 0))
+            goto err;
+    }
+
+    OPENSSL_free(work);
+    return n;
+
+ err:
+    X509_NAME_free(n);
+    OPENSSL_free(work);
+    return NULL;
+}
+
+static EVP_PKEY  *e_cakey=NULL;
+static ENGINE    *engine=NULL;
+static int        engine_used=0;
+
+/*
+ * The issuer certificate, CA signing key and sub-CA certificates are
+ * read once by certauth_load_issuer() and used for every certificate
+ * issued until the configuration names different files (or
+ * certificate_issuer_reload asks for them to be read again).  The key
+ * is decoded into OpenSSL's secure heap where available, which is
+ * locked in memory and left out of core dumps.  When an engine is
+ * configured, initialise_openssl_engine() supplies the key instead.
+ */
+typedef struct issuer_s {
+  char           *cert_path;
+  char           *key_path;
+  char           *key_passphrase;
+  char           *subca_path;
+  int             use_engine;
+  X509           *cert;
+  EVP_PKEY       *key;
+  STACK_OF(X509) *subca;
+} issuer_t;
+
+static issuer_t issuer;
+
+static int
+same_string(const char *a, const char *b)
+{
+  return (a == NULL) ? (b == NULL) : (b != NULL && strcmp(a, b) == 0);
+}
+
+static char *
+dup_string(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+static void
+issuer_clear(issuer_t *i)
+{
+  free(i->cert_path);
+  free(i->key_path);
+  if (i->key_passphrase) {
+    OPENSSL_cleanse(i->key_passphrase, strlen(i->key_passphrase));
+    free(i->key_passphrase);
+  }
+  free(i->subca_path);
+  if (i->cert) X509_free(i->cert);
+  if (i->key) EVP_PKEY_free(i->key);
+  if (i->subca) sk_X509_pop_free(i->subca, X509_free);
+  memset(i, 0, sizeof(*i));
+}
+
+/* Was i loaded from the files server_context names? */
+static int
+issuer_matches(const issuer_t *i, myproxy_server_context_t *server_context)
+{
+  return (i->cert != NULL &&
+          same_string(i->cert_path, server_context->certificate_issuer_cert) &&
+          same_string(i->key_path, server_context->certificate_issuer_key) &&
+          same_string(i->key_passphrase,
+                      server_context->certificate_issuer_key_passphrase) &&
+          same_string(i->subca_path,
+                      server_context->certificate_issuer_subca_certfile) &&
+          i->use_engine ==
+          (server_context->certificate_openssl_engine_id != NULL));
+}
+
+static EVP_PKEY *
+read_issuer_key(const char *path, const char *passphrase)
+{
+  FILE     *inkey;
+  EVP_PKEY *cakey;
+
+  inkey = fopen(path, "r");
+  if (!inkey) {
+    verror_put_string("Could not open cakey file handle: %s", path);
+    verror_put_errno(errno);
+    return NULL;
+  }
+  cakey = PEM_read_PrivateKey(inkey, NULL, NULL, (char *)passphrase);
+  fclose(inkey);
+
+  if (cakey == NULL) {
+    verror_put_string("Could not load cakey for certificate signing.");
+    ssl_error_to_verror();
+  }
+  return cakey;
+}
+
+static int
+issuer_load(issuer_t *i, myproxy_server_context_t *server_context)
+{
+  FILE *fp = NULL;
+  X509 *x = NULL;
+
+  memset(i, 0, sizeof(*i));
+  i->cert_path = dup_string(server_context->certificate_issuer_cert);
+  i->key_path = dup_string(server_context->certificate_issuer_key);
+  i->key_passphrase =
+    dup_string(server_context->certificate_issuer_key_passphrase);
+  i->subca_path = dup_string(server_context->certificate_issuer_subca_certfile);
+  i->use_engine = (server_context->certificate_openssl_engine_id != NULL);
+
+  fp = fopen(i->cert_path, "r");
+  if (fp == NULL) {
+    verror_put_string("Error opening certificate file %s", i->cert_path);
+    verror_put_errno(errno);
+    goto error;
+  }
+  if ((i->cert = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL) {
+    verror_put_string("Error reading certificate %s", i->cert_path);
+    ssl_error_to_verror();
+    goto error;
+  }
+  fclose(fp);
+  fp = NULL;
+
+  if (!i->use_engine) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (!CRYPTO_secure_malloc_initialized() &&
+        CRYPTO_secure_malloc_init(MYPROXY_CA_SECURE_HEAP, 32) != 1) {
+      myproxy_log("Could not lock memory for the CA signing key");
+    }
+#endif
+    if ((i->key = read_issuer_key(i->key_path, i->key_passphrase)) == NULL) {
+      goto error;
+    }
+    if (!X509_check_private_key(i->cert, i->key)) {
+      verror_put_string("CA certificate and CA private key do not match.");
+      ssl_error_to_verror();
+      goto error;
+    }
+  }
+
+  if (i->subca_path) {
+    fp = fopen(i->subca_path, "r");
+    if (fp == NULL) {
+      verror_put_string("Error opening certificate file %s", i->subca_path);
+      verror_put_errno(errno);
+      goto error;
+    }
+    i->subca = sk_X509_new_null();
+    ERR_clear_error();
+    while ((x = PEM_read_X509(fp, NULL, NULL, NULL)) != NULL) {
+      if (!sk_X509_push(i->subca, x)) {
+        X509_free(x);
+        verror_put_string("Error parsing certificate chain");
+        ssl_error_to_verror();
+        goto error;
+      }
+    }
+    if (sk_X509_num(i->subca) == 0 ||
+        ERR_GET_REASON(ERR_peek_error()) != PEM_R_NO_START_LINE) {
+      verror_put_string("Error reading sub-CA certificates from %s",
+                        i->subca_path);
+      ssl_error_to_verror();
+      goto error;
+    }
+    ERR_clear_error();
+    fclose(fp);
+    fp = NULL;
+  }
+
+  return 0;
+
+ error:
+  if (fp) fclose(fp);
+  issuer_clear(i);
+  return -1;
+}
+
+int
+certauth_load_issuer(myproxy_server_context_t *server_context, int reload)
+{
+  issuer_t fresh;
+
+  if (server_context->certificate_issuer_cert == NULL ||
+      server_context->certificate_issuer_key == NULL) {
+    issuer_clear(&issuer);
+    return 0;
+  }
+  if (!reload && issuer_matches(&issuer, server_context)) {
+    return 0;
+  }
+  if (issuer_load(&fresh, server_context) < 0) {
+    if (issuer_matches(&issuer, server_context)) {
+      myproxy_log("Keeping the CA credentials loaded from %s",
+                  issuer.cert_path);
+    } else {
+      issuer_clear(&issuer);
+    }
+    return -1;
+  }
+  issuer_clear(&issuer);
+  issuer = fresh;
+  myproxy_debug("Loaded CA certificate %s", issuer.cert_path);
+
+  return 0;
+}
+
+/*
+ * certificate_extfile is parsed once into an extension profile and
+ * parsed again only when the file changes.  Extensions that don't
+ * depend on the certificate being issued are built once as well; the
+ * rest (subjectKeyIdentifier=hash, for example, or any value using the
+ * %{username}, %{dn} or %{email_domain} variables) are kept as text and
+ * built for each certificate.  The variables may only be used in the
+ * email: and URI: values of subjectAltName and issuerAltName, and
+ * values that could change how OpenSSL parses the rest of the line
+ * are refused, so a username can't add names or sections of its own.
+ */
+typedef struct ext_entry_s {
+  char           *name;
+  char           *value;
+  int             vars;         /* value uses %{...} variables */
+  X509_EXTENSION *ext;          /* prebuilt, or NULL */
+} ext_entry_t;
+
+typedef struct ext_profile_s {
+  char        *path;
+  struct stat  st;              /* of path when it was parsed */
+  CONF        *conf;            /* for @section references */
+  ext_entry_t *entries;
+  int          count;
+} ext_profile_t;
+
+static ext_profile_t ext_profile;
+
+static void
+ext_profile_clear(ext_profile_t *p)
+{
+  int i;
+
+  for (i = 0; i < p->count; i++) {
+    free(p->entries[i].name);
+    free(p->entries[i].value);
+    if (p->entries[i].ext) X509_EXTENSION_free(p->entries[i].ext);
+  }
+  free(p->entries);
+  free(p->path);
+  if (p->conf) NCONF_free(p->conf);
+  memset(p, 0, sizeof(*p));
+}
+
+/* Was p parsed from path as it is now? */
+static int
+ext_profile_current(const ext_profile_t *p, const char *path)
+{
+  struct stat st;
+
+  if (p->conf == NULL || !same_string(p->path, path)) {
+    return 0;
+  }
+  if (stat(path, &st) < 0) {
+    return 1;                   /* keep what we have */
+  }
+  return (st.st_mtime == p->st.st_mtime &&
+          st.st_size == p->st.st_size &&
+          st.st_ino == p->st.st_ino &&
+          st.st_dev == p->st.st_dev);
+}
+
+/* Are the %{...} variables in value only in the email: or URI: value
+   of a subjectAltName or issuerAltName entry? */
+static int
+ext_vars_allowed(const char *name, const char *value)
+{
+  const char *var, *item;
+  int nid = OBJ_txt2nid(name);
+
+  if (nid != NID_subject_alt_name && nid != NID_issuer_alt_name) {
+    return 0;
+  }
+  for (var = strstr(value, "%{"); var; var = strstr(var + 2, "%{")) {
+    for (item = var; item > value && item[-1] != ','; item--)
+      ;
+    while (isspace((unsigned char)*item)) {
+      item++;
+    }
+    if (strncmp(item, "email:", 6) != 0 && strncmp(item, "URI:", 4) != 0) {
+      return 0;
+    }
+    if (memchr(item, ':', var - item) == NULL) {
+      return 0;                 /* in the type, not the value */
+    }
+  }
+
+  return 1;
+}
+
+static int
+ext_profile_load(ext_profile_t *p, const char *path)
+{
+  STACK_OF(CONF_VALUE) *section;
+  X509V3_CTX ctx;
+  long errorline = -1;
+  int i;
+
+  memset(p, 0, sizeof(*p));
+  p->path = strdup(path);
+
+  /* stat before parsing, so edits made while we parse are noticed */
+  if (stat(path, &p->st) < 0) {
+    memset(&p->st, 0, sizeof(p->st));
+  }
+
+  p->conf = NCONF_new(NULL);
+  if (NCONF_load(p->conf, path, &errorline) <= 0) {
+    if (errorline <= 0) {
+      verror_put_string("OpenSSL error loading the certificate_extfile '%s'",
+                        path);
+    } else {
+      verror_put_string("OpenSSL error on line %ld of certificate_extfile '%s'\n",
+                        errorline, path);
+    }
+    goto error;
+  }
+  if ((section = NCONF_get_section(p->conf, "default")) == NULL) {
+    verror_put_string("No extensions in certificate_extfile '%s'", path);
+    goto error;
+  }
+
+  p->count = sk_CONF_VALUE_num(section);
+  p->entries = calloc(p->count ? p->count : 1, sizeof(ext_entry_t));
+  if (p->entries == NULL) {
+    verror_put_errno(errno);
+    p->count = 0;
+    goto error;
+  }
+
+  /* no subject or issuer, so extensions that need one fail here */
+  X509V3_set_ctx(&ctx, NULL, NULL, NULL, NULL, 0);
+  X509V3_set_nconf(&ctx, p->conf);
+
+  for (i = 0; i < p->count; i++) {
+    CONF_VALUE *val = sk_CONF_VALUE_value(section, i);
+    ext_entry_t *e = &p->entries[i];
+
+    e->name = strdup(val->name);
+    e->value = strdup(val->value);
+    e->vars = (strstr(val->value, "%{") != NULL);
+    if (e->vars && !ext_vars_allowed(e->name, e->value)) {
+      verror_put_string("%s in certificate_extfile '%s' may only use "
+                        "%%{...} variables in email: or URI: values of "
+                        "subjectAltName or issuerAltName", e->name, path);
+      goto error;
+    }
+    if (!e->vars) {
+      ERR_set_mark();
+      e->ext = X509V3_EXT_nconf(p->conf, &ctx, e->name, e->value);
+      ERR_pop_to_mark();
+    }
+  }
+  myproxy_debug("Successfully loaded extensions file %s.", path);
+
+  return 0;
+
+ error:
+  ext_profile_clear(p);
+  return -1;
+}
+
+int
+certauth_load_extensions(myproxy_server_context_t *server_context)
+{
+  if (server_context->certificate_extfile == NULL) {
+    ext_profile_clear(&ext_profile);
+    return 0;
+  }
+  if (ext_profile_current(&ext_profile,
+                          server_context->certificate_extfile)) {
+    return 0;
+  }
+  ext_profile_clear(&ext_profile);
+  return ext_profile_load(&ext_profile, server_context->certificate_extfile);
+}
+
+/* Characters that would let a substituted value end the name it is
+   in, start another one or refer to a config section. */
+static int
+ext_var_safe(const char *sub)
+{
+  for (; *sub; sub++) {
+    if (*sub == ',' || *sub == ':' || *sub == '@' ||
+        iscntrl((unsigned char)*sub)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Replace the %{...} variables in value.  Returns a new string, or
+   NULL with verror set. */
+static char *
+ext_expand(const char *value, const char *username, const char *userdn,
+           const char *email_domain)
+{
+  const char *name, *end, *sub;
+  char *out, *o;
+  size_t len, n;
+
+  /* every variable is at least 3 characters, so this is enough */
+  len = strlen(value) + 1;
+  for (name = strstr(value, "%{"); name; name = strstr(name + 2, "%{")) {
+    len += strlen(userdn) + strlen(username) +
+      (email_domain ? strlen(email_domain) : 0);
+  }
+  if ((out = malloc(len)) == NULL) {
+    verror_put_errno(errno);
+    return NULL;
+  }
+
+  for (o = out; *value; ) {
+    if (value[0] != '%' || value[1] != '{') {
+      *o++ = *value++;
+      continue;
+    }
+    name = value + 2;
+    if ((end = strchr(name, '}')) == NULL) {
+      verror_put_string("Unterminated variable in certificate_extfile: %s",
+                        value);
+      goto error;
+    }
+    n = end - name;
+    if (n == 8 && strncmp(name, "username", n) == 0) {
+      sub = username;
+    } else if (n == 2 && strncmp(name, "dn", n) == 0) {
+      sub = userdn;
+    } else if (n == 12 && strncmp(name, "email_domain", n) == 0) {
+      sub = email_domain;
+      if (sub == NULL) {
+        verror_put_string("%%{email_domain} used in certificate_extfile "
+                          "but certificate_issuer_email_domain not set");
+        goto error;
+      }
+    } else {
+      verror_put_string("Unknown variable %%{%.*s} in certificate_extfile",
+                        (int)n, name);
+      goto error;
+    }
+    if (!ext_var_safe(sub)) {
+      verror_put_string("Value of %%{%.*s} has characters not allowed in "
+                        "certificate extensions", (int)n, name);
+      goto error;
+    }
+    strcpy(o, sub);
+    o += strlen(sub);
+    value = end + 1;
+  }
+  *o = '\0';
+
+  return out;
+
+ error:
+  free(out);
+  return NULL;
+}
+
+static int
+ext_profile_apply(const ext_profile_t *p, X509V3_CTX *ctxp, X509 *cert,
+                  const char *username, const char *userdn,
+                  const char *email_domain)
+{
+  X509_EXTENSION *ex;
+  char *value;
+  int i, rc;
+
+  X509V3_set_nconf(ctxp, p->conf);
+  for (i = 0; i < p->count; i++) {
+    const ext_entry_t *e = &p->entries[i];
+
+    if (e->ext) {
+      if (!X509_add_ext(cert, e->ext, -1)) {
+        verror_put_string("OpenSSL error adding extensions.");
+        ssl_error_to_verror();
+        return -1;
+      }
+      continue;
+    }
+    if (e->vars) {
+      if ((value = ext_expand(e->value, username, userdn,
+                              email_domain)) == NULL) {
+        return -1;
+      }
+    } else {
+      value = e->value;
+    }
+    ex = X509V3_EXT_nconf(p->conf, ctxp, e->name, value);
+    if (value != e->value) {
+      free(value);
+    }
+    rc = (ex != NULL && X509_add_ext(cert, ex, -1));
+    if (ex) {
+      X509_EXTENSION_free(ex);
+    }
+    if (!rc) {
+      verror_put_string("OpenSSL error adding extensions.");
+      ssl_error_to_verror();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Make the engine the default for all of OpenSSL's methods, or for
+   none of them.  Returns 0 on success, -1 with verror set. */
+static int
+engine_set_default(int all)
+{
+  if (!ENGINE_set_default(engine, all ? ENGINE_METHOD_ALL :
+                          ENGINE_METHOD_NONE)) {
+    verror_put_string("ENGINE_set_default(%s) failed.",
+                      all ? "ENGINE_METHOD_ALL" : "ENGINE_METHOD_NONE");
+    ssl_error_to_verror();
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * With certificate_openssl_engine_sessions set, the server processes
+ * don't open the engine themselves.  Instead, a pool of helper
+ * processes (see myproxy_coproc.h) each initialise the engine and
+ * load the CA key once, and sign the certificates the other
+ * processes send them, so up to that many signatures are in flight
+ * at once.  A request is the digest name (empty for none) on a line,
+ * followed by the DER certificate to sign; the response is the
+ * signed DER certificate.
+ */
+static myproxy_server_context_t *signer_context = NULL;
+static EVP_PKEY *signer_key = NULL;
+
+static int
+signer_open()
+{
+  if (!initialise_openssl_engine(signer_context)) {
+    verror_put_string("Could not initialise OpenSSL engine.");
+    return -1;
+  }
+  /* this process does nothing but sign */
+  if (engine_set_default(1) < 0) {
+    return -1;
+  }
+  engine_used = 1;
+  if (e_cakey) {
+    signer_key = e_cakey;
+  } else {
+    signer_key =
+      read_issuer_key(signer_context->certificate_issuer_key,
+                      signer_context->certificate_issuer_key_passphrase);
+    if (signer_key == NULL) {
+      return -1;
+    }
+  }
+  if (!X509_check_private_key(issuer.cert, signer_key)) {
+    verror_put_string("CA certificate and CA private key do not match.");
+    ssl_error_to_verror();
+    return -1;
+  }
+  myproxy_log("OpenSSL engine session ready for signing");
+
+  return 0;
+}
+
+/* myproxy_coproc_handler_t for the signing helpers */
+static int
+signer_handler(const char *request, size_t request_len,
+               char **response, size_t *response_len)
+{
+  const char          *nl;
+  const unsigned char *der;
+  const EVP_MD        *md = NULL;
+  X509                *cert = NULL;
+  unsigned char       *p;
+  char                 digest[64];
+  int                  len;
+
+  verror_clear();
+  if (signer_key == NULL && signer_open() < 0) {
+    goto error;
+  }
+  if (request_len == 0) {       /* health check */
+    return 0;
+  }
+
+  nl = memchr(request, '\n', request_len);
+  if (nl == NULL || nl - request >= sizeof(digest)) {
+    verror_put_string("Malformed signing request.");
+    goto error;
+  }
+  memcpy(digest, request, nl - request);
+  digest[nl - request] = '\0';
+  /* Ed25519 and similar CA keys sign without a separate digest. */
+  if (digest[0] &&
+      (EVP_PKEY_id(signer_key) == EVP_PKEY_RSA ||
+       EVP_PKEY_id(signer_key) == EVP_PKEY_DSA ||
+       EVP_PKEY_id(signer_key) == EVP_PKEY_EC) &&
+      (md = EVP_get_digestbyname(digest)) == NULL) {
+    verror_put_string("Unknown digest %s.", digest);
+    goto error;
+  }
+  der = (const unsigned char *)nl + 1;
+  cert = d2i_X509(NULL, &der, request_len - (nl + 1 - request));
+  if (cert == NULL) {
+    verror_put_string("Malformed signing request.");
+    ssl_error_to_verror();
+    goto error;
+  }
+
+  if (!X509_sign(cert, signer_key, md)) {
+    verror_put_string("Certificate/cakey sign failed.");
+    ssl_error_to_verror();
+    goto error;
+  }
+  if ((len = i2d_X509(cert, NULL)) <= 0 ||
+      (*response = malloc(len)) == NULL) {
+    verror_put_string("Failed to encode signed certificate.");
+    goto error;
+  }
+  p = (unsigned char *)*response;
+  i2d_X509(cert, &p);
+  *response_len = len;
+  X509_free(cert);
 
- error:
-    free(path);
-	BIO_free_all(bp);
+  return 0;
 
-    return rval;
+ error:
+  if (cert) X509_free(cert);
+  *response = strdup(verror_get_string());
+  *response_len = *response ? strlen(*response) : 0;
+  verror_clear();
+  return 1;
 }
 
-/*
- * FROM: https://github.com/openssl/openssl/blob/master/apps/apps.c
- *
- * name is expected to be in the format /type0=value0/type1=value1/type2=...
- * where characters may be escaped by \
- */
-X509_NAME *parse_name(const char *cp, long chtype, int canmulti)
+int
+certauth_configure_signers(myproxy_server_context_t *server_context)
 {
-    int nextismulti = 0;
-    char *work;
-    X509_NAME *n;
+  char name[BUF_SIZE];
+  int  count = 0;
 
-    if (*cp++ != '/')
-        return NULL;
-
-    n = X509_NAME_new();
-    if (n == NULL)
-        return NULL;
-    work = OPENSSL_strdup(cp);
-    if (work == NULL)
-        goto err;
+  signer_context = server_context;
+  /* not if this process opened the engine itself at startup */
+  if (server_context->certificate_openssl_engine_id &&
+      server_context->certificate_issuer_cert && engine == NULL) {
+    count = server_context->certificate_openssl_engine_sessions;
+    /* start new sessions if the engine or key changes */
+    snprintf(name, sizeof(name), "OpenSSL engine %s key %s",
+             server_context->certificate_openssl_engine_id,
+             server_context->certificate_issuer_key ?
+             server_context->certificate_issuer_key : "");
+  }
 
-    while (*cp) {
-        char *bp = work;
-        char *typestr = bp;
-        unsigned char *valstr;
-        int nid;
-        int ismulti = nextismulti;
-        nextismulti = 0;
+  if (myproxy_coproc_configure_handler(MYPROXY_COPROC_SIGNER,
+                                       count ? name : NULL,
+                                       signer_handler, count,
+                                       server_context->certificate_callout_timeout) < 0) {
+    return -1;
+  }
 
-        /* Collect the type */
-        while (*cp && *cp != '=')
-            *bp++ = *cp++;
-        if (*cp == '\0') {
-            verror_put_string(
-                    "parse_name: Hit end of string before finding the equals.");
-            goto err;
-        }
-        *bp++ = '\0';
-        ++cp;
+  if (server_context->certificate_openssl_engine_sessions && engine) {
+    myproxy_log("certificate_openssl_engine_sessions takes effect on "
+                "restart");
+  }
+  /* without helpers, open the engine here so children inherit it */
+  if (server_context->certificate_openssl_engine_id && engine == NULL &&
+      !myproxy_coproc_running(MYPROXY_COPROC_SIGNER) &&
+      !initialise_openssl_engine(server_context)) {
+    verror_put_string("Could not initialise OpenSSL engine.");
+    return -1;
+  }
 
-        /* Collect the value. */
-        valstr = (unsigned char *)bp;
-        for (; *cp && *cp != '/'; *bp++ = *cp++) {
-            if (canmulti && *cp == '+') {
-                nextismulti = 1;
-                break;
-            }
-            if (*cp == '\\' && *++cp == '\0') {
-                verror_put_string(
-                        "parse_name: escape character at end of string\n");
-                goto err;
-            }
-        }
-        *bp++ = '\0';
+  return 0;
+}
 
-        /* If not at EOS (must be + or /), move forward. */
-        if (*cp)
-            ++cp;
+/*
+ * Have a signing helper sign cert.  Returns the signed certificate,
+ * or NULL on error.
+ */
+static X509 *
+signer_sign(X509 *cert, const EVP_MD *md)
+{
+  BIO                 *bio = NULL;
+  X509                *signed_cert = NULL;
+  const X509_ALGOR    *alg;
+  const unsigned char *der;
+  char                *data, *response = NULL;
+  long                 len;
+  size_t               response_len;
+  int                  rc;
+
+  /* a placeholder, so the unsigned certificate can be encoded; the
+     helper replaces it when it signs */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  X509_ALGOR_set0((X509_ALGOR *)X509_get0_tbs_sigalg(cert),
+                  OBJ_nid2obj(NID_sha256WithRSAEncryption), V_ASN1_NULL,
+                  NULL);
+  X509_get0_signature(NULL, &alg, cert);
+#else
+  X509_ALGOR_set0(cert->cert_info->signature,
+                  OBJ_nid2obj(NID_sha256WithRSAEncryption), V_ASN1_NULL,
+                  NULL);
+  alg = cert->sig_alg;
+#endif
+  X509_ALGOR_set0((X509_ALGOR *)alg,
+                  OBJ_nid2obj(NID_sha256WithRSAEncryption), V_ASN1_NULL,
+                  NULL);
 
-        /* Parse */
-        nid = OBJ_txt2nid(typestr);
-        if (nid == NID_undef) {
-            verror_put_string("parse_name: Skipping unknown attribute \"%s\"\n",
-                      typestr);
-            continue;
-        }
-        if (!X509_NAME_add_entry_by_NID(n, nid, chtype,
-                                        valstr, strlen((char *)valstr),
-                                        -1, ismulti ? -1 : 0))
-            goto err;
-    }
+  if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+    verror_put_string("BIO_new() failed");
+    ssl_error_to_verror();
+    return NULL;
+  }
+  if (md) {
+    BIO_puts(bio, OBJ_nid2sn(EVP_MD_type(md)));
+  }
+  BIO_puts(bio, "\n");
+  if (!i2d_X509_bio(bio, cert)) {
+    verror_put_string("Failed to encode certificate for signing.");
+    ssl_error_to_verror();
+    BIO_free(bio);
+    return NULL;
+  }
+  len = BIO_get_mem_data(bio, &data);
+  rc = myproxy_coproc_call(MYPROXY_COPROC_SIGNER, data, len,
+                           &response, &response_len);
+  BIO_free(bio);
+  if (rc == 1) {
+    verror_put_string("No OpenSSL engine session available for signing.");
+  }
+  if (rc != 0) {
+    return NULL;
+  }
 
-    OPENSSL_free(work);
-    return n;
+  der = (const unsigned char *)response;
+  if ((signed_cert = d2i_X509(NULL, &der, response_len)) == NULL) {
+    verror_put_string("Malformed certificate from signing helper.");
+    ssl_error_to_verror();
+  }
+  free(response);
 
- err:
-    X509_NAME_free(n);
-    OPENSSL_free(work);
-    return NULL;
+  return signed_cert;
 }
 
-static EVP_PKEY  *e_cakey=NULL;
-static ENGINE    *engine=NULL;
-static int        engine_used=0;
-
 static int 
 generate_certificate( X509_REQ                 *request, 
 		      X509                     **certificate,
@@ -570,11 +1579,10 @@ generate_certificate( X509_REQ                 *request,
   X509           * cert = NULL;
   X509_NAME      * subject = NULL;
   EVP_PKEY       * cakey = NULL;
+  EVP_PKEY       * own_cakey = NULL;
+  const EVP_MD   * md_alg = NULL;
   X509V3_CTX       ctx, *ctxp;
 
-  FILE * inkey = NULL;
-  FILE * issuer_cert_file = NULL;
-
 #if GLOBUS
   globus_result_t globus_result;
 #endif
@@ -647,24 +1655,10 @@ generate_certificate( X509_REQ                 *request,
 
   /* issuer info */
 
-  issuer_cert_file = fopen(server_context->certificate_issuer_cert, "r");
-  if (issuer_cert_file == NULL) {
-      verror_put_string("Error opening certificate file %s",
-			server_context->certificate_issuer_cert);
-      verror_put_errno(errno);
-      goto error;
-  }
-  
-  if ((issuer_cert = PEM_read_X509(issuer_cert_file,
-				   NULL, NULL, NULL)) == NULL)
-  {
-      verror_put_string("Error reading certificate %s",
-			server_context->certificate_issuer_cert);
-      ssl_error_to_verror();
-      fclose(issuer_cert_file);
+  if (certauth_load_issuer(server_context, 0) < 0) {
       goto error;
   }
-  fclose(issuer_cert_file);
+  issuer_cert = issuer.cert;
 
   myproxy_debug("certificate_issuer_cert: %s",
                 server_context->certificate_issuer_cert );
@@ -700,81 +1694,107 @@ generate_certificate( X509_REQ                 *request,
 
   /* extensions */
 
-  if (server_context->certificate_extfile ||
-      server_context->certificate_extapp) {
+  if (server_context->certificate_extfile) {
+      if (certauth_load_extensions(server_context) < 0 ||
+          ext_profile_apply(&ext_profile, ctxp, cert,
+                            client_request->username, userdn,
+                            server_context->certificate_issuer_email_domain)) {
+          goto error;
+      }
+      myproxy_debug("Successfully added extensions.");
+  } else if (server_context->certificate_extapp) {
       CONF *extconf = NULL;
       long errorline = -1;
+      pid_t childpid;
+      int fds[3];
+      int exit_status;
+      FILE *nconf_stream = NULL;
+      BIO *output = NULL;
+      char input[BUF_SIZE];
+      int rc = 1;
+
+      if (snprintf(input, sizeof(input), "username=%s\n",
+                   client_request->username) < sizeof(input)) {
+          rc = callout_helper(MYPROXY_COPROC_EXTAPP, input, NULL, &output);
+      }
+      if (rc == -1) {
+          goto error;
+      }
       extconf = NCONF_new(NULL);
-      if (server_context->certificate_extfile) {
-	  if (NCONF_load(extconf, server_context->certificate_extfile,
-			 &errorline) <= 0) {
-	      if (errorline <= 0) {
-		  verror_put_string("OpenSSL error loading the certificate_extfile '%s'", server_context->certificate_extfile);
-	      } else {
-		  verror_put_string("OpenSSL error on line %ld of certificate_extfile '%s'\n", errorline, server_context->certificate_extfile);
-	      }
-	      goto error;
-	  }
-	  myproxy_debug("Successfully loaded extensions file %s.",
-			server_context->certificate_extfile);
+      if (rc == 0) {
+          myproxy_debug("Received extensions from call-out helper.");
+          if (NCONF_load_bio(extconf, output, &errorline) <= 0) {
+              if (errorline <= 0) {
+                  verror_put_string("OpenSSL error parsing output of certificate_extapp call-out.");
+              } else {
+                  verror_put_string("OpenSSL error parsing line %ld of of certificate_extapp call-out output.", errorline);
+              }
+              BIO_free(output);
+              NCONF_free(extconf);
+              goto error;
+          }
+          BIO_free(output);
       } else {
-	  pid_t childpid;
-	  int fds[3];
-	  int exit_status;
-	  FILE *nconf_stream = NULL;
-	  myproxy_debug("calling %s", server_context->certificate_extapp);
-	  if ((childpid = myproxy_popen(fds,
-					server_context->certificate_extapp,
-					client_request->username,
-					NULL)) < 0) {
-	      return -1; /* myproxy_popen will set verror */
-	  }
-	  close(fds[0]);
-	  if (waitpid(childpid, &exit_status, 0) == -1) {
-	      verror_put_string("wait() failed for extapp child");
-	      verror_put_errno(errno);
-	      return -1;
-	  }
-	  if (exit_status != 0) {
-	      FILE *fp = NULL;
-	      char buf[100];
-	      verror_put_string("Certificate extension call-out returned non-zero.");
-	      fp = fdopen(fds[1], "r");
-	      if (fp) {
-		  while (fgets(buf, 100, fp) != NULL) {
-		      verror_put_string("%s", buf);
-		  }
-		  fclose(fp);
-	      }
-	      fp = fdopen(fds[2], "r");
-	      if (fp) {
-		  while (fgets(buf, 100, fp) != NULL) {
-		      verror_put_string("%s", buf);
-		  }
-		  fclose(fp);
-	      }
-	      goto error;
-	  }
-	  close(fds[2]);
-	  nconf_stream = fdopen(fds[1], "r");
-	  if (NCONF_load_fp(extconf, nconf_stream, &errorline) <= 0) {
-	      if (errorline <= 0) {
-		  verror_put_string("OpenSSL error parsing output of certificate_extapp call-out.");
-	      } else {
-		  verror_put_string("OpenSSL error parsing line %ld of of certificate_extapp call-out output.", errorline);
-	      }
-	      fclose(nconf_stream);
-	      goto error;
-	  }
-	  fclose(nconf_stream);
+          myproxy_debug("calling %s", server_context->certificate_extapp);
+          if ((childpid = myproxy_popen(fds,
+                                        server_context->certificate_extapp,
+                                        client_request->username,
+                                        NULL)) < 0) {
+              NCONF_free(extconf);
+              return -1; /* myproxy_popen will set verror */
+          }
+          close(fds[0]);
+          if (waitpid(childpid, &exit_status, 0) == -1) {
+              verror_put_string("wait() failed for extapp child");
+              verror_put_errno(errno);
+              NCONF_free(extconf);
+              return -1;
+          }
+          if (exit_status != 0) {
+              FILE *fp = NULL;
+              char buf[100];
+              verror_put_string("Certificate extension call-out returned non-zero.");
+              fp = fdopen(fds[1], "r");
+              if (fp) {
+                  while (fgets(buf, 100, fp) != NULL) {
+                      verror_put_string("%s", buf);
+                  }
+                  fclose(fp);
+              }
+              fp = fdopen(fds[2], "r");
+              if (fp) {
+                  while (fgets(buf, 100, fp) != NULL) {
+                      verror_put_string("%s", buf);
+                  }
+                  fclose(fp);
+              }
+              NCONF_free(extconf);
+              goto error;
+          }
+          close(fds[2]);
+          nconf_stream = fdopen(fds[1], "r");
+          if (NCONF_load_fp(extconf, nconf_stream, &errorline) <= 0) {
+              if (errorline <= 0) {
+                  verror_put_string("OpenSSL error parsing output of certificate_extapp call-out.");
+              } else {
+                  verror_put_string("OpenSSL error parsing line %ld of of certificate_extapp call-out output.", errorline);
+              }
+              fclose(nconf_stream);
+              NCONF_free(extconf);
+              goto error;
+          }
+          fclose(nconf_stream);
       }
       X509V3_set_nconf(&ctx, extconf);
       if (!X509V3_EXT_add_nconf(extconf, &ctx, "default", cert))
       {
-	  verror_put_string("OpenSSL error adding extensions.");
-      ssl_error_to_verror();
-	  goto error;
+          verror_put_string("OpenSSL error adding extensions.");
+          ssl_error_to_verror();
+          NCONF_free(extconf);
+          goto error;
       }
+      X509V3_set_nconf(&ctx, NULL);
+      NCONF_free(extconf);
       myproxy_debug("Successfully added extensions.");
   } else {			/* add some defaults */
       add_ext(ctxp, cert, NID_key_usage, "critical,Digital Signature, Key Encipherment, Data Encipherment");
@@ -792,86 +1812,104 @@ generate_certificate( X509_REQ                 *request,
       free(email);
   }
 
-  /* load ca key */
-
-  if (engine) {
-      if (server_context->certificate_openssl_engine_lockfile) {
-          lockfd = open(server_context->certificate_openssl_engine_lockfile,
-                        O_RDWR|O_CREAT, 0600);
+  if (server_context->certificate_openssl_engine_id &&
+      myproxy_coproc_running(MYPROXY_COPROC_SIGNER)) {
+    X509 *signed_cert;
 
-          if (lockfd == -1) {
-              verror_put_string("Call to open() failed on %s", server_context->certificate_openssl_engine_lockfile);
-              verror_put_errno(errno);
-              goto error;
-          }
+    /* the engine sessions live in the signing helpers */
+    myproxy_debug("Signing internally generated certificate "
+                  "with an OpenSSL engine session.");
+    signed_cert =
+      signer_sign(cert, (const EVP_MD *)server_context->certificate_hashalg);
+    if (signed_cert == NULL) {
+      goto error;
+    }
+    X509_free(cert);
+    cert = signed_cert;
+  } else {
+    /* no signing helpers running (anymore), so use the engine here */
+    if (server_context->certificate_openssl_engine_id && engine == NULL &&
+        !initialise_openssl_engine(server_context)) {
+        verror_put_string("Could not initialise OpenSSL engine.");
+        goto error;
+    }
 
-          if ( lock_file(lockfd) == -1 ) {
-              verror_put_string("Failed to get lock on %s", server_context->certificate_openssl_engine_lockfile);
-              verror_put_errno(errno);
-              goto error;
-          }
-      }
+    /* load ca key */
 
-      if (!ENGINE_set_default(engine, ENGINE_METHOD_ALL)) {
-          verror_put_string("ENGINE_set_default(ENGINE_METHOD_ALL) failed.");
-          ssl_error_to_verror();
-          goto error;
-      }
-  }
+    if (engine) {
+        if (server_context->certificate_openssl_engine_lockfile) {
+            lockfd = open(server_context->certificate_openssl_engine_lockfile,
+                          O_RDWR|O_CREAT, 0600);
 
-  if(e_cakey) {
-      cakey = e_cakey;
-  } else {
-      inkey = fopen( server_context->certificate_issuer_key, "r");
+            if (lockfd == -1) {
+                verror_put_string("Call to open() failed on %s", server_context->certificate_openssl_engine_lockfile);
+                verror_put_errno(errno);
+                goto error;
+            }
 
-      if (!inkey) {
-         verror_put_string("Could not open cakey file handle: %s",
-	     	      server_context->certificate_issuer_key);
-         verror_put_errno(errno);
-         goto error;
-      }
+            if ( lock_file(lockfd) == -1 ) {
+                verror_put_string("Failed to get lock on %s", server_context->certificate_openssl_engine_lockfile);
+                verror_put_errno(errno);
+                goto error;
+            }
+        }
 
-      cakey = PEM_read_PrivateKey( inkey, NULL, NULL,
-	           (char *)server_context->certificate_issuer_key_passphrase );
+        if (engine_set_default(1) < 0) {
+            goto error;
+        }
+    }
 
-      fclose(inkey);
-  }
+    if (e_cakey) {
+        cakey = e_cakey;
+    } else if (issuer.key) {
+        cakey = issuer.key;
+    } else {
+        /* the engine did not load the key; read it with the engine
+           as the default method, as before */
+        cakey = own_cakey =
+            read_issuer_key(server_context->certificate_issuer_key,
+                            server_context->certificate_issuer_key_passphrase);
+        if (cakey == NULL) {
+            goto error;
+        }
+    }
 
-  if ( cakey == NULL ) {
-    verror_put_string("Could not load cakey for certificate signing.");
-    ssl_error_to_verror();
-    goto error;
-  } else {
     myproxy_debug("certificate_issuer_key: %s",
                   server_context->certificate_issuer_key );
-  }
 
-  if (!X509_check_private_key(issuer_cert,cakey)) {
-      verror_put_string("CA certificate and CA private key do not match.");
-      ssl_error_to_verror();
-      goto error;
-  }
+    /* issuer_load() checked a key it loaded itself */
+    if (cakey != issuer.key && !X509_check_private_key(issuer_cert,cakey)) {
+        verror_put_string("CA certificate and CA private key do not match.");
+        ssl_error_to_verror();
+        goto error;
+    }
 
-  /* sign it */
+    /* sign it */
 
-  myproxy_debug("Signing internally generated certificate.");
+    myproxy_debug("Signing internally generated certificate.");
+
+    /* Ed25519 and similar CA keys sign without a separate digest. */
+    if (EVP_PKEY_id(cakey) == EVP_PKEY_RSA ||
+        EVP_PKEY_id(cakey) == EVP_PKEY_DSA ||
+        EVP_PKEY_id(cakey) == EVP_PKEY_EC) {
+        md_alg = (const EVP_MD *)server_context->certificate_hashalg;
+    }
+
+    if (!X509_sign(cert, cakey, md_alg)) {
+      verror_put_string("Certificate/cakey sign failed.");
+      ssl_error_to_verror();
+      goto error;
+    } 
+    if (engine) {
+        engine_used=1;
+        if (lockfd != -1) close(lockfd);
+        if (engine_set_default(0) < 0) {
+            goto error;
+        }
+    }
 
-  if (!X509_sign(cert, cakey,
-                 (const EVP_MD *)server_context->certificate_hashalg ) ) {
-    verror_put_string("Certificate/cakey sign failed.");
-    ssl_error_to_verror();
-    goto error;
-  } 
-  serial = i2s_ASN1_OCTET_STRING(NULL, X509_get_serialNumber(cert));
-  if (engine) {
-      engine_used=1;
-      if (lockfd != -1) close(lockfd);
-      if (!ENGINE_set_default(engine, ENGINE_METHOD_NONE)) {
-          verror_put_string("ENGINE_set_default(ENGINE_METHOD_NONE) failed.");
-          ssl_error_to_verror();
-          goto error;
-      }
   }
+  serial = i2s_ASN1_OCTET_STRING(NULL, X509_get_serialNumber(cert));
 
   return_value = 0;
 
@@ -894,8 +1932,8 @@ generate_certificate( X509_REQ                 *request,
       X509_free(cert);
     }
   }
-  if (cakey && !e_cakey)
-    EVP_PKEY_free( cakey );
+  if (own_cakey)
+    EVP_PKEY_free( own_cakey );
   if (userdn) {
     free(userdn);
     userdn = NULL;
@@ -1148,6 +2186,126 @@ check_newcert(const char *callout, const X509 *cert)
     return do_check(callout, NULL, cert);
 }
 
+/*
+ * key_type_accepted()
+ *
+ * Returns 1 if the accepted_key_types policy allows the given key type
+ * ("rsa", "ec", or "ed25519"), 0 otherwise.  Without an explicit policy
+ * RSA and EC keys are accepted.
+ */
+static int
+key_type_accepted(myproxy_server_context_t *server_context,
+                  const char *keytype)
+{
+    int i;
+
+    if (server_context->accepted_key_types == NULL) {
+        return (strcmp(keytype, "rsa") == 0 || strcmp(keytype, "ec") == 0);
+    }
+    for (i=0; server_context->accepted_key_types[i]; i++) {
+        if (strcasecmp(server_context->accepted_key_types[i], keytype) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * check_certreq_key()
+ *
+ * Verify that the public key in a certificate request satisfies the
+ * CA key policy: accepted_key_types, plus min_keylen for RSA keys and
+ * min_ec_keylen for EC keys.  EC keys must use NIST P-256 or P-384.
+ *
+ * Returns 0 if acceptable, -1 (setting verror) otherwise.
+ */
+static int
+check_certreq_key(myproxy_server_context_t *server_context, EVP_PKEY *pkey)
+{
+  int keysize;
+
+  switch (EVP_PKEY_id(pkey)) {
+  case EVP_PKEY_RSA: {
+    if (!key_type_accepted(server_context, "rsa")) {
+      verror_put_string("RSA public keys are not accepted by this CA.");
+      return -1;
+    }
+
+    const BIGNUM *e;
+    RSA_get0_key(EVP_PKEY_get0_RSA(pkey), NULL, &e, NULL);
+    unsigned long exp = BN_get_word(e);
+    myproxy_debug("RSA exponent in certificate request is: %lu", exp);
+    if (exp < 65537) {
+      verror_put_string("RSA public key in certificate request has weak exponent (%lu).", exp);
+      verror_put_string("RSA public key exponent must be 65537 or larger.");
+      return -1;
+    }
+
+    keysize = RSA_size(EVP_PKEY_get0_RSA(pkey))*8;
+    myproxy_debug("RSA key in certificate request is %d bits.", keysize);
+    if (server_context->min_keylen &&
+        keysize < server_context->min_keylen) {
+      verror_put_string("RSA public key in certificate request is too small (%d bits).", keysize);
+      verror_put_string("RSA public key must be at least %d bits.",
+                        server_context->min_keylen);
+      return -1;
+    }
+    break;
+  }
+#if !defined(OPENSSL_NO_EC)
+  case EVP_PKEY_EC: {
+    int curve = NID_undef;
+
+    if (!key_type_accepted(server_context, "ec")) {
+      verror_put_string("EC public keys are not accepted by this CA.");
+      return -1;
+    }
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    char curve_name[80];
+    if (EVP_PKEY_get_group_name(pkey, curve_name, sizeof(curve_name), NULL)) {
+      curve = OBJ_txt2nid(curve_name);
+    }
+#else
+    curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey)));
+#endif
+    if (curve != NID_X9_62_prime256v1 && curve != NID_secp384r1) {
+      verror_put_string("EC public key in certificate request uses an unsupported curve (%s).",
+                        (curve == NID_undef) ? "unknown" : OBJ_nid2sn(curve));
+      verror_put_string("EC public keys must use NIST P-256 or P-384.");
+      return -1;
+    }
+
+    keysize = EVP_PKEY_bits(pkey);
+    myproxy_debug("EC key in certificate request is %d bits (%s).",
+                  keysize, OBJ_nid2sn(curve));
+    if (server_context->min_ec_keylen &&
+        keysize < server_context->min_ec_keylen) {
+      verror_put_string("EC public key in certificate request is too small (%d bits).", keysize);
+      verror_put_string("EC public key must be at least %d bits.",
+                        server_context->min_ec_keylen);
+      return -1;
+    }
+    break;
+  }
+#endif
+#if defined(EVP_PKEY_ED25519)
+  case EVP_PKEY_ED25519:
+    if (!key_type_accepted(server_context, "ed25519")) {
+      verror_put_string("Ed25519 public keys are not accepted by this CA.");
+      return -1;
+    }
+    myproxy_debug("Ed25519 key in certificate request.");
+    break;
+#endif
+  default:
+    verror_put_string("Public key in certificate request is of unsupported type (%s).",
+                      OBJ_nid2sn(EVP_PKEY_id(pkey)));
+    return -1;
+  }
+
+  return 0;
+}
+
 static int 
 handle_certificate(unsigned char            *input_buffer,
 		   size_t                   input_buffer_length,
@@ -1158,10 +2316,10 @@ handle_certificate(unsigned char            *input_buffer,
 
   int           return_value = 1;
   int           verify;
+  int           i;
   long          sub_hash;
   unsigned char md[SHA_DIGEST_LENGTH];
   unsigned int  md_len = 0;
-  int           keysize;
 
   BIO      * request_bio  = NULL;
   X509_REQ * req          = NULL;
@@ -1205,28 +2363,7 @@ handle_certificate(unsigned char            *input_buffer,
     goto error;
   } 
 
-  if (EVP_PKEY_id(pkey) != EVP_PKEY_RSA) {
-      verror_put_string("Public key in certificate request is not of type RSA.");
-      goto error;
-  }
-
-  const BIGNUM *e;
-  RSA_get0_key(EVP_PKEY_get0_RSA(pkey), NULL, &e, NULL);
-  unsigned long exp = BN_get_word(e);
-  myproxy_debug("RSA exponent in certificate request is: %lu", exp);
-  if (exp < 65537) {
-      verror_put_string("RSA public key in certificate request has weak exponent (%lu).", exp);
-      verror_put_string("RSA public key exponent must be 65537 or larger.");
-      goto error;
-  }
-
-  keysize = RSA_size(EVP_PKEY_get0_RSA(pkey))*8;
-  myproxy_debug("RSA key in certificate request is %d bits.", keysize);
-  if (server_context->min_keylen &&
-      keysize < server_context->min_keylen) {
-      verror_put_string("RSA public key in certificate request is too small (%d bits).", keysize);
-      verror_put_string("RSA public key must be at least %d bits.",
-                        server_context->min_keylen);
+  if (check_certreq_key(server_context, pkey) < 0) {
       goto error;
   }
 
@@ -1308,9 +2445,21 @@ handle_certificate(unsigned char            *input_buffer,
     goto error;
   }
 
-  /* Load any intermediate/sub-CA certs if configured */
+  /* Load any intermediate/sub-CA certs if configured, using the
+     copies read with the issuer when there are some */
   if (server_context->certificate_issuer_subca_certfile != NULL) {
-    if (ssl_certificate_load_from_file(creds,
+    if (issuer.subca != NULL && issuer_matches(&issuer, server_context)) {
+      for (i = sk_X509_num(issuer.subca) - 1; i >= 0; i--) {
+        X509 *subca = sk_X509_value(issuer.subca, i);
+
+        X509_up_ref(subca);
+        if (ssl_certificate_push(creds, subca) != SSL_SUCCESS) {
+          X509_free(subca);
+          verror_put_string("Error pushing sub-CA cert onto creds");
+          goto error;
+        }
+      }
+    } else if (ssl_certificate_load_from_file(creds,
         server_context->certificate_issuer_subca_certfile) != SSL_SUCCESS) {
       verror_put_string("Failed to load sub-CA certs from file (%s)!",
                    server_context->certificate_issuer_subca_certfile);
@@ -6,6 +6,38 @@
 
 int initialise_openssl_engine(myproxy_server_context_t *server_context);
 
+/*
+ * Share the block of serial numbers reserved with
+ * certificate_serial_block among processes forked after this call.
+ * Returns 0 on success, -1 on error.
+ */
+int certauth_serial_init();
+
+/*
+ * Read the CA issuer certificate, signing key and sub-CA certificates
+ * named in server_context, so they are not read again for each
+ * certificate issued.  Those already loaded from the same files are
+ * kept unless reload is set; if reading them again fails, the loaded
+ * ones stay in use.  Returns 0 on success, -1 on error.
+ */
+int certauth_load_issuer(myproxy_server_context_t *server_context,
+                         int reload);
+
+/*
+ * Parse certificate_extfile into the extension profile used for
+ * issued certificates.  It is parsed again only if the file has
+ * changed.  Returns 0 on success, -1 on error.
+ */
+int certauth_load_extensions(myproxy_server_context_t *server_context);
+
+/*
+ * Start, stop or restart the helper processes that each hold one of
+ * the certificate_openssl_engine_sessions engine sessions used to
+ * sign issued certificates.  Called by the process that owns the
+ * call-out helpers.  Returns 0 on success, -1 on error.
+ */
+int certauth_configure_signers(myproxy_server_context_t *server_context);
+
 int is_certificate_authority_configured(myproxy_server_context_t
                                         *server_context);
 
@@ -30,6 +30,108 @@ GSI_SOCKET_set_error_string(GSI_SOCKET *self,
     return GSI_SOCKET_SUCCESS;
 }
 
+#if !GLOBUS
+/*
+ * Server-side session ticket keys.  They are generated once in the
+ * parent server process by GSI_SOCKET_init_session_tickets() and
+ * inherited by every forked child, so a ticket issued by one worker
+ * can be redeemed by any other.  A configuration reload only turns
+ * their use on or off; the keys themselves last until the server exits.
+ */
+static unsigned char	*session_ticket_keys = NULL;
+static long		session_ticket_keys_len = 0;
+static int		session_resumption = 0;
+
+#define SESSION_ID_CONTEXT	"myproxy"
+
+/*
+ * Client-side session cache, keyed by "host:port".  A session saved
+ * here is offered on the next connection to the same server.
+ */
+#define SESSION_CACHE_SIZE	16
+
+static struct {
+    char		*key;
+    SSL_SESSION		*session;
+} session_cache[SESSION_CACHE_SIZE];
+static int session_cache_next = 0;
+
+static int
+session_cache_find(const char *key)
+{
+    int i;
+
+    for (i = 0; i < SESSION_CACHE_SIZE; i++) {
+	if (session_cache[i].key && strcmp(session_cache[i].key, key) == 0) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+static void
+session_cache_remove(const char *key)
+{
+    int i;
+
+    if ((i = session_cache_find(key)) < 0) {
+	return;
+    }
+    free(session_cache[i].key);
+    SSL_SESSION_free(session_cache[i].session);
+    session_cache[i].key = NULL;
+    session_cache[i].session = NULL;
+}
+
+/*
+ * session_cache_store()
+ *
+ * Save session under key, replacing any older entry for the same
+ * server.  Takes ownership of the session reference.
+ */
+static void
+session_cache_store(const char *key, SSL_SESSION *session)
+{
+    int i;
+
+    if ((i = session_cache_find(key)) >= 0) {
+	SSL_SESSION_free(session_cache[i].session);
+	session_cache[i].session = session;
+	return;
+    }
+    i = session_cache_next;
+    session_cache_next = (session_cache_next + 1) % SESSION_CACHE_SIZE;
+    if (session_cache[i].key) {
+	free(session_cache[i].key);
+	SSL_SESSION_free(session_cache[i].session);
+    }
+    session_cache[i].key = strdup(key);
+    session_cache[i].session = session;
+    if (session_cache[i].key == NULL) {
+	SSL_SESSION_free(session);
+	session_cache[i].session = NULL;
+    }
+}
+
+/*
+ * session_new_cb()
+ *
+ * Called by OpenSSL when the server hands us a new session (for TLS
+ * 1.3 this happens after the handshake, as tickets arrive).
+ */
+static int
+session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+    GSI_SOCKET *self = SSL_get_app_data(ssl);
+
+    if (self == NULL || self->session_key == NULL) {
+	return 0;
+    }
+    session_cache_store(self->session_key, session);
+    return 1;
+}
+#endif
+
 #if GLOBUS
 /*
  * append_gss_status()
@@ -381,6 +483,11 @@ GSI_SOCKET_destroy(GSI_SOCKET *self)
     }
 #else
     if (self->ssl != NULL) {
+	if (self->session_key != NULL) {
+	    /* Quiet shutdown sends nothing, but without it SSL_free()
+	       marks the cached session as not resumable. */
+	    SSL_shutdown(self->ssl);
+	}
 	SSL_free(self->ssl);
 	self->ssl = NULL;
     }
@@ -388,13 +495,30 @@ GSI_SOCKET_destroy(GSI_SOCKET *self)
 	SSL_CTX_free(self->ssl_ctx);
 	self->ssl_ctx = NULL;
     }
+    if (self->session_key != NULL) {
+	free(self->session_key);
+    }
 #endif
 
     if (self->peer_name != NULL)
     {
 	free(self->peer_name);
     }
-    
+
+    if (self->pending_token != NULL)
+    {
+	free(self->pending_token);
+    }
+
+    if (self->batch_creds != NULL)
+    {
+	while (self->batch_next < self->batch_len)
+	{
+	    ssl_credentials_destroy(self->batch_creds[self->batch_next++]);
+	}
+	free(self->batch_creds);
+    }
+
     if (self->error_string)
     {
 	free(self->error_string);
@@ -414,6 +538,77 @@ GSI_SOCKET_destroy(GSI_SOCKET *self)
 }
 
 
+int
+GSI_SOCKET_init_session_tickets()
+{
+#if GLOBUS
+    return GSI_SOCKET_SUCCESS;
+#else
+    SSL_CTX *ctx;
+    long len;
+
+    if (session_ticket_keys) {
+	return GSI_SOCKET_SUCCESS; /* keep existing tickets valid */
+    }
+
+    my_init();
+
+    /* The key blob size depends on the OpenSSL version, so ask. */
+    #if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+    ctx = SSL_CTX_new(TLS_server_method());
+    #else
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    #endif
+    if (ctx == NULL) {
+	ssl_error_to_verror();
+	return GSI_SOCKET_ERROR;
+    }
+    len = SSL_CTX_get_tlsext_ticket_keys(ctx, NULL, 0);
+    SSL_CTX_free(ctx);
+    if (len <= 0) {
+	verror_put_string("unable to determine session ticket key size");
+	return GSI_SOCKET_ERROR;
+    }
+
+    if ((session_ticket_keys = malloc(len)) == NULL) {
+	verror_put_errno(errno);
+	verror_put_string("malloc() failed");
+	return GSI_SOCKET_ERROR;
+    }
+    if (RAND_bytes(session_ticket_keys, len) != 1) {
+	ssl_error_to_verror();
+	free(session_ticket_keys);
+	session_ticket_keys = NULL;
+	return GSI_SOCKET_ERROR;
+    }
+    session_ticket_keys_len = len;
+
+    return GSI_SOCKET_SUCCESS;
+#endif
+}
+
+int
+GSI_SOCKET_set_session_resumption(int enable)
+{
+#if GLOBUS
+    if (enable) {
+	verror_put_string("TLS session resumption not supported "
+			  "by GSSAPI MyProxy");
+	return GSI_SOCKET_ERROR;
+    }
+    return GSI_SOCKET_SUCCESS;
+#else
+    if (enable && session_ticket_keys == NULL) {
+	verror_put_string("no session ticket keys were generated "
+			  "at startup");
+	session_resumption = 0;
+	return GSI_SOCKET_ERROR;
+    }
+    session_resumption = enable;
+    return GSI_SOCKET_SUCCESS;
+#endif
+}
+
 int
 GSI_SOCKET_get_error_string(GSI_SOCKET *self,
 			    char *buffer,
@@ -585,6 +780,23 @@ GSI_SOCKET_set_max_token_len(GSI_SOCKET *self, int bytes)
     return 0;
 }
 
+int
+GSI_SOCKET_pending(GSI_SOCKET *self)
+{
+    if (self == NULL) {
+        return 0;
+    }
+    if (self->pending_token) {
+        return 1;
+    }
+#if !GLOBUS
+    if (self->ssl && SSL_pending(self->ssl) > 0) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
 int
 GSI_SOCKET_context_established(GSI_SOCKET *self)
 {
@@ -798,14 +1010,37 @@ GSI_SOCKET_authentication_init(GSI_SOCKET *self, char *accepted_peer_names[],
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
     #endif
     SSL_CTX_load_verify_locations(ctx, NULL, get_trusted_certs_path());
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+				   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, session_new_cb);
 
     ssl = SSL_new(ctx);
     SSL_set_fd(ssl, self->sock);
+    SSL_set_app_data(ssl, self);
+    SSL_set_quiet_shutdown(ssl, 1);
+    if (attrs && attrs->pshost) {
+	char key[MAXHOSTNAMELEN+16];
+	int slot;
+
+	snprintf(key, sizeof(key), "%s:%d", attrs->pshost, attrs->psport);
+	self->session_key = strdup(key);
+	if ((slot = session_cache_find(key)) >= 0) {
+	    SSL_set_session(ssl, session_cache[slot].session);
+	}
+    }
     if (SSL_connect(ssl) <= 0) {
+      if (self->session_key) {
+          session_cache_remove(self->session_key);
+      }
+      SSL_free(ssl);
+      SSL_CTX_free(ctx);
       GSI_SOCKET_set_error_string(self,
                                   "SSL_connect failed");
       goto error;
     }
+    if (SSL_session_reused(ssl)) {
+	myproxy_debug("resumed TLS session with %s", self->session_key);
+    }
 
     SSL_write(ssl, "0", 1);    /* GSI deleg flag */
 
@@ -928,6 +1163,11 @@ GSI_SOCKET_authentication_init(GSI_SOCKET *self, char *accepted_peer_names[],
     }
 #endif
     if (!rc) {		/* no match with acceptable target names */
+#if !GLOBUS
+	if (self->session_key) {
+	    session_cache_remove(self->session_key);
+	}
+#endif
 	GSI_SOCKET_set_error_string(self, "authenticated peer name does not match");
 	return_value = GSI_SOCKET_UNAUTHORIZED;
 	goto error;
@@ -1088,6 +1328,27 @@ GSI_SOCKET_authentication_accept(GSI_SOCKET *self)
        return GSI_SOCKET_ERROR;
     }
 
+    if (session_resumption && session_ticket_keys) {
+       SSL_CTX_set_session_id_context(ctx,
+               (const unsigned char *)SESSION_ID_CONTEXT,
+               strlen(SESSION_ID_CONTEXT));
+       if (SSL_CTX_set_tlsext_ticket_keys(ctx, session_ticket_keys,
+                                          session_ticket_keys_len) != 1) {
+          GSI_SOCKET_set_error_string(self,
+                  "Error setting session ticket keys\n");
+          ssl_error_to_verror();
+          return GSI_SOCKET_ERROR;
+       }
+    } else {
+       /* Resumption is off, or tickets would be sealed with keys
+          private to this SSL_CTX and could never be redeemed, so
+          don't bother issuing them. */
+       SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+       #if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+       SSL_CTX_set_num_tickets(ctx, 0);
+       #endif
+    }
+
     ssl = SSL_new(ctx);
     if(!ssl) {
        GSI_SOCKET_set_error_string(self,
@@ -1368,6 +1629,13 @@ int GSI_SOCKET_read_token(GSI_SOCKET *self,
     int			return_status = GSI_SOCKET_ERROR;
     static unsigned char local_buffer[10024];
 
+    if (self->pending_token) {
+	*pbuffer = self->pending_token;
+	*pbuffer_len = self->pending_token_len;
+	self->pending_token = NULL;
+	self->pending_token_len = 0;
+	return GSI_SOCKET_SUCCESS;
+    }
     
 #if GLOBUS
     if (saved_buffer) {
@@ -1490,6 +1758,14 @@ int GSI_SOCKET_read_token(GSI_SOCKET *self,
 		(*pbuffer)[bytes_read] = '\0';
 		return GSI_SOCKET_SUCCESS;
 	}
+	retval = SSL_get_error(self->ssl, bytes_read);
+	if (retval != SSL_ERROR_WANT_READ && retval != SSL_ERROR_WANT_WRITE) {
+	    /* peer closed the connection or the session failed;
+	       retrying would spin */
+	    self->error_number = errno;
+	    GSI_SOCKET_set_error_string(self, "connection closed");
+	    break;
+	}
 
 	/* Check for more data on the socket.  We want the entire
 	   message and SSL may have fragmented it. */
@@ -1518,8 +1794,6 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
 {
     int				return_value = GSI_SOCKET_ERROR;
 #if GLOBUS
-    SSL_CREDENTIALS		*creds = NULL;
-    SSL_PROXY_RESTRICTIONS	*proxy_restrictions = NULL;
     unsigned char		*input_buffer = NULL;
     size_t			input_buffer_length;
     unsigned char		*output_buffer = NULL;
@@ -1537,28 +1811,6 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
 	goto error;
     }
 
-    /*
-     * Load proxy we are going to use to sign delegation
-     */
-    creds = ssl_credentials_new();
-    
-    if (creds == NULL)
-    {
-	GSI_SOCKET_set_error_from_verror(self);
-	goto error;
-    }
-    
-    if (passphrase && passphrase[0] == '\0') {
-	passphrase = NULL;
-    }
-
-    if (ssl_proxy_load_from_file(creds, source_credentials,
-				 passphrase) == SSL_ERROR)
-    {
-	GSI_SOCKET_set_error_from_verror(self);
-	goto error;
-    }
-
     /*
      * Read the certificate request from the client
      */
@@ -1582,6 +1834,96 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
         goto error;
     }
 
+    /*
+     * Sign the request
+     */
+    if (GSI_SOCKET_delegation_sign(self, source_credentials, lifetime,
+				   passphrase, input_buffer,
+				   input_buffer_length, &output_buffer,
+				   &output_buffer_length) == GSI_SOCKET_ERROR)
+    {
+	goto error;
+    }
+
+    /*
+     * Write the proxy certificate back to user
+     */
+    if (GSI_SOCKET_write_buffer(self,
+				(const char *)output_buffer,
+				output_buffer_length) == GSI_SOCKET_ERROR)
+    {
+	goto error;
+    }
+
+    /* Success */
+    return_value = GSI_SOCKET_SUCCESS;
+    
+  error:
+    if (input_buffer != NULL)
+    {
+	GSI_SOCKET_free_token(input_buffer);
+    }
+    
+    if (output_buffer != NULL)
+    {
+	GSI_SOCKET_free_token(output_buffer);
+    }
+#endif
+    
+    return return_value;
+}
+
+int GSI_SOCKET_delegation_sign(GSI_SOCKET *self,
+			       const char *source_credentials,
+			       int lifetime,
+			       const char *passphrase,
+			       const unsigned char *certreq,
+			       size_t certreq_len,
+			       unsigned char **chain,
+			       int *chain_len)
+{
+    int				return_value = GSI_SOCKET_ERROR;
+#if GLOBUS
+    SSL_CREDENTIALS		*creds = NULL;
+    SSL_PROXY_RESTRICTIONS	*proxy_restrictions = NULL;
+    unsigned char		*output_buffer = NULL;
+    int				output_buffer_length;
+#endif
+
+    if (self == NULL)
+    {
+	return GSI_SOCKET_ERROR;
+    }
+
+    if ((certreq == NULL) || (chain == NULL) || (chain_len == NULL))
+    {
+	self->error_number = EINVAL;
+	return GSI_SOCKET_ERROR;
+    }
+
+#if GLOBUS
+    /*
+     * Load proxy we are going to use to sign delegation
+     */
+    creds = ssl_credentials_new();
+    
+    if (creds == NULL)
+    {
+	GSI_SOCKET_set_error_from_verror(self);
+	goto error;
+    }
+    
+    if (passphrase && passphrase[0] == '\0') {
+	passphrase = NULL;
+    }
+
+    if (ssl_proxy_load_from_file(creds, source_credentials,
+				 passphrase) == SSL_ERROR)
+    {
+	GSI_SOCKET_set_error_from_verror(self);
+	goto error;
+    }
+
     /*
      * Set up the restrictions on the proxy
      */
@@ -1607,8 +1949,8 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
      */
     if (ssl_proxy_delegation_sign(creds,
 				  proxy_restrictions,
-				  input_buffer,
-				  input_buffer_length,
+				  (unsigned char *)certreq,
+				  certreq_len,
 				  &output_buffer,
 				  &output_buffer_length) == SSL_ERROR)
     {
@@ -1616,25 +1958,14 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
 	goto error;
     }
 
-    /*
-     * Write the proxy certificate back to user
-     */
-    if (GSI_SOCKET_write_buffer(self,
-				(const char *)output_buffer,
-				output_buffer_length) == GSI_SOCKET_ERROR)
-    {
-	goto error;
-    }
+    *chain = output_buffer;
+    *chain_len = output_buffer_length;
+    output_buffer = NULL;
 
     /* Success */
     return_value = GSI_SOCKET_SUCCESS;
     
   error:
-    if (input_buffer != NULL)
-    {
-	GSI_SOCKET_free_token(input_buffer);
-    }
-    
     if (output_buffer != NULL)
     {
 	ssl_free_buffer(output_buffer);
@@ -1649,12 +1980,103 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *self,
     {
 	ssl_proxy_restrictions_destroy(proxy_restrictions);
     }
+#else
+    GSI_SOCKET_set_error_string(self,
+				"proxy delegation is not supported in this build");
 #endif
     
     return return_value;
 }
 
 
+/*
+ * Read the certificate chain signed for creds from the peer and
+ * return the completed credentials in PEM format.
+ */
+static int
+delegation_finalize(GSI_SOCKET *self,
+		    SSL_CREDENTIALS *creds,
+		    unsigned char **delegated_credentials,
+		    int *delegated_credentials_len,
+		    char *passphrase)
+{
+    int			return_value = GSI_SOCKET_ERROR;
+    unsigned char	*input_buffer = NULL;
+    size_t		input_buffer_len;
+    unsigned char	*fmsg;
+    int                 i;
+
+    /* Now read the signed certificate */
+    if (GSI_SOCKET_read_token(self, &input_buffer,
+			      &input_buffer_len) == GSI_SOCKET_ERROR)
+    {
+	goto error;
+    }
+
+    /* HACK: We may get just an error message rather than a cert... */
+    if (strncmp((const char *)input_buffer, "VERSION",
+                strlen("VERSION")) == 0) {
+        myproxy_response_t *response;
+        response = malloc(sizeof(*response));
+        memset(response, 0, sizeof(*response));
+        myproxy_handle_response((const char *)input_buffer, 
+                                input_buffer_len,
+                                response);
+        myproxy_free(NULL, NULL, response);
+        GSI_SOCKET_set_error_string(self,
+                                    "server-side error: check server logs");
+        goto error;
+    }
+
+    /* MAJOR HACK:
+       We don't have application-level framing in our protocol.
+       We can't separate the certificate chain easily from
+       the final protocol message, so split it off and keep it for
+       the next GSI_SOCKET_read_token() call. */
+    fmsg = input_buffer;
+    for (i=0; i < input_buffer_len-strlen("VERSION"); i++, fmsg++) {
+	if (strncmp((const char *)fmsg, "VERSION", strlen("VERSION")) == 0) {
+	    self->pending_token_len = input_buffer_len - (fmsg-input_buffer);
+	    self->pending_token = malloc(self->pending_token_len);
+	    if (self->pending_token) {
+		memcpy(self->pending_token, fmsg, self->pending_token_len);
+	    } else {
+		self->pending_token_len = 0;
+	    }
+	    input_buffer_len = fmsg-input_buffer;
+	    break;
+	}
+    }
+    
+    if (ssl_proxy_delegation_finalize(creds, input_buffer,
+				      input_buffer_len) == SSL_ERROR)
+    {
+	GSI_SOCKET_set_error_from_verror(self);
+	goto error;
+    }
+    
+    if (passphrase && passphrase[0] == '\0') {
+	passphrase = NULL;
+    }
+    if (ssl_proxy_to_pem(creds, delegated_credentials,
+			 delegated_credentials_len, passphrase) == SSL_ERROR)
+    {
+	GSI_SOCKET_set_error_from_verror(self);
+	goto error;
+    }
+    
+    /* Success */
+    return_value = GSI_SOCKET_SUCCESS;
+    
+  error:
+    if (input_buffer != NULL)
+    {
+	GSI_SOCKET_free_token(input_buffer);
+    }
+
+    return return_value;
+}
+
 int
 GSI_SOCKET_delegation_accept(GSI_SOCKET *self,
 			     unsigned char **delegated_credentials,
@@ -1665,10 +2087,6 @@ GSI_SOCKET_delegation_accept(GSI_SOCKET *self,
     SSL_CREDENTIALS	*creds = NULL;
     unsigned char	*output_buffer = NULL;
     int			output_buffer_len;
-    unsigned char	*input_buffer = NULL;
-    size_t		input_buffer_len;
-    unsigned char	*fmsg;
-    int                 i;
     
     if (self == NULL)
     {	
@@ -1720,74 +2138,131 @@ GSI_SOCKET_delegation_accept(GSI_SOCKET *self,
 	goto error;
     }
     
-    /* Now read the signed certificate */
-    if (GSI_SOCKET_read_token(self, &input_buffer,
-			      &input_buffer_len) == GSI_SOCKET_ERROR)
+    return_value = delegation_finalize(self, creds, delegated_credentials,
+				       delegated_credentials_len, passphrase);
+    
+  error:
+    if (creds != NULL)
     {
-	goto error;
+	ssl_credentials_destroy(creds);
     }
-
-    /* HACK: We may get just an error message rather than a cert... */
-    if (strncmp((const char *)input_buffer, "VERSION",
-                strlen("VERSION")) == 0) {
-        myproxy_response_t *response;
-        response = malloc(sizeof(*response));
-        memset(response, 0, sizeof(*response));
-        myproxy_handle_response((const char *)input_buffer, 
-                                input_buffer_len,
-                                response);
-        myproxy_free(NULL, NULL, response);
-        GSI_SOCKET_set_error_string(self,
-                                    "server-side error: check server logs");
-        goto error;
+    
+    if (output_buffer != NULL)
+    {
+	ssl_free_buffer(output_buffer);
     }
 
-    /* MAJOR HACK:
-       We don't have application-level framing in our protocol.
-       We can't separate the certificate chain easily from
-       the final protocol message, so just discard it. */
-    fmsg = input_buffer;
-    for (i=0; i < input_buffer_len-strlen("VERSION"); i++, fmsg++) {
-	if (strncmp((const char *)fmsg, "VERSION", strlen("VERSION")) == 0) {
-	    input_buffer_len = fmsg-input_buffer;
-	    break;
-	}
+    return return_value;
+}
+
+int
+GSI_SOCKET_delegation_request_batch(GSI_SOCKET *self,
+                                    int count)
+{
+    int			return_value = GSI_SOCKET_ERROR;
+    unsigned char	*output_buffer = NULL;
+    int			output_buffer_len;
+    SSL_CREDENTIALS	**batch_creds;
+
+    if (self == NULL)
+    {	
+	return GSI_SOCKET_ERROR;
     }
-    
-    if (ssl_proxy_delegation_finalize(creds, input_buffer,
-				      input_buffer_len) == SSL_ERROR)
+
+    if (count <= 0)
     {
-	GSI_SOCKET_set_error_from_verror(self);
-	goto error;
+	self->error_number = EINVAL;
+	return GSI_SOCKET_ERROR;
     }
-    
-    if (passphrase && passphrase[0] == '\0') {
-	passphrase = NULL;
+
+#if GLOBUS
+    if (self->gss_context == GSS_C_NO_CONTEXT)
+#else
+    if (self->ssl == NULL)
+#endif
+    {
+	GSI_SOCKET_set_error_string(self, "GSI_SOCKET not authenticated");
+	return GSI_SOCKET_ERROR;
     }
-    if (ssl_proxy_to_pem(creds, delegated_credentials,
-			 delegated_credentials_len, passphrase) == SSL_ERROR)
+
+    batch_creds = realloc(self->batch_creds,
+			  (self->batch_len + count) * sizeof(*batch_creds));
+    if (batch_creds == NULL)
     {
-	GSI_SOCKET_set_error_from_verror(self);
-	goto error;
+	self->error_number = errno;
+	GSI_SOCKET_set_error_string(self, "realloc() failed");
+	return GSI_SOCKET_ERROR;
     }
-    
+    self->batch_creds = batch_creds;
+
+    /* Send every request before the peer answers any of them */
+    while (count-- > 0) {
+	if (ssl_proxy_delegation_init(&self->batch_creds[self->batch_len],
+				      &output_buffer, &output_buffer_len,
+				      0 /* default number of bits */,
+				      NULL /* No callback */) == SSL_ERROR)
+	{
+	    GSI_SOCKET_set_error_from_verror(self);
+	    goto error;
+	}
+	self->batch_len++;
+
+	if (GSI_SOCKET_write_buffer(self, (const char *)output_buffer,
+				    output_buffer_len) == GSI_SOCKET_ERROR)
+	{
+	    goto error;
+	}
+	ssl_free_buffer(output_buffer);
+	output_buffer = NULL;
+    }
+
     /* Success */
     return_value = GSI_SOCKET_SUCCESS;
-    
+
   error:
-    if (creds != NULL)
+    if (output_buffer != NULL)
     {
-	ssl_credentials_destroy(creds);
+	ssl_free_buffer(output_buffer);
     }
-    
-    if (input_buffer != NULL)
+
+    return return_value;
+}
+
+int
+GSI_SOCKET_delegation_accept_batch(GSI_SOCKET *self,
+                                   unsigned char **delegated_credentials,
+                                   int *delegated_credentials_len,
+                                   char *passphrase)
+{
+    int			return_value = GSI_SOCKET_SUCCESS;
+    SSL_CREDENTIALS	*creds;
+
+    if (self == NULL)
+    {	
+	return GSI_SOCKET_ERROR;
+    }
+
+    if (self->batch_next >= self->batch_len)
     {
-	GSI_SOCKET_free_token(input_buffer);
+	GSI_SOCKET_set_error_string(self, "no certificate request outstanding");
+	return GSI_SOCKET_ERROR;
     }
-    
-    if (output_buffer != NULL)
+
+    creds = self->batch_creds[self->batch_next];
+    self->batch_creds[self->batch_next++] = NULL;
+
+    if (delegated_credentials != NULL)
     {
-	ssl_free_buffer(output_buffer);
+	return_value = delegation_finalize(self, creds,
+					   delegated_credentials,
+					   delegated_credentials_len,
+					   passphrase);
+    }
+    ssl_credentials_destroy(creds);
+
+    if (self->batch_next == self->batch_len)
+    {
+	self->batch_next = self->batch_len = 0;
     }
 
     return return_value;
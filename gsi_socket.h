@@ -38,6 +38,31 @@ GSI_SOCKET *GSI_SOCKET_new(int sock);
  */
 void GSI_SOCKET_destroy(GSI_SOCKET *gsi_socket);
 
+/*
+ * GSI_SOCKET_init_session_tickets()
+ *
+ * Generate the TLS session ticket keys, if not done already.  Call
+ * once in the server's parent process before it forks, so every
+ * child shares the same keys.  Calling again keeps the current keys.
+ *
+ * Returns GSI_SOCKET_SUCCESS on success, GSI_SOCKET_ERROR otherwise
+ * (with verror set).
+ */
+int GSI_SOCKET_init_session_tickets();
+
+/*
+ * GSI_SOCKET_set_session_resumption()
+ *
+ * Enable or disable TLS session resumption for sockets subsequently
+ * accepted by this process and its children.  Only turns the keys
+ * from GSI_SOCKET_init_session_tickets() on or off; enabling fails
+ * if they were not generated.
+ *
+ * Returns GSI_SOCKET_SUCCESS on success, GSI_SOCKET_ERROR otherwise
+ * (with verror set).
+ */
+int GSI_SOCKET_set_session_resumption(int enable);
+
 /*
  * GSI_SOCKET_get_error_string()
  *
@@ -209,6 +234,28 @@ int GSI_SOCKET_delegation_init_ext(GSI_SOCKET *gsi_socket,
 				   const char *source_credentials,
 				   int lifetime,
 				   const char *passphrase);
+
+/*
+ * GSI_SOCKET_delegation_sign()
+ *
+ * Sign a certificate request already read from the peer, as
+ * GSI_SOCKET_delegation_init_ext() does, but return the new
+ * certificate chain in an allocated buffer instead of sending it.
+ * The caller should free the buffer with GSI_SOCKET_free_token().
+ *
+ * source_credentials, lifetime and passphrase are as for
+ * GSI_SOCKET_delegation_init_ext().
+ *
+ * Returns GSI_SOCKET_SUCCESS success, GSI_SOCKET_ERROR otherwise.
+ */
+int GSI_SOCKET_delegation_sign(GSI_SOCKET *gsi_socket,
+			       const char *source_credentials,
+			       int lifetime,
+			       const char *passphrase,
+			       const unsigned char *certreq,
+			       size_t certreq_len,
+			       unsigned char **chain,
+			       int *chain_len);
 /*
  * Values for GSI_SOCKET_DELEGATION_init() flags:
  */
@@ -270,6 +317,37 @@ int
 GSI_SOCKET_delegation_set_certreq(GSI_SOCKET *gsi_socket,
                                   char *certreq);
 
+/*
+ * GSI_SOCKET_delegation_request_batch()
+ *
+ * Generate count new keypairs and send a certificate request for
+ * each one, without waiting for the signed certificates.  The keys
+ * are kept with the GSI_SOCKET, in order, until they are collected by
+ * GSI_SOCKET_delegation_accept_batch().
+ *
+ * Returns GSI_SOCKET_SUCCESS on success, GSI_SOCKET_ERROR otherwise.
+ */
+int
+GSI_SOCKET_delegation_request_batch(GSI_SOCKET *gsi_socket,
+                                    int count);
+
+/*
+ * GSI_SOCKET_delegation_accept_batch()
+ *
+ * Read the certificate chain signed for the oldest key sent by
+ * GSI_SOCKET_delegation_request_batch() and return the credentials
+ * as GSI_SOCKET_delegation_accept() does.  If delegated_credentials
+ * is NULL, the key is dropped without reading anything, for requests
+ * the peer refused.
+ *
+ * Returns GSI_SOCKET_SUCCESS on success, GSI_SOCKET_ERROR otherwise.
+ */
+int
+GSI_SOCKET_delegation_accept_batch(GSI_SOCKET *gsi_socket,
+                                   unsigned char **delegated_credentials,
+                                   int *delegated_credentials_len,
+                                   char *passphrase);
+
 /*
  * GSI_SOCKET_credentials_accept_ext()
  *
@@ -330,6 +408,15 @@ int GSI_SOCKET_set_peer_limited_proxy(GSI_SOCKET *self, int flag);
  */
 int GSI_SOCKET_set_max_token_len(GSI_SOCKET *self, int bytes);
 
+/*
+ * GSI_SOCKET_pending()
+ *
+ * Returns 1 if a message has already been read from the connection
+ * and is waiting to be returned by GSI_SOCKET_read_token(), so the
+ * caller shouldn't wait on the socket for it.  Returns 0 otherwise.
+ */
+int GSI_SOCKET_pending(GSI_SOCKET *self);
+
 /*
  * GSI_SOCKET_context_established()
  *
@@ -20,11 +20,17 @@ struct _gsi_socket
 #else
     SSL_CTX			*ssl_ctx;
     SSL				*ssl;
+    char			*session_key; /* host:port for session cache */
 #endif
     char			*peer_name;
     int             limited_proxy; /* 1 if peer used a limited proxy */
     int             max_token_len;
     char            *certreq;   /* path to a PEM encoded cert req */
+    unsigned char   *pending_token; /* message read ahead of its turn */
+    size_t          pending_token_len;
+    SSL_CREDENTIALS **batch_creds; /* keys awaiting signed certs */
+    int             batch_len;
+    int             batch_next;
 };
 
 #define DEFAULT_SERVICE_NAME		"host"
@@ -98,6 +98,74 @@ static int parse_add_creds (char *response_str, char ***pstrs, int *num_creds)
 	*num_creds = idx;
 	return 0;
 }
+
+/*
+ * Build the list of bulk GET entries from the newline-separated
+ * values of the BULK_USER, BULK_CRED and BULK_PHRASE lines, which
+ * must all hold the same number of values.
+ */
+static int parse_bulk_entries (const char *usernames, const char *crednames,
+			       const char *passphrases,
+			       myproxy_bulk_entry_t **entries)
+{
+	myproxy_bulk_entry_t **tail = entries;
+	size_t ulen, clen, plen;
+
+	if (countchr(usernames, '\n') != countchr(crednames, '\n') ||
+	    countchr(usernames, '\n') != countchr(passphrases, '\n')) {
+		verror_put_string("Mismatched BULK_USER, BULK_CRED and BULK_PHRASE values");
+		return -1;
+	}
+
+	while (1) {
+		ulen = strcspn(usernames, "\n");
+		clen = strcspn(crednames, "\n");
+		plen = strcspn(passphrases, "\n");
+
+		if (ulen == 0) {
+			verror_put_string("Empty BULK_USER value");
+			return -1;
+		}
+		if (plen > MAX_PASS_LEN) {
+			verror_put_string("BULK_PHRASE value too long");
+			return -1;
+		}
+
+		*tail = malloc(sizeof(**tail));
+		if (*tail == NULL) {
+			verror_put_errno(errno);
+			return -1;
+		}
+		memset(*tail, 0, sizeof(**tail));
+		(*tail)->username = malloc(ulen+1);
+		if ((*tail)->username == NULL) {
+			verror_put_errno(errno);
+			return -1;
+		}
+		memcpy((*tail)->username, usernames, ulen);
+		(*tail)->username[ulen] = '\0';
+		if (clen > 0) {
+			(*tail)->credname = malloc(clen+1);
+			if ((*tail)->credname == NULL) {
+				verror_put_errno(errno);
+				return -1;
+			}
+			memcpy((*tail)->credname, crednames, clen);
+			(*tail)->credname[clen] = '\0';
+		}
+		memcpy((*tail)->passphrase, passphrases, plen);
+		tail = &(*tail)->next;
+
+		if (usernames[ulen] == '\0') {
+			break;
+		}
+		usernames += ulen+1;
+		crednames += clen+1;
+		passphrases += plen+1;
+	}
+
+	return 0;
+}
 		
 /**
  * Return the timeout for a socket connection.  This function checks
@@ -741,9 +809,21 @@ myproxy_bootstrap_client(myproxy_socket_attrs_t *socket_attrs,
 
 int 
 myproxy_init_client(myproxy_socket_attrs_t *attrs) {
+    char c;
+
     myproxy_debug("MyProxy %s", myproxy_version(0,0,0));
 
     assert(attrs);
+    /* Reuse the connection if the server agreed to take another
+       request on it and hasn't since closed it for being idle. */
+    if (attrs->gsi_socket && attrs->keepalive &&
+        GSI_SOCKET_context_established(attrs->gsi_socket) &&
+        recv(attrs->socket_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        myproxy_debug("reusing connection (%d)", attrs->socket_fd);
+        return attrs->socket_fd;
+    }
+    attrs->keepalive = 0;
     if (attrs->gsi_socket) {
         GSI_SOCKET_destroy(attrs->gsi_socket);
         attrs->gsi_socket = NULL;
@@ -807,6 +887,11 @@ myproxy_authenticate_init(myproxy_socket_attrs_t *attrs,
 
    assert(attrs);
 
+   if (attrs->keepalive &&
+       GSI_SOCKET_context_established(attrs->gsi_socket)) {
+       return 0;                /* reused connection is authenticated */
+   }
+
    if (GSI_SOCKET_use_creds(attrs->gsi_socket,
 			    proxyfile) == GSI_SOCKET_ERROR) {
        GSI_SOCKET_get_error_string(attrs->gsi_socket, error_string,
@@ -1066,6 +1151,29 @@ myproxy_init_delegation(myproxy_socket_attrs_t *attrs, const char *delegfile, co
   return 0;
 }
 
+int
+myproxy_sign_delegation(myproxy_socket_attrs_t *attrs, const char *delegfile,
+			const int lifetime, char *passphrase,
+			const char *certreq, const int certreq_len,
+			char **chain, int *chain_len)
+{
+  char error_string[1024];
+
+  assert(attrs);
+  assert(chain != NULL);
+
+  if (GSI_SOCKET_delegation_sign(attrs->gsi_socket, delegfile, lifetime,
+				 passphrase, (const unsigned char *)certreq,
+				 certreq_len, (unsigned char **)chain,
+				 chain_len) == GSI_SOCKET_ERROR) {
+    GSI_SOCKET_get_error_string(attrs->gsi_socket, error_string,
+				sizeof(error_string));
+    verror_put_string("Error delegating credentials: %s\n", error_string);
+    return -1;
+  }
+  return 0;
+}
+
 int
 myproxy_accept_delegation(myproxy_socket_attrs_t *attrs, char *data, const int datalen, char *passphrase)
 {
@@ -1275,6 +1383,13 @@ myproxy_serialize_request_ex(const myproxy_request_t *request, char **data)
         return -1;
     }
 
+    /* keep connection open for more requests */
+    if (request->keepalive) {
+      len = my_append(data, MYPROXY_KEEPALIVE_STRING, "1", "\n", NULL);
+      if (len < 0)
+        return -1;
+    }
+
     /* voname */
     if (request->voname) {
         char *tok = NULL, *vonameDup = NULL;
@@ -1321,6 +1436,23 @@ myproxy_serialize_request_ex(const myproxy_request_t *request, char **data)
         }
     }
 
+    /* bulk GET entries, one line of each kind per credential */
+    if (request->bulk_entries) {
+        myproxy_bulk_entry_t *entry;
+
+        for (entry = request->bulk_entries; entry; entry = entry->next) {
+            len = my_append(data, MYPROXY_BULK_USERNAME_STRING,
+                            entry->username, "\n",
+                            MYPROXY_BULK_CREDNAME_STRING,
+                            entry->credname ? entry->credname : "", "\n",
+                            MYPROXY_BULK_PASSPHRASE_STRING,
+                            entry->passphrase, "\n", NULL);
+            if (len < 0) {
+                return -1;
+            }
+        }
+    }
+
     return len+1;
 }
 
@@ -1631,6 +1763,29 @@ myproxy_deserialize_request(const char *data, const int datalen,
 	}
     }
 
+    /* keep-alive */
+    len = convert_message(data,
+			  MYPROXY_KEEPALIVE_STRING,
+			  CONVERT_MESSAGE_DEFAULT_FLAGS,
+			  &buf);
+
+    if (len == -2)  /*-2 indicates string not found*/
+       request->keepalive = 0;
+    else
+    if (len <= -1)
+    {
+	verror_prepend_string("Error parsing KEEPALIVE in client request");
+	goto error;
+    }
+    else
+    {
+	if (string_to_int(buf, &request->keepalive) !=
+	    STRING_TO_INT_SUCCESS) {
+	    verror_prepend_string("Error parsing KEEPALIVE in client request");
+	    goto error;
+	}
+    }
+
     /* voname */
     len = convert_message(data,
                           MYPROXY_VONAME_STRING,
@@ -1675,6 +1830,41 @@ myproxy_deserialize_request(const char *data, const int datalen,
         }
     }
 
+    /* bulk GET entries */
+    len = convert_message(data,
+                          MYPROXY_BULK_USERNAME_STRING,
+                          CONVERT_MESSAGE_ALLOW_MULTIPLE,
+                          &buf);
+
+    if (len == -2) /* -2 indicates string not found */
+        request->bulk_entries = NULL;
+    else
+    if (len <= -1)
+    {
+        verror_prepend_string("Error parsing BULK_USER in client request");
+        goto error;
+    }
+    else
+    {
+        char *crednames = NULL, *passphrases = NULL;
+
+        if (convert_message(data, MYPROXY_BULK_CREDNAME_STRING,
+                            CONVERT_MESSAGE_ALLOW_MULTIPLE,
+                            &crednames) < 0 ||
+            convert_message(data, MYPROXY_BULK_PASSPHRASE_STRING,
+                            CONVERT_MESSAGE_ALLOW_MULTIPLE,
+                            &passphrases) < 0 ||
+            parse_bulk_entries(buf, crednames, passphrases,
+                               &request->bulk_entries) < 0) {
+            verror_prepend_string("Error parsing bulk entries in client request");
+            if (crednames) free(crednames);
+            if (passphrases) free(passphrases);
+            goto error;
+        }
+        free(crednames);
+        free(passphrases);
+    }
+
     /* Success */
     return_code = 0;
 
@@ -1741,6 +1931,14 @@ myproxy_serialize_response_ex(const myproxy_response_t *response,
 		    response_string, "\n", NULL);
     if (len < 0)
         return -1;
+
+    /* Connection stays open for another request */
+    if (response->response_type == MYPROXY_OK_RESPONSE &&
+        response->keepalive) {
+        len = my_append(data, MYPROXY_KEEPALIVE_STRING, "1", "\n", NULL);
+        if (len < 0)
+            return -1;
+    }
     
     /*Authorization data*/
 #if GLOBUS_TODO
@@ -2072,6 +2270,13 @@ myproxy_deserialize_response(myproxy_response_t *response,
 	goto error;
     }
 
+    response->keepalive = 0;
+    if (response->response_type == MYPROXY_OK_RESPONSE &&
+        convert_message(data, MYPROXY_KEEPALIVE_STRING,
+                        CONVERT_MESSAGE_DEFAULT_FLAGS, &buf) > 0) {
+        response->keepalive = (strcmp(buf, "1") == 0);
+    }
+
     if (response->response_type == MYPROXY_ERROR_RESPONSE) {
 	/* It's ok if ERROR not present */
 	response->error_string = 0;
@@ -2481,6 +2686,9 @@ myproxy_send(myproxy_socket_attrs_t *attrs,
 
     assert(data != NULL);
 
+    /* connection is busy until the server says otherwise */
+    attrs->keepalive = 0;
+
     if (GSI_SOCKET_write_buffer(attrs->gsi_socket, data, datalen) == GSI_SOCKET_ERROR)
     {
 	GSI_SOCKET_get_error_string(attrs->gsi_socket, error_string,
@@ -2556,6 +2764,7 @@ myproxy_recv_response(myproxy_socket_attrs_t *attrs,
 
     rval = myproxy_handle_response(response_buffer, responselen, response);
 	free(response_buffer);
+    attrs->keepalive = (rval == 0 && response->keepalive);
     return rval;
 }
 
@@ -2729,6 +2938,8 @@ myproxy_free(myproxy_socket_attrs_t *attrs,
 	  free(request->voname);
        if (request->vomses != NULL)
 	  free(request->vomses);
+       if (request->bulk_entries != NULL)
+	  myproxy_bulk_entries_free(request->bulk_entries);
        free(request);
     }
     
@@ -2821,6 +3032,80 @@ myproxy_request_add_vomses(myproxy_request_t *client_request,
     return return_status;
 }
 
+int
+myproxy_request_add_bulk_entry(myproxy_request_t *client_request,
+                               const char *username,
+                               const char *credname,
+                               const char *passphrase)
+{
+    int return_status = -1;
+    myproxy_bulk_entry_t *entry = NULL, **tail;
+
+    if (client_request == NULL) {
+        verror_put_string("NULL client_request passed.");
+        goto error;
+    }
+    if (username == NULL || username[0] == '\0') {
+        verror_put_string("NULL username passed.");
+        goto error;
+    }
+    if (passphrase == NULL) {
+        passphrase = "";
+    }
+    if (strlen(passphrase) > MAX_PASS_LEN) {
+        verror_put_string("passphrase too long");
+        goto error;
+    }
+    if (strchr(username, '\n') || (credname && strchr(credname, '\n')) ||
+        strchr(passphrase, '\n')) {
+        verror_put_string("bulk entries may not contain newlines");
+        goto error;
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        verror_put_string("malloc() failed");
+        goto error;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->username = strdup(username);
+    if (credname && credname[0]) {
+        entry->credname = strdup(credname);
+    }
+    strcpy(entry->passphrase, passphrase);
+
+    for (tail = &client_request->bulk_entries; *tail; tail = &(*tail)->next)
+        ;
+    *tail = entry;
+
+    return_status = 0;
+
+  error:
+    return return_status;
+}
+
+void
+myproxy_bulk_entries_free(myproxy_bulk_entry_t *entries)
+{
+    myproxy_bulk_entry_t *next;
+
+    while (entries) {
+        next = entries->next;
+        if (entries->username != NULL)
+            free(entries->username);
+        if (entries->credname != NULL)
+            free(entries->credname);
+        if (entries->error_string != NULL)
+            free(entries->error_string);
+        if (entries->credentials != NULL) {
+            memset(entries->credentials, 0, entries->credentials_len);
+            free(entries->credentials);
+        }
+        memset(entries->passphrase, 0, sizeof(entries->passphrase));
+        free(entries);
+        entries = next;
+    }
+}
 
 /*--------- Helper functions ------------*/
 /*
@@ -3025,6 +3310,10 @@ encode_command(const myproxy_proto_request_type_t	command_value)
         string = "7";
         break;
 
+      case MYPROXY_BULK_GET_PROXY:
+        string = "8";
+        break;
+
       default:
 	/* Should never get here */
 	string = NULL;
@@ -31,6 +31,7 @@ BuildRoot:      %{_tmppath}/%{name}-%{version}-%{release}-root-%(%{__id_u} -n)
 BuildRequires:  globus-gss-assist-devel > 3
 BuildRequires:  globus-usage-devel
 BuildRequires:  pam-devel
+BuildRequires:  sqlite-devel
 BuildRequires:  graphviz
 BuildRequires:  voms-devel >= 1.9.12.1
 BuildRequires:  cyrus-sasl-devel
@@ -339,6 +340,7 @@ fi
 %{_bindir}/myproxy-get-trustroots
 %{_bindir}/myproxy-info
 %{_bindir}/myproxy-init
+%{_bindir}/myproxy-keypool
 %{_bindir}/myproxy-logon
 %{_bindir}/myproxy-retrieve
 %{_bindir}/myproxy-store
@@ -348,6 +350,7 @@ fi
 %{_mandir}/man1/myproxy-get-delegation.1.gz
 %{_mandir}/man1/myproxy-info.1.gz
 %{_mandir}/man1/myproxy-init.1.gz
+%{_mandir}/man1/myproxy-keypool.1.gz
 %{_mandir}/man1/myproxy-logon.1.gz
 %{_mandir}/man1/myproxy-retrieve.1.gz
 %{_mandir}/man1/myproxy-store.1.gz
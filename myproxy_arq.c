@@ -34,6 +34,11 @@ static char usage[] =
 "    -L | --lock         'msg'       Lock access to credential(s).\n"
 "                                    Specified msg will be returned instead.\n"
 "    -U | --unlock                   Unlock previously locked credential(s).\n"
+"    -R | --rebuild-catalog          Rebuild the credential catalog\n"
+"    -S | --shard-storage            Move credentials into hashed\n"
+"                                    subdirectories of the storage directory\n"
+"    -M | --convert-metadata         Rewrite credential data files in the\n"
+"                                    binary format\n"
 "    -v | --verbose                  Display debugging messages\n"
 "    -V | --version                  Displays version\n"
 "\n";
@@ -55,10 +60,13 @@ struct option long_options[] =
     {"version",           no_argument, NULL, 'V'},
     {"remove",            no_argument, NULL, 'r'},
     {"invalid",           no_argument, NULL, 'i'},
+    {"rebuild-catalog",   no_argument, NULL, 'R'},
+    {"shard-storage",     no_argument, NULL, 'S'},
+    {"convert-metadata",  no_argument, NULL, 'M'},
     {0, 0, 0, 0}
 };
 
-static char short_options[] = "hul:c:k:o:e:t:s:vVriL:U";
+static char short_options[] = "hul:c:k:o:e:t:s:vVriL:URSM";
 
 static char version[] =
 BINARY_NAME "version " MYPROXY_VERSION " (" MYPROXY_VERSION_DATE ") "  "\n";
@@ -76,6 +84,9 @@ char *lock_msg = NULL;
 char *config_file = NULL;
 int unlock_creds = 0;
 int invalid_creds = 0;
+int rebuild_catalog = 0;
+int shard_storage = 0;
+int convert_metadata = 0;
 int verbose = 0;
 
 int
@@ -101,6 +112,45 @@ main(int argc, char *argv[])
     /* Read server config file for OCSP options, etc. */
     server_context.config_file = config_file;
     myproxy_server_config_read(&server_context);
+    if (server_context.credential_storage &&
+        myproxy_creds_set_backend(server_context.credential_storage) == -1) {
+        fprintf(stderr, "%s\n", verror_get_string());
+        exit(1);
+    }
+
+    if (shard_storage) {
+        numcreds = myproxy_creds_shard_storage();
+        if (numcreds < 0) {
+            fprintf(stderr, "Failed to shard credential storage.\n%s\n",
+                    verror_get_string());
+            exit(1);
+        }
+        printf("Moved %d credentials into storage shards.\n", numcreds);
+        exit(0);
+    }
+
+    if (convert_metadata) {
+        numcreds = myproxy_creds_convert_metadata();
+        if (numcreds < 0) {
+            fprintf(stderr, "Failed to convert credential data files.\n%s\n",
+                    verror_get_string());
+            exit(1);
+        }
+        printf("Converted %d credential data files.\n", numcreds);
+        exit(0);
+    }
+
+    if (rebuild_catalog) {
+        numcreds = myproxy_creds_catalog_rebuild();
+        if (numcreds < 0) {
+            fprintf(stderr, "Failed to rebuild credential catalog.\n%s\n",
+                    verror_get_string());
+            exit(1);
+        }
+        printf("Credential catalog rebuilt with %d credentials.\n",
+               numcreds);
+        exit(0);
+    }
 
     numcreds = myproxy_admin_retrieve_all(&cred);
     if (numcreds < 0) {
@@ -213,6 +263,15 @@ init_arguments(int argc,
 	case 'U':	/* unlock */
 	    unlock_creds = 1;
 	    break;
+	case 'R':	/* rebuild credential catalog */
+	    rebuild_catalog = 1;
+	    break;
+	case 'S':	/* shard the storage directory */
+	    shard_storage = 1;
+	    break;
+	case 'M':	/* convert data files to binary */
+	    convert_metadata = 1;
+	    break;
 	case 'v':	/* verbose */
 	    myproxy_debug_set_level(1);
         verbose = 1;
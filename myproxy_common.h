@@ -18,19 +18,30 @@
 #include <netdb.h>
 #include <netinet/in.h>	/* Might be needed before <arpa/inet.h> */
 #include <arpa/inet.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 #include <dlfcn.h>
@@ -58,6 +69,7 @@ typedef int socklen_t;
 #include "myproxy.h" /* public headers */
 #include "myproxy_extensions.h"
 #include "myproxy_popen.h"
+#include "myproxy_coproc.h"
 #include "myproxy_ocsp.h"
 #include "myproxy_usage.h"
 #include "accept_credmap.h"
@@ -17,9 +17,31 @@
 #define MYPROXY_DEFAULT_DELEG_HOURS    12
 
 #define MYPROXY_DEFAULT_KEYBITS        2048    /* NIST SP 800-57 */
+#define MYPROXY_DEFAULT_KEYTYPE        "rsa"   /* or p256, p384, ed25519 */
 
 #define MYPROXY_DEFAULT_TIMEOUT        120
 
+#define MYPROXY_PREFORK_WORKER_LIMIT   1024    /* scoreboard slots */
+#define MYPROXY_PREFORK_MAX_REQUESTS   1000    /* requests per worker */
+#define MYPROXY_PREFORK_RESPAWN_RATE   100     /* after failures, per second */
+#define MYPROXY_REACTOR_CONNECTIONS    4096    /* held by prefork_reactor */
+#define MYPROXY_KEEPALIVE_REQUESTS     100     /* requests per connection */
+#define MYPROXY_KEEPALIVE_TIMEOUT      10      /* idle seconds allowed */
+#define MYPROXY_MAX_LISTENERS          256     /* reuseport_listeners */
+#define MYPROXY_BULK_MAX_ENTRIES       100     /* credentials per bulk GET */
+#define MYPROXY_COALESCE_SLOTS         64      /* credentials shared at once */
+#define MYPROXY_KEY_CACHE_LIMIT        4096    /* signing_key_cache_size */
+#define MYPROXY_KEY_CACHE_TTL          300     /* seconds keys are cached */
+#define MYPROXY_REAPER_RATE            10      /* credentials per second */
+#define MYPROXY_REAPER_INTERVAL        3600    /* seconds between passes */
+#define MYPROXY_REAPER_REPORT          300     /* seconds between progress logs */
+#define MYPROXY_REAPER_RESTART         60      /* seconds between restarts */
+#define MYPROXY_CA_SECURE_HEAP         65536   /* locked bytes for the CA key */
+#define MYPROXY_COPROC_LIMIT           32      /* helpers per call-out */
+#define MYPROXY_COPROC_TIMEOUT         30      /* seconds per helper call */
+#define MYPROXY_COPROC_PING            60      /* seconds between health checks */
+#define MYPROXY_COPROC_RESTART         10      /* seconds between restarts */
+
 #define MYPROXY_DEFAULT_CLOCK_SKEW     300     /* 5 minutes */
 
 #define MYPROXY_CREDS_MAX_NAMELEN      80      /* longer names are
@@ -51,6 +73,10 @@
 #define MYPROXY_FILEDATA_PREFIX     "FILEDATA"
 #define MYPROXY_VONAME_STRING      "VONAME="
 #define MYPROXY_VOMSES_STRING      "VOMSES="
+#define MYPROXY_KEEPALIVE_STRING   "KEEPALIVE="
+#define MYPROXY_BULK_USERNAME_STRING   "BULK_USER="
+#define MYPROXY_BULK_CREDNAME_STRING   "BULK_CRED="
+#define MYPROXY_BULK_PASSPHRASE_STRING "BULK_PHRASE="
 
 /* myproxy server protocol information */
 #define MYPROXY_RESPONSE_TYPE_STRING     "RESPONSE="
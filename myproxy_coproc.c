@@ -0,0 +1,749 @@
+/*
+ * myproxy_coproc.c
+ *
+ * Pools of persistent call-out helper processes.  See myproxy_coproc.h.
+ *
+ * Each helper slot has a request pipe and a response pipe that the
+ * owning process creates once and keeps open, so the descriptors
+ * inherited by worker processes stay valid when a helper is
+ * restarted.  Which process is talking to a helper, and whether the
+ * helper is up, is kept in memory shared by all server processes.
+ */
+
+#include "myproxy_common.h"
+
+#define COPROC_MAX_FRAME  (1024 * 1024)     /* longest response body */
+#define COPROC_PING_WAIT  1                 /* seconds for a health check */
+#define COPROC_HEADER     64                /* longest response header */
+
+enum { REQ_W, RESP_R, REQ_R, RESP_W };     /* pipe ends of a slot */
+
+enum { SLOT_DOWN, SLOT_UP, SLOT_BROKEN };
+
+typedef struct coproc_slot_s {
+    volatile pid_t  lock;       /* process using the helper, or 0 */
+    volatile int    state;
+    volatile pid_t  helper;
+    volatile time_t started;
+    volatile time_t used;       /* last successful exchange */
+} coproc_slot_t;
+
+typedef struct coproc_shared_s {
+    volatile int  generation[MYPROXY_COPROC_POOLS];
+    coproc_slot_t slot[MYPROXY_COPROC_POOLS][MYPROXY_COPROC_LIMIT];
+} coproc_shared_t;
+
+static coproc_shared_t *shared = NULL;
+static pid_t owner = 0;         /* process that runs the helpers */
+
+/* This process's view of each pool, inherited across fork(). */
+static struct {
+    char *path;
+    myproxy_coproc_handler_t handler;   /* run in-process, if set */
+    int   count;
+    int   timeout;
+    int   generation;
+    int   fds[MYPROXY_COPROC_LIMIT][4];
+    /* health checks the owner is waiting on */
+    time_t pinged[MYPROXY_COPROC_LIMIT];
+    char   ping[MYPROXY_COPROC_LIMIT][COPROC_HEADER];
+    size_t ping_len[MYPROXY_COPROC_LIMIT];
+} pools[MYPROXY_COPROC_POOLS];
+
+int
+myproxy_coproc_init()
+{
+    if (shared) {
+        return 0;
+    }
+    shared = mmap(NULL, sizeof(coproc_shared_t), PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        shared = NULL;
+        verror_put_errno(errno);
+        verror_put_string("Failed to map shared call-out helper table");
+        return -1;
+    }
+    memset(shared, 0, sizeof(coproc_shared_t));
+
+    return 0;
+}
+
+static int
+slot_lock(coproc_slot_t *s)
+{
+    return __sync_bool_compare_and_swap(&s->lock, 0, getpid());
+}
+
+static void
+slot_unlock(coproc_slot_t *s)
+{
+    __sync_synchronize();
+    s->lock = 0;
+}
+
+/* Give up on a helper after a failed exchange.  The owner restarts
+   it once it has been reaped. */
+static void
+slot_break(coproc_slot_t *s)
+{
+    pid_t helper = s->helper;
+
+    s->state = SLOT_BROKEN;
+    if (helper > 0) {
+        kill(helper, SIGKILL);
+    }
+}
+
+static void
+drain(int fd)
+{
+    char buf[1024];
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    fcntl(fd, F_SETFL, flags);
+}
+
+static int
+read_full(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+write_full(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Answer requests on stdin with handler until the owner closes the
+ * pipe or something fails.  Runs in the helper process.
+ */
+static int
+serve(myproxy_coproc_handler_t handler)
+{
+    char header[64], *request = NULL, *response = NULL;
+    unsigned long len;
+    size_t n, response_len = 0;
+    int status;
+
+    if (handler("", 0, &response, &response_len) != 0) {
+        if (response) {
+            fprintf(stderr, "%.*s\n", (int)response_len, response);
+        }
+        return 1;
+    }
+    free(response);
+
+    while (1) {
+        for (n = 0; n < sizeof(header) - 1; n++) {
+            if (read_full(0, &header[n], 1) < 0) {
+                return 0;   /* owner closed the pipe */
+            }
+            if (header[n] == '\n') break;
+        }
+        header[n] = '\0';
+        if (sscanf(header, "%lu", &len) != 1 || len > COPROC_MAX_FRAME ||
+            (request = malloc(len + 1)) == NULL ||
+            read_full(0, request, len) < 0) {
+            return 1;
+        }
+        request[len] = '\0';
+        response = NULL;
+        response_len = 0;
+        status = handler(request, len, &response, &response_len);
+        free(request);
+        if (response == NULL) {
+            response_len = 0;
+        }
+        snprintf(header, sizeof(header), "%d %lu\n", status,
+                 (unsigned long)response_len);
+        if (write_full(1, header, strlen(header)) < 0 ||
+            write_full(1, response, response_len) < 0) {
+            return 1;
+        }
+        free(response);
+        if (len == 0 && status != 0) {
+            return 1;       /* failed health check */
+        }
+    }
+}
+
+static int
+slot_start(int pool, int i)
+{
+    coproc_slot_t *s = &shared->slot[pool][i];
+    int *fds = pools[pool].fds[i];
+    sigset_t chldset, oldset;
+    pid_t pid;
+    int fd, fdlimit;
+
+    /* discard what's left of an exchange the last helper didn't finish */
+    drain(fds[REQ_R]);
+    drain(fds[RESP_R]);
+
+    /* don't let the SIGCHLD handler run before we record the pid */
+    sigemptyset(&chldset);
+    sigaddset(&chldset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldset, &oldset);
+    if ((pid = fork()) < 0) {
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        verror_put_string("fork() failed");
+        verror_put_errno(errno);
+        return -1;
+    }
+    if (pid == 0) {
+        if (dup2(fds[REQ_R], 0) < 0 || dup2(fds[RESP_W], 1) < 0) {
+            perror("dup2");
+            _exit(1);
+        }
+        fdlimit = sysconf(_SC_OPEN_MAX);
+        for (fd = 3; fd < fdlimit; fd++) {
+            close(fd);
+        }
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&oldset);
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        setenv("MYPROXY_COPROCESS", "1", 1);
+        if (pools[pool].handler) {
+            _exit(serve(pools[pool].handler));
+        }
+        execl(pools[pool].path, pools[pool].path, (char *)NULL);
+        fprintf(stderr, "failed to run %s: %s\n", pools[pool].path,
+                strerror(errno));
+        _exit(1);
+    }
+    s->helper = pid;
+    s->started = s->used = time(NULL);
+    s->state = SLOT_UP;
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+
+    return 0;
+}
+
+static void
+pool_stop(int pool)
+{
+    int i, j;
+
+    for (i = 0; i < pools[pool].count; i++) {
+        coproc_slot_t *s = &shared->slot[pool][i];
+        pid_t helper = s->helper;
+
+        s->helper = 0;
+        s->state = SLOT_DOWN;
+        if (helper > 0) {
+            kill(helper, SIGTERM);
+        }
+        for (j = 0; j < 4; j++) {
+            if (pools[pool].fds[i][j] >= 0) {
+                close(pools[pool].fds[i][j]);
+            }
+        }
+        s->lock = 0;
+        pools[pool].pinged[i] = 0;
+    }
+    /* processes still holding the old descriptors must not use them */
+    shared->generation[pool]++;
+    free(pools[pool].path);
+    pools[pool].path = NULL;
+    pools[pool].handler = NULL;
+    pools[pool].count = 0;
+}
+
+static int
+pool_configure(int pool, const char *path,
+               myproxy_coproc_handler_t handler, int count, int timeout)
+{
+    int i, j;
+
+    if (path == NULL || count < 0) {
+        count = 0;
+    }
+    if (count > MYPROXY_COPROC_LIMIT) {
+        count = MYPROXY_COPROC_LIMIT;
+    }
+    pools[pool].timeout = timeout;
+    if (count == pools[pool].count &&
+        (count == 0 || (strcmp(path, pools[pool].path) == 0 &&
+                        handler == pools[pool].handler))) {
+        return 0;
+    }
+    if (shared == NULL) {
+        verror_put_string("Call-out helpers not initialised");
+        return -1;
+    }
+    owner = getpid();
+    if (pools[pool].count > 0) {
+        myproxy_log("Stopping %s call-out helpers", pools[pool].path);
+        pool_stop(pool);
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (handler == NULL && access(path, X_OK) < 0) {
+        verror_put_string("%s not executable", path);
+        verror_put_errno(errno);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        int req[2], resp[2];
+
+        if (pipe(req) < 0) {
+            verror_put_string("pipe() failed");
+            verror_put_errno(errno);
+            goto error;
+        }
+        if (pipe(resp) < 0) {
+            verror_put_string("pipe() failed");
+            verror_put_errno(errno);
+            close(req[0]);
+            close(req[1]);
+            goto error;
+        }
+        pools[pool].fds[i][REQ_W] = req[1];
+        pools[pool].fds[i][REQ_R] = req[0];
+        pools[pool].fds[i][RESP_R] = resp[0];
+        pools[pool].fds[i][RESP_W] = resp[1];
+        for (j = 0; j < 4; j++) {
+            fcntl(pools[pool].fds[i][j], F_SETFD, FD_CLOEXEC);
+        }
+        fcntl(req[1], F_SETFL, fcntl(req[1], F_GETFL) | O_NONBLOCK);
+        fcntl(resp[0], F_SETFL, fcntl(resp[0], F_GETFL) | O_NONBLOCK);
+        pools[pool].count = i + 1;
+    }
+    pools[pool].path = strdup(path);
+    pools[pool].handler = handler;
+    pools[pool].generation = shared->generation[pool];
+
+    for (i = 0; i < count; i++) {
+        if (slot_start(pool, i) < 0) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+    }
+    myproxy_log("Started %d %s call-out helpers", count, path);
+
+    return 0;
+
+ error:
+    for (i = 0; i < pools[pool].count; i++) {
+        for (j = 0; j < 4; j++) {
+            close(pools[pool].fds[i][j]);
+        }
+    }
+    pools[pool].count = 0;
+    return -1;
+}
+
+int
+myproxy_coproc_configure(int pool, const char *path, int count,
+                         int timeout)
+{
+    return pool_configure(pool, path, NULL, count, timeout);
+}
+
+int
+myproxy_coproc_configure_handler(int pool, const char *name,
+                                 myproxy_coproc_handler_t handler,
+                                 int count, int timeout)
+{
+    return pool_configure(pool, name, handler, count, timeout);
+}
+
+int
+myproxy_coproc_running(int pool)
+{
+    return (shared != NULL && pools[pool].count > 0 &&
+            pools[pool].generation == shared->generation[pool]);
+}
+
+/*
+ * Wait until fd is ready for events, the deadline passes, or the
+ * helper in slot s goes away.  Returns 0 when ready, -1 otherwise.
+ */
+static int
+slot_wait(coproc_slot_t *s, pid_t helper, int fd, short events,
+          time_t deadline)
+{
+    struct pollfd pfd;
+    time_t now;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1) {
+        if (s->helper != helper || s->state != SLOT_UP) {
+            verror_put_string("call-out helper exited");
+            return -1;
+        }
+        now = time(NULL);
+        if (now >= deadline) {
+            verror_put_string("call-out helper timed out");
+            return -1;
+        }
+        rc = poll(&pfd, 1, 1000);   /* wake to check on the helper */
+        if (rc > 0) {
+            return 0;
+        }
+        if (rc < 0 && errno != EINTR) {
+            verror_put_string("poll() failed");
+            verror_put_errno(errno);
+            return -1;
+        }
+    }
+}
+
+static int
+slot_write(coproc_slot_t *s, pid_t helper, int fd, const char *buf,
+           size_t len, time_t deadline)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            verror_put_string("write to call-out helper failed");
+            verror_put_errno(errno);
+            return -1;
+        } else if (slot_wait(s, helper, fd, POLLOUT, deadline) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+slot_read(coproc_slot_t *s, pid_t helper, int fd, char *buf, size_t len,
+          time_t deadline)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            verror_put_string("read from call-out helper failed");
+            verror_put_errno(errno);
+            return -1;
+        } else if (slot_wait(s, helper, fd, POLLIN, deadline) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Send one request to the helper in a slot we hold and read its
+ * response.  Returns 0 with *status set if the helper answered, -1 if
+ * the exchange failed.
+ */
+static int
+slot_exchange(int pool, int i, const char *request, size_t request_len,
+              int timeout, int *status, char **body, size_t *body_len)
+{
+    coproc_slot_t *s = &shared->slot[pool][i];
+    int *fds = pools[pool].fds[i];
+    pid_t helper = s->helper;
+    time_t deadline = time(NULL) + timeout;
+    char header[COPROC_HEADER];
+    unsigned long len;
+    size_t n = 0;
+
+    *body = NULL;
+    snprintf(header, sizeof(header), "%lu\n", (unsigned long)request_len);
+    if (slot_write(s, helper, fds[REQ_W], header, strlen(header),
+                   deadline) < 0 ||
+        slot_write(s, helper, fds[REQ_W], request, request_len,
+                   deadline) < 0) {
+        return -1;
+    }
+
+    /* one byte at a time, so none of the body is read with it */
+    do {
+        if (n == sizeof(header) - 1) {
+            verror_put_string("bad response header from call-out helper");
+            return -1;
+        }
+        if (slot_read(s, helper, fds[RESP_R], &header[n], 1, deadline) < 0) {
+            return -1;
+        }
+    } while (header[n++] != '\n');
+    header[n] = '\0';
+    if (sscanf(header, "%d %lu", status, &len) != 2 ||
+        len > COPROC_MAX_FRAME) {
+        verror_put_string("bad response header from call-out helper");
+        return -1;
+    }
+
+    if ((*body = malloc(len + 1)) == NULL) {
+        verror_put_errno(errno);
+        return -1;
+    }
+    if (slot_read(s, helper, fds[RESP_R], *body, len, deadline) < 0) {
+        free(*body);
+        *body = NULL;
+        return -1;
+    }
+    (*body)[len] = '\0';
+    *body_len = len;
+
+    return 0;
+}
+
+int
+myproxy_coproc_call(int pool, const char *request, size_t request_len,
+                    char **response, size_t *response_len)
+{
+    int count = pools[pool].count;
+    coproc_slot_t *s = NULL;
+    time_t deadline;
+    int i, j, up, status;
+
+    if (shared == NULL || count == 0 ||
+        pools[pool].generation != shared->generation[pool]) {
+        return 1;
+    }
+
+    /* find an idle helper, waiting for one if all are busy */
+    deadline = time(NULL) + pools[pool].timeout;
+    for (j = getpid() % count; ; usleep(1000)) {
+        up = 0;
+        for (i = 0; i < count; i++, j = (j + 1) % count) {
+            s = &shared->slot[pool][j];
+            if (s->state != SLOT_UP) continue;
+            up++;
+            if (!slot_lock(s)) continue;
+            if (s->state == SLOT_UP) break;
+            slot_unlock(s);
+        }
+        if (i < count) break;
+        if (up == 0 || time(NULL) >= deadline) {
+            myproxy_debug("no %s call-out helper available",
+                          pools[pool].path);
+            return 1;
+        }
+    }
+
+    if (slot_exchange(pool, j, request, request_len, pools[pool].timeout,
+                      &status, response, response_len) < 0) {
+        verror_put_string("%s call-out helper failed", pools[pool].path);
+        slot_break(s);
+        slot_unlock(s);
+        return -1;
+    }
+    s->used = time(NULL);
+    slot_unlock(s);
+
+    if (status != 0) {
+        verror_put_string("%s returned status %d", pools[pool].path,
+                          status);
+        if (*response_len > 0) {
+            verror_put_string("%s", *response);
+        }
+        free(*response);
+        *response = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+myproxy_coproc_reaped(pid_t pid)
+{
+    int pool, i;
+
+    if (shared == NULL || owner != getpid()) {
+        return 0;
+    }
+    for (pool = 0; pool < MYPROXY_COPROC_POOLS; pool++) {
+        for (i = 0; i < pools[pool].count; i++) {
+            if (shared->slot[pool][i].helper == pid) {
+                shared->slot[pool][i].helper = 0;
+                shared->slot[pool][i].state = SLOT_DOWN;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Start a health check of the helper in a slot we hold by sending it
+ * an empty request, without waiting for the answer.
+ * Returns 0 on success, -1 on error and sets verror.
+ */
+static int
+ping_start(int pool, int i)
+{
+    if (write(pools[pool].fds[i][REQ_W], "0\n", 2) != 2) {
+        verror_put_string("write to call-out helper failed");
+        verror_put_errno(errno);
+        return -1;
+    }
+    pools[pool].pinged[i] = time(NULL);
+    pools[pool].ping_len[i] = 0;
+    return 0;
+}
+
+/*
+ * Read what has arrived of a helper's answer to a health check.
+ * Returns 1 if it answered, 0 if the answer isn't complete yet, and
+ * -1 with verror set if the helper failed the check.
+ */
+static int
+ping_poll(int pool, int i)
+{
+    char *buf = pools[pool].ping[i];
+    size_t *n = &pools[pool].ping_len[i];
+    unsigned long len;
+    ssize_t r;
+    int status;
+
+    while (*n < COPROC_HEADER - 1) {
+        r = read(pools[pool].fds[i][RESP_R], &buf[*n], 1);
+        if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        }
+        if (r <= 0) {
+            verror_put_string("read from call-out helper failed");
+            verror_put_errno(errno);
+            return -1;
+        }
+        if (buf[(*n)++] == '\n') {
+            buf[*n] = '\0';
+            if (sscanf(buf, "%d %lu", &status, &len) != 2 ||
+                status != 0 || len != 0) {
+                verror_put_string("bad health check response from "
+                                  "call-out helper");
+                return -1;
+            }
+            return 1;
+        }
+    }
+    verror_put_string("bad response header from call-out helper");
+    return -1;
+}
+
+void
+myproxy_coproc_check()
+{
+    time_t now = time(NULL);
+    int pool, i, rc;
+
+    if (shared == NULL || owner != getpid()) {
+        return;
+    }
+    for (pool = 0; pool < MYPROXY_COPROC_POOLS; pool++) {
+        for (i = 0; i < pools[pool].count; i++) {
+            coproc_slot_t *s = &shared->slot[pool][i];
+            pid_t lock = s->lock;
+
+            if (pools[pool].pinged[i]) {
+                /* the slot is still ours while the check is out */
+                if (s->state != SLOT_UP) {
+                    rc = 1;     /* exited meanwhile; restarted below */
+                } else if ((rc = ping_poll(pool, i)) == 0) {
+                    if (now - pools[pool].pinged[i] <= COPROC_PING_WAIT) {
+                        continue;
+                    }
+                    verror_put_string("call-out helper timed out");
+                    rc = -1;
+                }
+                if (rc < 0) {
+                    myproxy_log_verror();
+                    verror_clear();
+                    myproxy_log("%s call-out helper failed health check",
+                                pools[pool].path);
+                    slot_break(s);
+                } else if (s->state == SLOT_UP) {
+                    s->used = now;
+                }
+                pools[pool].pinged[i] = 0;
+                slot_unlock(s);
+                continue;
+            }
+
+            if (lock != 0 && kill(lock, 0) < 0 && errno == ESRCH &&
+                __sync_bool_compare_and_swap(&s->lock, lock, getpid())) {
+                myproxy_log("%s call-out helper abandoned by process %ld",
+                            pools[pool].path, (long)lock);
+                slot_break(s);
+                slot_unlock(s);
+                continue;
+            }
+            if (s->state == SLOT_DOWN && s->helper == 0 &&
+                now - s->started >= MYPROXY_COPROC_RESTART &&
+                slot_lock(s)) {
+                myproxy_log("Restarting %s call-out helper",
+                            pools[pool].path);
+                if (slot_start(pool, i) < 0) {
+                    myproxy_log_verror();
+                    verror_clear();
+                    s->started = now;   /* try again later */
+                }
+                slot_unlock(s);
+                continue;
+            }
+            if (s->state == SLOT_UP &&
+                now - s->used >= MYPROXY_COPROC_PING && slot_lock(s)) {
+                if (ping_start(pool, i) < 0) {
+                    myproxy_log_verror();
+                    verror_clear();
+                    myproxy_log("%s call-out helper failed health check",
+                                pools[pool].path);
+                    slot_break(s);
+                    slot_unlock(s);
+                }
+            }
+        }
+    }
+}
+
+void
+myproxy_coproc_stop()
+{
+    int pool;
+
+    if (shared == NULL || owner != getpid()) {
+        return;
+    }
+    for (pool = 0; pool < MYPROXY_COPROC_POOLS; pool++) {
+        if (pools[pool].count > 0) {
+            pool_stop(pool);
+        }
+    }
+}
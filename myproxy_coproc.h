@@ -0,0 +1,125 @@
+/*
+ * myproxy_coproc.h
+ *
+ * Pools of persistent call-out helper processes.
+ *
+ * Instead of running a call-out program once per request with
+ * myproxy_popen(), the server can keep a few copies of it running and
+ * exchange framed requests and responses with them over pipes.
+ *
+ * A request is a line holding the decimal length of the request body,
+ * followed by the body.  The helper answers with a line holding a
+ * status (0 for success) and the decimal length of the response body,
+ * followed by the body.  On failure, the body is an error message.
+ * An empty request is a health check, to be answered with "0 0".
+ * Helpers run with MYPROXY_COPROCESS=1 in their environment and are
+ * stopped with SIGTERM.
+ *
+ * A pool can instead run a handler function in forked copies of the
+ * owning process, for services the server provides itself.
+ */
+
+#ifndef __MYPROXY_COPROC_H
+#define __MYPROXY_COPROC_H
+
+#include <sys/types.h>
+
+/* call-outs that can run as helpers */
+#define MYPROXY_COPROC_ISSUER   0       /* certificate_issuer_program */
+#define MYPROXY_COPROC_EXTAPP   1       /* certificate_extapp */
+#define MYPROXY_COPROC_SIGNER   2       /* certificate_openssl_engine_sessions */
+#define MYPROXY_COPROC_POOLS    3
+
+/*
+ * A helper run in-process answers each request with a status and a
+ * response (allocated with malloc(), or NULL if empty).  It is also
+ * called with an empty request when the helper starts, and for each
+ * health check; a nonzero status then stops the helper.
+ */
+typedef int (*myproxy_coproc_handler_t)(const char *request,
+                                         size_t request_len,
+                                         char **response,
+                                         size_t *response_len);
+
+/*
+ * myproxy_coproc_init()
+ *
+ * Set up the helper state shared by this process and those forked
+ * after this call.
+ * Returns 0 on success, -1 on error and sets verror.
+ */
+int myproxy_coproc_init();
+
+/*
+ * myproxy_coproc_configure()
+ *
+ * Run count helpers of the program at path for the given pool, each
+ * call waiting at most timeout seconds.  The helpers are restarted
+ * only if path or count changed.  A count of 0 or a NULL path stops
+ * the pool.  Called by the process that owns the helpers.
+ * Returns 0 on success, -1 on error and sets verror.
+ */
+int myproxy_coproc_configure(int pool, const char *path, int count,
+                             int timeout);
+
+/*
+ * myproxy_coproc_configure_handler()
+ *
+ * Like myproxy_coproc_configure(), but the helpers are forked copies
+ * of the calling process that run handler.  The helpers are restarted
+ * only if name, handler, or count changed.
+ * Returns 0 on success, -1 on error and sets verror.
+ */
+int myproxy_coproc_configure_handler(int pool, const char *name,
+                                     myproxy_coproc_handler_t handler,
+                                     int count, int timeout);
+
+/*
+ * myproxy_coproc_running()
+ *
+ * Returns 1 if this process can send requests to helpers in the given
+ * pool, 0 if the pool isn't configured or was reconfigured since this
+ * process was forked.
+ */
+int myproxy_coproc_running(int pool);
+
+/*
+ * myproxy_coproc_check()
+ *
+ * Restart helpers that have exited or were abandoned in the middle
+ * of a call, and check that idle helpers still answer.  Doesn't wait
+ * for the answers; they are collected by the next call.  Called about
+ * once a second by the process that owns the helpers.
+ */
+void myproxy_coproc_check();
+
+/*
+ * myproxy_coproc_reaped()
+ *
+ * Note that the child process pid has exited.  Safe to call from a
+ * signal handler.
+ * Returns 1 if pid was a helper, 0 otherwise.
+ */
+int myproxy_coproc_reaped(pid_t pid);
+
+/*
+ * myproxy_coproc_stop()
+ *
+ * Stop all helpers.
+ */
+void myproxy_coproc_stop();
+
+/*
+ * myproxy_coproc_call()
+ *
+ * Send request to a helper in the given pool and return its response
+ * in *response (allocated, NUL-terminated), with its length in
+ * *response_len.
+ * Returns 0 on success, -1 on error and sets verror, or 1 if no
+ * helper is available, in which case the caller should run the
+ * program itself.
+ */
+int myproxy_coproc_call(int pool, const char *request, size_t request_len,
+                        char **response, size_t *response_len);
+
+#endif /* __MYPROXY_COPROC_H */
@@ -7,6 +7,7 @@
  */
 
 #include "myproxy_common.h"	/* all needed headers included here */
+#include "myproxy_creds_backend.h"
 #include "pwd.h"
 
 #ifndef MAXPATHLEN
@@ -37,6 +38,19 @@
 static char *storage_dir = NULL;
 static int searched_for_storage_dir = 0;
 static int max_namelen = -1;
+static int verifier_cost = 0;
+static int storage_sharded = 0;
+static const myproxy_creds_backend_t *backend = NULL;
+
+static int myproxy_creds_match(struct myproxy_creds *creds,
+                               char *username, char *owner_name,
+                               char *credname,
+                               time_t start_time, time_t end_time);
+static int files_retrieve(struct myproxy_creds *creds);
+static int files_exist(const char *username, const char *credname);
+static const myproxy_creds_backend_t *get_backend();
+static const myproxy_creds_backend_t files_backend;
+static void reap_reset();
 
 /**********************************************************************
  *
@@ -306,6 +320,158 @@ strmd5(const char *s, unsigned char *digest)
 }
         
     
+/*
+ * sterile_name()
+ *
+ * Return an allocated copy of the given username or credname that is
+ * safe to use in a file name: the MD5 hash of the name if it is too
+ * long or contains a '/', otherwise the sterilized name itself.
+ *
+ * Returns NULL on error.
+ */
+static char *
+sterile_name(const char *name)
+{
+    char *sterile = NULL;
+
+    if (strlen(name) > max_namelen || strchr(name, '/')) {
+        return strmd5(name, NULL);
+    }
+
+    sterile = mystrdup(name);
+    if (sterile != NULL) {
+        sterilize_string(sterile);
+    }
+
+    return sterile;
+}
+
+/*
+ * Sharded storage layout
+ *
+ * A flat storage directory with millions of entries is slow to search
+ * and list.  When SHARD_MARKER exists in the storage directory, each
+ * user's files go in <storage_dir>/xx/yy/, where xxyy are the first
+ * four hex digits of the MD5 of the sterilized username, so all of a
+ * user's credentials share one small directory.
+ * myproxy_creds_shard_storage() moves an existing repository into
+ * this layout.  While SHARD_PENDING also exists, it may not have
+ * finished, so credentials are looked for at the top level too.
+ */
+#define SHARD_MARKER		".sharded"
+#define SHARD_PENDING		".sharding"
+#define LAYOUT_FLAT		0
+#define LAYOUT_MIGRATING	1
+#define LAYOUT_SHARDED		2
+
+/*
+ * storage_layout()
+ *
+ * Return the LAYOUT_* of the storage directory.  Once a repository is
+ * sharded it stays that way, so only that answer is remembered.
+ */
+static int
+storage_layout()
+{
+    char path[MAXPATHLEN];
+
+    if (storage_sharded) {
+        return LAYOUT_SHARDED;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", storage_dir,
+                 SHARD_MARKER) >= sizeof(path) ||
+        access(path, F_OK) < 0) {
+        return LAYOUT_FLAT;
+    }
+    snprintf(path, sizeof(path), "%s/%s", storage_dir, SHARD_PENDING);
+    if (access(path, F_OK) == 0) {
+        return LAYOUT_MIGRATING;
+    }
+    storage_sharded = 1;
+
+    return LAYOUT_SHARDED;
+}
+
+/*
+ * shard_dir()
+ *
+ * Return the allocated path of the shard for a sterilized username.
+ */
+static char *
+shard_dir(const char *sterile_username)
+{
+    char *hash, *dir = NULL;
+
+    if ((hash = strmd5(sterile_username, NULL)) == NULL) {
+        return NULL;
+    }
+    if ((dir = malloc(strlen(storage_dir)+7)) == NULL) {
+        verror_put_errno(errno);
+    } else {
+        sprintf(dir, "%s/%.2s/%.2s", storage_dir, hash, hash+2);
+    }
+    free(hash);
+
+    return dir;
+}
+
+/*
+ * make_shard_dirs()
+ *
+ * Create the shard directories above the given storage path, if they
+ * are missing.
+ */
+static int
+make_shard_dirs(const char *path)
+{
+    char dir[MAXPATHLEN];
+    size_t len = strlen(storage_dir);
+    char *slash;
+
+    if (strncmp(path, storage_dir, len) || path[len] != '/' ||
+        snprintf(dir, sizeof(dir), "%s", path) >= sizeof(dir)) {
+        return 0;
+    }
+    for (slash = strchr(dir+len+1, '/'); slash;
+         slash = strchr(slash+1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+            verror_put_errno(errno);
+            verror_put_string("creating %s", dir);
+            return -1;
+        }
+        *slash = '/';
+    }
+
+    return 0;
+}
+
+/*
+ * storage_paths()
+ *
+ * Set the .creds, .data, and .lock paths for a file name stem in dir.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+storage_paths(const char *dir, const char *stem,
+              char **creds_path, char **data_path, char **lock_path)
+{
+    if (*creds_path) (*creds_path)[0] = '\0';
+    if (*data_path) (*data_path)[0] = '\0';
+    if (*lock_path) (*lock_path)[0] = '\0';
+
+    if (my_append(creds_path, dir, "/", stem, ".creds", NULL) == -1 ||
+        my_append(data_path, dir, "/", stem, ".data", NULL) == -1 ||
+        my_append(lock_path, dir, "/", stem, ".lock", NULL) == -1) {
+        verror_put_string("Internal error: can't form storage path for %s",
+                          stem);
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * get_storage_locations()
  *
@@ -323,13 +489,11 @@ get_storage_locations(const char *username,
 		      char **lock_path)
 {
     int return_code = -1;
-    int long_username = 0;
-    int long_credname = 0;
+    int layout;
     char *sterile_username = NULL;
     char *sterile_credname = NULL;
-    const char *creds_suffix = ".creds";
-    const char *data_suffix = ".data";
-    const char *lock_suffix = ".lock";
+    char *stem = NULL, *dir = NULL;
+    char *flat_creds = NULL, *flat_data = NULL, *flat_lock = NULL;
     
     assert(username != NULL);
     assert(creds_path != NULL);
@@ -340,100 +504,49 @@ get_storage_locations(const char *username,
         goto error;
     }
 
-    if (strlen(username) > max_namelen) {
-        long_username = 1;
+    sterile_username = sterile_name(username);
+    if (sterile_username == NULL) {
+        goto error;
     }
-
-    if (long_username || strchr(username, '/')) {
-       sterile_username = strmd5(username, NULL);
-
-       if (sterile_username == NULL) {
-           goto error;
-       }
-
-    } else {
-       sterile_username = mystrdup(username);
-
-       if (sterile_username == NULL) {
-	   goto error;
-       }
-       
-       sterilize_string(sterile_username);
+    if (my_append(&stem, sterile_username, NULL) == -1) {
+        goto error;
     }
-
-    if (*creds_path) (*creds_path)[0] = '\0';
-    if (*data_path) (*data_path)[0] = '\0';
-    if (*lock_path) (*lock_path)[0] = '\0';
-   
-    if (!credname) {
-    	if (my_append(creds_path, storage_dir,
-		      "/", sterile_username, creds_suffix,
-		      NULL) == -1) {
-	    verror_put_string("Internal error: creds_path too small: "
-			      "%s line %s", __FILE__, __LINE__);
-	    goto error;
-    	}
-    	if (my_append(data_path, storage_dir,
-		      "/", sterile_username, data_suffix,
-		      NULL) == -1) {
-	    verror_put_string("Internal error: data_path too small: "
-			      "%s line %s", __FILE__, __LINE__);
-	    goto error;
-    	}
-    	if (my_append(lock_path, storage_dir,
-		      "/", sterile_username, lock_suffix,
-		      NULL) == -1) {
-	    verror_put_string("Internal error: lock_path too small: "
-			      "%s line %s", __FILE__, __LINE__);
-	    goto error;
-    	}
-
-    } else {
-
-        if (strlen(credname) > max_namelen) {
-            long_credname = 1;
+    if (credname) {
+        sterile_credname = sterile_name(credname);
+        if (sterile_credname == NULL ||
+            my_append(&stem, "-", sterile_credname, NULL) == -1) {
+            goto error;
         }
+    }
 
-        if (long_credname || strchr(credname, '/')) {
-            sterile_credname = strmd5(credname, NULL);
-
-            if (sterile_credname == NULL) {
-                goto error;
-            }
+    layout = storage_layout();
+    if (layout == LAYOUT_FLAT) {
+        return_code = storage_paths(storage_dir, stem,
+                                    creds_path, data_path, lock_path);
+        goto error;
+    }
 
-        } else {
-            sterile_credname = mystrdup(credname);
+    if ((dir = shard_dir(sterile_username)) == NULL ||
+        storage_paths(dir, stem, creds_path, data_path, lock_path) == -1) {
+        goto error;
+    }
 
-            if (sterile_credname == NULL) {
-                goto error;
-            }
-       
-            sterilize_string(sterile_credname);
+    /* While the repository is being sharded, credentials that haven't
+       been moved into their shard yet are still at the top level. */
+    if (layout == LAYOUT_MIGRATING && file_exists(*data_path) != 1) {
+        if (storage_paths(storage_dir, stem,
+                          &flat_creds, &flat_data, &flat_lock) == -1) {
+            goto error;
+        }
+        if (file_exists(flat_data) == 1) {
+            free(*creds_path);
+            free(*data_path);
+            free(*lock_path);
+            *creds_path = flat_creds;
+            *data_path = flat_data;
+            *lock_path = flat_lock;
+            flat_creds = flat_data = flat_lock = NULL;
         }
-    
-    	if (my_append(creds_path, storage_dir,
-				"/", sterile_username, "-",
-				sterile_credname, creds_suffix, NULL) == -1) {
-         verror_put_string("Internal error: creds_path too small: %s line %s",
-			   __FILE__, __LINE__);
-       	 goto error;
-    	}
-    	if (my_append(data_path, storage_dir,
-				"/", sterile_username, "-",
-				sterile_credname, data_suffix, NULL) == -1)
-    	{
-       	 verror_put_string("Internal error: data_path too small: %s line %s",
-       	                   __FILE__, __LINE__);
-       	 goto error;
-    	}
-    	if (my_append(lock_path, storage_dir,
-				"/", sterile_username, "-",
-				sterile_credname, lock_suffix, NULL) == -1)
-    	{
-       	 verror_put_string("Internal error: lock_path too small: %s line %s",
-       	                   __FILE__, __LINE__);
-       	 goto error;
-    	}
     }
 
     /* Success */
@@ -446,414 +559,2402 @@ get_storage_locations(const char *username,
     if (sterile_credname != NULL) {
         free(sterile_credname);
     }
+    if (stem) free(stem);
+    if (dir) free(dir);
+    if (flat_creds) free(flat_creds);
+    if (flat_data) free(flat_data);
+    if (flat_lock) free(flat_lock);
     
     return return_code;
 }
 
 
 /*
- * write_data_file()
- *
- * Write the data in the myproxy_creds structure to the
- * file name given, creating the file with the given mode.
- *
- * Returns 0 on success, -1 on error.
+ * The storage_scan_*() functions list the .data files in the storage
+ * directory, or, in a sharded repository, in all of the shards or
+ * just the shard for one sterilized username.  When the repository
+ * is being sharded, the top level is listed too.
  */
+typedef struct {
+    int flat;                   /* top level still to list */
+    char *shard;                /* single shard still to list */
+    int shards;                 /* walk all shards */
+    DIR *l1, *l2, *dir;         /* shard levels and current directory */
+    char l1_name[3];
+    char dir_path[MAXPATHLEN];  /* current directory */
+    int in_shard;               /* current directory is a shard */
+    int error;
+} storage_scan_t;
+
 static int
-write_data_file(const struct myproxy_creds *creds,
-                const char *data_file_path,
-                const mode_t data_file_mode)
+storage_scan_open(storage_scan_t *scan, const char *sterile_username)
 {
-
-    int data_fd = -1;
-    FILE *data_stream = NULL;
-    char *tmpfilename = NULL;
-    int bufsiz;
-    int return_code = -1;
-
-    if (data_file_path == NULL) {
-        goto error;
+    int layout = storage_layout();
+
+    memset(scan, 0, sizeof(*scan));
+    scan->flat = (layout != LAYOUT_SHARDED);
+    if (layout != LAYOUT_FLAT) {
+        if (sterile_username) {
+            if ((scan->shard = shard_dir(sterile_username)) == NULL) {
+                return -1;
+            }
+        } else {
+            scan->shards = 1;
+        }
     }
 
-    bufsiz = strlen(data_file_path)+15;
-    tmpfilename = malloc(bufsiz);
-    snprintf(tmpfilename, bufsiz, "%s.temp.XXXXXX", data_file_path);
+    return 0;
+}
 
-    data_fd = mkstemp(tmpfilename);
-    if (data_fd == -1)
-    {
-        verror_put_errno(errno);
-        verror_put_string("opening %s for writing", tmpfilename);
-        goto error;
-    }
+/* next entry of a shard level: two lowercase hex digits */
+static struct dirent *
+next_shard_entry(DIR *dir)
+{
+    struct dirent *de;
 
-    if (data_file_mode != 0600) { /* mkstemp creates file with 0600 */
-        fchmod(data_fd, data_file_mode);
+    while ((de = readdir(dir)) != NULL) {
+        if (strlen(de->d_name) == 2 &&
+            strchr("0123456789abcdef", de->d_name[0]) &&
+            strchr("0123456789abcdef", de->d_name[1])) {
+            return de;
+        }
     }
 
-    /* Now open as stream for easier IO */
-    data_stream = fdopen(data_fd, "w");
-    
-    if (data_stream == NULL)
-    {
+    return NULL;
+}
+
+static int
+storage_scan_opendir(storage_scan_t *scan, int in_shard)
+{
+    scan->in_shard = in_shard;
+    if ((scan->dir = opendir(scan->dir_path)) == NULL) {
+        if (in_shard && errno == ENOENT) { /* no credentials there yet */
+            return 0;
+        }
         verror_put_errno(errno);
-        verror_put_string("reopening storage file %s", data_file_path);
-        goto error;
+        verror_put_string("failed to open credential storage directory %s",
+                          scan->dir_path);
+        scan->error = 1;
+        return -1;
     }
 
-    fprintf (data_stream, "OWNER=%s\n",creds->owner_name);
-    fprintf (data_stream, "LIFETIME=%d\n", creds->lifetime);
+    return 0;
+}
 
-    if (creds->credname != NULL)
-	fprintf (data_stream, "NAME=%s\n", creds->credname);
+/*
+ * storage_scan_next()
+ *
+ * Return the name of the next .data file, which is in
+ * scan->dir_path, or NULL at the end or on error (with scan->error
+ * set).
+ */
+static const char *
+storage_scan_next(storage_scan_t *scan)
+{
+    struct dirent *de;
+    size_t len;
+
+    for (;;) {
+        if (scan->dir) {
+            while ((de = readdir(scan->dir)) != NULL) {
+                len = strlen(de->d_name);
+                if (len > 5 && strcmp(de->d_name+len-5, ".data") == 0) {
+                    return de->d_name;
+                }
+            }
+            closedir(scan->dir);
+            scan->dir = NULL;
+        }
+        if (scan->flat) {
+            scan->flat = 0;
+            snprintf(scan->dir_path, sizeof(scan->dir_path), "%s",
+                     storage_dir);
+            if (storage_scan_opendir(scan, 0) == -1) {
+                return NULL;
+            }
+            continue;
+        }
+        if (scan->shard) {
+            snprintf(scan->dir_path, sizeof(scan->dir_path), "%s",
+                     scan->shard);
+            free(scan->shard);
+            scan->shard = NULL;
+            if (storage_scan_opendir(scan, 1) == -1) {
+                return NULL;
+            }
+            continue;
+        }
+        if (!scan->shards) {
+            return NULL;
+        }
+        if (scan->l2 && (de = next_shard_entry(scan->l2)) != NULL) {
+            snprintf(scan->dir_path, sizeof(scan->dir_path), "%s/%s/%s",
+                     storage_dir, scan->l1_name, de->d_name);
+            if (storage_scan_opendir(scan, 1) == -1) {
+                return NULL;
+            }
+            continue;
+        }
+        if (scan->l2) {
+            closedir(scan->l2);
+            scan->l2 = NULL;
+        }
+        if (scan->l1 == NULL && (scan->l1 = opendir(storage_dir)) == NULL) {
+            verror_put_errno(errno);
+            verror_put_string("failed to open credential storage directory");
+            scan->error = 1;
+            return NULL;
+        }
+        if ((de = next_shard_entry(scan->l1)) == NULL) {
+            scan->shards = 0;
+            return NULL;
+        }
+        memcpy(scan->l1_name, de->d_name, 3);
+        snprintf(scan->dir_path, sizeof(scan->dir_path), "%s/%s",
+                 storage_dir, scan->l1_name);
+        if ((scan->l2 = opendir(scan->dir_path)) == NULL) {
+            verror_put_errno(errno);
+            verror_put_string("failed to open %s", scan->dir_path);
+            scan->error = 1;
+            return NULL;
+        }
+    }
+}
 
-    if (creds->creddesc != NULL)
-	fprintf (data_stream, "DESCRIPTION=%s\n", creds->creddesc);
+static void
+storage_scan_close(storage_scan_t *scan)
+{
+    if (scan->dir) closedir(scan->dir);
+    if (scan->l2) closedir(scan->l2);
+    if (scan->l1) closedir(scan->l1);
+    if (scan->shard) free(scan->shard);
+    memset(scan, 0, sizeof(*scan));
+}
 
-    if (creds->retrievers != NULL)
-	fprintf (data_stream, "RETRIEVERS=%s\n", creds->retrievers);
+/*
+ * storage_scan_split()
+ *
+ * Split the name of a .data file returned by storage_scan_next() into
+ * the allocated (sterilized) username and credname it was stored
+ * under.  Either may contain '-', so in a shard the username is the
+ * prefix that hashes to that shard; at the top level it is everything
+ * before the first '-'.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+storage_scan_split(const storage_scan_t *scan, const char *name,
+                   char **username, char **credname)
+{
+    char *stem, *dash, *dir = NULL;
 
-    if (creds->keyretrieve != NULL)
-	fprintf (data_stream, "KEYRETRIEVERS=%s\n", creds->keyretrieve);
+    *username = *credname = NULL;
+    if ((stem = mystrdup(name)) == NULL) {
+        return -1;
+    }
+    stem[strlen(stem)-5] = '\0'; /* ".data" */
+
+    dash = strchr(stem, '-');
+    if (scan->in_shard) {
+        for (;;) {
+            if (dash) *dash = '\0';
+            dir = shard_dir(stem);
+            if (dash) *dash = '-';
+            if (dir == NULL) {
+                free(stem);
+                return -1;
+            }
+            if (strcmp(dir, scan->dir_path) == 0 || dash == NULL) {
+                break;
+            }
+            free(dir);
+            dir = NULL;
+            dash = strchr(dash+1, '-');
+        }
+        free(dir);
+    }
+    if (dash) {
+        *dash = '\0';
+        *credname = mystrdup(dash+1);
+    }
+    *username = stem;
 
-    if (creds->trusted_retrievers != NULL)
-	fprintf (data_stream, "TRUSTED_RETRIEVERS=%s\n",
-		 creds->trusted_retrievers);
+    return 0;
+}
 
-    if (creds->renewers != NULL)
-	fprintf (data_stream, "RENEWERS=%s\n", creds->renewers);
+/*
+ * Write-ahead journal
+ *
+ * Credential files are written to a temporary file and renamed into
+ * place, but nothing is fsync()'ed, so a crash can lose a store,
+ * delete, lock, or passphrase change the client was told succeeded.
+ * While the storage directory holds a JOURNAL_FILE (see
+ * myproxy_creds_journal_check()), the renames and unlinks making up
+ * each such change are collected between journal_begin() and
+ * journal_end() and appended, with the new file contents, to the
+ * journal as one checksummed record.  Once that record is on disk the
+ * changes are made; after a crash, journal_replay() makes them again.
+ *
+ * Server processes committing at the same time share an fdatasync()
+ * of the journal (group commit): the process holding the sync lock
+ * syncs everything appended so far and notes the synced length in the
+ * journal header, so the others usually find their records already
+ * on disk.  When the journal passes JOURNAL_CHECKPOINT_SIZE, the files
+ * it names are fsync()'ed and it is emptied.
+ *
+ * Byte-range locks on the journal coordinate processes: JOURNAL_LOCK_TXN
+ * is held shared from append until the changes are made and exclusively
+ * to checkpoint or replay, and JOURNAL_LOCK_APPEND and JOURNAL_LOCK_SYNC
+ * serialize appends and syncs.
+ *
+ * Header: "MPJ1", 4 unused bytes, synced length (int64).
+ * Record: "MPJ1", payload length (uint32), SHA-256 of payload, payload.
+ * Payload: for each change, type (1 byte), mode (uint32), path length
+ * (uint32), path, contents length (uint32), contents.
+ */
+#define JOURNAL_FILE		".journal"
+#define JOURNAL_MAGIC		"MPJ1"
+#define JOURNAL_HEADER_LEN	16
+#define JOURNAL_RECORD_LEN	40
+#define JOURNAL_CHECKPOINT_SIZE	(4*1024*1024)
+#define JOURNAL_LOCK_TXN	0
+#define JOURNAL_LOCK_APPEND	1
+#define JOURNAL_LOCK_SYNC	2
+
+#define JOURNAL_OP_RENAME	'R'	/* rename from to path */
+#define JOURNAL_OP_UNLINK	'U'
+#define JOURNAL_OP_DESTROY	'D'	/* ssl_proxy_file_destroy() */
+#define JOURNAL_OP_CATALOG	'C'	/* catalog_update() after commit,
+					   path is username, from credname */
+
+struct journal_op {
+    char type;
+    char *path;
+    char *from;
+    int from_temp;		/* remove from if not committed */
+    struct journal_op *next;
+};
+
+static int storage_journaled = 0;
+static int journal_fd = -1;
+static pid_t journal_pid = 0;
+static int journal_depth = 0;
+static struct journal_op *journal_ops = NULL;
+
+static void catalog_update(const char *username, const char *credname);
+static int journal_replay(int redo);
 
-    if (creds->username != NULL)
-    fprintf (data_stream, "USERNAME=%s\n", creds->username);
+/*
+ * journal_path()
+ *
+ * Returns the journal path in static storage, or NULL if too long.
+ */
+static const char *
+journal_path()
+{
+    static char path[MAXPATHLEN];
 
-    fprintf (data_stream, "END_OPTIONS\n");
+    if (snprintf(path, sizeof(path), "%s/%s", storage_dir,
+                 JOURNAL_FILE) >= sizeof(path)) {
+        verror_put_string("journal path too long");
+        return NULL;
+    }
+    return path;
+}
 
-    fclose(data_stream);
-    data_fd = -1;
+/*
+ * journal_exists()
+ *
+ * Returns 1 if the storage directory is journaled, 0 otherwise.
+ * Like storage_layout(), only the positive answer is cached.
+ */
+static int
+journal_exists()
+{
+    const char *path;
 
-    if (rename(tmpfilename, data_file_path) < 0) {
-        verror_put_string("rename(%s,%s) failed", tmpfilename, data_file_path);
-        verror_put_errno(errno);
-        goto error;
+    if (!storage_journaled && storage_dir &&
+        (path = journal_path()) != NULL && access(path, F_OK) == 0) {
+        storage_journaled = 1;
     }
+    return storage_journaled;
+}
 
-    /* Success */
-    return_code = 0;
-    
-  error:
-    if (data_fd != -1) {
-        if (data_stream != NULL) {
-            fclose(data_stream); /* this does close(data_fd) */
-        } else {
-            close(data_fd);
+static int
+journal_lock(int which, short type, int wait)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = which;
+    fl.l_len = 1;
+    while (fcntl(journal_fd, wait ? F_SETLKW : F_SETLK, &fl) < 0) {
+        if (errno != EINTR) {
+            if (wait) {
+                verror_put_errno(errno);
+                verror_put_string("locking credential journal");
+            }
+            return -1;
         }
     }
-    if (tmpfilename) {
-        if (return_code == -1) {
-            unlink(tmpfilename);
+
+    return 0;
+}
+
+#define journal_unlock(which)	journal_lock((which), F_UNLCK, 1)
+
+static int
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-        free(tmpfilename);
+        buf += n;
+        len -= n;
     }
-    
-    return return_code;
+
+    return 0;
 }
 
 /*
- * read_data_file()
- *
- * Read the data contained in the given data file and fills in the
- * given creds structure.
+ * fsync_path()
+ *
+ * fsync() the given file or directory, if it exists.
+ */
+static int
+fsync_path(const char *path)
+{
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+
+    return rc;
+}
+
+static int
+fsync_parent(const char *path)
+{
+    char dir[MAXPATHLEN];
+    char *slash;
+
+    if (snprintf(dir, sizeof(dir), "%s", path) >= sizeof(dir) ||
+        (slash = strrchr(dir, '/')) == NULL) {
+        return 0;
+    }
+    *slash = '\0';
+
+    return fsync_path(dir);
+}
+
+static int64_t
+journal_synced()
+{
+    int64_t synced = 0;
+
+    if (pread(journal_fd, &synced, sizeof(synced), 8) != sizeof(synced)) {
+        return 0;
+    }
+    return synced;
+}
+
+static int
+journal_set_synced(int64_t synced)
+{
+    if (pwrite(journal_fd, &synced, sizeof(synced), 8) != sizeof(synced)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * journal_open()
+ *
+ * Open the journal in this process, creating it if create is set.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+journal_open(int create)
+{
+    const char *path;
+    unsigned char header[JOURNAL_HEADER_LEN];
+    struct stat st;
+
+    if (journal_fd >= 0 && journal_pid == getpid()) {
+        return 0;
+    }
+    if (journal_fd >= 0) {	/* inherited; our locks weren't */
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    if ((path = journal_path()) == NULL) {
+        return -1;
+    }
+    if ((journal_fd = open(path, create ? O_RDWR|O_CREAT : O_RDWR,
+                           FILE_MODE)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("opening %s", path);
+        return -1;
+    }
+    journal_pid = getpid();
+
+    if (journal_lock(JOURNAL_LOCK_APPEND, F_WRLCK, 1) == -1) {
+        goto error;
+    }
+    if (fstat(journal_fd, &st) == 0 && st.st_size < JOURNAL_HEADER_LEN) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, JOURNAL_MAGIC, 4);
+        if (fchmod(journal_fd, FILE_MODE) < 0 ||
+            ftruncate(journal_fd, 0) < 0 ||
+            pwrite(journal_fd, header, sizeof(header), 0) != sizeof(header) ||
+            journal_set_synced(JOURNAL_HEADER_LEN) == -1 ||
+            fdatasync(journal_fd) < 0 || fsync_parent(path) < 0) {
+            verror_put_errno(errno);
+            verror_put_string("initializing %s", path);
+            journal_unlock(JOURNAL_LOCK_APPEND);
+            goto error;
+        }
+    }
+    journal_unlock(JOURNAL_LOCK_APPEND);
+
+    return 0;
+
+  error:
+    close(journal_fd);
+    journal_fd = -1;
+
+    return -1;
+}
+
+static void
+journal_close()
+{
+    if (journal_fd >= 0 && journal_pid == getpid()) {
+        close(journal_fd);
+    }
+    journal_fd = -1;
+}
+
+/*
+ * journal_begin()
+ *
+ * Start collecting storage changes if the storage directory is
+ * journaled.  Transactions nest; only the outermost journal_end()
+ * commits.
+ *
+ * Returns 1 if changes are being collected, 0 if not.
+ */
+static int
+journal_begin()
+{
+    if (journal_depth || journal_exists()) {
+        journal_depth++;
+    }
+    return (journal_depth > 0);
+}
+
+static int
+journal_add(char type, const char *path, const char *from, int from_temp)
+{
+    struct journal_op *op, **tail;
+
+    if ((op = malloc(sizeof(*op))) == NULL) {
+        return -1;
+    }
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    op->from_temp = from_temp;
+    if ((path && (op->path = strdup(path)) == NULL) ||
+        (from && (op->from = strdup(from)) == NULL)) {
+        if (op->path) free(op->path);
+        free(op);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (tail = &journal_ops; *tail; tail = &(*tail)->next);
+    *tail = op;
+
+    return 0;
+}
+
+/*
+ * storage_rename(), storage_unlink(), storage_destroy()
+ *
+ * rename(), unlink(), and ssl_proxy_file_destroy() in the storage
+ * directory, put off until commit inside a journal transaction.
+ * Set temp if from is a temporary file to remove if the transaction
+ * doesn't commit.
+ *
+ * Return 0 on success, -1 on error with errno set.
+ */
+static int
+storage_rename(const char *from, const char *to, int temp)
+{
+    if (journal_depth) {
+        return journal_add(JOURNAL_OP_RENAME, to, from, temp);
+    }
+    return rename(from, to);
+}
+
+static int
+storage_unlink(const char *path)
+{
+    if (journal_depth) {
+        if (access(path, F_OK) < 0) {
+            return -1;
+        }
+        return journal_add(JOURNAL_OP_UNLINK, path, NULL, 0);
+    }
+    return unlink(path);
+}
+
+static int
+storage_destroy(const char *path)
+{
+    if (journal_depth) {
+        return journal_add(JOURNAL_OP_DESTROY, path, NULL, 0);
+    }
+    return (ssl_proxy_file_destroy(path) == SSL_SUCCESS) ? 0 : -1;
+}
+
+typedef struct {
+    unsigned char *buf;
+    size_t len, size;
+    int failed;
+} journal_buf_t;
+
+static void
+journal_put(journal_buf_t *jb, const void *data, size_t n)
+{
+    unsigned char *new;
+
+    if (jb->failed) {
+        return;
+    }
+    if (jb->len + n > jb->size) {
+        jb->size = (jb->len + n) * 2;
+        if ((new = malloc(jb->size)) == NULL) {
+            jb->failed = 1;
+            return;
+        }
+        if (jb->buf) {
+            memcpy(new, jb->buf, jb->len);
+            memset(jb->buf, 0, jb->len);   /* may hold private keys */
+            free(jb->buf);
+        }
+        jb->buf = new;
+    }
+    memcpy(jb->buf + jb->len, data, n);
+    jb->len += n;
+}
+
+static void
+journal_put32(journal_buf_t *jb, uint32_t n)
+{
+    journal_put(jb, &n, sizeof(n));
+}
+
+static void
+journal_buf_free(journal_buf_t *jb)
+{
+    if (jb->buf) {
+        memset(jb->buf, 0, jb->len);
+        free(jb->buf);
+    }
+    memset(jb, 0, sizeof(*jb));
+}
+
+/*
+ * journal_record()
+ *
+ * Build the journal record for the collected changes in jb.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+journal_record(journal_buf_t *jb)
+{
+    static const unsigned char zero[32];
+    struct journal_op *op;
+    unsigned char *contents;
+    unsigned int md_len;
+    struct stat st;
+    int contents_len;
+
+    memset(jb, 0, sizeof(*jb));
+    journal_put(jb, JOURNAL_MAGIC, 4);
+    journal_put32(jb, 0);			/* length and digest, */
+    journal_put(jb, zero, sizeof(zero));	/* filled in below */
+
+    for (op = journal_ops; op; op = op->next) {
+        if (op->type == JOURNAL_OP_CATALOG) {
+            continue;
+        }
+        contents = NULL;
+        contents_len = 0;
+        st.st_mode = 0;
+        if (op->type == JOURNAL_OP_RENAME &&
+            (stat(op->from, &st) < 0 ||
+             buffer_from_file(op->from, &contents, &contents_len) < 0)) {
+            verror_put_errno(errno);
+            verror_put_string("reading %s", op->from);
+            goto error;
+        }
+        if (contents_len > 0) {
+            contents_len--;	/* buffer_from_file() adds a NUL */
+        }
+        journal_put(jb, &op->type, 1);
+        journal_put32(jb, st.st_mode & 07777);
+        journal_put32(jb, strlen(op->path));
+        journal_put(jb, op->path, strlen(op->path));
+        journal_put32(jb, contents_len);
+        if (contents) {
+            journal_put(jb, contents, contents_len);
+            memset(contents, 0, contents_len);
+            free(contents);
+        }
+    }
+    if (jb->failed) {
+        verror_put_errno(ENOMEM);
+        goto error;
+    }
+
+    *(uint32_t *)(jb->buf + 4) = jb->len - JOURNAL_RECORD_LEN;
+    if (EVP_Digest(jb->buf + JOURNAL_RECORD_LEN, jb->len - JOURNAL_RECORD_LEN,
+                   jb->buf + 8, &md_len, EVP_sha256(), NULL) != 1) {
+        verror_put_string("computing journal record digest");
+        goto error;
+    }
+
+    return 0;
+
+  error:
+    journal_buf_free(jb);
+
+    return -1;
+}
+
+/*
+ * journal_append()
+ *
+ * Append the record in jb to the journal and wait until it's on disk.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+journal_append(const journal_buf_t *jb, off_t *end)
+{
+    off_t start;
+
+    if (journal_lock(JOURNAL_LOCK_APPEND, F_WRLCK, 1) == -1) {
+        return -1;
+    }
+    if ((start = lseek(journal_fd, 0, SEEK_END)) < 0 ||
+        write_all(journal_fd, jb->buf, jb->len) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("writing credential journal");
+        if (start >= 0 && ftruncate(journal_fd, start) < 0) {
+            myproxy_debug("failed to remove partial journal record");
+        }
+        journal_unlock(JOURNAL_LOCK_APPEND);
+        return -1;
+    }
+    *end = start + jb->len;
+    journal_unlock(JOURNAL_LOCK_APPEND);
+
+    /* Whoever holds the sync lock syncs everything appended so far. */
+    if (journal_lock(JOURNAL_LOCK_SYNC, F_WRLCK, 1) == -1) {
+        return -1;
+    }
+    if (journal_synced() < *end) {
+        struct stat st;
+
+        if (fstat(journal_fd, &st) < 0 || fdatasync(journal_fd) < 0) {
+            verror_put_errno(errno);
+            verror_put_string("syncing credential journal");
+            journal_unlock(JOURNAL_LOCK_SYNC);
+            return -1;
+        }
+        if (journal_set_synced(st.st_size) == -1) {
+            myproxy_debug("failed to note synced journal length");
+        }
+    }
+    journal_unlock(JOURNAL_LOCK_SYNC);
+
+    return 0;
+}
+
+/*
+ * journal_apply()
+ *
+ * Make the collected changes.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+journal_apply()
+{
+    struct journal_op *op;
+    int rc = 0;
+
+    for (op = journal_ops; op; op = op->next) {
+        switch (op->type) {
+        case JOURNAL_OP_RENAME:
+            if (rename(op->from, op->path) < 0) {
+                verror_put_string("rename(%s,%s) failed", op->from, op->path);
+                verror_put_errno(errno);
+                rc = -1;
+            }
+            break;
+        case JOURNAL_OP_UNLINK:
+            if (unlink(op->path) < 0 && errno != ENOENT) {
+                verror_put_errno(errno);
+                verror_put_string("deleting %s", op->path);
+                rc = -1;
+            }
+            break;
+        case JOURNAL_OP_DESTROY:
+            if (access(op->path, F_OK) == 0 &&
+                ssl_proxy_file_destroy(op->path) != SSL_SUCCESS) {
+                verror_put_string("deleting %s", op->path);
+                rc = -1;
+            }
+            break;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * journal_commit()
+ *
+ * Write the collected changes to the journal, then make them.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+journal_commit()
+{
+    journal_buf_t jb;
+    off_t end = 0;
+    int rc = -1;
+
+    if (journal_open(1) == -1 || journal_record(&jb) == -1) {
+        return -1;
+    }
+    if (journal_lock(JOURNAL_LOCK_TXN, F_RDLCK, 1) == -1) {
+        goto error;
+    }
+    if (journal_append(&jb, &end) == 0) {
+        rc = journal_apply();
+    }
+    journal_unlock(JOURNAL_LOCK_TXN);
+
+    /* Checkpoint, unless someone else is in a transaction. */
+    if (rc == 0 && end > JOURNAL_CHECKPOINT_SIZE &&
+        journal_lock(JOURNAL_LOCK_TXN, F_WRLCK, 0) == 0) {
+        if (journal_replay(0) == -1) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+        journal_unlock(JOURNAL_LOCK_TXN);
+    }
+
+  error:
+    journal_buf_free(&jb);
+
+    return rc;
+}
+
+/*
+ * journal_end()
+ *
+ * End the transaction started by journal_begin(), committing the
+ * collected changes if this is the outermost one and rc is 0.
+ *
+ * Returns rc if the commit succeeds (or wasn't needed), -1 otherwise.
+ */
+static int
+journal_end(int rc)
+{
+    struct journal_op *op, *ops;
+
+    if (journal_depth == 0 || --journal_depth > 0) {
+        return rc;
+    }
+    ops = journal_ops;
+    if (rc == 0 && ops) {
+        rc = journal_commit();
+    }
+    journal_ops = NULL;
+
+    for (op = ops; ops; op = ops) {
+        ops = op->next;
+        if (op->type == JOURNAL_OP_CATALOG) {
+            if (rc == 0) {
+                catalog_update(op->path, op->from);
+            }
+        } else if (rc == -1 && op->from_temp && op->from) {
+            unlink(op->from);
+        }
+        if (op->path) free(op->path);
+        if (op->from) free(op->from);
+        free(op);
+    }
+
+    return rc;
+}
+
+/*
+ * journal_safe_path()
+ *
+ * Returns 1 if a path read from the journal is within the storage
+ * directory, 0 otherwise.
+ */
+static int
+journal_safe_path(const char *path)
+{
+    size_t len = strlen(storage_dir);
+    const char *p;
+
+    if (strncmp(path, storage_dir, len) || path[len] != '/') {
+        return 0;
+    }
+    for (p = path + len; (p = strstr(p, "/..")) != NULL; p++) {
+        if (p[3] == '/' || p[3] == '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * journal_redo_rename()
+ *
+ * Rewrite path with the given contents, durably.
+ */
+static int
+journal_redo_rename(const char *path, mode_t mode,
+                    const unsigned char *contents, size_t len)
+{
+    char tmp[MAXPATHLEN];
+    int fd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.temp.XXXXXX", path) >= sizeof(tmp) ||
+        make_shard_dirs(path) == -1) {
+        return -1;
+    }
+    if ((fd = mkstemp(tmp)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("opening %s for writing", tmp);
+        return -1;
+    }
+    if (fchmod(fd, mode ? mode : FILE_MODE) < 0 ||
+        write_all(fd, contents, len) < 0 || fsync(fd) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("writing %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        verror_put_string("rename(%s,%s) failed", tmp, path);
+        verror_put_errno(errno);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * journal_replay()
+ *
+ * With the journal locked exclusively, make sure the changes in its
+ * complete records are on disk, then empty it.  If redo is set
+ * (recovery), make the changes again first; otherwise (checkpoint)
+ * they were already made and only need syncing.  Replay stops at the
+ * first torn or corrupt record, which was never committed.
+ *
+ * Returns the number of records replayed, or -1 on error.
+ */
+static int
+journal_replay(int redo)
+{
+    const char *path;
+    unsigned char *buf = NULL, *p, *end, digest[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    uint32_t payload_len, mode, path_len, contents_len;
+    char op_path[MAXPATHLEN];
+    int buf_len = 0, records = 0, rc = -1;
+
+    if ((path = journal_path()) == NULL ||
+        buffer_from_file(path, &buf, &buf_len) == -1) {
+        goto error;
+    }
+    buf_len--;			/* buffer_from_file() adds a NUL */
+
+    for (p = buf + JOURNAL_HEADER_LEN;
+         p + JOURNAL_RECORD_LEN <= buf + buf_len; p = end, records++) {
+        memcpy(&payload_len, p + 4, 4);
+        if (memcmp(p, JOURNAL_MAGIC, 4) ||
+            payload_len > buf + buf_len - p - JOURNAL_RECORD_LEN ||
+            EVP_Digest(p + JOURNAL_RECORD_LEN, payload_len, digest, &md_len,
+                       EVP_sha256(), NULL) != 1 ||
+            memcmp(digest, p + 8, 32)) {
+            myproxy_log("ignoring incomplete credential journal record");
+            break;
+        }
+        end = p + JOURNAL_RECORD_LEN + payload_len;
+        for (p += JOURNAL_RECORD_LEN; p < end; p += contents_len) {
+            if (end - p < 9) {
+                goto corrupt;
+            }
+            memcpy(&mode, p + 1, 4);
+            memcpy(&path_len, p + 5, 4);
+            if (path_len >= sizeof(op_path) || end - p - 9 < path_len + 4) {
+                goto corrupt;
+            }
+            memcpy(op_path, p + 9, path_len);
+            op_path[path_len] = '\0';
+            memcpy(&contents_len, p + 9 + path_len, 4);
+            if (end - p - 13 - path_len < contents_len ||
+                strlen(op_path) != path_len || !journal_safe_path(op_path)) {
+                goto corrupt;
+            }
+            if (redo) {
+                switch (*p) {
+                case JOURNAL_OP_RENAME:
+                    if (journal_redo_rename(op_path, mode, p + 13 + path_len,
+                                            contents_len) == -1) {
+                        goto error;
+                    }
+                    break;
+                case JOURNAL_OP_UNLINK:
+                    unlink(op_path);
+                    break;
+                case JOURNAL_OP_DESTROY:
+                    if (access(op_path, F_OK) == 0) {
+                        ssl_proxy_file_destroy(op_path);
+                    }
+                    break;
+                default:
+                    goto corrupt;
+                }
+            } else if (*p == JOURNAL_OP_RENAME && fsync_path(op_path) < 0) {
+                verror_put_errno(errno);
+                verror_put_string("syncing %s", op_path);
+                goto error;
+            }
+            if (fsync_parent(op_path) < 0) {
+                verror_put_errno(errno);
+                verror_put_string("syncing directory of %s", op_path);
+                goto error;
+            }
+            p += 13 + path_len;
+        }
+    }
+
+    /* Everything's on disk; scrub and empty the journal. */
+    if (buf_len > JOURNAL_HEADER_LEN) {
+        memset(buf, 0, buf_len - JOURNAL_HEADER_LEN);
+        if (pwrite(journal_fd, buf, buf_len - JOURNAL_HEADER_LEN,
+                   JOURNAL_HEADER_LEN) < 0 ||
+            fdatasync(journal_fd) < 0 ||
+            ftruncate(journal_fd, JOURNAL_HEADER_LEN) < 0 ||
+            journal_set_synced(JOURNAL_HEADER_LEN) == -1 ||
+            fdatasync(journal_fd) < 0) {
+            verror_put_errno(errno);
+            verror_put_string("emptying %s", path);
+            goto error;
+        }
+    }
+    rc = records;
+    goto done;
+
+  corrupt:
+    verror_put_string("corrupt credential journal record %d in %s",
+                      records + 1, path);
+  error:
+    rc = -1;
+  done:
+    if (buf) {
+        memset(buf, 0, buf_len);
+        free(buf);
+    }
+
+    return rc;
+}
+
+/*
+ * Credential data file formats
+ *
+ * A data file holds a credential's policy and metadata.  It is either
+ * the original text format, KEY=VALUE lines ending with END_OPTIONS,
+ * or a binary record:
+ *
+ *   "MPDB", version (1 byte), 3 unused bytes,
+ *   payload length (4 bytes), FNV-1a checksum of payload (4 bytes),
+ *   payload: for each field, tag (1 byte), length (4 bytes), value
+ *
+ * Integers are little-endian.  String values are stored without a
+ * terminating NUL; numeric values are 8-byte integers.  Readers skip
+ * fields with tags they don't know.  Either format is read with one
+ * read() and parsed in place; data files are written in binary once
+ * the storage directory holds DATA_BINARY_MARKER (see
+ * myproxy_creds_convert_metadata()).
+ */
+#define DATA_BINARY_MARKER	".binary"
+#define DATA_MAGIC		"MPDB"
+#define DATA_VERSION		1
+#define DATA_HEADER_LEN		16
+#define DATA_FIELD_NUMBER	0x80	/* flag: value is a number */
+
+static const struct data_field {
+    unsigned char tag;
+    const char *key;		/* in the text format */
+    size_t offset;		/* of the field in struct myproxy_creds */
+} data_fields[] = {
+    { 1, "OWNER", offsetof(struct myproxy_creds, owner_name) },
+    { 2|DATA_FIELD_NUMBER, "LIFETIME", offsetof(struct myproxy_creds, lifetime) },
+    { 3, "NAME", offsetof(struct myproxy_creds, credname) },
+    { 4, "DESCRIPTION", offsetof(struct myproxy_creds, creddesc) },
+    { 5, "RETRIEVERS", offsetof(struct myproxy_creds, retrievers) },
+    { 6, "KEYRETRIEVERS", offsetof(struct myproxy_creds, keyretrieve) },
+    { 7, "TRUSTED_RETRIEVERS",
+      offsetof(struct myproxy_creds, trusted_retrievers) },
+    { 8, "RENEWERS", offsetof(struct myproxy_creds, renewers) },
+    { 9, "USERNAME", offsetof(struct myproxy_creds, username) },
+    { 10|DATA_FIELD_NUMBER, "START_TIME",
+      offsetof(struct myproxy_creds, start_time) },
+    { 11|DATA_FIELD_NUMBER, "END_TIME",
+      offsetof(struct myproxy_creds, end_time) },
+    { 12, "SUBJECT", offsetof(struct myproxy_creds, subject) },
+    { 13, "FINGERPRINT", offsetof(struct myproxy_creds, fingerprint) },
+    { 14, "VERIFIER", offsetof(struct myproxy_creds, verifier) },
+    { 15, "LOCKMSG", offsetof(struct myproxy_creds, lockmsg) },
+    /* We no longer store a PASSPHRASE element.
+       Read it in for backwards compatibility only. */
+    { 16, "PASSPHRASE", offsetof(struct myproxy_creds, passphrase) },
+    { 0, NULL, 0 }
+};
+
+static int storage_binary = 0;
+
+/*
+ * data_binary()
+ *
+ * Returns 1 if data files are written in binary, 0 otherwise.
+ * Like storage_layout(), only the positive answer is cached.
+ */
+static int
+data_binary()
+{
+    char path[MAXPATHLEN];
+
+    if (!storage_binary && storage_dir &&
+        snprintf(path, sizeof(path), "%s/%s", storage_dir,
+                 DATA_BINARY_MARKER) < sizeof(path) &&
+        access(path, F_OK) == 0) {
+        storage_binary = 1;
+    }
+    return storage_binary;
+}
+
+static uint32_t
+fnv1a(const unsigned char *p, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while (len-- > 0) {
+        h = (h ^ *p++) * 16777619U;
+    }
+    return h;
+}
+
+static uint32_t
+get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put_le32(unsigned char *p, uint32_t n)
+{
+    p[0] = n; p[1] = n >> 8; p[2] = n >> 16; p[3] = n >> 24;
+}
+
+/*
+ * data_field_set()
+ *
+ * Set the given field of creds from len bytes of value.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+data_field_set(struct myproxy_creds *creds, const struct data_field *f,
+               const unsigned char *value, size_t len, int binary)
+{
+    char *field = (char *)creds + f->offset;
+    int64_t n = 0;
+    int i;
+
+    if (f->tag & DATA_FIELD_NUMBER) {
+        if (binary) {
+            if (len != 8) {
+                return -1;
+            }
+            for (i = 7; i >= 0; i--) {
+                n = (n << 8) | value[i];
+            }
+        } else {
+            n = strtol((const char *)value, NULL, 10);
+        }
+        if (f->offset == offsetof(struct myproxy_creds, lifetime)) {
+            *(int *)field = (int)n;
+        } else {
+            *(time_t *)field = (time_t)n;
+        }
+        return 0;
+    }
+
+    if (*(char **)field) {
+        free(*(char **)field);
+    }
+    if ((*(char **)field = malloc(len + 1)) == NULL) {
+        verror_put_errno(errno);
+        verror_put_string("malloc() failed");
+        return -1;
+    }
+    memcpy(*(char **)field, value, len);
+    (*(char **)field)[len] = '\0';
+
+    return 0;
+}
+
+/*
+ * parse_binary_data()
+ *
+ * Fill in creds from the binary data file in buf.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+parse_binary_data(struct myproxy_creds *creds, const unsigned char *buf,
+                  size_t buf_len, const char *path)
+{
+    const struct data_field *f;
+    const unsigned char *p, *end;
+    uint32_t payload_len, len;
+
+    if (buf_len < DATA_HEADER_LEN || buf[4] != DATA_VERSION ||
+        (payload_len = get_le32(buf + 8)) != buf_len - DATA_HEADER_LEN ||
+        fnv1a(buf + DATA_HEADER_LEN, payload_len) != get_le32(buf + 12)) {
+        verror_put_string("corrupt or unsupported data file %s", path);
+        return -1;
+    }
+
+    end = buf + buf_len;
+    for (p = buf + DATA_HEADER_LEN; p < end; p += len) {
+        if (end - p < 5 || (len = get_le32(p + 1)) > end - p - 5) {
+            verror_put_string("truncated field in %s", path);
+            return -1;
+        }
+        for (f = data_fields; f->key && f->tag != p[0]; f++);
+        p += 5;
+        if (f->key && data_field_set(creds, f, p, len, 1) == -1) {
+            verror_put_string("bad %s field in %s", f->key, path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * parse_text_data()
+ *
+ * Fill in creds from the text data file in buf, which is NUL-terminated
+ * and modified in place.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+parse_text_data(struct myproxy_creds *creds, char *buf,
+                const char *datafile_path)
+{
+    const struct data_field *f;
+    char *line, *next, *value;
+    int line_number = 0;
+
+    for (line = buf; *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) == NULL) {
+            break;          /* didn't get a full line */
+        }
+        *next++ = '\0';
+        line_number++;
+
+        if ((value = strchr(line, '=')) != NULL) {
+            /* NUL-terminate variable name and advance to value */
+            *value++ = '\0';
+        }
+
+        if (strcmp(line, "END_OPTIONS") == 0) {
+            return 0;
+        }
+
+        /* Everything else requires values to be non-NULL */
+        if (value == NULL) {
+            verror_put_string("malformed line: %s line %d",
+                              datafile_path, line_number);
+            return -1;
+        }
+
+        for (f = data_fields; f->key && strcmp(f->key, line); f++);
+        if (f->key == NULL) {
+            /* Unrecognized variable */
+            verror_put_string("unrecognized line: %s line %d",
+                              datafile_path, line_number);
+            return -1;
+        }
+        if (data_field_set(creds, f, (unsigned char *)value,
+                           strlen(value), 0) == -1) {
+            return -1;
+        }
+    }
+
+    verror_put_string("unexpected EOF reading %s", datafile_path);
+    return -1;
+}
+
+/*
+ * binary_data_put()
+ *
+ * Append a field to the binary data file in buf.
+ */
+static void
+binary_data_put(unsigned char *buf, size_t *len, unsigned char tag,
+                const void *value, size_t value_len)
+{
+    buf[*len] = tag;
+    put_le32(buf + *len + 1, value_len);
+    memcpy(buf + *len + 5, value, value_len);
+    *len += 5 + value_len;
+}
+
+/*
+ * format_binary_data()
+ *
+ * Return (in allocated *buf) the binary data file for creds, with the
+ * same fields write_data_file() writes in text.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+format_binary_data(const struct myproxy_creds *creds, int with_status,
+                   unsigned char **buf, size_t *len)
+{
+    const struct data_field *f;
+    const char *field;
+    unsigned char number[8];
+    size_t size = DATA_HEADER_LEN;
+    int64_t n;
+    int i;
+
+    for (f = data_fields; f->key; f++) {
+        field = (const char *)creds + f->offset;
+        size += 5 + ((f->tag & DATA_FIELD_NUMBER) ? 8 :
+                     (*(char **)field ? strlen(*(char **)field) : 0));
+    }
+    if ((*buf = malloc(size)) == NULL) {
+        verror_put_errno(errno);
+        verror_put_string("malloc() failed");
+        return -1;
+    }
+
+    *len = DATA_HEADER_LEN;
+    for (f = data_fields; f->key; f++) {
+        field = (const char *)creds + f->offset;
+        if (f->offset == offsetof(struct myproxy_creds, passphrase) ||
+            (f->offset == offsetof(struct myproxy_creds, lockmsg) &&
+             !with_status)) {
+            continue;
+        }
+        if (f->tag & DATA_FIELD_NUMBER) {
+            if (f->offset == offsetof(struct myproxy_creds, lifetime)) {
+                n = *(const int *)field;
+            } else if (creds->fingerprint == NULL) {
+                continue;   /* times are only known with the details */
+            } else {
+                n = *(const time_t *)field;
+            }
+            for (i = 0; i < 8; i++) {
+                number[i] = (n >> (8 * i)) & 0xff;
+            }
+            binary_data_put(*buf, len, f->tag, number, 8);
+        } else if (*(char **)field) {
+            binary_data_put(*buf, len, f->tag, *(char **)field,
+                            strlen(*(char **)field));
+        }
+    }
+
+    memcpy(*buf, DATA_MAGIC, 4);
+    (*buf)[4] = DATA_VERSION;
+    (*buf)[5] = (*buf)[6] = (*buf)[7] = 0;
+    put_le32(*buf + 8, *len - DATA_HEADER_LEN);
+    put_le32(*buf + 12, fnv1a(*buf + DATA_HEADER_LEN,
+                              *len - DATA_HEADER_LEN));
+
+    return 0;
+}
+
+/*
+ * records_lock()
+ *
+ * Serialize changes to one credential's files among processes, so a
+ * read-modify-write of its data file (files_set_verifier()) can't lose
+ * a change made at the same time.  Each credential maps to a byte of
+ * RECORDS_LOCK_FILE, locked with fcntl(), so writers of different
+ * credentials rarely wait for each other and no lock is left behind if
+ * a process dies.  Held around the write and journal commit only.
+ * Returns a slot for records_unlock(), or -1 on error, in which case
+ * the caller must not write.
+ */
+#define RECORDS_LOCK_FILE	".records.lock"
+#define RECORDS_LOCK_SLOTS	65536
+
+static int records_fd = -1;
+
+static int
+records_lock(const char *username, const char *credname)
+{
+    struct flock fl;
+    char *path = NULL;
+    uint32_t slot;
+
+    if (records_fd < 0) {
+        if (storage_dir == NULL ||
+            my_append(&path, storage_dir, "/", RECORDS_LOCK_FILE,
+                      NULL) == -1) {
+            verror_put_string("locking credential");
+            if (path) free(path);
+            return -1;
+        }
+        records_fd = open(path, O_RDWR | O_CREAT, FILE_MODE);
+        if (records_fd < 0) {
+            verror_put_errno(errno);
+            verror_put_string("opening %s", path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
+
+    slot = fnv1a((const unsigned char *)username, strlen(username));
+    if (credname) {
+        slot = (slot ^ '-') * 16777619U;
+        slot ^= fnv1a((const unsigned char *)credname, strlen(credname));
+    }
+    slot %= RECORDS_LOCK_SLOTS;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = slot;
+    fl.l_len = 1;
+    while (fcntl(records_fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            verror_put_errno(errno);
+            verror_put_string("locking credential %s", username);
+            return -1;
+        }
+    }
+    return slot;
+}
+
+static void
+records_unlock(int slot)
+{
+    struct flock fl;
+
+    if (slot >= 0) {
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_UNLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = slot;
+        fl.l_len = 1;
+        fcntl(records_fd, F_SETLK, &fl);
+    }
+}
+
+/*
+ * write_data_file()
+ *
+ * Write the data in the myproxy_creds structure to the
+ * file name given, creating the file with the given mode.
+ * The certificate details (validity times, subject, and fingerprint)
+ * are written if known, so retrieval needn't parse the certificates.
+ * If with_status is set, also write the credential's lock message
+ * (used for credential catalog records).
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+write_data_file(const struct myproxy_creds *creds,
+                const char *data_file_path,
+                const mode_t data_file_mode,
+                int with_status)
+{
+
+    int data_fd = -1;
+    FILE *data_stream = NULL;
+    char *tmpfilename = NULL;
+    int bufsiz;
+    int return_code = -1;
+
+    if (data_file_path == NULL) {
+        goto error;
+    }
+
+    bufsiz = strlen(data_file_path)+15;
+    tmpfilename = malloc(bufsiz);
+    snprintf(tmpfilename, bufsiz, "%s.temp.XXXXXX", data_file_path);
+
+    data_fd = mkstemp(tmpfilename);
+    if (data_fd == -1)
+    {
+        verror_put_errno(errno);
+        verror_put_string("opening %s for writing", tmpfilename);
+        goto error;
+    }
+
+    if (data_file_mode != 0600) { /* mkstemp creates file with 0600 */
+        fchmod(data_fd, data_file_mode);
+    }
+
+    if (data_binary()) {
+        unsigned char *buf = NULL;
+        size_t len;
+
+        if (format_binary_data(creds, with_status, &buf, &len) == -1) {
+            goto error;
+        }
+        if (write_all(data_fd, buf, len) < 0) {
+            verror_put_errno(errno);
+            verror_put_string("writing %s", tmpfilename);
+            free(buf);
+            goto error;
+        }
+        free(buf);
+        close(data_fd);
+        data_fd = -1;
+    } else {
+        /* Now open as stream for easier IO */
+        data_stream = fdopen(data_fd, "w");
+    
+        if (data_stream == NULL)
+        {
+            verror_put_errno(errno);
+            verror_put_string("reopening storage file %s", data_file_path);
+            goto error;
+        }
+
+        fprintf (data_stream, "OWNER=%s\n",creds->owner_name);
+        fprintf (data_stream, "LIFETIME=%d\n", creds->lifetime);
+
+        if (creds->credname != NULL)
+	    fprintf (data_stream, "NAME=%s\n", creds->credname);
+
+        if (creds->creddesc != NULL)
+	    fprintf (data_stream, "DESCRIPTION=%s\n", creds->creddesc);
+
+        if (creds->retrievers != NULL)
+	    fprintf (data_stream, "RETRIEVERS=%s\n", creds->retrievers);
+
+        if (creds->keyretrieve != NULL)
+	    fprintf (data_stream, "KEYRETRIEVERS=%s\n", creds->keyretrieve);
+
+        if (creds->trusted_retrievers != NULL)
+	    fprintf (data_stream, "TRUSTED_RETRIEVERS=%s\n",
+		     creds->trusted_retrievers);
+
+        if (creds->renewers != NULL)
+	    fprintf (data_stream, "RENEWERS=%s\n", creds->renewers);
+
+        if (creds->username != NULL)
+        fprintf (data_stream, "USERNAME=%s\n", creds->username);
+
+        if (creds->fingerprint != NULL) {
+	    fprintf (data_stream, "START_TIME=%ld\n", (long)creds->start_time);
+	    fprintf (data_stream, "END_TIME=%ld\n", (long)creds->end_time);
+	    if (creds->subject != NULL)
+		fprintf (data_stream, "SUBJECT=%s\n", creds->subject);
+	    fprintf (data_stream, "FINGERPRINT=%s\n", creds->fingerprint);
+        }
+
+        if (creds->verifier != NULL)
+	    fprintf (data_stream, "VERIFIER=%s\n", creds->verifier);
+
+        if (with_status && creds->lockmsg != NULL)
+	    fprintf (data_stream, "LOCKMSG=%.*s\n",
+		     (int)strcspn(creds->lockmsg, "\n"), creds->lockmsg);
+
+        fprintf (data_stream, "END_OPTIONS\n");
+
+        fclose(data_stream);
+        data_fd = -1;
+    }
+
+    if (storage_rename(tmpfilename, data_file_path, 1) < 0) {
+        verror_put_string("rename(%s,%s) failed", tmpfilename, data_file_path);
+        verror_put_errno(errno);
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+    
+  error:
+    if (data_fd != -1) {
+        if (data_stream != NULL) {
+            fclose(data_stream); /* this does close(data_fd) */
+        } else {
+            close(data_fd);
+        }
+    }
+    if (tmpfilename) {
+        if (return_code == -1) {
+            unlink(tmpfilename);
+        }
+        free(tmpfilename);
+    }
+    
+    return return_code;
+}
+
+/*
+ * read_data_file()
+ *
+ * Read the data contained in the given data file and fills in the
+ * given creds structure.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_data_file(struct myproxy_creds *creds,
+               const char *datafile_path)
+{
+    unsigned char stack_buf[4096], *buf = stack_buf;
+    struct stat st;
+    ssize_t n;
+    size_t len = 0;
+    int fd = -1;
+    int return_code = -1;
+
+    assert(creds != NULL);
+    assert(datafile_path != NULL);
+    
+    myproxy_creds_free_contents(creds);	/* initialize creds structure */
+
+    fd = open(datafile_path, O_RDONLY);
+    
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        verror_put_errno(errno);
+        verror_put_string("opening %s for reading", datafile_path);
+        goto error;
+    }
+
+    /* Read it all at once and parse it in place. */
+    if (st.st_size >= sizeof(stack_buf) &&
+        (buf = malloc(st.st_size + 1)) == NULL)
+    {
+        verror_put_errno(errno);
+        verror_put_string("malloc() failed");
+        goto error;
+    }
+    while (len < st.st_size &&
+           (n = pread(fd, buf + len, st.st_size - len, len)) != 0)
+    {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            verror_put_errno(errno);
+            verror_put_string("reading %s", datafile_path);
+            goto error;
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+
+    if (len >= 4 && memcmp(buf, DATA_MAGIC, 4) == 0) {
+        return_code = parse_binary_data(creds, buf, len, datafile_path);
+    } else {
+        return_code = parse_text_data(creds, (char *)buf, datafile_path);
+    }
+    
+  error:
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (buf != stack_buf)
+    {
+        free(buf);
+    }
+    
+    return return_code;
+}
+
+static int
+write_lock_file(const char *filename, const char *reason)
+{
+    int lock_fd = -1;
+    FILE *lock_stream = NULL;
+    char *tmpfilename = NULL;
+    int bufsiz;
+    int return_code = -1;
+
+    if (filename == NULL) {
+        goto error;
+    }
+
+    bufsiz = strlen(filename)+15;
+    tmpfilename = malloc(bufsiz);
+    snprintf(tmpfilename, bufsiz, "%s.temp.XXXXXX", filename);
+
+    lock_fd = mkstemp(tmpfilename);
+    if (lock_fd == -1) {
+        verror_put_errno(errno);
+        verror_put_string("opening %s for writing", tmpfilename);
+        goto error;
+    }
+
+    /* Now open as stream for easier IO */
+    lock_stream = fdopen(lock_fd, "w");
+    if (lock_stream == NULL) {
+        verror_put_errno(errno);
+        verror_put_string("reopening lock file %s", filename);
+        goto error;
+    }
+
+    fprintf(lock_stream, "%s", reason);
+    fclose(lock_stream);
+    lock_stream = NULL;
+    lock_fd = -1;
+
+    if (storage_rename(tmpfilename, filename, 1) < 0) {
+        verror_put_string("rename(%s,%s) failed", tmpfilename, filename);
+        verror_put_errno(errno);
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+ error:
+    if (lock_stream) {
+        fclose(lock_stream);
+    } else if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+    if (tmpfilename) {
+        if (return_code == -1) {
+            unlink(tmpfilename);
+        }
+        free(tmpfilename);
+    }
+
+    return return_code;
+}
+
+/*
+ * Credential catalog
+ *
+ * If the storage directory contains a .catalog directory, each stored
+ * credential also has a catalog record there, filed by username and
+ * by owner:
+ *
+ *   .catalog/user/<sterile username>/<credential file name>.rec
+ *   .catalog/owner/<MD5 of owner DN>/<credential file name>.rec
+ *
+ * A record has the same format as the credential's .data file, plus
+ * the credential's validity times and lock message.  The owner record
+ * is a hard link to the user record.  Queries by username or owner
+ * therefore open one small directory instead of scanning and parsing
+ * every credential in the storage directory.
+ *
+ * The catalog is only used while .catalog/complete exists.  If an
+ * update fails, that marker is removed and queries go back to scanning
+ * the storage directory until myproxy_creds_catalog_rebuild() is run.
+ */
+#define CATALOG_DIR		".catalog"
+#define CATALOG_COMPLETE	"complete"
+#define CATALOG_SUFFIX		".rec"
+
+/*
+ * catalog_path()
+ *
+ * Format a path of at most MAXPATHLEN bytes into path.
+ *
+ * Returns 0 on success, -1 if the path is too long.
+ */
+static int
+catalog_path(char *path, const char *format, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(path, MAXPATHLEN, format, ap);
+    va_end(ap);
+    if (len < 0 || len >= MAXPATHLEN) {
+        verror_put_string("catalog path too long: %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * catalog_complete()
+ *
+ * Returns 1 if the credential catalog exists and is up to date, 0 otherwise.
+ */
+static int
+catalog_complete()
+{
+    char path[MAXPATHLEN];
+
+    if (catalog_path(path, "%s/%s/%s", storage_dir, CATALOG_DIR,
+                     CATALOG_COMPLETE) == -1) {
+        verror_clear();
+        return 0;
+    }
+
+    return (access(path, F_OK) == 0);
+}
+
+/*
+ * catalog_invalidate()
+ *
+ * Stop using the credential catalog until it is rebuilt.
+ */
+static void
+catalog_invalidate(const char *reason)
+{
+    char path[MAXPATHLEN];
+
+    if (catalog_path(path, "%s/%s/%s", storage_dir, CATALOG_DIR,
+                     CATALOG_COMPLETE) == -1) {
+        verror_clear();
+        return;
+    }
+    if (unlink(path) == 0) {
+        myproxy_log("credential catalog disabled (%s); "
+                    "run myproxy-admin-query --rebuild-catalog", reason);
+    }
+}
+
+/*
+ * catalog_record_paths()
+ *
+ * Fill in the paths of the user and owner directories and the record
+ * name for the given credential in the catalog under root.
+ * owner_dir is only filled in if owner_name is non-NULL.
  *
  * Returns 0 on success, -1 on error.
  */
 static int
-read_data_file(struct myproxy_creds *creds,
-               const char *datafile_path)
+catalog_record_paths(const char *root,
+                     const char *username,
+                     const char *credname,
+                     const char *owner_name,
+                     char *user_dir,
+                     char *owner_dir,
+                     char *record)
 {
-    FILE *data_stream = NULL;
-    char *data_stream_mode = "r";
-    int done = 0;
-    int line_number = 0;
+    char *creds_path = NULL, *data_path = NULL, *lock_path = NULL;
+    char *sterile_username = NULL, *owner_hash = NULL;
+    char *base, *dot;
     int return_code = -1;
-    char *line_buffer = NULL;
-    size_t line_buffer_len = 512;
 
-    assert(creds != NULL);
-    assert(datafile_path != NULL);
-    
-    myproxy_creds_free_contents(creds);	/* initialize creds structure */
+    if (get_storage_locations(username, credname,
+                              &creds_path, &data_path, &lock_path) == -1) {
+        goto error;
+    }
+    if ((sterile_username = sterile_name(username)) == NULL) {
+        goto error;
+    }
+    if (catalog_path(user_dir, "%s/user/%s", root, sterile_username) == -1) {
+        goto error;
+    }
 
-    data_stream = fopen(datafile_path, data_stream_mode);
-    
-    if (data_stream == NULL)
-    {
-        verror_put_errno(errno);
-        verror_put_string("opening %s for reading", datafile_path);
+    base = strrchr(data_path, '/') + 1;
+    if ((dot = strrchr(base, '.')) != NULL) {
+        *dot = '\0';
+    }
+    if (catalog_path(record, "%s%s", base, CATALOG_SUFFIX) == -1) {
         goto error;
     }
 
-    line_buffer = (char *)malloc(line_buffer_len);
-    assert(line_buffer != NULL);
+    if (owner_name) {
+        if ((owner_hash = strmd5(owner_name, NULL)) == NULL) {
+            goto error;
+        }
+        if (catalog_path(owner_dir, "%s/owner/%s", root, owner_hash) == -1) {
+            goto error;
+        }
+    }
 
-    while (!done)
-    {
-        char *variable;
-        char *value;
-        int len;
-        
-        if (fgets(line_buffer, line_buffer_len, data_stream) == NULL)
-        {
-            int errno_save = errno;
-            
-            if (feof(data_stream))
-            {
-                verror_put_string("unexpected EOF reading %s", datafile_path);
-                goto error;
-            }
-            else
-            {
-                verror_put_errno(errno_save);
-                verror_put_string("reading %s", datafile_path);
-                goto error;
-            }
-            /* Not reached */
+    return_code = 0;
+
+  error:
+    if (creds_path) free(creds_path);
+    if (data_path) free(data_path);
+    if (lock_path) free(lock_path);
+    if (sterile_username) free(sterile_username);
+    if (owner_hash) free(owner_hash);
+
+    return return_code;
+}
+
+/*
+ * catalog_unlink()
+ *
+ * Remove a catalog record, and its directory if that is now empty.
+ */
+static void
+catalog_unlink(const char *dir, const char *record)
+{
+    char path[MAXPATHLEN];
+
+    if (catalog_path(path, "%s/%s", dir, record) == 0) {
+        unlink(path);
+    }
+    rmdir(dir);                 /* fails harmlessly unless empty */
+}
+
+/*
+ * catalog_write()
+ *
+ * Write the catalog record for the given (fully retrieved) credential
+ * under root.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+catalog_write(const char *root, const struct myproxy_creds *creds)
+{
+    struct myproxy_creds rec = *creds;
+    char user_dir[MAXPATHLEN], owner_dir[MAXPATHLEN], record[MAXPATHLEN];
+    char user_path[MAXPATHLEN], owner_path[MAXPATHLEN];
+
+    if (catalog_record_paths(root, creds->username, creds->credname,
+                             creds->owner_name, user_dir, owner_dir,
+                             record) == -1) {
+        return -1;
+    }
+    if (catalog_path(user_path, "%s/%s", user_dir, record) == -1 ||
+        catalog_path(owner_path, "%s/%s", owner_dir, record) == -1) {
+        return -1;
+    }
+
+    if ((mkdir(user_dir, 0700) < 0 && errno != EEXIST) ||
+        (mkdir(owner_dir, 0700) < 0 && errno != EEXIST)) {
+        verror_put_errno(errno);
+        verror_put_string("creating catalog directory");
+        return -1;
+    }
+    rec.verifier = NULL;        /* kept only in the credential data file */
+    if (write_data_file(&rec, user_path, FILE_MODE, 1) == -1) {
+        return -1;
+    }
+    /* The record was replaced, so re-point the owner link at it. */
+    unlink(owner_path);
+    if (link(user_path, owner_path) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("link(%s,%s) failed", user_path, owner_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * catalog_update()
+ *
+ * Bring the catalog record for the given credential up to date after
+ * it was stored, deleted, locked, or unlocked.
+ */
+static void
+catalog_update(const char *username, const char *credname)
+{
+    struct myproxy_creds creds = {0}, old = {0};
+    char root[MAXPATHLEN];
+    char user_dir[MAXPATHLEN], owner_dir[MAXPATHLEN], record[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    int exists;
+
+    if (!catalog_complete()) {
+        return;
+    }
+    if (journal_depth) {        /* wait for the journal commit */
+        if (journal_add(JOURNAL_OP_CATALOG, username, credname, 0) == -1) {
+            catalog_invalidate("update failed");
         }
+        return;
+    }
+    if (catalog_path(root, "%s/%s", storage_dir, CATALOG_DIR) == -1 ||
+        catalog_record_paths(root, username, credname, NULL,
+                             user_dir, owner_dir, record) == -1) {
+        goto error;
+    }
 
-        len = strlen(line_buffer);
-        while (line_buffer[len-1] != '\n') { /* didn't get a full line */
-            char *more;
-            line_buffer_len *= 2;
-            line_buffer = realloc(line_buffer, line_buffer_len);
-            assert(line_buffer != NULL);
-            more = line_buffer+len;
-            if (fgets(more, line_buffer_len-len, data_stream) == NULL) {
-                verror_put_errno(errno);
-                verror_put_string("reading %s", datafile_path);
-                goto error;
-            }
-            len = strlen(line_buffer);
+    /* Drop the previous record; the owner may have changed. */
+    if (catalog_path(path, "%s/%s", user_dir, record) == -1) {
+        goto error;
+    }
+    if (read_data_file(&old, path) == 0) {
+        if (catalog_record_paths(root, username, credname, old.owner_name,
+                                 user_dir, owner_dir, record) == -1) {
+            goto error;
         }
+        catalog_unlink(owner_dir, record);
+    }
+    myproxy_creds_free_contents(&old);
+    verror_clear();
 
-        /* Remove terminating newline */
-        line_buffer[len-1] = '\0';
+    exists = files_exist(username, credname);
+    if (exists == 0) {
+        catalog_unlink(user_dir, record);
+        return;
+    }
+    creds.username = mystrdup(username);
+    if (credname) {
+        creds.credname = mystrdup(credname);
+    }
+    if (exists < 0 || files_retrieve(&creds) == -1 ||
+        catalog_write(root, &creds) == -1) {
+        goto error;
+    }
+    myproxy_creds_free_contents(&creds);
 
-        line_number++;
-        
-        variable = line_buffer;
-        
-        value = strchr(line_buffer, '=');
+    return;
 
-        if (value != NULL)
-        {
-            /* NUL-terminate variable name */
-            *value = '\0';
+  error:
+    myproxy_creds_free_contents(&creds);
+    myproxy_log_verror();
+    verror_clear();
+    catalog_invalidate("update failed");
+}
 
-            /* ...and advance value to point at value */
-            value++;
-        }
+/*
+ * catalog_query()
+ *
+ * Answer a files_retrieve_all() query from the catalog,
+ * filling in creds as that function does.
+ *
+ * Returns the number of matching credentials, or -1 on error.
+ */
+static int
+catalog_query(struct myproxy_creds *creds,
+              char *username, char *owner_name, char *credname,
+              time_t start_time, time_t end_time)
+{
+    char root[MAXPATHLEN], dir_path[MAXPATHLEN], path[MAXPATHLEN];
+    char *key = NULL;
+    struct myproxy_creds *head = NULL, *tail = NULL, *rec = NULL;
+    DIR *top = NULL, *dir = NULL;
+    struct dirent *de = NULL, *te = NULL;
+    size_t suffix_len = strlen(CATALOG_SUFFIX);
+    int numcreds = 0;
+
+    if (catalog_path(root, "%s/%s", storage_dir, CATALOG_DIR) == -1) {
+        goto error;
+    }
 
-        if (strcmp(variable, "END_OPTIONS") == 0) 
-        {
-            done = 1;
-            break;
+    /* Pick the index: by username, by owner, or everything. */
+    if (username) {
+        if ((key = sterile_name(username)) == NULL) {
+            goto error;
         }
-        
-        /* Everything else requires values to be non-NULL */
-        if (value == NULL)
-        {
-            verror_put_string("malformed line: %s line %d",
-                              datafile_path, line_number);
+        if (catalog_path(dir_path, "%s/user", root) == -1) {
             goto error;
         }
-        
-        if (strcmp(variable, "OWNER") == 0)
-        {
-            creds->owner_name = mystrdup(value);
-            
-            if (creds->owner_name == NULL)
-            {
-                goto error;
-            }
-            continue;
+    } else if (owner_name) {
+        if ((key = strmd5(owner_name, NULL)) == NULL) {
+            goto error;
         }
-
-	/* We no longer store a PASSPHRASE element.
-	   Read it in for backwards compatibility only. */
-        if (strcmp(variable, "PASSPHRASE") == 0)
-        {
-            creds->passphrase = mystrdup(value);
-            
-            if (creds->passphrase == NULL)
-            {
-                goto error;
-            }
-            continue;
+        if (catalog_path(dir_path, "%s/owner", root) == -1) {
+            goto error;
         }
-       
-        if (strcmp(variable, "RETRIEVERS") == 0)
-        {
-            creds->retrievers = mystrdup(value);
-            
-            if (creds->retrievers == NULL)
-            {
-                goto error;
-            }
-            continue;
+    } else {
+        if (catalog_path(dir_path, "%s/user", root) == -1) {
+            goto error;
         }
-       
-        if (strcmp(variable, "KEYRETRIEVERS") == 0)
-        {
-            creds->keyretrieve = mystrdup(value);
-            
-            if (creds->keyretrieve == NULL)
-            {
-                goto error;
-            }
-            continue;
+        if ((top = opendir(dir_path)) == NULL) {
+            verror_put_errno(errno);
+            verror_put_string("opening %s", dir_path);
+            goto error;
         }
-        
-        if (strcmp(variable, "TRUSTED_RETRIEVERS") == 0)
-        {
-            creds->trusted_retrievers = mystrdup(value);
-            
-            if (creds->trusted_retrievers == NULL)
-            {
+    }
+
+    while (1) {
+        char sub[MAXPATHLEN];
+
+        if (top) {
+            if ((te = readdir(top)) == NULL) break;
+            if (te->d_name[0] == '.') continue;
+            if (catalog_path(sub, "%s/%s", dir_path, te->d_name) == -1) {
                 goto error;
             }
-            continue;
+        } else if (catalog_path(sub, "%s/%s", dir_path, key) == -1) {
+            goto error;
         }
-        
-        if (strcmp(variable, "RENEWERS") == 0)
-        {
-            creds->renewers = mystrdup(value);
-            
-            if (creds->renewers == NULL)
-            {
+        if ((dir = opendir(sub)) == NULL) {
+            if (errno != ENOENT) {
+                verror_put_errno(errno);
+                verror_put_string("opening %s", sub);
                 goto error;
             }
-            continue;
         }
-        
-        if (strcmp(variable, "NAME") == 0)
-        {
-            creds->credname = mystrdup(value);
-            
-            if (creds->credname == NULL)
-            {
+        while (dir && (de = readdir(dir)) != NULL) {
+            size_t len = strlen(de->d_name);
+            char *cpath = NULL, *dpath = NULL, *lpath = NULL;
+
+            if (len <= suffix_len ||
+                strcmp(de->d_name+len-suffix_len, CATALOG_SUFFIX)) {
+                continue;
+            }
+            if (catalog_path(path, "%s/%s", sub, de->d_name) == -1) {
                 goto error;
             }
-            continue;
-        }
-        
-        if (strcmp(variable, "DESCRIPTION") == 0)
-        {
-            creds->creddesc= mystrdup(value);
-            
-            if (creds->creddesc == NULL)
-            {
+            rec = malloc(sizeof(struct myproxy_creds));
+            memset(rec, 0, sizeof(struct myproxy_creds));
+            if (read_data_file(rec, path) == -1) {
+                if (verror_get_errno() == ENOENT) { /* removed under us */
+                    verror_clear();
+                    myproxy_creds_free(rec);
+                    rec = NULL;
+                    continue;
+                }
                 goto error;
             }
-            continue;
-        }
-        
-        if (strcmp(variable, "LIFETIME") == 0)
-        {
-            creds->lifetime = (int) strtol(value, NULL, 10);
-            
-            continue;
-        }
-        
-        if (strcmp(variable, "USERNAME") == 0)
-        {
-            creds->username = mystrdup(value);
-            
-            if (creds->username == NULL)
-            {
+            if (rec->username == NULL ||
+                !myproxy_creds_match(rec, username, owner_name, credname,
+                                     start_time, end_time)) {
+                myproxy_creds_free(rec);
+                rec = NULL;
+                continue;
+            }
+            if (get_storage_locations(rec->username, rec->credname,
+                                      &cpath, &dpath, &lpath) == -1) {
                 goto error;
             }
-            continue;
+            rec->location = cpath;
+            free(dpath);
+            free(lpath);
+            /* the default credential always goes first */
+            if (!head) {
+                head = tail = rec;
+            } else if (!rec->credname) {
+                rec->next = head;
+                head = rec;
+            } else {
+                tail->next = rec;
+                tail = rec;
+            }
+            rec = NULL;
+            numcreds++;
         }
-        
-        /* Unrecognized varibale */
-        verror_put_string("unrecognized line: %s line %d",
-                          datafile_path, line_number);
-        goto error;
+        if (dir) {
+            closedir(dir);
+            dir = NULL;
+        }
+        if (!top) break;
     }
 
-    /* Success */
-    return_code = 0;
-    
+    /* The first credential is returned in the caller's structure. */
+    if (head) {
+        myproxy_creds_free_contents(creds);
+        *creds = *head;
+        free(head);
+    }
+    head = NULL;
+
+    if (top) closedir(top);
+    if (key) free(key);
+
+    return numcreds;
+
   error:
-    if (data_stream != NULL)
-    {
-        fclose(data_stream);
+    if (dir) closedir(dir);
+    if (top) closedir(top);
+    if (key) free(key);
+    if (rec) myproxy_creds_free(rec);
+    if (head) myproxy_creds_free(head);
+
+    return -1;
+}
+
+/*
+ * remove_tree()
+ *
+ * Recursively remove the given directory.
+ */
+static void
+remove_tree(const char *path)
+{
+    DIR *dir = NULL;
+    struct dirent *de = NULL;
+    struct stat statbuf;
+    char child[MAXPATHLEN];
+
+    if ((dir = opendir(path)) == NULL) {
+        return;
     }
-    if (line_buffer != NULL)
-    {
-        free(line_buffer);
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+            continue;
+        }
+        if (catalog_path(child, "%s/%s", path, de->d_name) == -1) {
+            verror_clear();
+            continue;
+        }
+        if (lstat(child, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+            remove_tree(child);
+        } else {
+            unlink(child);
+        }
     }
-    
-    return return_code;
+    closedir(dir);
+    rmdir(path);
 }
 
-static int
-write_lock_file(const char *filename, const char *reason)
+/*
+ * Passphrase verifiers
+ *
+ * A verifier lets myproxy_creds_verify_passphrase() check a passphrase
+ * with one scrypt computation of configurable cost instead of
+ * decrypting the private key.  It is kept in the credential data file
+ * as
+ *
+ *   VERIFIER=scrypt$<log2 N>$<r>$<p>$<salt>$<hash>$<key digest>
+ *
+ * where the salt and hash are hex encoded and the key digest is the
+ * SHA-256 of the .creds file the verifier was made for.  A verifier
+ * whose key digest doesn't match the current .creds file is ignored,
+ * so replacing the credential can't leave a stale verifier behind.
+ */
+#define VERIFIER_SCHEME		"scrypt"
+#define VERIFIER_R		8
+#define VERIFIER_P		1
+#define VERIFIER_SALT_LEN	16
+#define VERIFIER_HASH_LEN	32
+
+/*
+ * hex_encode()
+ *
+ * Return an allocated hex string for the given bytes.
+ */
+static char *
+hex_encode(const unsigned char *buf, size_t len)
 {
-    int lock_fd = -1;
-    FILE *lock_stream = NULL;
-    char *tmpfilename = NULL;
-    int bufsiz;
-    int return_code = -1;
+    char *hex;
+    size_t i;
 
-    if (filename == NULL) {
-        goto error;
+    if ((hex = malloc(len*2+1)) == NULL) {
+        verror_put_errno(errno);
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        sprintf(hex+i*2, "%02x", buf[i]);
     }
 
-    bufsiz = strlen(filename)+15;
-    tmpfilename = malloc(bufsiz);
-    snprintf(tmpfilename, bufsiz, "%s.temp.XXXXXX", filename);
+    return hex;
+}
 
-    lock_fd = mkstemp(tmpfilename);
-    if (lock_fd == -1) {
+/*
+ * file_digest()
+ *
+ * Return an allocated hex string of the SHA-256 of the given file.
+ */
+static char *
+file_digest(const char *path)
+{
+    EVP_MD_CTX *ctx = NULL;
+    unsigned char buf[4096], md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    char *digest = NULL;
+    size_t n;
+    FILE *fp = NULL;
+
+    if ((fp = fopen(path, "r")) == NULL) {
         verror_put_errno(errno);
-        verror_put_string("opening %s for writing", tmpfilename);
+        verror_put_string("opening %s", path);
         goto error;
     }
-
-    /* Now open as stream for easier IO */
-    lock_stream = fdopen(lock_fd, "w");
-    if (lock_stream == NULL) {
-        verror_put_errno(errno);
-        verror_put_string("reopening lock file %s", filename);
+    if ((ctx = EVP_MD_CTX_create()) == NULL ||
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        goto error;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        EVP_DigestUpdate(ctx, buf, n);
+    }
+    if (ferror(fp) || EVP_DigestFinal_ex(ctx, md, &md_len) != 1) {
+        verror_put_string("reading %s", path);
         goto error;
     }
+    digest = hex_encode(md, md_len);
 
-    fprintf(lock_stream, "%s", reason);
-    fclose(lock_stream);
-    lock_stream = NULL;
-    lock_fd = -1;
+  error:
+    if (ctx) EVP_MD_CTX_destroy(ctx);
+    if (fp) fclose(fp);
 
-    if (rename(tmpfilename, filename) < 0) {
-        verror_put_string("rename(%s,%s) failed", tmpfilename, filename);
+    return digest;
+}
+
+/*
+ * verifier_hash()
+ *
+ * Compute the scrypt hash of passphrase into hash.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+verifier_hash(const char *passphrase, int log_n, int r, int p,
+              const unsigned char *salt, size_t salt_len,
+              unsigned char *hash)
+{
+    uint64_t n = (uint64_t)1 << log_n;
+
+    /* allow for the N*r*128 byte working buffer */
+    if (EVP_PBE_scrypt(passphrase, strlen(passphrase), salt, salt_len,
+                       n, r, p, 128*(uint64_t)r*(n+p+2),
+                       hash, VERIFIER_HASH_LEN) != 1) {
+        verror_put_string("scrypt failed");
+        ssl_error_to_verror();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * verifier_check()
+ *
+ * Check passphrase against the verifier for the credential in creds_path.
+ *
+ * Returns 1 if it matches, 0 if not, -1 if there's no usable verifier.
+ */
+static int
+verifier_check(const char *verifier, const char *creds_path,
+               const char *passphrase)
+{
+    char scheme[16], salt_hex[VERIFIER_SALT_LEN*2+1];
+    char hash_hex[VERIFIER_HASH_LEN*2+1], key_digest[EVP_MAX_MD_SIZE*2+1];
+    unsigned char salt[VERIFIER_SALT_LEN], hash[VERIFIER_HASH_LEN];
+    unsigned char stored[VERIFIER_HASH_LEN];
+    char *digest = NULL;
+    int log_n, r, p, i, rc = -1;
+
+    if (verifier == NULL ||
+        sscanf(verifier, "%15[^$]$%d$%d$%d$%32[0-9a-f]$%64[0-9a-f]$%128[0-9a-f]",
+               scheme, &log_n, &r, &p, salt_hex, hash_hex, key_digest) != 7 ||
+        strcmp(scheme, VERIFIER_SCHEME) ||
+        strlen(salt_hex) != sizeof(salt_hex)-1 ||
+        strlen(hash_hex) != sizeof(hash_hex)-1 ||
+        log_n < 1 || log_n > 30 || r < 1 || p < 1) {
+        goto done;
+    }
+    if ((digest = file_digest(creds_path)) == NULL ||
+        strcmp(digest, key_digest)) {
+        goto done;              /* made for a different key */
+    }
+    for (i = 0; i < VERIFIER_SALT_LEN; i++) {
+        sscanf(salt_hex+i*2, "%2hhx", &salt[i]);
+    }
+    for (i = 0; i < VERIFIER_HASH_LEN; i++) {
+        sscanf(hash_hex+i*2, "%2hhx", &stored[i]);
+    }
+    if (verifier_hash(passphrase, log_n, r, p, salt, sizeof(salt),
+                      hash) == -1) {
+        goto done;
+    }
+    rc = (CRYPTO_memcmp(hash, stored, sizeof(hash)) == 0) ? 1 : 0;
+
+  done:
+    if (digest) free(digest);
+    if (rc == -1) verror_clear();
+
+    return rc;
+}
+
+/*
+ * verifier_save()
+ *
+ * Store a verifier for passphrase with the given credential.
+ * key_digest is the digest of the credential file the passphrase was
+ * checked against; nothing is saved if the credential has changed since.
+ * Only the verifier is written, so changes made to the credential's
+ * record meanwhile are kept.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+verifier_save(const char *username, const char *credname,
+              const char *key_digest, const char *passphrase)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+    unsigned char salt[VERIFIER_SALT_LEN], hash[VERIFIER_HASH_LEN];
+    char *salt_hex = NULL, *hash_hex = NULL, *verifier = NULL;
+    int len, return_code = -1;
+
+    if (b == NULL) {
+        goto error;
+    }
+    if (RAND_bytes(salt, sizeof(salt)) != 1) {
+        verror_put_string("RAND_bytes() failed");
+        goto error;
+    }
+    if (verifier_hash(passphrase, verifier_cost, VERIFIER_R, VERIFIER_P,
+                      salt, sizeof(salt), hash) == -1 ||
+        (salt_hex = hex_encode(salt, sizeof(salt))) == NULL ||
+        (hash_hex = hex_encode(hash, sizeof(hash))) == NULL) {
+        goto error;
+    }
+    len = strlen(VERIFIER_SCHEME) + strlen(salt_hex) + strlen(hash_hex) +
+        strlen(key_digest) + 64;
+    if ((verifier = malloc(len)) == NULL) {
         verror_put_errno(errno);
+        verror_put_string("malloc() failed");
+        goto error;
+    }
+    snprintf(verifier, len, "%s$%d$%d$%d$%s$%s$%s",
+             VERIFIER_SCHEME, verifier_cost, VERIFIER_R, VERIFIER_P,
+             salt_hex, hash_hex, key_digest);
+    if (b->set_verifier(username, credname, key_digest, verifier) == -1) {
         goto error;
     }
 
-    /* Success */
     return_code = 0;
 
- error:
-    if (lock_stream) {
-        fclose(lock_stream);
-    } else if (lock_fd >= 0) {
-        close(lock_fd);
-    }
-    if (tmpfilename) {
-        if (return_code == -1) {
-            unlink(tmpfilename);
-        }
-        free(tmpfilename);
-    }
+  error:
+    if (salt_hex) free(salt_hex);
+    if (hash_hex) free(hash_hex);
+    if (verifier) free(verifier);
 
     return return_code;
 }
@@ -913,22 +3014,352 @@ myproxy_check_trusted_certs_dir()
     }
     return -1;
 }
-    
+    
+/*
+ * Shared credential metadata cache
+ *
+ * myproxy_creds_cache_init() maps a table of cache slots shared by the
+ * server and the worker processes it forks afterwards.  files_retrieve()
+ * looks credentials up there before reading the .data and .lock files,
+ * and fills in the slot on a miss, so frequently used credentials are
+ * retrieved without touching the storage directory.
+ *
+ * Each slot holds one credential's metadata, as a binary data record
+ * (see "Credential data file formats") with its lock message, plus its
+ * .creds path.  Slots are direct-mapped by a hash of the username and
+ * credential name.  A writer claims the slot by putting its pid in the
+ * slot's filler field, and makes the slot's sequence number odd while
+ * it fills the slot; readers copy the slot and use the copy only if the
+ * sequence number was even and unchanged throughout.  If the filler
+ * dies part way, the next process to fill the slot finds its pid gone
+ * and takes the slot over, so it isn't left unusable.
+ *
+ * The cache is invalidated all at once by advancing its epoch, since a
+ * file name doesn't reliably give the username and credential name (see
+ * files_retrieve_all()); slots filled in an earlier epoch are ignored.
+ * The epoch advances when this process changes a stored credential,
+ * and when inotify reports changes in the storage directory (or in a
+ * shard holding a cached credential) made by anyone, such as the
+ * myproxy-admin tools.  The inotify instance is shared with the worker
+ * processes, so whichever process reads an event advances the epoch for
+ * all of them.
+ */
+#define CACHE_SLOT_SIZE		4096
+#define CACHE_MAX_SLOTS		(1024*1024)
+
+typedef struct {
+    volatile unsigned int seq;	/* odd while being filled */
+    volatile pid_t filler;	/* process filling the slot, or 0 */
+    unsigned int epoch;
+    uint32_t hash;
+    uint16_t key_len;		/* username, NUL, credential name */
+    uint16_t location_len;
+    uint32_t data_len;
+    unsigned char buf[CACHE_SLOT_SIZE - 24];	/* key, location, data */
+} cache_slot_t;
+
+typedef struct {
+    volatile unsigned int epoch;
+    int nslots;
+    cache_slot_t slots[1];
+} cache_t;
+
+static cache_t *cache = NULL;
+static size_t cache_size = 0;
+static int cache_inotify_fd = -1;
+
+/*
+ * cache_key()
+ *
+ * Put the cache key for the given credential in key.
+ *
+ * Returns its length, or -1 if too long to cache.
+ */
+static int
+cache_key(const char *username, const char *credname, char *key, int size)
+{
+    int len;
+
+    len = snprintf(key, size, "%s%c%s", username, '\0',
+                   credname ? credname : "");
+    return (len < 0 || len >= size) ? -1 : len;
+}
+
+/*
+ * cache_invalidate()
+ *
+ * Forget everything in the cache.
+ */
+static void
+cache_invalidate()
+{
+    if (cache) {
+        __sync_fetch_and_add(&cache->epoch, 1);
+    }
+}
+
+/*
+ * cache_check_events()
+ *
+ * Invalidate the cache if inotify reports changes in the storage
+ * directory.
+ */
+static void
+cache_check_events()
+{
+#if HAVE_SYS_INOTIFY_H
+    char events[4096];
+    int changed = 0;
+    ssize_t n;
+
+    while ((n = read(cache_inotify_fd, events, sizeof(events))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+        changed = 1;
+    }
+    if (changed) {
+        cache_invalidate();
+    }
+#endif
+}
+
+static unsigned int
+cache_epoch()
+{
+    return cache ? cache->epoch : 0;
+}
+
+/*
+ * cache_lookup()
+ *
+ * Fill in creds from the cache.
+ *
+ * Returns 1 on a hit, 0 on a miss.
+ */
+static int
+cache_lookup(struct myproxy_creds *creds)
+{
+    char key[1024];
+    char *username;
+    cache_slot_t copy, *slot;
+    unsigned int seq;
+    uint32_t hash;
+    int key_len;
+
+    if ((key_len = cache_key(creds->username, creds->credname,
+                             key, sizeof(key))) == -1) {
+        return 0;
+    }
+    cache_check_events();
+
+    hash = fnv1a((unsigned char *)key, key_len);
+    slot = &cache->slots[hash % cache->nslots];
+    seq = slot->seq;
+    __sync_synchronize();
+    memcpy(&copy, slot, sizeof(copy));
+    __sync_synchronize();
+    if ((seq & 1) || seq != slot->seq || copy.epoch != cache->epoch ||
+        copy.hash != hash || copy.key_len != key_len ||
+        memcmp(copy.buf, key, key_len) ||
+        (size_t)key_len + copy.location_len + copy.data_len >
+        sizeof(copy.buf)) {
+        return 0;
+    }
+
+    /* as files_retrieve() does, keep the username if the data hasn't */
+    username = creds->username;
+    creds->username = NULL;
+    myproxy_creds_free_contents(creds);
+    if (parse_binary_data(creds, copy.buf + key_len + copy.location_len,
+                          copy.data_len, "cache") == -1 ||
+        (creds->location = malloc(copy.location_len + 1)) == NULL) {
+        myproxy_creds_free_contents(creds);
+        creds->username = username;
+        verror_clear();
+        return 0;
+    }
+    memcpy(creds->location, copy.buf + key_len, copy.location_len);
+    creds->location[copy.location_len] = '\0';
+    if (creds->username == NULL) {
+        creds->username = username;
+    } else {
+        free(username);
+    }
+
+    return 1;
+}
+
+/*
+ * cache_fill()
+ *
+ * Cache the given credential, retrieved by files_retrieve() with the
+ * given cache key after the cache reached the given epoch.
+ */
+static void
+cache_fill(const char *key, int key_len,
+           const struct myproxy_creds *creds, unsigned int epoch)
+{
+    unsigned char *data = NULL;
+    size_t data_len, location_len;
+    cache_slot_t *slot;
+    unsigned int seq;
+    uint32_t hash;
+    pid_t me = getpid(), filler;
+
+    /* Legacy crypt()'ed passphrases aren't in binary records. */
+    if (cache == NULL || creds->passphrase || creds->fingerprint == NULL ||
+        format_binary_data(creds, 1, &data, &data_len) == -1) {
+        verror_clear();
+        return;
+    }
+    location_len = strlen(creds->location);
+    if (key_len + location_len + data_len > sizeof(slot->buf)) {
+        goto done;
+    }
+
+#if HAVE_SYS_INOTIFY_H
+    /* Watch the shard, if any, for changes to this credential. */
+    if (strchr(creds->location + strlen(storage_dir) + 1, '/')) {
+        char dir[MAXPATHLEN];
+
+        if (snprintf(dir, sizeof(dir), "%s", creds->location) >= sizeof(dir)) {
+            goto done;
+        }
+        *strrchr(dir, '/') = '\0';
+        if (inotify_add_watch(cache_inotify_fd, dir,
+                              IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|
+                              IN_MOVED_FROM|IN_MOVED_TO) < 0) {
+            goto done;
+        }
+    }
+#endif
+
+    hash = fnv1a((unsigned char *)key, key_len);
+    slot = &cache->slots[hash % cache->nslots];
+    filler = slot->filler;
+    if (filler != 0 && (kill(filler, 0) == 0 || errno != ESRCH)) {
+        goto done;              /* someone else is filling it */
+    }
+    if (!__sync_bool_compare_and_swap(&slot->filler, filler, me)) {
+        goto done;
+    }
+    if (filler != 0) {
+        myproxy_debug("reclaiming credential cache slot left by process %ld",
+                      (long)filler);
+    }
+    seq = slot->seq;
+    if ((seq & 1) == 0) {       /* odd already if the filler died */
+        slot->seq = ++seq;
+    }
+    __sync_synchronize();
+    slot->epoch = epoch;
+    slot->hash = hash;
+    slot->key_len = key_len;
+    slot->location_len = location_len;
+    slot->data_len = data_len;
+    memcpy(slot->buf, key, key_len);
+    memcpy(slot->buf + key_len, creds->location, location_len);
+    memcpy(slot->buf + key_len + location_len, data, data_len);
+    __sync_synchronize();
+    slot->seq = seq + 1;
+    __sync_synchronize();
+    slot->filler = 0;
+
+  done:
+    free(data);
+}
+
+int
+myproxy_creds_cache_init(int entries)
+{
+#if HAVE_SYS_INOTIFY_H
+    size_t size;
+#endif
+
+    if (cache) {
+        munmap(cache, cache_size);
+        cache = NULL;
+    }
+#if HAVE_SYS_INOTIFY_H
+    if (cache_inotify_fd >= 0) {
+        close(cache_inotify_fd);
+        cache_inotify_fd = -1;
+    }
+#endif
+    if (entries <= 0) {
+        return 0;
+    }
+#if HAVE_SYS_INOTIFY_H
+    if (entries > CACHE_MAX_SLOTS) {
+        verror_put_string("credential cache size %d too large (at most %d)",
+                          entries, CACHE_MAX_SLOTS);
+        return -1;
+    }
+    if (check_storage_directory() == -1) {
+        return -1;
+    }
+    if (get_backend() != &files_backend) {
+        verror_put_string("the credential cache is only used with the "
+                          "files storage backend");
+        return -1;
+    }
+
+    cache_inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (cache_inotify_fd < 0 ||
+        inotify_add_watch(cache_inotify_fd, storage_dir,
+                          IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|
+                          IN_MOVED_FROM|IN_MOVED_TO) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("watching %s for changes", storage_dir);
+        goto error;
+    }
+
+    size = offsetof(cache_t, slots) + entries * sizeof(cache_slot_t);
+    cache = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+                 -1, 0);
+    if (cache == MAP_FAILED) {
+        cache = NULL;
+        verror_put_errno(errno);
+        verror_put_string("mapping credential cache");
+        goto error;
+    }
+    cache_size = size;
+    cache->nslots = entries;        /* mmap() zeroes the rest */
+
+    return 0;
+
+  error:
+    if (cache_inotify_fd >= 0) {
+        close(cache_inotify_fd);
+        cache_inotify_fd = -1;
+    }
+    return -1;
+#else
+    verror_put_string("the credential cache requires inotify, which is "
+                      "not available on this platform");
+    return -1;
+#endif
+}
+
 /**********************************************************************
  *
  * API routines
  *
  */
 
-int
-myproxy_creds_store(const struct myproxy_creds *creds)
+static int
+files_store(const struct myproxy_creds *creds)
 {
+    struct myproxy_creds data_creds;
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
     char *path_prefix = NULL, *path_end = NULL;
     mode_t data_file_mode = FILE_MODE;
     mode_t creds_file_mode = FILE_MODE;
+    char *tmp_path = NULL;
+    int tmp_fd, bufsiz;
+    int journaled = 0, copied = 0;
+    int locked = -1;
     int return_code = -1;
    
     if ((creds == NULL) ||
@@ -944,8 +3375,31 @@ myproxy_creds_store(const struct myproxy_creds *creds)
         goto error;
     }
 
+    /* Cache the certificate details in the data file so retrieval
+       doesn't need to parse the certificates. If they can't be read,
+       store without them and let retrieval fall back to parsing. */
+    data_creds = *creds;
+    data_creds.subject = data_creds.fingerprint = NULL;
+    data_creds.verifier = NULL;  /* any verifier was for the old key */
+    if (ssl_get_cert_info(creds->location, &data_creds.start_time,
+                          &data_creds.end_time, &data_creds.subject,
+                          &data_creds.fingerprint) == -1) {
+        myproxy_debug("not caching certificate details for %s: %s",
+                      creds->location, verror_get_string());
+        verror_clear();
+    }
+
+    if (make_shard_dirs(data_path) == -1) {
+        goto clean_up;
+    }
+
+    if ((locked = records_lock(creds->username, creds->credname)) == -1) {
+        goto unlocked;          /* leave the stored credential alone */
+    }
+    journaled = journal_begin();
+
     /* info about credential */
-    if (write_data_file(creds, data_path, data_file_mode) == -1) {
+    if (write_data_file(&data_creds, data_path, data_file_mode, 0) == -1) {
 	verror_put_string ("Error writing data file");
 	goto clean_up;
     }
@@ -959,18 +3413,35 @@ myproxy_creds_store(const struct myproxy_creds *creds)
     if (strncmp(path_prefix, creds_path, strlen(path_prefix)) == 0) {
         /* If we're in the same directory (and thus on the same
            filesystem), we can do an atomic rename. */
-        if (rename(creds->location, creds_path) < 0) {
+        if (storage_rename(creds->location, creds_path, 0) < 0) {
             verror_put_string("rename(%s,%s) failed", creds->location,
                               creds_path);
             verror_put_errno(errno);
             goto clean_up;
         }
     } else {
-        if (copy_file(creds->location, creds_path, creds_file_mode) == -1) {
+        /* Copy next to the credential, then rename into place. */
+        bufsiz = strlen(creds_path)+15;
+        tmp_path = malloc(bufsiz);
+        snprintf(tmp_path, bufsiz, "%s.temp.XXXXXX", creds_path);
+        if ((tmp_fd = mkstemp(tmp_path)) == -1) {
+            verror_put_errno(errno);
+            verror_put_string("opening %s for writing", tmp_path);
+            goto clean_up;
+        }
+        close(tmp_fd);
+        if (copy_file(creds->location, tmp_path, creds_file_mode) == -1) {
             verror_put_string ("Error writing credential file");
+            unlink(tmp_path);
             goto clean_up;
         }
-        ssl_proxy_file_destroy(creds->location);
+        if (storage_rename(tmp_path, creds_path, 1) < 0) {
+            verror_put_string("rename(%s,%s) failed", tmp_path, creds_path);
+            verror_put_errno(errno);
+            unlink(tmp_path);
+            goto clean_up;
+        }
+        copied = 1;
     }
 
     /* administrative locks */
@@ -980,37 +3451,54 @@ myproxy_creds_store(const struct myproxy_creds *creds)
             goto clean_up;
         }
     } else {
-        unlink(lock_path);
+        storage_unlink(lock_path);
     }
+
+    catalog_update(creds->username, creds->credname);
 	
     /* Success */
     return_code = 0;
 
 clean_up:
-    /* XXX */
-    /* Remove files on error */
-    if (return_code == -1)
-    {
+    if (journaled) {
+        /* Nothing was changed unless the journal commit succeeds. */
+        return_code = journal_end(return_code);
+    } else if (return_code == -1) {
+        /* XXX */
+        /* Remove files on error */
         unlink(data_path);
         ssl_proxy_file_destroy(creds_path);
     }
+unlocked:
+    records_unlock(locked);
+    if (return_code == 0 && copied) {
+        ssl_proxy_file_destroy(creds->location);
+    }
+    cache_invalidate();
+    ssl_proxy_share_invalidate(creds_path);
     if (creds_path) free(creds_path);
     if (data_path) free(data_path);
     if (lock_path) free(lock_path);
     if (path_prefix) free(path_prefix);
+    if (tmp_path) free(tmp_path);
+    if (data_creds.subject) free(data_creds.subject);
+    if (data_creds.fingerprint) free(data_creds.fingerprint);
 
 error:
     return return_code;
 }
 
-int
-myproxy_creds_retrieve(struct myproxy_creds *creds)
+static int
+files_retrieve(struct myproxy_creds *creds)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
     char *username = NULL;
+    char key[1024];
     FILE *lockfile = NULL;
+    unsigned int epoch = 0;
+    int key_len = -1;
     int return_code = -1;
     
     
@@ -1019,6 +3507,15 @@ myproxy_creds_retrieve(struct myproxy_creds *creds)
 	goto error;
     }
 
+    if (cache) {
+        if (cache_lookup(creds)) {
+            return 0;
+        }
+        epoch = cache_epoch();
+        key_len = cache_key(creds->username, creds->credname,
+                            key, sizeof(key));
+    }
+
     /* stash username */
     username = mystrdup(creds->username);
 
@@ -1027,6 +3524,7 @@ myproxy_creds_retrieve(struct myproxy_creds *creds)
 	goto error;
     }
 
+    creds->start_time = creds->end_time = 0;
     if (read_data_file(creds, data_path) == -1) {
 	if (verror_get_errno() == ENOENT) {
 	    verror_clear();
@@ -1067,7 +3565,24 @@ myproxy_creds_retrieve(struct myproxy_creds *creds)
     username = NULL;
     assert(creds->location == NULL);
     creds->location = mystrdup(creds_path);
-    ssl_get_times(creds_path, &creds->start_time, &creds->end_time);
+
+    /* Data files written before the certificate details were cached
+       don't have them, so parse the certificates instead. */
+    if (creds->fingerprint == NULL) {
+	if (creds->subject) {
+	    free(creds->subject);
+	    creds->subject = NULL;
+	}
+	if (ssl_get_cert_info(creds_path, &creds->start_time,
+			      &creds->end_time, &creds->subject,
+			      &creds->fingerprint) == -1) {
+	    verror_clear();
+	}
+    }
+
+    if (key_len >= 0) {
+        cache_fill(key, key_len, creds, epoch);
+    }
 
     /* Success */
     return_code = 0;
@@ -1111,22 +3626,25 @@ myproxy_creds_match(struct myproxy_creds *creds,
  * don't want it implemented in multiple places. Note that because of
  * the translations we do between username/credname and the actual
  * filename used to store the credentials, we do a brute force scan,
- * calling myproxy_creds_retrieve() for each credentials, relying on
+ * calling files_retrieve() for each credentials, relying on
  * that function to set username/credname/etc. correctly for us, again
  * so we have just one function that does the translation. Beware
  * trying to optimize this function, because the handling of usernames
  * containing '/' and '-' characters can cause surprises.
+ * When the credential catalog is available, catalog_query() answers
+ * the query instead; its records hold the real username and credname,
+ * so it doesn't depend on that translation.
  */
-static int 
-myproxy_creds_retrieve_all_ex(struct myproxy_creds *creds)
+static int
+files_retrieve_all(struct myproxy_creds *creds)
 {
     char *username = NULL, *sterile_username = NULL;
     char *credname = NULL, *owner_name = NULL;
     time_t end_time = 0, start_time = 0;
     size_t sterile_username_len = 0;
     struct myproxy_creds *cur_cred = NULL, *new_cred = NULL;
-    DIR *dir = NULL;
-    struct dirent *de = NULL;
+    storage_scan_t scan = {0};
+    const char *name;
     int return_code = -1, numcreds=0;
 
     if (check_storage_directory() == -1) {
@@ -1138,190 +3656,750 @@ myproxy_creds_retrieve_all_ex(struct myproxy_creds *creds)
         goto error;
     }
 
-    /* stash query values so we can test each credential */
-    if (creds->username) {
-        username = creds->username;
-        creds->username = NULL;
-        if (strchr(username, '/')) {
-            sterile_username = strmd5(username, NULL);
-        } else {
-            sterile_username = strdup(username);
+    /* stash query values so we can test each credential */
+    if (creds->username) {
+        username = creds->username;
+        creds->username = NULL;
+        sterile_username = sterile_name(username);
+        if (sterile_username == NULL) {
+            goto error;
+        }
+        sterile_username_len = strlen(sterile_username);
+    }
+    if (creds->owner_name) {
+        owner_name = creds->owner_name;
+        creds->owner_name = NULL;
+    }
+    if (creds->credname) {
+        credname = creds->credname;
+        creds->credname = NULL;
+    }
+    if (creds->start_time) {
+        start_time = creds->start_time;
+        creds->start_time = 0;
+    }
+    if (creds->end_time) {
+        end_time = creds->end_time;
+        creds->end_time = 0;
+    }
+
+    /* use the credential catalog, if there is one */
+    if (catalog_complete()) {
+        numcreds = catalog_query(creds, username, owner_name, credname,
+                                 start_time, end_time);
+        if (numcreds >= 0) {
+            return_code = numcreds;
+            goto error;
+        }
+        myproxy_log_verror();
+        verror_clear();
+        catalog_invalidate("query failed");
+        numcreds = 0;
+    }
+
+    /*
+     * cur_cred always points to the last valid credential in the list.
+     * If cur_cred is NULL, we haven't found any credentials yet.
+     * The first cred in the list is the one passed in.  Other creds
+     *    in the list are ones we allocated and added.
+     */
+
+    new_cred = creds; /* new_cred is what we're filling in */
+
+    /*
+     * first add the credential w/o a credname, if one exists, because
+     * we always want it to be first on the list.
+     */
+    if (sterile_username &&
+        (!credname || credname[0] == '\0')) { /* only if no credname query */
+        assert(new_cred->username == NULL);
+        assert(new_cred->credname == NULL);
+        new_cred->username = strdup(sterile_username);
+        if (files_retrieve(new_cred) == 0) {
+            if (myproxy_creds_match(new_cred, username,
+                                    owner_name, credname,
+                                    start_time, end_time)) {
+                cur_cred = new_cred;
+                new_cred = malloc(sizeof(struct myproxy_creds));
+                memset(new_cred, 0, sizeof(struct myproxy_creds));
+                numcreds++;
+            }
+        } else {
+            verror_clear();     /* OK if we don't find creds w/o credname */
+        }
+    }
+
+    /*
+     * next search for credentials with a credname, by scanning the
+     * entire directory, or just the user's shard...
+     */
+    if (storage_scan_open(&scan, sterile_username) == -1) {
+        goto error;
+    }
+    while ((name = storage_scan_next(&scan)) != NULL) {
+        /* optimization: skip credential right away if username
+                         doesn't match */
+        if (sterile_username && 
+            strncmp(name, sterile_username, sterile_username_len)) {
+            continue;
+        }
+
+        myproxy_creds_free_contents(new_cred); /* left by a mismatch */
+        if (storage_scan_split(&scan, name, &new_cred->username,
+                               &new_cred->credname) == -1) {
+            goto error;
+        }
+        if (files_retrieve(new_cred) == 0) {
+            if (sterile_username && !new_cred->credname)
+                continue;   /* already handled cred w/o name */
+            if (!myproxy_creds_match(new_cred, username,
+                                     owner_name, credname,
+                                     start_time, end_time)) {
+                continue;
+            }
+            if (cur_cred) cur_cred->next = new_cred;
+            cur_cred = new_cred;
+            new_cred = malloc(sizeof(struct myproxy_creds));
+            memset(new_cred, 0, sizeof(struct myproxy_creds));
+            numcreds++;
+        } else {
+            verror_put_string("failed to retrieve credentials from "
+                              "%s/%s", scan.dir_path, name);
+            myproxy_log_verror(); /* internal error; should not happen */
+            verror_clear();
+        }
+    }
+    if (scan.error) {
+        goto error;
+    }
+
+    return_code = numcreds;
+
+ error:
+    storage_scan_close(&scan);
+    if (username) free(username);
+    if (sterile_username) free(sterile_username);
+    if (owner_name) free(owner_name);
+    if (credname) free(credname);
+    if (cur_cred && new_cred) {
+        myproxy_creds_free_contents(new_cred);
+        free(new_cred);
+    }
+    return return_code;
+}
+
+int myproxy_creds_retrieve_all(struct myproxy_creds *creds)
+{
+    int return_code = -1;
+    char *username = NULL, *credname = NULL, *owner_name = NULL;
+
+    if ((creds == NULL) || (creds->username == NULL) ||
+        (creds->owner_name == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    /* stash query values for error message */
+    username = strdup(creds->username);
+    owner_name = strdup(creds->owner_name);
+    if (creds->credname) {
+        credname = strdup(creds->credname);
+    }
+
+    return_code = (get_backend() == NULL) ? -1 :
+        backend->retrieve_all(creds);
+
+    if (return_code > 0) {
+        return_code = 0;
+    } else if (return_code == 0) {
+        if (credname) {
+            verror_put_string("no credentials found with name %s for user %s, "
+                              ", owner \"%s\"",
+                              credname, username, owner_name);
+        } else {
+            verror_put_string("no credentials found for user %s, owner \"%s\"",
+                              username, owner_name);
+        }
+        return_code = -1;
+    }
+
+    free(username);
+    free(owner_name);
+    if (credname) free(credname);
+
+    return return_code;
+}
+
+int myproxy_admin_retrieve_all(struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->retrieve_all(creds) : -1;
+}
+
+int
+myproxy_creds_catalog_rebuild()
+{
+    char root[MAXPATHLEN], new_root[MAXPATHLEN], old_root[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    struct myproxy_creds creds = {0};
+    storage_scan_t scan = {0};
+    const char *name;
+    int fd, numcreds = 0;
+
+    if (check_storage_directory() == -1) {
+        return -1;
+    }
+    if (get_backend() != &files_backend) {
+        verror_put_string("the credential catalog is only used with the "
+                          "files storage backend");
+        return -1;
+    }
+    if (catalog_path(root, "%s/%s", storage_dir, CATALOG_DIR) == -1 ||
+        catalog_path(new_root, "%s/%s.new.%ld", storage_dir,
+                     CATALOG_DIR, (long)getpid()) == -1 ||
+        catalog_path(old_root, "%s/%s.old.%ld", storage_dir,
+                     CATALOG_DIR, (long)getpid()) == -1) {
+        return -1;
+    }
+
+    /* Queries scan the storage directory while we rebuild. */
+    catalog_invalidate("rebuilding");
+
+    remove_tree(new_root);
+    if (catalog_path(path, "%s/user", new_root) == -1) {
+        goto error;
+    }
+    if (mkdir(new_root, 0700) < 0 || mkdir(path, 0700) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", path);
+        goto error;
+    }
+    if (catalog_path(path, "%s/owner", new_root) == -1) {
+        goto error;
+    }
+    if (mkdir(path, 0700) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", path);
+        goto error;
+    }
+
+    if (storage_scan_open(&scan, NULL) == -1) {
+        goto error;
+    }
+    while ((name = storage_scan_next(&scan)) != NULL) {
+        /* see files_retrieve_all() for this translation */
+        if (storage_scan_split(&scan, name, &creds.username,
+                               &creds.credname) == -1) {
+            goto error;
+        }
+        if (files_retrieve(&creds) == -1) {
+            verror_put_string("failed to retrieve credentials from %s/%s",
+                              scan.dir_path, name);
+            myproxy_log_verror();
+            verror_clear();
+        } else if (catalog_write(new_root, &creds) == -1) {
+            goto error;
+        } else {
+            numcreds++;
+        }
+        myproxy_creds_free_contents(&creds);
+    }
+    if (scan.error) {
+        goto error;
+    }
+    storage_scan_close(&scan);
+
+    if (catalog_path(path, "%s/%s", new_root, CATALOG_COMPLETE) == -1) {
+        goto error;
+    }
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, FILE_MODE)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", path);
+        goto error;
+    }
+    close(fd);
+
+    if (rename(root, old_root) < 0 && errno != ENOENT) {
+        verror_put_errno(errno);
+        verror_put_string("rename(%s,%s) failed", root, old_root);
+        goto error;
+    }
+    if (rename(new_root, root) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("rename(%s,%s) failed", new_root, root);
+        goto error;
+    }
+    remove_tree(old_root);
+
+    myproxy_log("credential catalog rebuilt with %d credentials", numcreds);
+
+    return numcreds;
+
+  error:
+    storage_scan_close(&scan);
+    myproxy_creds_free_contents(&creds);
+    remove_tree(new_root);
+
+    return -1;
+}
+
+int
+myproxy_creds_catalog_check()
+{
+    if (check_storage_directory() == -1) {
+        return -1;
+    }
+    if (get_backend() != &files_backend || catalog_complete()) {
+        return 0;
+    }
+    myproxy_log("credential catalog missing or incomplete; rebuilding");
+
+    return (myproxy_creds_catalog_rebuild() < 0) ? -1 : 0;
+}
+
+int
+myproxy_creds_journal_check(int enabled)
+{
+    const char *path;
+    int records;
+
+    if (check_storage_directory() == -1) {
+        return -1;
+    }
+    if (get_backend() != &files_backend) {
+        return 0;
+    }
+    if ((path = journal_path()) == NULL) {
+        return -1;
+    }
+
+    /* Finish the changes committed before a crash. */
+    if (access(path, F_OK) == 0) {
+        if (journal_open(0) == -1 ||
+            journal_lock(JOURNAL_LOCK_TXN, F_WRLCK, 1) == -1) {
+            return -1;
         }
-        if (sterile_username == NULL) {
-            goto error;
+        records = journal_replay(1);
+        journal_unlock(JOURNAL_LOCK_TXN);
+        if (records < 0) {
+            return -1;
+        }
+        if (records > 0) {
+            myproxy_log("replayed %d credential journal records", records);
+            catalog_invalidate("credential journal replayed");
         }
-        sterilize_string(sterile_username);
-        sterile_username_len = strlen(sterile_username);
     }
-    if (creds->owner_name) {
-        owner_name = creds->owner_name;
-        creds->owner_name = NULL;
+
+    if (enabled) {
+        if (journal_open(1) == -1) {
+            return -1;
+        }
+        storage_journaled = 1;
+    } else if (access(path, F_OK) == 0) {
+        journal_close();
+        if (unlink(path) < 0) {
+            verror_put_errno(errno);
+            verror_put_string("removing %s", path);
+            return -1;
+        }
+        fsync_parent(path);
+        storage_journaled = 0;
     }
-    if (creds->credname) {
-        credname = creds->credname;
-        creds->credname = NULL;
+
+    return 0;
+}
+
+/*
+ * shard_link()
+ *
+ * Make dst another link to src, replacing dst, or remove dst if src
+ * doesn't exist.
+ */
+static int
+shard_link(const char *src, const char *dst)
+{
+    char tmp[MAXPATHLEN];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.new", dst) >= sizeof(tmp)) {
+        verror_put_string("path too long: %s", dst);
+        return -1;
     }
-    if (creds->start_time) {
-        start_time = creds->start_time;
-        creds->start_time = 0;
+    unlink(tmp);
+    if (link(src, tmp) < 0) {
+        if (errno == ENOENT) {
+            unlink(dst);
+            return 0;
+        }
+        verror_put_errno(errno);
+        verror_put_string("link(%s,%s) failed", src, tmp);
+        return -1;
     }
-    if (creds->end_time) {
-        end_time = creds->end_time;
-        creds->end_time = 0;
+    if (rename(tmp, dst) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("rename(%s,%s) failed", tmp, dst);
+        unlink(tmp);
+        return -1;
     }
 
-    /*
-     * cur_cred always points to the last valid credential in the list.
-     * If cur_cred is NULL, we haven't found any credentials yet.
-     * The first cred in the list is the one passed in.  Other creds
-     *    in the list are ones we allocated and added.
-     */
+    return 0;
+}
 
-    new_cred = creds; /* new_cred is what we're filling in */
+int
+myproxy_creds_shard_storage()
+{
+    char marker[MAXPATHLEN], pending[MAXPATHLEN];
+    char from[3][MAXPATHLEN], to[3][MAXPATHLEN];
+    static const char *suffix[3] = { ".creds", ".lock", ".data" };
+    struct myproxy_creds data = {0};
+    DIR *dir = NULL;
+    struct dirent *de;
+    char *sterile = NULL, *shard = NULL, *dash;
+    size_t len;
+    int i, fd, moved = 0;
 
-    /*
-     * first add the credential w/o a credname, if one exists, because
-     * we always want it to be first on the list.
-     */
-    if (sterile_username &&
-        (!credname || credname[0] == '\0')) { /* only if no credname query */
-        assert(new_cred->username == NULL);
-        assert(new_cred->credname == NULL);
-        new_cred->username = strdup(sterile_username);
-        if (myproxy_creds_retrieve(new_cred) == 0) {
-            if (myproxy_creds_match(new_cred, username,
-                                    owner_name, credname,
-                                    start_time, end_time)) {
-                cur_cred = new_cred;
-                new_cred = malloc(sizeof(struct myproxy_creds));
-                memset(new_cred, 0, sizeof(struct myproxy_creds));
-                numcreds++;
-            }
-        } else {
-            verror_clear();     /* OK if we don't find creds w/o credname */
-        }
+    if (check_storage_directory() == -1) {
+        return -1;
+    }
+    if (storage_layout() == LAYOUT_SHARDED) {
+        return 0;
+    }
+    if (catalog_path(marker, "%s/%s", storage_dir, SHARD_MARKER) == -1 ||
+        catalog_path(pending, "%s/%s", storage_dir, SHARD_PENDING) == -1) {
+        return -1;
     }
 
-    /*
-     * next search for credentials with a credname, by scanning the
-     * entire directory...
-     */
+    /* Mark the move as pending before switching layouts, so the
+       credentials still at the top level are found meanwhile. */
+    if ((fd = open(pending, O_WRONLY|O_CREAT, FILE_MODE)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", pending);
+        return -1;
+    }
+    close(fd);
+    if ((fd = open(marker, O_WRONLY|O_CREAT, FILE_MODE)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", marker);
+        return -1;
+    }
+    close(fd);
+
     if ((dir = opendir(storage_dir)) == NULL) {
+        verror_put_errno(errno);
         verror_put_string("failed to open credential storage directory");
-        goto error;
+        return -1;
     }
     while ((de = readdir(dir)) != NULL) {
-        if (!strncmp(de->d_name+strlen(de->d_name)-5, ".data", 5)) {
-            char *cname = NULL, *dot, *dash;
+        len = strlen(de->d_name);
+        if (len <= 5 || strcmp(de->d_name+len-5, ".data")) {
+            continue;
+        }
+        len -= 5;
 
-            /* optimization: skip credential right away if username
-                             doesn't match */
-            if (sterile_username && 
-                strncmp(de->d_name, sterile_username, sterile_username_len)) {
+        /* the shard is chosen by the real username, which the data
+           file has unless it's very old */
+        if (catalog_path(from[2], "%s/%s", storage_dir,
+                         de->d_name) == -1) {
+            goto error;
+        }
+        if (read_data_file(&data, from[2]) == -1) {
+            if (verror_get_errno() == ENOENT) { /* removed under us */
+                verror_clear();
                 continue;
             }
-
-            dash = strchr (de->d_name, '-');
-            dot = strrchr(de->d_name, '.');
-            *dot = '\0';
-            if (dash) { /*Credential with a name */
+            goto error;
+        }
+        if (data.username &&
+            (sterile = sterile_name(data.username)) != NULL &&
+            (strncmp(de->d_name, sterile, strlen(sterile)) ||
+             (de->d_name[strlen(sterile)] != '-' &&
+              strlen(sterile) != len))) {
+            free(sterile);      /* not this file's username after all */
+            sterile = NULL;
+        }
+        if (sterile == NULL) {
+            sterile = mystrdup(de->d_name);
+            if (sterile && (dash = strchr(sterile, '-')) != NULL) {
                 *dash = '\0';
-                cname = dash+1;
+            } else if (sterile) {
+                sterile[len] = '\0';
             }
-            if (new_cred->username) free(new_cred->username);
-            if (new_cred->credname) free(new_cred->credname);
-            new_cred->username = strdup(de->d_name);
-            if (cname) {
-                new_cred->credname = strdup(cname);
-            } else {
-                new_cred->credname = NULL;
+        }
+        if (sterile == NULL || (shard = shard_dir(sterile)) == NULL) {
+            goto error;
+        }
+
+        for (i = 0; i < 3; i++) {
+            if (catalog_path(from[i], "%s/%.*s%s", storage_dir, (int)len,
+                             de->d_name, suffix[i]) == -1 ||
+                catalog_path(to[i], "%s/%.*s%s", shard, (int)len,
+                             de->d_name, suffix[i]) == -1) {
+                goto error;
             }
-            if (myproxy_creds_retrieve(new_cred) == 0) {
-                if (sterile_username && !new_cred->credname)
-                    continue;   /* already handled cred w/o name */
-                if (!myproxy_creds_match(new_cred, username,
-                                         owner_name, credname,
-                                         start_time, end_time)) {
-                    continue;
-                }
-                if (cur_cred) cur_cred->next = new_cred;
-                cur_cred = new_cred;
-                new_cred = malloc(sizeof(struct myproxy_creds));
-                memset(new_cred, 0, sizeof(struct myproxy_creds));
-                numcreds++;
-            } else {
-                verror_put_string("failed to retrieve credentials for "
-                                  "username \"%s\", credname \"%s\"",
-                                  de->d_name, cname ? cname : "");
-                myproxy_log_verror(); /* internal error; should not happen */
-                verror_clear();
+        }
+        if (make_shard_dirs(to[2]) == -1) {
+            goto error;
+        }
+
+        /* Link the files into the shard, data file last, and then
+           unlink the originals, data file first, so that readers
+           always find a complete set in one place or the other.  A
+           data file already in the shard was linked by an earlier,
+           interrupted run. */
+        if (file_exists(to[2]) != 1) {
+            if (shard_link(from[0], to[0]) == -1 ||
+                shard_link(from[1], to[1]) == -1 ||
+                shard_link(from[2], to[2]) == -1) {
+                goto error;
             }
-	    }
-	}
-    closedir(dir);
+        }
+        unlink(from[2]);
+        unlink(from[0]);
+        unlink(from[1]);
+        moved++;
 
-    return_code = numcreds;
+        myproxy_creds_free_contents(&data);
+        free(sterile);
+        sterile = NULL;
+        free(shard);
+        shard = NULL;
+    }
+    closedir(dir);
+    dir = NULL;
 
- error:
-    if (username) free(username);
-    if (sterile_username) free(sterile_username);
-    if (owner_name) free(owner_name);
-    if (credname) free(credname);
-    if (cur_cred && new_cred) {
-        myproxy_creds_free_contents(new_cred);
-        free(new_cred);
+    if (unlink(pending) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("removing %s", pending);
+        return -1;
     }
-    return return_code;
+    storage_sharded = 1;
+    myproxy_log("moved %d credentials into storage shards", moved);
+
+    return moved;
+
+  error:
+    if (dir) closedir(dir);
+    myproxy_creds_free_contents(&data);
+    if (sterile) free(sterile);
+    if (shard) free(shard);
+
+    return -1;
 }
 
-int myproxy_creds_retrieve_all(struct myproxy_creds *creds)
+int
+myproxy_creds_convert_metadata()
 {
-    int return_code = -1;
-    char *username = NULL, *credname = NULL, *owner_name = NULL;
+    char marker[MAXPATHLEN], path[MAXPATHLEN];
+    unsigned char magic[4];
+    struct myproxy_creds data = {0};
+    storage_scan_t scan = {0};
+    const char *name;
+    int fd, n, converted = 0;
 
-    if ((creds == NULL) || (creds->username == NULL) ||
-        (creds->owner_name == NULL)) {
-        verror_put_errno(EINVAL);
+    if (check_storage_directory() == -1) {
         return -1;
     }
-
-    /* stash query values for error message */
-    username = strdup(creds->username);
-    owner_name = strdup(creds->owner_name);
-    if (creds->credname) {
-        credname = strdup(creds->credname);
+    if (get_backend() != &files_backend) {
+        verror_put_string("only the files storage backend has data files");
+        return -1;
     }
 
-    return_code = myproxy_creds_retrieve_all_ex(creds);
+    /* New data files are written in binary from here on. */
+    if (catalog_path(marker, "%s/%s", storage_dir,
+                     DATA_BINARY_MARKER) == -1) {
+        return -1;
+    }
+    if ((fd = open(marker, O_WRONLY|O_CREAT, FILE_MODE)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", marker);
+        return -1;
+    }
+    close(fd);
+    storage_binary = 1;
 
-    if (return_code > 0) {
-        return_code = 0;
-    } else if (return_code == 0) {
-        if (credname) {
-            verror_put_string("no credentials found with name %s for user %s, "
-                              ", owner \"%s\"",
-                              credname, username, owner_name);
-        } else {
-            verror_put_string("no credentials found for user %s, owner \"%s\"",
-                              username, owner_name);
+    if (storage_scan_open(&scan, NULL) == -1) {
+        return -1;
+    }
+    while ((name = storage_scan_next(&scan)) != NULL) {
+        if (catalog_path(path, "%s/%s", scan.dir_path, name) == -1) {
+            goto error;
         }
-        return_code = -1;
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            continue;           /* removed meanwhile */
+        }
+        n = read(fd, magic, sizeof(magic));
+        close(fd);
+        if (n == sizeof(magic) && memcmp(magic, DATA_MAGIC, 4) == 0) {
+            continue;
+        }
+        if (read_data_file(&data, path) == -1) {
+            verror_put_string("failed to convert %s", path);
+            myproxy_log_verror();
+            verror_clear();
+            continue;
+        }
+        journal_begin();
+        n = journal_end(write_data_file(&data, path, FILE_MODE, 0));
+        myproxy_creds_free_contents(&data);
+        if (n == -1) {
+            goto error;
+        }
+        converted++;
+    }
+    if (scan.error) {
+        goto error;
     }
+    storage_scan_close(&scan);
 
-    free(username);
-    free(owner_name);
-    if (credname) free(credname);
+    myproxy_log("converted %d credential data files to binary", converted);
 
-    return return_code;
+    return converted;
+
+  error:
+    storage_scan_close(&scan);
+    myproxy_creds_free_contents(&data);
+
+    return -1;
 }
 
-int myproxy_admin_retrieve_all(struct myproxy_creds *creds)
+/*
+ * Where the current pass of myproxy_creds_reap() has got to: a scan of
+ * the storage directory for the files backend, or, for other backends,
+ * the remaining candidates from a retrieve_all() query.
+ */
+static storage_scan_t reap_scan;
+static int reap_scanning = 0;
+static struct myproxy_creds *reap_list = NULL, *reap_next = NULL;
+
+static void
+reap_reset()
+{
+    if (reap_scanning) {
+        storage_scan_close(&reap_scan);
+        reap_scanning = 0;
+    }
+    myproxy_creds_free(reap_list);
+    reap_list = reap_next = NULL;
+}
+
+/*
+ * reap_creds()
+ *
+ * Delete the given credentials if they expired before cutoff.
+ */
+static void
+reap_creds(const struct myproxy_creds *creds, time_t cutoff,
+           myproxy_creds_reap_stats_t *stats)
 {
-    return myproxy_creds_retrieve_all_ex(creds);
+    stats->examined++;
+    if (creds->end_time == 0 || creds->end_time >= cutoff) {
+        return;
+    }
+    if (myproxy_creds_delete(creds) == -1) {
+        verror_put_string("failed to remove expired credentials for %s",
+                          creds->username);
+        myproxy_log_verror();
+        verror_clear();
+        stats->errors++;
+        return;
+    }
+    myproxy_log("removed credentials for %s%s%s, expired %ld seconds ago",
+                creds->username, creds->credname ? " named " : "",
+                creds->credname ? creds->credname : "",
+                (long)(time(NULL) - creds->end_time));
+    stats->removed++;
 }
 
 int
-myproxy_creds_exist(const char *username, const char *credname)
+myproxy_creds_reap(time_t grace, int max, myproxy_creds_reap_stats_t *stats)
+{
+    struct myproxy_creds creds = {0};
+    const char *name;
+    time_t cutoff;
+    int n;
+
+    if ((stats == NULL) || (max <= 0) || (grace < 0)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+    if (check_storage_directory() == -1 || get_backend() == NULL) {
+        return -1;
+    }
+    cutoff = time(NULL) - grace;
+
+    /* start a new pass */
+    if (!reap_scanning && reap_next == NULL) {
+        stats->pass_start = time(NULL);
+        stats->examined = stats->removed = stats->errors = 0;
+        if (backend == &files_backend) {
+            if (storage_scan_open(&reap_scan, NULL) == -1) {
+                return -1;
+            }
+            reap_scanning = 1;
+        } else {
+            reap_list = malloc(sizeof(struct myproxy_creds));
+            if (reap_list == NULL) {
+                verror_put_errno(errno);
+                verror_put_string("malloc() failed");
+                return -1;
+            }
+            memset(reap_list, 0, sizeof(struct myproxy_creds));
+            reap_list->end_time = cutoff;
+            if ((n = backend->retrieve_all(reap_list)) <= 0) {
+                reap_reset();
+                if (n == -1) {
+                    return -1;
+                }
+                stats->passes++;
+                return 1;
+            }
+            reap_next = reap_list;
+        }
+    }
+
+    if (!reap_scanning) {
+        for (n = 0; n < max && reap_next; n++) {
+            reap_creds(reap_next, cutoff, stats);
+            reap_next = reap_next->next;
+        }
+    } else {
+        for (n = 0; n < max; n++) {
+            if ((name = storage_scan_next(&reap_scan)) == NULL) {
+                if (reap_scan.error) {
+                    reap_reset();
+                    return -1;
+                }
+                break;
+            }
+            /* see files_retrieve_all() for this translation */
+            if (storage_scan_split(&reap_scan, name, &creds.username,
+                                   &creds.credname) == -1) {
+                reap_reset();
+                return -1;
+            }
+            if (files_retrieve(&creds) == 0) {
+                reap_creds(&creds, cutoff, stats);
+            } else {
+                verror_clear();     /* removed meanwhile */
+            }
+            myproxy_creds_free_contents(&creds);
+        }
+        if (n == max) {
+            return 0;
+        }
+    }
+    if (reap_next) {
+        return 0;
+    }
+
+    reap_reset();
+    stats->passes++;
+
+    return 1;
+}
+
+static int
+files_exist(const char *username, const char *credname)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
@@ -1404,22 +4482,19 @@ myproxy_creds_is_owner(const char		*username,
 			const char 		*credname, 
 			const char		*client_name)
 {
-    char *creds_path = NULL;
-    char *data_path = NULL;
-    char *lock_path = NULL;
+    const myproxy_creds_backend_t *b;
     struct myproxy_creds retrieved_creds = {0}; /* initialize with 0s */
     int return_code = -1;
 
     assert(username != NULL);
     assert(client_name != NULL);
     
-    if (get_storage_locations(username, credname,
-                              &creds_path, &data_path, &lock_path) == -1)
-    {
-        goto error;
+    retrieved_creds.username = mystrdup(username);
+    if (credname) {
+        retrieved_creds.credname = mystrdup(credname);
     }
-
-    if (read_data_file(&retrieved_creds, data_path) == -1)
+    if ((b = get_backend()) == NULL ||
+        b->retrieve(&retrieved_creds) == -1)
     {
         goto error;
     }
@@ -1437,19 +4512,18 @@ myproxy_creds_is_owner(const char		*username,
     
   error:
     myproxy_creds_free_contents(&retrieved_creds);
-    if (creds_path) free(creds_path);
-    if (data_path) free(data_path);
-    if (lock_path) free(lock_path);
     
     return return_code;
 }
-
-int
-myproxy_creds_delete(const struct myproxy_creds *creds)
+
+static int
+files_delete(const struct myproxy_creds *creds)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
+    int journaled = 0;
+    int locked = -1;
     int return_code = -1;
     
     if ((creds == NULL) || (creds->username == NULL)) {
@@ -1462,7 +4536,12 @@ myproxy_creds_delete(const struct myproxy_creds *creds)
         goto error;
     }
 
-    if (unlink(data_path) == -1) {
+    if ((locked = records_lock(creds->username, creds->credname)) == -1) {
+        goto error;
+    }
+    journaled = journal_begin();
+
+    if (storage_unlink(data_path) == -1) {
 	if (errno == ENOENT) {
 	    verror_put_string("Credentials do not exist.");
 	} else {
@@ -1473,17 +4552,25 @@ myproxy_creds_delete(const struct myproxy_creds *creds)
         goto error;
     }
 
-    if (ssl_proxy_file_destroy(creds_path) != SSL_SUCCESS) {
+    if (storage_destroy(creds_path) == -1) {
 	verror_put_string("deleting credentials file %s", creds_path);
         goto error;
     }
     
-    unlink(lock_path);		/* may not exist */
+    storage_unlink(lock_path);	/* may not exist */
+
+    catalog_update(creds->username, creds->credname);
 
     /* Success */
     return_code = 0;
     
   error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    records_unlock(locked);
+    cache_invalidate();
+    ssl_proxy_share_invalidate(creds_path);
     if (creds_path) free(creds_path);
     if (data_path) free(data_path);
     if (lock_path) free(lock_path);
@@ -1491,12 +4578,13 @@ myproxy_creds_delete(const struct myproxy_creds *creds)
     return return_code;
 }
 
-int
-myproxy_creds_lock(const struct myproxy_creds *creds, const char *reason)
+static int
+files_lock(const struct myproxy_creds *creds, const char *reason)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
+    int journaled = 0;
     int return_code = -1;
     
     if ((creds == NULL) || (creds->username == NULL) || (reason == NULL)) {
@@ -1509,15 +4597,23 @@ myproxy_creds_lock(const struct myproxy_creds *creds, const char *reason)
         goto error;
     }
 
+    journaled = journal_begin();
+
     if (write_lock_file(lock_path, reason) < 0) {
         verror_put_string("Error writing lockfile");
         goto error;
     }
 
+    catalog_update(creds->username, creds->credname);
+
     /* Success */
     return_code = 0;
     
   error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    cache_invalidate();
     if (creds_path) free(creds_path);
     if (data_path) free(data_path);
     if (lock_path) free(lock_path);
@@ -1525,12 +4621,13 @@ myproxy_creds_lock(const struct myproxy_creds *creds, const char *reason)
     return return_code;
 }
 
-int
-myproxy_creds_unlock(const struct myproxy_creds *creds)
+static int
+files_unlock(const struct myproxy_creds *creds)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
+    int journaled = 0;
     int return_code = -1;
     
     if ((creds == NULL) || (creds->username == NULL)) {
@@ -1543,12 +4640,20 @@ myproxy_creds_unlock(const struct myproxy_creds *creds)
         goto error;
     }
 
-    unlink(lock_path);
+    journaled = journal_begin();
+
+    storage_unlink(lock_path);
+
+    catalog_update(creds->username, creds->credname);
 
     /* Success */
     return_code = 0;
     
   error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    cache_invalidate();
     if (creds_path) free(creds_path);
     if (data_path) free(data_path);
     if (lock_path) free(lock_path);
@@ -1557,15 +4662,19 @@ myproxy_creds_unlock(const struct myproxy_creds *creds)
 
 /* Server password change function - called from myproxy_server.
    Checks existing password before changing it */ 
-int
-myproxy_creds_change_passphrase(const struct myproxy_creds *creds,
-				const char *new_passphrase)
+static int
+files_change_passphrase(const struct myproxy_creds *creds,
+			const char *new_passphrase)
 {
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
     mode_t data_file_mode = FILE_MODE;
     struct myproxy_creds tmp_creds = {0}; /* initialize with 0s */
+    char *tmp_path = NULL;
+    int tmp_fd, bufsiz;
+    int journaled = 0;
+    int locked = -1;
     int return_code = -1;
     SSL_CREDENTIALS *ssl_creds = NULL;
     
@@ -1588,19 +4697,11 @@ myproxy_creds_change_passphrase(const struct myproxy_creds *creds,
 	goto error;
     }
 
-    if (read_data_file(&tmp_creds, data_path) == -1) {
-        goto error;
-    }
-   
-    /* Remove and rewrite with modified password.  Crude but works */ 
-    if (unlink(data_path) == -1) {
-        verror_put_errno(errno);
-        verror_put_string("deleting credentials data file %s: %s", data_path,
-                          verror_strerror());
+    /* the data file is read and rewritten */
+    if ((locked = records_lock(creds->username, creds->credname)) == -1) {
         goto error;
     }
-    if (ssl_proxy_file_destroy(creds_path) == SSL_ERROR) {
-        verror_put_string("deleting credentials data file %s", creds_path);
+    if (read_data_file(&tmp_creds, data_path) == -1) {
         goto error;
     }
 
@@ -1608,19 +4709,64 @@ myproxy_creds_change_passphrase(const struct myproxy_creds *creds,
     if (new_passphrase && new_passphrase[0])
 	tmp_creds.passphrase = strdup(new_passphrase);
 
-    if (write_data_file(&tmp_creds, data_path, data_file_mode) == -1) {
-	verror_put_string ("Error writing data file");
-       	goto error;
+    /* the verifier is for the old passphrase */
+    if (tmp_creds.verifier) {
+	free(tmp_creds.verifier);
+	tmp_creds.verifier = NULL;
     }
-    if (ssl_proxy_store_to_file(ssl_creds, creds_path, tmp_creds.passphrase) !=
+
+    /* Write the re-encrypted credential next to the old one (the
+       store routine insists on creating the file itself), then
+       replace the data file and the old credential. */
+    bufsiz = strlen(creds_path)+15;
+    tmp_path = malloc(bufsiz);
+    snprintf(tmp_path, bufsiz, "%s.temp.XXXXXX", creds_path);
+    if ((tmp_fd = mkstemp(tmp_path)) == -1) {
+        verror_put_errno(errno);
+        verror_put_string("opening %s for writing", tmp_path);
+        goto error;
+    }
+    close(tmp_fd);
+    unlink(tmp_path);
+    if (ssl_proxy_store_to_file(ssl_creds, tmp_path, tmp_creds.passphrase) !=
 	SSL_SUCCESS) {
 	goto error;
     }
 
+    journaled = journal_begin();
+
+    if (write_data_file(&tmp_creds, data_path, data_file_mode, 0) == -1) {
+	verror_put_string ("Error writing data file");
+       	goto error;
+    }
+    if (storage_destroy(creds_path) == -1) {
+        verror_put_string("deleting credentials file %s", creds_path);
+        goto error;
+    }
+    if (storage_rename(tmp_path, creds_path, 1) < 0) {
+        verror_put_string("rename(%s,%s) failed", tmp_path, creds_path);
+        verror_put_errno(errno);
+        goto error;
+    }
+    free(tmp_path);
+    tmp_path = NULL;
+
     /* Success */
     return_code = 0;
     
   error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    records_unlock(locked);
+    cache_invalidate();
+    ssl_proxy_share_invalidate(creds_path);
+    if (tmp_path) {
+        if (access(tmp_path, F_OK) == 0) {
+            ssl_proxy_file_destroy(tmp_path);
+        }
+        free(tmp_path);
+    }
     myproxy_creds_free_contents(&tmp_creds);
     ssl_credentials_destroy(ssl_creds);
     if (creds_path) free(creds_path);
@@ -1630,12 +4776,298 @@ myproxy_creds_change_passphrase(const struct myproxy_creds *creds,
     return return_code;
 }
 
-int
-myproxy_creds_encrypted(const struct myproxy_creds *creds)
+/*
+ * files_update()
+ *
+ * Rewrite the data file of an existing credential.
+ */
+static int
+files_update(const struct myproxy_creds *creds)
+{
+    char *creds_path = NULL;
+    char *data_path = NULL;
+    char *lock_path = NULL;
+    int journaled = 0;
+    int locked = -1;
+    int return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL) ||
+        (creds->owner_name == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if (get_storage_locations(creds->username, creds->credname,
+                              &creds_path, &data_path, &lock_path) == -1) {
+        goto error;
+    }
+
+    if ((locked = records_lock(creds->username, creds->credname)) == -1) {
+        goto error;
+    }
+    journaled = journal_begin();
+
+    if (write_data_file(creds, data_path, FILE_MODE, 0) == -1) {
+        verror_put_string("Error writing data file");
+        goto error;
+    }
+
+    catalog_update(creds->username, creds->credname);
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    records_unlock(locked);
+    cache_invalidate();
+    if (creds_path) free(creds_path);
+    if (data_path) free(data_path);
+    if (lock_path) free(lock_path);
+
+    return return_code;
+}
+
+/*
+ * files_set_verifier()
+ *
+ * Rewrite the verifier in the data file of an existing credential,
+ * keeping the rest of the record as it is on disk now.
+ */
+static int
+files_set_verifier(const char *username, const char *credname,
+                   const char *key_digest, const char *verifier)
 {
+    struct myproxy_creds tmp_creds = {0};
     char *creds_path = NULL;
     char *data_path = NULL;
     char *lock_path = NULL;
+    char *digest = NULL;
+    int journaled = 0;
+    int locked = -1;
+    int return_code = -1;
+
+    if (get_storage_locations(username, credname,
+                              &creds_path, &data_path, &lock_path) == -1) {
+        goto error;
+    }
+
+    if ((locked = records_lock(username, credname)) == -1) {
+        goto error;
+    }
+    if ((digest = file_digest(creds_path)) == NULL ||
+        strcmp(digest, key_digest)) {
+        verror_clear();
+        return_code = 0;        /* credential replaced or removed */
+        goto error;
+    }
+    if (read_data_file(&tmp_creds, data_path) == -1) {
+        goto error;
+    }
+    if (tmp_creds.verifier) free(tmp_creds.verifier);
+    tmp_creds.verifier = mystrdup(verifier);
+
+    journaled = journal_begin();
+
+    if (write_data_file(&tmp_creds, data_path, FILE_MODE, 0) == -1) {
+        verror_put_string("Error writing data file");
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    if (journaled) {
+        return_code = journal_end(return_code);
+    }
+    records_unlock(locked);
+    cache_invalidate();
+    myproxy_creds_free_contents(&tmp_creds);
+    if (creds_path) free(creds_path);
+    if (data_path) free(data_path);
+    if (lock_path) free(lock_path);
+    if (digest) free(digest);
+
+    return return_code;
+}
+
+/*
+ * files_credential_path()
+ *
+ * Return the path of the .creds file for the given credential.
+ */
+static int
+files_credential_path(const char *username, const char *credname,
+                      char **path)
+{
+    char *data_path = NULL;
+    char *lock_path = NULL;
+    int return_code;
+
+    return_code = get_storage_locations(username, credname,
+                                        path, &data_path, &lock_path);
+    if (data_path) free(data_path);
+    if (lock_path) free(lock_path);
+
+    return return_code;
+}
+
+static int
+files_open(const char *arg)
+{
+    if (arg) {
+        verror_put_string("the files storage backend takes no argument "
+                          "(use the storage directory)");
+        return -1;
+    }
+    return 0;
+}
+
+static const myproxy_creds_backend_t files_backend = {
+    "files",
+    files_open,
+    files_store,
+    files_retrieve,
+    files_retrieve_all,
+    files_delete,
+    files_lock,
+    files_unlock,
+    files_change_passphrase,
+    files_exist,
+    files_update,
+    files_set_verifier,
+    files_credential_path
+};
+
+static const myproxy_creds_backend_t *backends[] = {
+    &files_backend,
+#if defined(HAVE_LIBSQLITE3)
+    &myproxy_creds_sqlite_backend,
+#endif
+    NULL
+};
+
+/*
+ * get_backend()
+ *
+ * Return the storage backend in use, selecting it from the
+ * MYPROXY_CREDENTIAL_STORAGE environment variable (default "files")
+ * if myproxy_creds_set_backend() hasn't been called.
+ */
+static const myproxy_creds_backend_t *
+get_backend()
+{
+    const char *spec;
+
+    if (backend == NULL) {
+        spec = getenv("MYPROXY_CREDENTIAL_STORAGE");
+        if (myproxy_creds_set_backend(spec ? spec : "files") == -1) {
+            return NULL;
+        }
+    }
+
+    return backend;
+}
+
+int
+myproxy_creds_set_backend(const char *spec)
+{
+    const char *arg = NULL;
+    size_t len;
+    int i;
+
+    if (spec == NULL) {         /* back to the default */
+        backend = NULL;
+        return 0;
+    }
+    len = strcspn(spec, ":");
+    if (spec[len] == ':') {
+        arg = spec+len+1;
+    }
+    for (i = 0; backends[i]; i++) {
+        if (strlen(backends[i]->name) == len &&
+            strncmp(backends[i]->name, spec, len) == 0) {
+            break;
+        }
+    }
+    if (backends[i] == NULL) {
+        verror_put_string("unknown credential storage backend: %s", spec);
+        return -1;
+    }
+    if (backends[i]->open(arg) == -1) {
+        return -1;
+    }
+    backend = backends[i];
+    reap_reset();
+
+    return 0;
+}
+
+int
+myproxy_creds_store(const struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->store(creds) : -1;
+}
+
+int
+myproxy_creds_retrieve(struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->retrieve(creds) : -1;
+}
+
+int
+myproxy_creds_exist(const char *username, const char *credname)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->exist(username, credname) : -1;
+}
+
+int
+myproxy_creds_delete(const struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->remove(creds) : -1;
+}
+
+int
+myproxy_creds_lock(const struct myproxy_creds *creds, const char *reason)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->lock(creds, reason) : -1;
+}
+
+int
+myproxy_creds_unlock(const struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->unlock(creds) : -1;
+}
+
+int
+myproxy_creds_change_passphrase(const struct myproxy_creds *creds,
+				const char *new_passphrase)
+{
+    const myproxy_creds_backend_t *b = get_backend();
+
+    return b ? b->change_passphrase(creds, new_passphrase) : -1;
+}
+
+int
+myproxy_creds_encrypted(const struct myproxy_creds *creds)
+{
+    const myproxy_creds_backend_t *b;
+    char *creds_path = NULL;
     int rc = -1;
     
     if ((creds == NULL) || (creds->username == NULL)) {
@@ -1643,16 +5075,15 @@ myproxy_creds_encrypted(const struct myproxy_creds *creds)
 	goto error;
     }
     
-    if (get_storage_locations(creds->username, creds->credname,
-                              &creds_path, &data_path, &lock_path) == -1) {
+    if ((b = get_backend()) == NULL ||
+	b->credential_path(creds->username, creds->credname,
+			   &creds_path) == -1) {
 	goto error;
     }
 
     rc = ssl_private_key_is_encrypted(creds_path);
  error:
     if (creds_path) free(creds_path);
-    if (data_path) free(data_path);
-    if (lock_path) free(lock_path);
 
     return rc;
 }
@@ -1661,10 +5092,11 @@ int
 myproxy_creds_verify_passphrase(const struct myproxy_creds *creds,
 				const char *passphrase)
 {
+    const myproxy_creds_backend_t *b;
     char *creds_path = NULL;
-    char *data_path = NULL;
-    char *lock_path = NULL;
-    char *tmp = NULL;
+    char *tmp = NULL, *key_digest = NULL;
+    struct myproxy_creds tmp_creds = {0};
+    int matched = -1;
     int return_code = -1;
     SSL_CREDENTIALS *ssl_creds = NULL;
     
@@ -1674,22 +5106,51 @@ myproxy_creds_verify_passphrase(const struct myproxy_creds *creds,
 	goto error;
     }
     
-    if (get_storage_locations(creds->username, creds->credname,
-                              &creds_path, &data_path, &lock_path) == -1) {
+    if ((b = get_backend()) == NULL ||
+	b->credential_path(creds->username, creds->credname,
+			   &creds_path) == -1) {
         goto error;
     }
 
     /*
      * Verify the passphrase here.
-     * If the private key is encrypted, verify the passphrase by attempting
-     * to decrypt.
+     * If the private key is encrypted, check the passphrase against
+     * the credential's verifier if it has a usable one, or else verify
+     * the passphrase by attempting to decrypt (and save a verifier for
+     * next time).
      * Otherwise, if we have a crypted passphrase in the myproxy_creds
      * struct, verify against that (for backwards compatibility).
      */
-    if (ssl_private_key_is_encrypted(creds_path) == 1 &&
-	(ssl_creds = ssl_credentials_new()) != NULL &&
-	ssl_private_key_load_from_file(ssl_creds, creds_path, passphrase,
-				       NULL) == SSL_SUCCESS) {
+    if (ssl_private_key_is_encrypted(creds_path) == 1) {
+	if (verifier_cost) {
+	    tmp_creds.username = mystrdup(creds->username);
+	    if (creds->credname) {
+		tmp_creds.credname = mystrdup(creds->credname);
+	    }
+	    if (b->retrieve(&tmp_creds) == 0) {
+		matched = verifier_check(tmp_creds.verifier,
+					 tmp_creds.location, passphrase);
+	    }
+	    verror_clear();
+	}
+	if (matched == -1) {
+	    key_digest = verifier_cost ? file_digest(creds_path) : NULL;
+	    if ((ssl_creds = ssl_credentials_new()) != NULL &&
+		ssl_private_key_load_from_file(ssl_creds, creds_path,
+					       passphrase,
+					       NULL) == SSL_SUCCESS) {
+		matched = 1;
+		if (key_digest &&
+		    verifier_save(creds->username, creds->credname,
+				  key_digest, passphrase) == -1) {
+		    myproxy_log_verror();
+		}
+	    }
+	    verror_clear();
+	}
+    }
+
+    if (matched == 1) {
 	return_code = 1;
     }
     else if (creds->passphrase &&
@@ -1704,9 +5165,9 @@ myproxy_creds_verify_passphrase(const struct myproxy_creds *creds,
 
   error:
     ssl_credentials_destroy(ssl_creds);
+    myproxy_creds_free_contents(&tmp_creds);
+    if (key_digest) free(key_digest);
     if (creds_path) free(creds_path);
-    if (data_path) free(data_path);
-    if (lock_path) free(lock_path);
 
     return return_code;
 }
@@ -1733,6 +5194,9 @@ void myproxy_creds_free_contents(struct myproxy_creds *creds)
     if (creds->credname != NULL)	free(creds->credname);
     if (creds->creddesc != NULL)	free(creds->creddesc);
     if (creds->lockmsg != NULL)     free(creds->lockmsg);
+    if (creds->subject != NULL)     free(creds->subject);
+    if (creds->fingerprint != NULL) free(creds->fingerprint);
+    if (creds->verifier != NULL)    free(creds->verifier);
     memset(creds, 0, sizeof(struct myproxy_creds));
 }
 
@@ -1753,6 +5217,12 @@ int myproxy_set_storage_dir(const char *dir)
     }
     storage_dir=strdup(dir);
     searched_for_storage_dir = 0;
+    storage_sharded = 0;
+    storage_journaled = 0;
+    storage_binary = 0;
+    journal_close();
+    cache_invalidate();
+    reap_reset();
     if (!storage_dir) {
 	verror_put_errno(errno);
 	verror_put_string("strdup() failed");
@@ -1761,6 +5231,17 @@ int myproxy_set_storage_dir(const char *dir)
     return 0;
 }
 
+int myproxy_creds_set_verifier_cost(int log_n)
+{
+    if (log_n != 0 && (log_n < 10 || log_n > 22)) {
+	verror_put_string("passphrase verifier cost %d out of range "
+			  "(10 to 22, or 0 to disable)", log_n);
+	return -1;
+    }
+    verifier_cost = log_n;
+    return 0;
+}
+
 int myproxy_check_storage_dir()
 {
     return check_storage_directory();
@@ -2041,9 +5522,8 @@ myproxy_install_trusted_cert_files(myproxy_certs_t *trusted_certs)
 
 int myproxy_creds_verify(const struct myproxy_creds *creds)
 {
+    const myproxy_creds_backend_t *b;
     char *creds_path = NULL;
-    char *data_path = NULL;
-    char *lock_path = NULL;
     int return_code = -1;
 
     if (!creds || !creds->username) {
@@ -2051,8 +5531,9 @@ int myproxy_creds_verify(const struct myproxy_creds *creds)
         goto error;
     }
 
-    if (get_storage_locations(creds->username, creds->credname,
-                              &creds_path, &data_path, &lock_path) == -1) {
+    if ((b = get_backend()) == NULL ||
+        b->credential_path(creds->username, creds->credname,
+                           &creds_path) == -1) {
         goto error;
     }
 
@@ -2066,8 +5547,6 @@ int myproxy_creds_verify(const struct myproxy_creds *creds)
 
   error:
     if (creds_path) free(creds_path);
-    if (data_path) free(data_path);
-    if (lock_path) free(lock_path);
 
     return return_code;
 }
@@ -31,6 +31,16 @@ struct myproxy_creds {
     time_t                start_time;
     time_t                end_time;
 
+    /* base subject and SHA-256 chain fingerprint of the certificates
+       in the cred; like start_time and end_time, these are cached in
+       the credential data file when the credential is stored */
+    char                 *subject;
+    char                 *fingerprint;
+
+    /* salted passphrase verifier, kept in the credential data file by
+       myproxy_creds_verify_passphrase() */
+    char                 *verifier;
+
     /* non-NULL lockmsg indicates credential is administratively
        locked and should not be accessible.  lockmsg should be
        returned on any attempted access. */
@@ -51,6 +61,17 @@ struct myproxy_certs {
 
 typedef struct myproxy_certs myproxy_certs_t;
 
+/* progress of the expired credential reaper */
+struct myproxy_creds_reap_stats {
+    int    passes;              /* passes completed */
+    time_t pass_start;          /* when the current pass started */
+    int    examined;            /* credentials examined this pass */
+    int    removed;             /* expired credentials removed this pass */
+    int    errors;              /* credentials that couldn't be removed */
+};
+
+typedef struct myproxy_creds_reap_stats myproxy_creds_reap_stats_t;
+
 /*
  * myproxy_creds_store()
  *
@@ -114,6 +135,95 @@ int myproxy_creds_retrieve_all(struct myproxy_creds *creds);
  */
 int myproxy_admin_retrieve_all(struct myproxy_creds *creds);
 
+/*
+ * myproxy_creds_catalog_rebuild()
+ *
+ * Rebuild the credential catalog from the credentials in the storage
+ * directory.  While the catalog exists, it is kept up to date as
+ * credentials are stored, deleted, locked, and unlocked, and it is
+ * used to answer myproxy_creds_retrieve_all() and
+ * myproxy_admin_retrieve_all() queries without scanning the storage
+ * directory.
+ *
+ * Returns -1 on error, number of credentials cataloged on success.
+ */
+int myproxy_creds_catalog_rebuild();
+
+/*
+ * myproxy_creds_shard_storage()
+ *
+ * Move the credentials in the storage directory into hashed
+ * subdirectories by username, so lookups and per-user queries don't
+ * search one huge directory.  The repository stays usable meanwhile,
+ * and an interrupted run can simply be repeated.  Once sharded, it
+ * stays sharded.
+ *
+ * Returns -1 on error, number of credentials moved on success.
+ */
+int myproxy_creds_shard_storage();
+
+/*
+ * myproxy_creds_convert_metadata()
+ *
+ * Rewrite the credential data files in the storage directory in the
+ * binary format, and write new ones in that format from now on.  Data
+ * files in the text format can still be read.
+ *
+ * Returns -1 on error, number of data files converted on success.
+ */
+int myproxy_creds_convert_metadata();
+
+/*
+ * myproxy_creds_catalog_check()
+ *
+ * Rebuild the credential catalog if it is missing or incomplete.
+ *
+ * Returns -1 on error, 0 on success.
+ */
+int myproxy_creds_catalog_check();
+
+/*
+ * myproxy_creds_journal_check()
+ *
+ * Replay the write-ahead journal in the storage directory, if any, to
+ * finish changes interrupted by a crash, then start (if enabled is set)
+ * or stop journaling.  While the storage directory is journaled, each
+ * change to a stored credential is written to the journal and synced
+ * to disk before it is made.  Only the files storage backend uses the
+ * journal.
+ *
+ * Returns -1 on error, 0 on success.
+ */
+int myproxy_creds_journal_check(int enabled);
+
+/*
+ * myproxy_creds_cache_init()
+ *
+ * Set up a cache of the metadata of up to the given number of stored
+ * credentials, shared with processes forked afterwards, so
+ * myproxy_creds_retrieve() can usually answer without reading the
+ * storage directory.  The cache is kept current by watching the storage
+ * directory with inotify.  Only the files storage backend uses the
+ * cache.  An entries value of 0 removes the cache.
+ *
+ * Returns -1 on error, 0 on success.
+ */
+int myproxy_creds_cache_init(int entries);
+
+/*
+ * myproxy_creds_reap()
+ *
+ * Examine up to max stored credentials, continuing the current pass
+ * over the repository (or starting a new one), and delete those that
+ * expired more than grace seconds ago.  Counters for the pass are kept
+ * in stats, which the caller should zero before the first call and
+ * pass unchanged thereafter.
+ *
+ * Returns -1 on error, 1 if the pass is complete, 0 otherwise.
+ */
+int myproxy_creds_reap(time_t grace, int max,
+                       myproxy_creds_reap_stats_t *stats);
+
 /*
  * myproxy_creds_delete()
  *
@@ -234,6 +344,32 @@ int myproxy_set_storage_dir(const char *dir);
  */
 int myproxy_check_storage_dir();
 
+/*
+ * myproxy_creds_set_backend()
+ *
+ * Select the credential storage backend.  spec is "files" (the
+ * default, using files in the storage directory) or "sqlite[:path]"
+ * (an SQLite database, by default credentials.db in the storage
+ * directory), when built with SQLite.  Without a call to this
+ * function, or after a call with a NULL spec, the
+ * MYPROXY_CREDENTIAL_STORAGE environment variable, if set, selects
+ * the backend.
+ * Returns -1 on error, 0 on success.
+ */
+int myproxy_creds_set_backend(const char *spec);
+
+/*
+ * myproxy_creds_set_verifier_cost()
+ *
+ * Set the scrypt cost (log2 of N) for passphrase verifiers, or 0 to
+ * disable them.  When enabled, myproxy_creds_verify_passphrase()
+ * checks passphrases against a salted verifier kept in the credential
+ * data file instead of decrypting the private key, and writes one the
+ * first time a passphrase is verified by decryption.
+ * Returns -1 on error, 0 on success.
+ */
+int myproxy_creds_set_verifier_cost(int log_n);
+
 /*
  * myproxy_get_storage_dir()
  *
@@ -0,0 +1,64 @@
+/*
+ * myproxy_creds_backend.h - credential storage backends
+ *
+ * The myproxy_creds_*() routines in myproxy_creds.c hand persistence
+ * off to a storage backend.  The "files" backend (the .creds, .data and
+ * .lock files in the storage directory) is the default and lives in
+ * myproxy_creds.c; other backends are selected by name with
+ * myproxy_creds_set_backend().
+ */
+#ifndef __MYPROXY_CREDS_BACKEND_H
+#define __MYPROXY_CREDS_BACKEND_H
+
+#include "myproxy_creds.h"
+
+/*
+ * Each routine follows the conventions of the myproxy_creds.h routine
+ * of the same name, returning -1 and setting verror on error.
+ *
+ * retrieve() must leave creds->location naming a file that holds the
+ * credential in PEM format, since the delegation and key routines in
+ * ssl_utils.c work on files.  Credentials returned by retrieve_all()
+ * may have a location that only credential_path() or retrieve()
+ * brings into existence.
+ */
+typedef struct myproxy_creds_backend {
+    const char *name;
+
+    /* Prepare the backend.  arg is the part of the backend
+       specification after the ':', or NULL. */
+    int (*open)(const char *arg);
+
+    int (*store)(const struct myproxy_creds *creds);
+    int (*retrieve)(struct myproxy_creds *creds);
+    int (*retrieve_all)(struct myproxy_creds *creds);
+    int (*remove)(const struct myproxy_creds *creds);
+    int (*lock)(const struct myproxy_creds *creds, const char *reason);
+    int (*unlock)(const struct myproxy_creds *creds);
+    int (*change_passphrase)(const struct myproxy_creds *creds,
+                             const char *new_passphrase);
+    int (*exist)(const char *username, const char *credname);
+
+    /* Rewrite the stored policy and metadata of an existing credential
+       from creds, leaving the credential itself alone. */
+    int (*update)(const struct myproxy_creds *creds);
+
+    /* Set the passphrase verifier of an existing credential, leaving
+       the rest of its record alone, but only if its stored key still
+       has the given SHA-256 digest.  Returns 0 without saving anything
+       if the key has changed. */
+    int (*set_verifier)(const char *username, const char *credname,
+                        const char *key_digest, const char *verifier);
+
+    /* Return (in allocated *path) a file holding the given credential
+       in PEM format. */
+    int (*credential_path)(const char *username, const char *credname,
+                           char **path);
+} myproxy_creds_backend_t;
+
+#if defined(HAVE_LIBSQLITE3)
+/* myproxy_creds_sqlite.c */
+extern const myproxy_creds_backend_t myproxy_creds_sqlite_backend;
+#endif
+
+#endif
@@ -0,0 +1,1035 @@
+/*
+ * myproxy_creds_sqlite.c
+ *
+ * SQLite credential storage backend.
+ *
+ * Each credential is one row of a single database (credentials.db in
+ * the storage directory by default), holding the credential itself
+ * along with its policy and metadata, so a store, lock, or passphrase
+ * change is one transaction instead of several files to keep in step.
+ * Since the SSL routines work on files, retrieved credentials are
+ * written out to a spool directory next to the database, named by the
+ * SHA-256 of their contents.
+ */
+
+#include "myproxy_common.h"	/* all needed headers included here */
+#include "myproxy_creds_backend.h"
+
+#if defined(HAVE_LIBSQLITE3)
+
+#include <sqlite3.h>
+
+#define SQLITE_DEFAULT_DB	"credentials.db"
+#define SQLITE_SPOOL_SUFFIX	".spool"
+#define MYPROXY_SQLITE_BUSY_MS	10000	/* milliseconds */
+
+static char *db_path = NULL;	/* as given to sqlite_open() */
+static char *spool_dir = NULL;
+static sqlite3 *db = NULL;
+static pid_t db_pid = 0;	/* process that opened db */
+
+static const char schema[] =
+    "CREATE TABLE IF NOT EXISTS credentials ("
+    " username TEXT NOT NULL,"
+    " credname TEXT NOT NULL DEFAULT '',"
+    " owner TEXT NOT NULL,"
+    " lifetime INTEGER NOT NULL DEFAULT 0,"
+    " description TEXT,"
+    " retrievers TEXT,"
+    " renewers TEXT,"
+    " keyretrievers TEXT,"
+    " trusted_retrievers TEXT,"
+    " start_time INTEGER NOT NULL DEFAULT 0,"
+    " end_time INTEGER NOT NULL DEFAULT 0,"
+    " subject TEXT,"
+    " fingerprint TEXT,"
+    " verifier TEXT,"
+    " lockmsg TEXT,"
+    " digest TEXT NOT NULL,"
+    " credential BLOB NOT NULL,"
+    " PRIMARY KEY (username, credname));"
+    "CREATE INDEX IF NOT EXISTS credentials_owner ON credentials (owner);"
+    "CREATE INDEX IF NOT EXISTS credentials_digest ON credentials (digest);";
+
+/* columns read by row_to_creds(), in order */
+#define CREDS_COLUMNS \
+    "username, credname, owner, lifetime, description, retrievers, " \
+    "renewers, keyretrievers, trusted_retrievers, start_time, end_time, " \
+    "subject, fingerprint, verifier, lockmsg, digest"
+#define CREDS_DIGEST_COLUMN	15
+
+/*
+ * sql_error()
+ *
+ * Report the last SQLite error on db.
+ */
+static void
+sql_error(const char *what)
+{
+    verror_put_string("%s: %s", what,
+                      db ? sqlite3_errmsg(db) : "no database connection");
+}
+
+/*
+ * db_connect()
+ *
+ * Open the database if this process hasn't already, creating it
+ * and the spool directory as needed.
+ */
+static int
+db_connect()
+{
+    const char *dir;
+    char *path = NULL;
+    mode_t old_umask;
+    int rc;
+
+    if (db && db_pid == getpid()) {
+        return 0;
+    }
+    /* A connection must not be used across fork(), and closing it
+       here could disturb the parent's locks, so just abandon it. */
+    db = NULL;
+
+    if (db_path) {
+        path = strdup(db_path);
+    } else {
+        if ((dir = myproxy_get_storage_dir()) == NULL) {
+            return -1;
+        }
+        path = malloc(strlen(dir)+strlen(SQLITE_DEFAULT_DB)+2);
+        if (path) {
+            sprintf(path, "%s/%s", dir, SQLITE_DEFAULT_DB);
+        }
+    }
+    if (path == NULL) {
+        verror_put_errno(errno);
+        return -1;
+    }
+
+    if (spool_dir == NULL) {
+        spool_dir = malloc(strlen(path)+strlen(SQLITE_SPOOL_SUFFIX)+1);
+        if (spool_dir == NULL) {
+            verror_put_errno(errno);
+            goto error;
+        }
+        sprintf(spool_dir, "%s%s", path, SQLITE_SPOOL_SUFFIX);
+    }
+
+    /* the database and its journal hold private keys */
+    old_umask = umask(077);
+    rc = sqlite3_open_v2(path, &db,
+                         SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL);
+    if (rc == SQLITE_OK && mkdir(spool_dir, 0700) < 0 && errno != EEXIST) {
+        umask(old_umask);
+        verror_put_errno(errno);
+        verror_put_string("creating %s", spool_dir);
+        goto error;
+    }
+    umask(old_umask);
+    if (rc != SQLITE_OK) {
+        verror_put_string("opening credential database %s", path);
+        sql_error("sqlite3_open_v2");
+        goto error;
+    }
+    sqlite3_busy_timeout(db, MYPROXY_SQLITE_BUSY_MS);
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL,
+                     NULL) != SQLITE_OK ||
+        sqlite3_exec(db, schema, NULL, NULL, NULL) != SQLITE_OK) {
+        verror_put_string("initializing credential database %s", path);
+        sql_error("sqlite3_exec");
+        goto error;
+    }
+    db_pid = getpid();
+    free(path);
+
+    return 0;
+
+  error:
+    if (db) {
+        sqlite3_close(db);
+        db = NULL;
+    }
+    free(path);
+
+    return -1;
+}
+
+/*
+ * prepare()
+ *
+ * Connect if needed and compile sql.
+ */
+static sqlite3_stmt *
+prepare(const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+
+    if (db_connect() == -1) {
+        return NULL;
+    }
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        sql_error("sqlite3_prepare_v2");
+        return NULL;
+    }
+
+    return stmt;
+}
+
+static int
+bind_text(sqlite3_stmt *stmt, int i, const char *value)
+{
+    if (value == NULL) {
+        return sqlite3_bind_null(stmt, i);
+    }
+    return sqlite3_bind_text(stmt, i, value, -1, SQLITE_TRANSIENT);
+}
+
+/* the default credential is stored with an empty credname */
+#define CREDNAME(c)	((c) ? (c) : "")
+
+static int
+begin()
+{
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+        sql_error("starting transaction");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+commit()
+{
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        sql_error("committing transaction");
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+rollback()
+{
+    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+}
+
+/*
+ * column_dup()
+ *
+ * Return an allocated copy of a text column, or NULL if it is NULL
+ * or (if empty_is_null) empty.
+ */
+static char *
+column_dup(sqlite3_stmt *stmt, int i, int empty_is_null)
+{
+    const char *value = (const char *)sqlite3_column_text(stmt, i);
+
+    if (value == NULL || (empty_is_null && value[0] == '\0')) {
+        return NULL;
+    }
+    return strdup(value);
+}
+
+static void
+replace(char **field, char *value)
+{
+    if (*field) free(*field);
+    *field = value;
+}
+
+/*
+ * row_to_creds()
+ *
+ * Fill in creds from a row of CREDS_COLUMNS.
+ */
+static void
+row_to_creds(sqlite3_stmt *stmt, struct myproxy_creds *creds)
+{
+    replace(&creds->username, column_dup(stmt, 0, 0));
+    replace(&creds->credname, column_dup(stmt, 1, 1));
+    replace(&creds->owner_name, column_dup(stmt, 2, 0));
+    creds->lifetime = sqlite3_column_int(stmt, 3);
+    replace(&creds->creddesc, column_dup(stmt, 4, 0));
+    replace(&creds->retrievers, column_dup(stmt, 5, 0));
+    replace(&creds->renewers, column_dup(stmt, 6, 0));
+    replace(&creds->keyretrieve, column_dup(stmt, 7, 0));
+    replace(&creds->trusted_retrievers, column_dup(stmt, 8, 0));
+    creds->start_time = (time_t)sqlite3_column_int64(stmt, 9);
+    creds->end_time = (time_t)sqlite3_column_int64(stmt, 10);
+    replace(&creds->subject, column_dup(stmt, 11, 0));
+    replace(&creds->fingerprint, column_dup(stmt, 12, 0));
+    replace(&creds->verifier, column_dup(stmt, 13, 0));
+    replace(&creds->lockmsg, column_dup(stmt, 14, 0));
+}
+
+/*
+ * spool_path()
+ *
+ * Return the allocated spool file path for a credential digest.
+ */
+static char *
+spool_path(const char *digest)
+{
+    char *path;
+
+    path = malloc(strlen(spool_dir)+strlen(digest)+2);
+    if (path == NULL) {
+        verror_put_errno(errno);
+        return NULL;
+    }
+    sprintf(path, "%s/%s", spool_dir, digest);
+
+    return path;
+}
+
+/*
+ * spool_write()
+ *
+ * Return the allocated path of the spool file for the credential with
+ * the given digest, writing it from the database if it isn't there.
+ */
+static char *
+spool_write(const char *digest)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *path = NULL, *tmp_path = NULL;
+    const void *blob;
+    int fd = -1, len;
+
+    if ((path = spool_path(digest)) == NULL) {
+        goto error;
+    }
+    if (access(path, R_OK) == 0) {
+        return path;
+    }
+
+    if ((stmt = prepare("SELECT credential FROM credentials "
+                        "WHERE digest = ?1 LIMIT 1")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, digest);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        verror_put_string("Credentials do not exist");
+        goto error;
+    }
+    blob = sqlite3_column_blob(stmt, 0);
+    len = sqlite3_column_bytes(stmt, 0);
+
+    tmp_path = malloc(strlen(path)+8);
+    if (tmp_path == NULL) {
+        verror_put_errno(errno);
+        goto error;
+    }
+    sprintf(tmp_path, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp_path)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", tmp_path);
+        free(tmp_path);
+        tmp_path = NULL;
+        goto error;
+    }
+    if (write(fd, blob, len) != len || fsync(fd) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("writing %s", tmp_path);
+        goto error;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(tmp_path, path) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("rename(%s,%s) failed", tmp_path, path);
+        goto error;
+    }
+    free(tmp_path);
+    sqlite3_finalize(stmt);
+
+    return path;
+
+  error:
+    if (fd >= 0) close(fd);
+    if (tmp_path) {
+        ssl_proxy_file_destroy(tmp_path);
+        free(tmp_path);
+    }
+    if (path) free(path);
+    sqlite3_finalize(stmt);
+
+    return NULL;
+}
+
+/*
+ * spool_release()
+ *
+ * Remove the spool file for digest unless a credential still has it.
+ */
+static void
+spool_release(const char *digest)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *path = NULL;
+
+    if (digest == NULL ||
+        (stmt = prepare("SELECT 1 FROM credentials "
+                        "WHERE digest = ?1 LIMIT 1")) == NULL) {
+        return;
+    }
+    bind_text(stmt, 1, digest);
+    if (sqlite3_step(stmt) == SQLITE_DONE &&
+        (path = spool_path(digest)) != NULL &&
+        access(path, F_OK) == 0) {
+        ssl_proxy_share_invalidate(path);
+        ssl_proxy_file_destroy(path);
+    }
+    sqlite3_finalize(stmt);
+    if (path) free(path);
+    verror_clear();
+}
+
+/*
+ * get_digest()
+ *
+ * Return the allocated digest of the given credential, or NULL
+ * (without setting verror) if there is no such credential.
+ */
+static char *
+get_digest(const char *username, const char *credname)
+{
+    sqlite3_stmt *stmt;
+    char *digest = NULL;
+
+    if ((stmt = prepare("SELECT digest FROM credentials "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        return NULL;
+    }
+    bind_text(stmt, 1, username);
+    bind_text(stmt, 2, CREDNAME(credname));
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        digest = column_dup(stmt, 0, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    return digest;
+}
+
+/*
+ * read_credential()
+ *
+ * Read the given file into an allocated buffer and compute its digest.
+ */
+static int
+read_credential(const char *path, unsigned char **buf, int *len,
+                char **digest)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0, i;
+
+    *buf = NULL;
+    *digest = NULL;
+    if (buffer_from_file(path, buf, len) < 0) {
+        verror_put_string("reading %s", path);
+        return -1;
+    }
+    if (EVP_Digest(*buf, *len, md, &md_len, EVP_sha256(), NULL) != 1 ||
+        (*digest = malloc(md_len*2+1)) == NULL) {
+        verror_put_string("computing digest of %s", path);
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+    for (i = 0; i < md_len; i++) {
+        sprintf(*digest+i*2, "%02x", md[i]);
+    }
+
+    return 0;
+}
+
+static int
+sqlite_open(const char *arg)
+{
+    char *path = NULL;
+
+    if (arg && arg[0]) {
+        if ((path = strdup(arg)) == NULL) {
+            verror_put_errno(errno);
+            return -1;
+        }
+    }
+    if (db && db_pid == getpid()) {
+        sqlite3_close(db);
+    }
+    db = NULL;
+    if (db_path) free(db_path);
+    db_path = path;
+    if (spool_dir) free(spool_dir);
+    spool_dir = NULL;
+
+    /* The server forks for each request, so there's nothing to gain
+       by connecting here; db_connect() is called on first use. */
+    return 0;
+}
+
+static int
+sqlite_store(const struct myproxy_creds *creds)
+{
+    struct myproxy_creds data_creds;
+    sqlite3_stmt *stmt = NULL;
+    unsigned char *buf = NULL;
+    char *digest = NULL, *old_digest = NULL;
+    int len = 0, return_code = -1;
+
+    if ((creds == NULL) ||
+        (creds->username == NULL) ||
+        (creds->owner_name == NULL) ||
+        (creds->location == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    /* as in the files backend, cache the certificate details */
+    data_creds = *creds;
+    data_creds.subject = data_creds.fingerprint = NULL;
+    if (ssl_get_cert_info(creds->location, &data_creds.start_time,
+                          &data_creds.end_time, &data_creds.subject,
+                          &data_creds.fingerprint) == -1) {
+        myproxy_debug("not caching certificate details for %s: %s",
+                      creds->location, verror_get_string());
+        verror_clear();
+    }
+
+    if (read_credential(creds->location, &buf, &len, &digest) == -1) {
+        goto error;
+    }
+
+    if ((stmt = prepare("INSERT OR REPLACE INTO credentials "
+                        "(username, credname, owner, lifetime, description, "
+                        "retrievers, renewers, keyretrievers, "
+                        "trusted_retrievers, start_time, end_time, subject, "
+                        "fingerprint, verifier, lockmsg, digest, credential) "
+                        "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, "
+                        "?11, ?12, ?13, NULL, ?14, ?15, ?16)")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+    bind_text(stmt, 3, creds->owner_name);
+    sqlite3_bind_int(stmt, 4, creds->lifetime);
+    bind_text(stmt, 5, creds->creddesc);
+    bind_text(stmt, 6, creds->retrievers);
+    bind_text(stmt, 7, creds->renewers);
+    bind_text(stmt, 8, creds->keyretrieve);
+    bind_text(stmt, 9, creds->trusted_retrievers);
+    sqlite3_bind_int64(stmt, 10, (sqlite3_int64)data_creds.start_time);
+    sqlite3_bind_int64(stmt, 11, (sqlite3_int64)data_creds.end_time);
+    bind_text(stmt, 12, data_creds.subject);
+    bind_text(stmt, 13, data_creds.fingerprint);
+    bind_text(stmt, 14, creds->lockmsg);
+    bind_text(stmt, 15, digest);
+    sqlite3_bind_blob(stmt, 16, buf, len, SQLITE_STATIC);
+
+    if (begin() == -1) {
+        goto error;
+    }
+    old_digest = get_digest(creds->username, creds->credname);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("storing credentials");
+        rollback();
+        goto error;
+    }
+    if (commit() == -1) {
+        goto error;
+    }
+
+    if (old_digest && strcmp(old_digest, digest)) {
+        spool_release(old_digest);
+    }
+    ssl_proxy_file_destroy(creds->location);
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+    if (buf) {
+        memset(buf, 0, len);
+        free(buf);
+    }
+    if (digest) free(digest);
+    if (old_digest) free(old_digest);
+    if (data_creds.subject) free(data_creds.subject);
+    if (data_creds.fingerprint) free(data_creds.fingerprint);
+
+    return return_code;
+}
+
+static int
+sqlite_retrieve(struct myproxy_creds *creds)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *digest = NULL;
+    int return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if ((stmt = prepare("SELECT " CREDS_COLUMNS " FROM credentials "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+    switch (sqlite3_step(stmt)) {
+    case SQLITE_ROW:
+        break;
+    case SQLITE_DONE:
+        verror_put_string("Credentials do not exist");
+        goto error;
+    default:
+        sql_error("Can't read credentials");
+        goto error;
+    }
+    row_to_creds(stmt, creds);
+    digest = column_dup(stmt, CREDS_DIGEST_COLUMN, 0);
+
+    replace(&creds->location, spool_write(digest));
+    if (creds->location == NULL) {
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+    if (digest) free(digest);
+
+    return return_code;
+}
+
+static int
+sqlite_retrieve_all(struct myproxy_creds *creds)
+{
+    sqlite3_stmt *stmt = NULL;
+    struct myproxy_creds *cur_cred = NULL, *new_cred = NULL;
+    char *username = NULL, *credname = NULL, *owner_name = NULL;
+    char *digest;
+    time_t start_time, end_time;
+    int rc, return_code = -1, numcreds = 0;
+
+    if (creds == NULL) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    /* stash query values, as files_retrieve_all() does */
+    username = creds->username;
+    creds->username = NULL;
+    owner_name = creds->owner_name;
+    creds->owner_name = NULL;
+    credname = creds->credname;
+    creds->credname = NULL;
+    start_time = creds->start_time;
+    creds->start_time = 0;
+    end_time = creds->end_time;
+    creds->end_time = 0;
+
+    /* the default credential (empty credname) sorts first */
+    if ((stmt = prepare("SELECT " CREDS_COLUMNS " FROM credentials "
+                        "WHERE (?1 IS NULL OR username = ?1) "
+                        "AND (?2 IS NULL OR owner = ?2) "
+                        "AND (?3 IS NULL OR credname = ?3) "
+                        "AND (?4 = 0 OR end_time >= ?4) "
+                        "AND (?5 = 0 OR end_time <= ?5) "
+                        "ORDER BY username, credname")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, username);
+    bind_text(stmt, 2, owner_name);
+    bind_text(stmt, 3, credname);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)start_time);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)end_time);
+
+    new_cred = creds;	/* the first cred goes in the caller's struct */
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (new_cred == NULL) {
+            if ((new_cred = malloc(sizeof(struct myproxy_creds))) == NULL) {
+                verror_put_errno(errno);
+                goto error;
+            }
+            memset(new_cred, 0, sizeof(struct myproxy_creds));
+            cur_cred->next = new_cred;
+        }
+        row_to_creds(stmt, new_cred);
+        /* like the files backend, name the credential without
+           writing it out; credential_path() or retrieve() will */
+        digest = column_dup(stmt, CREDS_DIGEST_COLUMN, 0);
+        replace(&new_cred->location, digest ? spool_path(digest) : NULL);
+        if (digest) free(digest);
+        cur_cred = new_cred;
+        new_cred = NULL;
+        numcreds++;
+    }
+    if (rc != SQLITE_DONE) {
+        sql_error("querying credentials");
+        goto error;
+    }
+
+    return_code = numcreds;
+
+  error:
+    sqlite3_finalize(stmt);
+    if (username) free(username);
+    if (owner_name) free(owner_name);
+    if (credname) free(credname);
+
+    return return_code;
+}
+
+static int
+sqlite_delete(const struct myproxy_creds *creds)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *digest = NULL;
+    int return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if ((stmt = prepare("DELETE FROM credentials "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+
+    if (begin() == -1) {
+        goto error;
+    }
+    digest = get_digest(creds->username, creds->credname);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("deleting credentials");
+        rollback();
+        goto error;
+    }
+    if (sqlite3_changes(db) == 0) {
+        rollback();
+        verror_put_string("Credentials do not exist.");
+        goto error;
+    }
+    if (commit() == -1) {
+        goto error;
+    }
+    spool_release(digest);
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+    if (digest) free(digest);
+
+    return return_code;
+}
+
+/*
+ * set_lockmsg()
+ *
+ * Set or (with NULL reason) clear the lock on a credential.
+ */
+static int
+set_lockmsg(const struct myproxy_creds *creds, const char *reason)
+{
+    sqlite3_stmt *stmt = NULL;
+    int return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if ((stmt = prepare("UPDATE credentials SET lockmsg = ?3 "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+    bind_text(stmt, 3, reason);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("updating credentials");
+        goto error;
+    }
+    if (sqlite3_changes(db) == 0) {
+        verror_put_string("Credentials do not exist.");
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+
+    return return_code;
+}
+
+static int
+sqlite_lock(const struct myproxy_creds *creds, const char *reason)
+{
+    if (reason == NULL) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+    return set_lockmsg(creds, reason);
+}
+
+static int
+sqlite_unlock(const struct myproxy_creds *creds)
+{
+    return set_lockmsg(creds, NULL);
+}
+
+static int
+sqlite_change_passphrase(const struct myproxy_creds *creds,
+                         const char *new_passphrase)
+{
+    sqlite3_stmt *stmt = NULL;
+    SSL_CREDENTIALS *ssl_creds = NULL;
+    char *old_digest = NULL, *path = NULL, *tmp_path = NULL;
+    char *digest = NULL;
+    unsigned char *buf = NULL;
+    int fd, len = 0, return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if ((old_digest = get_digest(creds->username,
+                                 creds->credname)) == NULL) {
+        verror_put_string("Credentials do not exist");
+        goto error;
+    }
+    if ((path = spool_write(old_digest)) == NULL) {
+        goto error;
+    }
+    if ((ssl_creds = ssl_credentials_new()) == NULL) {
+        goto error;
+    }
+    if (ssl_proxy_load_from_file(ssl_creds, path, creds->passphrase) !=
+        SSL_SUCCESS) {
+        goto error;
+    }
+
+    /* re-encrypt under the new passphrase */
+    tmp_path = myproxy_creds_path_template();
+    if ((fd = mkstemp(tmp_path)) < 0) {
+        verror_put_errno(errno);
+        verror_put_string("creating %s", tmp_path);
+        free(tmp_path);
+        tmp_path = NULL;
+        goto error;
+    }
+    /* ssl_proxy_store_to_file() creates the file exclusively */
+    close(fd);
+    unlink(tmp_path);
+    if (ssl_proxy_store_to_file(ssl_creds, tmp_path,
+                                (new_passphrase && new_passphrase[0]) ?
+                                new_passphrase : NULL) != SSL_SUCCESS) {
+        goto error;
+    }
+    if (read_credential(tmp_path, &buf, &len, &digest) == -1) {
+        goto error;
+    }
+
+    /* the verifier is for the old passphrase */
+    if ((stmt = prepare("UPDATE credentials SET credential = ?3, "
+                        "digest = ?4, verifier = NULL "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+    sqlite3_bind_blob(stmt, 3, buf, len, SQLITE_STATIC);
+    bind_text(stmt, 4, digest);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("updating credentials");
+        goto error;
+    }
+    spool_release(old_digest);
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+    ssl_credentials_destroy(ssl_creds);
+    if (tmp_path) {
+        if (access(tmp_path, F_OK) == 0) {
+            ssl_proxy_file_destroy(tmp_path);
+        }
+        free(tmp_path);
+    }
+    if (buf) {
+        memset(buf, 0, len);
+        free(buf);
+    }
+    if (old_digest) free(old_digest);
+    if (digest) free(digest);
+    if (path) free(path);
+
+    return return_code;
+}
+
+static int
+sqlite_exist(const char *username, const char *credname)
+{
+    char *digest;
+
+    if (username == NULL) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+    if (db_connect() == -1) {
+        return -1;
+    }
+    if ((digest = get_digest(username, credname)) == NULL) {
+        return 0;
+    }
+    free(digest);
+
+    return 1;
+}
+
+static int
+sqlite_update(const struct myproxy_creds *creds)
+{
+    sqlite3_stmt *stmt = NULL;
+    int return_code = -1;
+
+    if ((creds == NULL) || (creds->username == NULL) ||
+        (creds->owner_name == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    if ((stmt = prepare("UPDATE credentials SET owner = ?3, lifetime = ?4, "
+                        "description = ?5, retrievers = ?6, renewers = ?7, "
+                        "keyretrievers = ?8, trusted_retrievers = ?9, "
+                        "start_time = ?10, end_time = ?11, subject = ?12, "
+                        "fingerprint = ?13, verifier = ?14 "
+                        "WHERE username = ?1 AND credname = ?2")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, creds->username);
+    bind_text(stmt, 2, CREDNAME(creds->credname));
+    bind_text(stmt, 3, creds->owner_name);
+    sqlite3_bind_int(stmt, 4, creds->lifetime);
+    bind_text(stmt, 5, creds->creddesc);
+    bind_text(stmt, 6, creds->retrievers);
+    bind_text(stmt, 7, creds->renewers);
+    bind_text(stmt, 8, creds->keyretrieve);
+    bind_text(stmt, 9, creds->trusted_retrievers);
+    sqlite3_bind_int64(stmt, 10, (sqlite3_int64)creds->start_time);
+    sqlite3_bind_int64(stmt, 11, (sqlite3_int64)creds->end_time);
+    bind_text(stmt, 12, creds->subject);
+    bind_text(stmt, 13, creds->fingerprint);
+    bind_text(stmt, 14, creds->verifier);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("updating credentials");
+        goto error;
+    }
+    if (sqlite3_changes(db) == 0) {
+        verror_put_string("Credentials do not exist.");
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+
+    return return_code;
+}
+
+static int
+sqlite_set_verifier(const char *username, const char *credname,
+                    const char *key_digest, const char *verifier)
+{
+    sqlite3_stmt *stmt = NULL;
+    int return_code = -1;
+
+    if ((username == NULL) || (key_digest == NULL)) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+
+    /* no match if the credential was replaced or removed meanwhile */
+    if ((stmt = prepare("UPDATE credentials SET verifier = ?4 "
+                        "WHERE username = ?1 AND credname = ?2 "
+                        "AND digest = ?3")) == NULL) {
+        goto error;
+    }
+    bind_text(stmt, 1, username);
+    bind_text(stmt, 2, CREDNAME(credname));
+    bind_text(stmt, 3, key_digest);
+    bind_text(stmt, 4, verifier);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sql_error("updating credentials");
+        goto error;
+    }
+
+    /* Success */
+    return_code = 0;
+
+  error:
+    sqlite3_finalize(stmt);
+
+    return return_code;
+}
+
+static int
+sqlite_credential_path(const char *username, const char *credname,
+                       char **path)
+{
+    char *digest;
+
+    if (username == NULL || path == NULL) {
+        verror_put_errno(EINVAL);
+        return -1;
+    }
+    if (db_connect() == -1) {
+        return -1;
+    }
+    if ((digest = get_digest(username, credname)) == NULL) {
+        verror_put_string("Credentials do not exist");
+        return -1;
+    }
+    *path = spool_write(digest);
+    free(digest);
+
+    return (*path == NULL) ? -1 : 0;
+}
+
+const myproxy_creds_backend_t myproxy_creds_sqlite_backend = {
+    "sqlite",
+    sqlite_open,
+    sqlite_store,
+    sqlite_retrieve,
+    sqlite_retrieve_all,
+    sqlite_delete,
+    sqlite_lock,
+    sqlite_unlock,
+    sqlite_change_passphrase,
+    sqlite_exist,
+    sqlite_update,
+    sqlite_set_verifier,
+    sqlite_credential_path
+};
+
+#endif /* HAVE_LIBSQLITE3 */
@@ -121,6 +121,14 @@ int myproxy_get_delegation(
     }
 #endif
 
+    /* On a kept-alive connection the final response must be consumed
+       before the next request; it also says whether the server will
+       take one. */
+    if (client_request->keepalive &&
+        myproxy_recv_response(socket_attrs, server_response) < 0) {
+        return(1);
+    }
+
     if (outfile[0] == '-' && outfile[1] == '\0') {
         printf("%.*s", credential_len, credentials);
     } else {
@@ -146,3 +154,137 @@ int myproxy_get_delegation(
 
     return(0);
 }
+
+int myproxy_bulk_get_delegation(
+    myproxy_socket_attrs_t *socket_attrs,
+    myproxy_request_t      *client_request,
+    myproxy_response_t     *server_response)
+{
+    char *request_buffer = NULL;
+    char *response_buffer = NULL;
+    char error_string[1024];
+    int  requestlen, responselen, count = 0;
+    myproxy_bulk_entry_t *entry;
+    myproxy_response_t *entry_response;
+
+    assert(socket_attrs != NULL);
+    assert(client_request != NULL);
+    assert(server_response != NULL);
+
+    for (entry = client_request->bulk_entries; entry; entry = entry->next) {
+	count++;
+    }
+    if (count == 0) {
+	verror_put_string("no credentials in bulk request");
+	return(1);
+    }
+    if (count > MYPROXY_BULK_MAX_ENTRIES) {
+	verror_put_string("too many credentials in bulk request (%d > %d)",
+			  count, MYPROXY_BULK_MAX_ENTRIES);
+	return(1);
+    }
+    client_request->command_type = MYPROXY_BULK_GET_PROXY;
+    if (client_request->username == NULL) {
+	client_request->username = strdup("");
+    }
+
+    /* Set up client socket attributes */
+    if (socket_attrs->gsi_socket == NULL) {
+	if (myproxy_init_client(socket_attrs) < 0) {
+	    return(1);
+	}
+    }
+
+    GSI_SOCKET_allow_anonymous(socket_attrs->gsi_socket, 1);
+
+    /* Authenticate client to server */
+    if (GSI_SOCKET_context_established(socket_attrs->gsi_socket) == 0) {
+	if (myproxy_authenticate_init(socket_attrs, NULL) < 0) {
+	    return(1);
+	}
+    }
+
+    /* Serialize client request object */
+    requestlen = myproxy_serialize_request_ex(client_request, &request_buffer);
+    if (requestlen < 0) {
+        return(1);
+    }
+
+    /* Send request to the myproxy-server */
+    if (myproxy_send(socket_attrs, request_buffer, requestlen) < 0) {
+	free(request_buffer);
+        return(1);
+    }
+    free(request_buffer);
+    request_buffer = NULL;
+
+    /* Continue unless the response is not OK */
+    if (myproxy_recv_response_ex(socket_attrs, server_response,
+				 client_request) != 0) {
+	return(1);
+    }
+
+    /* Send one certificate request per entry, all at once */
+    if (GSI_SOCKET_delegation_request_batch(socket_attrs->gsi_socket,
+					    count) == GSI_SOCKET_ERROR) {
+	GSI_SOCKET_get_error_string(socket_attrs->gsi_socket, error_string,
+				    sizeof(error_string));
+	verror_put_string("Error sending certificate requests: %s\n",
+			  error_string);
+	return(1);
+    }
+
+    /* Each entry gets its own response, followed by its certificate
+       chain if the response is OK. */
+    for (entry = client_request->bulk_entries; entry; entry = entry->next) {
+	responselen = myproxy_recv_ex(socket_attrs, &response_buffer);
+	if (responselen <= 0) {
+	    if (responselen == 0) {
+		verror_put_string("Server closed connection.\n");
+	    }
+	    return(1);
+	}
+	entry_response = malloc(sizeof(*entry_response));
+	memset(entry_response, 0, sizeof(*entry_response));
+	if (myproxy_deserialize_response(entry_response, response_buffer,
+					 responselen) < 0) {
+	    free(response_buffer);
+	    myproxy_free(NULL, NULL, entry_response);
+	    return(1);
+	}
+	free(response_buffer);
+	response_buffer = NULL;
+
+	entry->response_type = entry_response->response_type;
+	if (entry->response_type == MYPROXY_OK_RESPONSE) {
+	    if (GSI_SOCKET_delegation_accept_batch(socket_attrs->gsi_socket,
+				   (unsigned char **)&entry->credentials,
+				   &entry->credentials_len,
+				   NULL) == GSI_SOCKET_ERROR) {
+		GSI_SOCKET_get_error_string(socket_attrs->gsi_socket,
+					    error_string,
+					    sizeof(error_string));
+		verror_put_string("Error accepting delegated credentials "
+				  "for %s: %s\n", entry->username,
+				  error_string);
+		myproxy_free(NULL, NULL, entry_response);
+		return(1);
+	    }
+	} else {
+	    entry->response_type = MYPROXY_ERROR_RESPONSE;
+	    entry->error_string = entry_response->error_string ?
+		strdup(entry_response->error_string) : NULL;
+	    GSI_SOCKET_delegation_accept_batch(socket_attrs->gsi_socket,
+					       NULL, NULL, NULL);
+	}
+	myproxy_free(NULL, NULL, entry_response);
+    }
+
+    /* Final response; also says whether the server will take
+       another request on this connection. */
+    if (myproxy_recv_response(socket_attrs, server_response) < 0) {
+	return(1);
+    }
+
+    return(0);
+}
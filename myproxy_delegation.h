@@ -17,6 +17,23 @@ int myproxy_get_delegation(
     myproxy_response_t     *server_response,
     char                   *outfile);
 
+/*
+ * myproxy_bulk_get_delegation()
+ *
+ * Retrieve a proxy for every credential listed in
+ * client_request->bulk_entries over a single connection.  The outcome
+ * for each credential is left in its entry: response_type, and either
+ * error_string or the PEM-encoded proxy and unencrypted private key in
+ * credentials.
+ *
+ * Returns 0 if the request completed (even if some entries failed),
+ * 1 on error.
+ */
+int myproxy_bulk_get_delegation(
+    myproxy_socket_attrs_t *socket_attrs,
+    myproxy_request_t      *client_request,
+    myproxy_response_t     *server_response);
+
 int myproxy_set_delegation_defaults(
     myproxy_socket_attrs_t *socket_attrs,
     myproxy_request_t      *client_request);
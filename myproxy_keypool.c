@@ -0,0 +1,194 @@
+/*
+ * myproxy-keypool
+ *
+ * Pre-generate key pairs for myproxy-logon and the MyProxy client library
+ */
+
+#include "myproxy_common.h"	/* all needed headers included here */
+
+static char usage[] = \
+"\n"
+"Syntax: myproxy-keypool [-d directory] [-n count] [-t type] [-b bits] [-w secs]\n"
+"        myproxy-keypool [-usage|-help] [-version]\n"
+"\n"
+"   Options\n"
+"       -h | --help                       Displays usage\n"
+"       -u | --usage                                    \n"
+"                                                      \n"
+"       -v | --verbose                    Display debugging messages\n"
+"       -V | --version                    Displays version\n"
+"       -d | --directory       <path>     Key pool directory\n"
+"                                         (default $MYPROXY_KEYPOOL)\n"
+"       -n | --count           <count>    Number of keys to keep in the pool\n"
+"       -t | --keytype         <type>     rsa, p256, p384, or ed25519\n"
+"                                         (default $MYPROXY_KEYTYPE or rsa)\n"
+"       -b | --bits            <bits>     RSA key size\n"
+"                                         (default $MYPROXY_KEYBITS or 2048)\n"
+"       -w | --watch           <secs>     Keep running, refilling the pool\n"
+"                                         every <secs> seconds\n"
+"       -q | --quiet                      Only output on error\n"
+"\n";
+
+struct option long_options[] =
+{
+    {"help",                   no_argument, NULL, 'h'},
+    {"usage",                  no_argument, NULL, 'u'},
+    {"verbose",                no_argument, NULL, 'v'},
+    {"version",                no_argument, NULL, 'V'},
+    {"directory",        required_argument, NULL, 'd'},
+    {"count",            required_argument, NULL, 'n'},
+    {"keytype",          required_argument, NULL, 't'},
+    {"bits",             required_argument, NULL, 'b'},
+    {"watch",            required_argument, NULL, 'w'},
+    {"quiet",                  no_argument, NULL, 'q'},
+    {0, 0, 0, 0}
+};
+
+static char short_options[] = "huvVd:n:t:b:w:q";
+
+static char version[] =
+"myproxy-keypool version " MYPROXY_VERSION " (" MYPROXY_VERSION_DATE ") "  "\n";
+
+#define DEFAULT_POOL_SIZE	10
+
+static char *pooldir = NULL;
+static char *keytype = NULL;
+static int keybits = MYPROXY_DEFAULT_KEYBITS;
+static int count = DEFAULT_POOL_SIZE;
+static int watch = 0;
+static int quiet = 0;
+
+void init_arguments(int argc, char *argv[]);
+
+/*
+ * Use setvbuf() instead of setlinebuf() since cygwin doesn't support
+ * setlinebuf().
+ */
+#define my_setlinebuf(stream)	setvbuf((stream), (char *) NULL, _IOLBF, 0)
+
+int
+main(int argc, char *argv[])
+{
+    int added;
+
+    /* check library version */
+    if (myproxy_check_version()) {
+	fprintf(stderr, "MyProxy library version mismatch.\n"
+		"Expecting %s.  Found %s.\n",
+		MYPROXY_VERSION_DATE, myproxy_version(0,0,0));
+	exit(1);
+    }
+
+    myproxy_log_use_stream (stderr);
+
+    my_setlinebuf(stdout);
+    my_setlinebuf(stderr);
+
+    if (getenv("MYPROXY_KEYPOOL")) {
+	pooldir = strdup(getenv("MYPROXY_KEYPOOL"));
+    }
+    if (getenv("MYPROXY_KEYTYPE")) {
+	keytype = strdup(getenv("MYPROXY_KEYTYPE"));
+    } else {
+	keytype = strdup(MYPROXY_DEFAULT_KEYTYPE);
+    }
+    if (getenv("MYPROXY_KEYBITS")) {
+	keybits = atoi(getenv("MYPROXY_KEYBITS"));
+    }
+
+    init_arguments(argc, argv);
+
+    /* Create the pool on first use. */
+    if (mkdir(pooldir, 0700) < 0 && errno != EEXIST) {
+	fprintf(stderr, "Unable to create %s: %s\n", pooldir,
+		strerror(errno));
+	exit(1);
+    }
+
+    do {
+	added = ssl_keypool_fill(pooldir, keytype, keybits, count);
+	if (added < 0) {
+	    verror_print_error(stderr);
+	    exit(1);
+	}
+	if (added > 0 && !quiet) {
+	    printf("Added %d %s key%s to %s.\n", added, keytype,
+		   (added == 1) ? "" : "s", pooldir);
+	}
+	if (watch) {
+	    sleep(watch);
+	}
+    } while (watch);
+
+    return 0;
+}
+
+void
+init_arguments(int argc,
+	       char *argv[])
+{
+    extern char *optarg;
+    int arg;
+
+    while((arg = getopt_long(argc, argv, short_options,
+				 long_options, NULL)) != EOF)
+    {
+        switch(arg)
+        {
+        case 'd': 	/* key pool directory */
+	    if (pooldir) free(pooldir);
+	    pooldir = strdup(optarg);
+            break;
+        case 'n': 	/* pool size */
+            count = atoi(optarg);
+            break;
+        case 't': 	/* key type */
+	    free(keytype);
+	    keytype = strdup(optarg);
+            break;
+        case 'b': 	/* RSA key size */
+            keybits = atoi(optarg);
+            break;
+        case 'w': 	/* refill interval */
+            watch = atoi(optarg);
+	    if (watch < 1) {
+		fprintf(stderr, "-w requires a positive number of seconds\n");
+		exit(1);
+	    }
+            break;
+	case 'h': 	/* print help and exit */
+        case 'u': 	/* print help and exit */
+            printf("%s", usage);
+            exit(0);
+            break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	case 'v':
+	    myproxy_debug_set_level(1);
+	    break;
+        case 'V':       /* print version and exit */
+            printf("%s", version);
+            exit(0);
+            break;
+        default:        /* print usage and exit */
+            fprintf(stderr, "%s", usage);
+	    exit(1);
+	    break;
+        }
+    }
+
+    if (optind != argc) {
+	fprintf(stderr, "%s: invalid option -- %s\n", argv[0],
+		argv[optind]);
+	fprintf(stderr, "%s", usage);
+	exit(1);
+    }
+
+    if (pooldir == NULL) {
+	fprintf(stderr, "Unspecified key pool. Please set the MYPROXY_KEYPOOL environment variable\nor set the key pool directory via the -d flag.\n");
+	exit(1);
+    }
+
+    return;
+}
@@ -16,7 +16,8 @@ typedef enum
     MYPROXY_CHANGE_CRED_PASSPHRASE,
     MYPROXY_STORE_CERT,
     MYPROXY_RETRIEVE_CERT,
-    MYPROXY_GET_TRUSTROOTS
+    MYPROXY_GET_TRUSTROOTS,
+    MYPROXY_BULK_GET_PROXY
 } myproxy_proto_request_type_t;
 
 /* server response codes */
@@ -34,8 +35,23 @@ typedef struct myproxy_socket_attrs_s
   int psport;
   int socket_fd;
   struct _gsi_socket *gsi_socket; 
+  int keepalive;	/* server will take another request on gsi_socket */
 } myproxy_socket_attrs_t;
 
+/* One credential named in a MYPROXY_BULK_GET_PROXY request */
+typedef struct myproxy_bulk_entry_s
+{
+    char                         *username;
+    char                         *credname; /* NULL for the default */
+    char                         passphrase[MAX_PASS_LEN+1];
+    /* set by myproxy_bulk_get_delegation() */
+    myproxy_proto_response_type_t response_type;
+    char                         *error_string;
+    char                         *credentials; /* PEM proxy and key */
+    int                          credentials_len;
+    struct myproxy_bulk_entry_s  *next;
+} myproxy_bulk_entry_t;
+
 /* A client request object */
 #define REGULAR_EXP 1
 #define MATCH_CN_ONLY 0
@@ -59,6 +75,8 @@ typedef struct
     char                         *voname;
     char                         *vomses;
     char                         *certreq;
+    int                          keepalive; /* 1=keep connection open */
+    myproxy_bulk_entry_t         *bulk_entries; /* MYPROXY_BULK_GET_PROXY */
 } myproxy_request_t;
 
 /* A server response object */
@@ -70,6 +88,7 @@ typedef struct
   char				*error_string;
   myproxy_creds_t		*info_creds;
   myproxy_certs_t               *trusted_certs;
+  int                           keepalive; /* 1=send next request */
 } myproxy_response_t;
 
   
@@ -230,6 +249,26 @@ int myproxy_init_delegation(myproxy_socket_attrs_t *attrs,
 			    const int lifetime_seconds,
 			    char *passphrase);
 
+/*
+ * myproxy_sign_delegation()
+ *
+ * Signs a certificate request already received from the client with
+ * the credentials found in file location delegfile, good for
+ * lifetime_seconds, and returns the certificate chain in a newly
+ * allocated buffer instead of sending it.
+ * The caller must deallocate the buffer.
+ *
+ * returns 0 on success, -1 on error 
+ */
+int myproxy_sign_delegation(myproxy_socket_attrs_t *attrs,
+			    const char *delegfile,
+			    const int lifetime_seconds,
+			    char *passphrase,
+			    const char *certreq,
+			    const int certreq_len,
+			    char **chain,
+			    int *chain_len);
+
 /*
  * myproxy_accept_delegation()
  *
@@ -388,4 +427,26 @@ int myproxy_request_add_voname(myproxy_request_t *client_request,
 int myproxy_request_add_vomses(myproxy_request_t *client_request, 
                                const char *vomses);
 
+/*
+ * myproxy_request_add_bulk_entry()
+ *
+ * Adds a credential to a MYPROXY_BULK_GET_PROXY request.
+ * credname and passphrase may be NULL.
+ * returns 0 if succesful, otherwise -1
+ *
+ */
+int myproxy_request_add_bulk_entry(myproxy_request_t *client_request,
+                                   const char *username,
+                                   const char *credname,
+                                   const char *passphrase);
+
+/*
+ * myproxy_bulk_entries_free()
+ *
+ * Frees a list of bulk GET entries, including any credentials
+ * retrieved for them.
+ *
+ */
+void myproxy_bulk_entries_free(myproxy_bulk_entry_t *entries);
+
 #endif /* __MYPROXY_PROTOCOL_H */
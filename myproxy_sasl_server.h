@@ -15,6 +15,7 @@ auth_sasl_negotiate_server(myproxy_socket_attrs_t *attrs,
 
 extern int myproxy_sasl_authenticated; /* set to 1 after success */
 
+/* Point into the active server configuration; not owned here. */
 extern char *myproxy_sasl_mech; /* force a SASL mechanism */
 
 /* for sasl_server_new(3) */
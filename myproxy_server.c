@@ -14,6 +14,10 @@
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 #endif
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 int have_voms = 0;
 void (*get_voms_proxy_impl)();
 
@@ -73,9 +77,9 @@ int init_arguments(int argc,
                    myproxy_socket_attrs_t *server_attrs, 
                    myproxy_server_context_t *server_context);
 
-int myproxy_init_server(myproxy_socket_attrs_t *server_attrs);
+int myproxy_init_server(myproxy_socket_attrs_t *server_attrs, int reuseport);
 
-int handle_config(myproxy_server_context_t *server_context);
+int handle_config(myproxy_server_context_t **server_context);
 
 int handle_client(myproxy_socket_attrs_t *server_attrs, 
                   myproxy_server_context_t *server_context);
@@ -121,6 +125,19 @@ static int become_daemon_step3(char);
 
 static void write_pfile(const char path[], long val);
 
+static int prefork_server(myproxy_server_context_t **server_context,
+                          struct pidfh *pfh,
+                          sigset_t *mysigset);
+
+static void reaper_check(myproxy_server_context_t **server_context,
+                         struct pidfh *pfh);
+
+static void callout_check(myproxy_server_context_t *context);
+
+static int listener_supervisor(myproxy_server_context_t **server_context,
+                               struct pidfh **pfh,
+                               sigset_t *mysigset);
+
 static int myproxy_check_policy(myproxy_server_context_t *context,
       				myproxy_socket_attrs_t *attrs,
 				myproxy_server_peer_t *client,
@@ -159,6 +176,12 @@ void get_credentials(myproxy_socket_attrs_t *attrs,
                      myproxy_response_t     *response,
                      int                     max_proxy_lifetime);
 
+/* Delegate each credential named in a bulk GET request */
+static void bulk_get_proxy(myproxy_socket_attrs_t *attrs,
+                           myproxy_server_context_t *context,
+                           myproxy_server_peer_t *client,
+                           myproxy_request_t *request);
+
 /* Accept end-entity credentials from client */
 void put_credentials(myproxy_socket_attrs_t *attrs,
                      myproxy_creds_t        *creds,
@@ -174,11 +197,74 @@ void check_and_store_credentials(const char              path[],
 
 static int debug = 0;
 static int readconfig = 1;      /* do we need to read config file? */
+static int config_generation = 0; /* number of configurations loaded */
+static struct stat config_stat; /* config file as of last read */
+
+/* reuseport_listeners: pids of listener processes, by index */
+static pid_t listener_pids[MYPROXY_MAX_LISTENERS];
+static struct sockaddr_storage listener_addr;  /* address they bind to */
+static socklen_t listener_addrlen = 0;
+/* was listenfd bound for listener processes?  -1 before it is bound
+   and in the listeners themselves */
+static int listener_reuseport = -1;
 static int cleanshutdown = 0;   /* should we shutdown? */
+static int reaper_parent = 0;   /* do we start the credential reaper? */
+static pid_t reaper_pid = 0;    /* credential reaper process */
+static time_t reaper_started = 0;
+static int reaper_failed = 0;   /* did it exit abnormally? */
+static int callout_parent = 0;  /* do we run the CA call-out helpers? */
+static int callout_generation = 0; /* configuration they were started for */
 static int caonly = 0;          /* CA-only mode */
 static int startup_pipe[2];
 static int listenfd = -1;
 
+/* Prefork worker pool scoreboard, shared between parent and workers.
+   The parent sets generation and state before fork() and pid after;
+   workers only update their own state.  sig_chld() frees the slot. */
+#define PREFORK_SLOT_STARTING 0
+#define PREFORK_SLOT_IDLE     1
+#define PREFORK_SLOT_BUSY     2
+
+typedef struct prefork_slot_s {
+    volatile pid_t pid;
+    volatile int   state;
+    volatile int   generation;
+} prefork_slot_t;
+
+static prefork_slot_t *scoreboard = NULL;
+static int prefork_generation = 0;  /* bumped on config reload */
+
+/* A request error ends the worker that hit it, as it would end a
+   forked child (see respond_with_error_and_die()), and the pool
+   replaces it.  sig_chld() counts those exits so the pool can hold
+   replacements to MYPROXY_PREFORK_RESPAWN_RATE a second while clients
+   keep failing, rather than forking for every bad request. */
+static volatile sig_atomic_t prefork_failed = 0;
+
+/* Connection reactor (prefork_reactor): the parent holds accepted
+   connections in epoll until the client sends data, then passes them
+   over a per-worker channel to a worker that has asked for one.  Only
+   the wait for the first data is taken off the workers; the TLS
+   handshake and the request are still served by a worker. */
+typedef struct reactor_conn_s {
+    int    fd;                      /* -1 if slot is free */
+    int    queued;                  /* data waiting, queued for a worker */
+    time_t deadline;                /* close if still silent by then */
+} reactor_conn_t;
+
+static int  prefork_chan[MYPROXY_PREFORK_WORKER_LIMIT]; /* parent's end */
+static char prefork_wants_conn[MYPROXY_PREFORK_WORKER_LIMIT];
+static int  worker_chan = -1;       /* worker's end of its channel */
+static int  reactor_epfd = -1;
+static int  reactor_listening = 0;
+static reactor_conn_t *reactor_conns = NULL;
+static int *reactor_free = NULL;    /* stack of free reactor_conns slots */
+static int *reactor_ready = NULL;   /* FIFO of slots ready for a worker */
+static int  reactor_size = 0;
+static int  reactor_count = 0;
+static int  reactor_ready_head = 0;
+static int  reactor_ready_len = 0;
+
 int
 main(int argc, char *argv[]) 
 {    
@@ -187,7 +273,9 @@ main(int argc, char *argv[])
     socklen_t client_addr_len = sizeof(client_addr);
     sigset_t mysigset;
     struct pidfh *pfh = NULL;
+    struct pollfd pfd;
     void * voms_lib_handle;
+    int engine_signers = 0;
 
     myproxy_socket_attrs_t         *socket_attrs;
     myproxy_server_context_t       *server_context;
@@ -266,8 +354,16 @@ main(int argc, char *argv[])
     my_signal(SIGINT,  sig_exit); 
     sigaddset(&mysigset, SIGINT);
 
+    /* Make the TLS session ticket keys before any fork, so every
+       server process accepts the tickets issued by the others, even
+       if session_resumption is only turned on by a later reload. */
+    if (GSI_SOCKET_init_session_tickets() != GSI_SOCKET_SUCCESS) {
+        myproxy_log_verror();
+        verror_clear();
+    }
+
     /* Read my configuration */
-    if (handle_config(server_context) < 0) {
+    if (handle_config(&server_context) < 0) {
         myproxy_log_verror();
         myproxy_log("Exiting.");
         exit(1);
@@ -286,7 +382,69 @@ main(int argc, char *argv[])
         }
     }
 
-    if(server_context->certificate_openssl_engine_id) {
+    /* Finish any changes interrupted by a crash, and start or stop
+       journaling, before the catalog is checked. */
+    if (!caonly &&
+        myproxy_creds_journal_check(server_context->storage_journal) < 0) {
+        myproxy_log_verror();
+        myproxy_log("Exiting.  Please fix errors with the credential journal and restart.");
+        exit(1);
+    }
+
+    /* Map the metadata cache before forking, so workers share it. */
+    if (!caonly && server_context->credential_cache_size &&
+        myproxy_creds_cache_init(server_context->credential_cache_size) < 0) {
+        myproxy_log_verror();
+        myproxy_log("Continuing without the credential cache.");
+        verror_clear();
+    }
+
+    /* Also before forking, so all server processes share loads.  The
+       signing key cache coalesces concurrent loads too. */
+    if (!caonly && server_context->signing_key_cache_size) {
+        if (ssl_proxy_share_init(server_context->signing_key_cache_size,
+                                 server_context->signing_key_cache_ttl)
+            == SSL_ERROR) {
+            myproxy_log_verror();
+            myproxy_log("Continuing without the signing key cache.");
+            verror_clear();
+        }
+    } else if (!caonly && server_context->coalesce_get_requests &&
+        ssl_proxy_share_init(MYPROXY_COALESCE_SLOTS, 0) == SSL_ERROR) {
+        myproxy_log_verror();
+        myproxy_log("Continuing without coalescing credential loads.");
+        verror_clear();
+    }
+
+    /* Build the credential catalog before we start taking requests. */
+    if (!caonly && server_context->credential_catalog &&
+        myproxy_creds_catalog_check() < 0) {
+        myproxy_log_verror();
+        myproxy_log("Continuing without the credential catalog.");
+        verror_clear();
+    }
+
+    /* Map the serial number block before forking, even if blocks are
+       only turned on by a later reload. */
+    if (is_certificate_authority_configured(server_context) &&
+        certauth_serial_init() < 0) {
+        myproxy_log_verror();
+        myproxy_log("Reserving CA serial numbers one at a time.");
+        verror_clear();
+    }
+
+    /* Likewise the call-out helper table. */
+    if (myproxy_coproc_init() < 0) {
+        myproxy_log_verror();
+        myproxy_log("Running CA call-outs once per request.");
+        verror_clear();
+    } else if (server_context->run_as_daemon &&
+               server_context->certificate_openssl_engine_sessions > 0) {
+        engine_signers = 1;
+    }
+
+    /* With engine sessions, the signing helpers open the engine. */
+    if(server_context->certificate_openssl_engine_id && !engine_signers) {
         if(!initialise_openssl_engine(server_context)) {
             myproxy_log_verror();
             my_failure("Could not initialise OpenSSL engine.");
@@ -309,7 +467,9 @@ main(int argc, char *argv[])
     } else {    
        /* Initialize the server before becoming a daemon to catch
           errors before exit of parent process. */
-       listenfd = myproxy_init_server(socket_attrs);
+       listener_reuseport = (server_context->reuseport_listeners > 1 &&
+                             !debug);
+       listenfd = myproxy_init_server(socket_attrs, listener_reuseport);
 
        /* Run as a daemon */
         if (!debug) {
@@ -360,9 +520,37 @@ main(int argc, char *argv[])
            become_daemon_step3(0); /* all done with initialization */
        }
 
+       /* So do the persistent CA call-out helpers. */
+       callout_parent = 1;
+       callout_check(server_context);
+
+       /* The expired-credential reaper runs beside whichever loop
+          below serves requests; this process keeps it running. */
+       if (!caonly && !debug) {
+           reaper_parent = 1;
+           reaper_check(&server_context, pfh);
+       }
+
+       /* With reuseport_listeners, this process just supervises the
+          listener processes, each of which runs the loop below on its
+          own SO_REUSEPORT socket.  Returns 1 in a listener process. */
+       if (server_context->reuseport_listeners > 1 && !debug) {
+           if (listener_supervisor(&server_context, &pfh, &mysigset) == 0) {
+               goto parent_exit;
+           }
+       }
+
        /* Set up concurrent server */
        while (1) {
 
+	  /* Hand off to the worker pool if configured.  Returns 1 if a
+	     config reload disabled prefork mode. */
+	  if (server_context->prefork_min_workers > 0 && !debug) {
+	     if (prefork_server(&server_context, pfh, &mysigset) == 0) {
+		goto parent_exit;
+	     }
+	  }
+
 	  /* make sure Globus hasn't blocked signals we care about */
 #ifdef HAVE_PTHREAD_SIGMASK
 	  pthread_sigmask(SIG_UNBLOCK, &mysigset, NULL);
@@ -370,14 +558,22 @@ main(int argc, char *argv[])
 	  sigprocmask(SIG_UNBLOCK, &mysigset, NULL);
 #endif
 
-	  socket_attrs->socket_fd = accept(listenfd,
-					   (struct sockaddr *) &client_addr,
-					   &client_addr_len);
+	  /* wake at least once a second, so the checks below run
+	     even while no client connects */
+	  pfd.fd = listenfd;
+	  pfd.events = POLLIN;
+	  if (poll(&pfd, 1, 1000) > 0) {
+	     socket_attrs->socket_fd = accept(listenfd,
+					      (struct sockaddr *) &client_addr,
+					      &client_addr_len);
+	  } else {
+	     socket_attrs->socket_fd = -1;
+	     errno = EINTR;	/* just run the checks */
+	  }
       if (cleanshutdown) goto parent_exit;
-     if (handle_config(server_context) < 0) {
-          myproxy_log_verror();
-          my_failure("error in handle_config()");
-      }
+      handle_config(&server_context);
+      reaper_check(&server_context, pfh);
+      callout_check(server_context);
 	  if (socket_attrs->socket_fd < 0) {
 	     if (errno == EINTR) {
 		continue; 
@@ -425,11 +621,18 @@ main(int argc, char *argv[])
 	  if (handle_client(socket_attrs, server_context) < 0) {
 	     my_failure_chld("error in handle_client()");
 	  } 
+#ifdef HAVE_GLOBUS_USAGE
+	  myproxy_usage_stats_close(server_context);
+#endif
 	  _exit(0);
        }
     }
 
  parent_exit:
+    if (reaper_pid > 0) {
+        kill(reaper_pid, SIGTERM);
+    }
+    myproxy_coproc_stop();
     pidfile_remove(pfh);
 #ifdef HAVE_GLOBUS_USAGE
     myproxy_usage_stats_close(server_context);
@@ -437,65 +640,281 @@ main(int argc, char *argv[])
     return 0;
 }   
 
-int
-handle_config(myproxy_server_context_t *server_context)
+/*
+ * config_file_changed()
+ *
+ * Returns 1 if the configuration file has been modified or replaced
+ * since it was last read, 0 otherwise.
+ */
+static int
+config_file_changed(myproxy_server_context_t *server_context)
 {
-    if (readconfig) {
-#ifdef HAVE_GLOBUS_USAGE
-        /* Clear usage metrics  */
-        myproxy_usage_stats_close(server_context);
-#endif
+    struct stat st;
+
+    if (server_context->config_file == NULL ||
+        stat(server_context->config_file, &st) < 0) {
+        return 0;               /* keep what we have */
+    }
+
+    return (st.st_mtime != config_stat.st_mtime ||
+            st.st_size != config_stat.st_size ||
+            st.st_ino != config_stat.st_ino ||
+            st.st_dev != config_stat.st_dev);
+}
+
+/*
+ * read_config()
+ *
+ * (Re-)read the configuration file if SIGHUP was received or the file
+ * has changed.  The new configuration is parsed into a fresh context
+ * and swapped in only if it is valid, so *server_context always
+ * points to a complete configuration.  If a reload fails, the error is
+ * logged and the current configuration stays in effect.  Reopens the
+ * log if the syslog settings are given, but applies nothing else.
+ *
+ * Returns 1 if a new configuration was loaded, 0 if not, and -1 if
+ * the initial configuration could not be read.
+ */
+static int
+read_config(myproxy_server_context_t **server_context)
+{
+    myproxy_server_context_t *old = *server_context;
+    myproxy_server_context_t *new = NULL;
+    struct stat st;
+    int have_st;
+
+    if (config_generation > 0 && !readconfig && !config_file_changed(old)) {
+        return 0;
+    }
+    readconfig = 0;         /* reset the flag now that we're reading it */
+
+    if (config_generation == 0) {
+        new = old;          /* initial read fills in the context from main */
+    } else {
+        new = malloc(sizeof(*new));
+        memset(new, 0, sizeof(*new));
+        new->my_name = old->my_name;
+        new->run_as_daemon = old->run_as_daemon;
+        new->config_file = old->config_file;
+        new->pidfile = old->pidfile;
+        new->portfile = old->portfile;
+    }
 
-        if (myproxy_server_config_read(server_context) == -1) {
+    /* stat before reading, so edits made while we parse are noticed */
+    memset(&st, 0, sizeof(st));
+    have_st = (new->config_file && stat(new->config_file, &st) == 0);
+
+    if (myproxy_server_config_read(new) == -1) {
+        if (config_generation == 0) {
             return -1;
         }
-        readconfig = 0;         /* reset the flag now that we've read it */
+        myproxy_log_verror();
+        myproxy_log("error reading %s, keeping current configuration",
+                    new->config_file);
+        verror_clear();
+        myproxy_server_clear_context(new);
+        free(new);
+        config_stat = st;   /* don't retry until the file changes again */
+        return 0;
+    }
+    if (!have_st) {         /* default config_file found by the read */
+        stat(new->config_file, &st);
+    }
+    config_stat = st;
+
+    if (new != old) {
+#ifdef HAVE_GLOBUS_USAGE
+        /* Clear usage metrics  */
+        myproxy_usage_stats_close(old);
+#endif
+        myproxy_server_clear_context(old);
+        free(old);
+        *server_context = new;
+    }
+    config_generation++;
 
     /* Check to see if config file had syslog_ident
        or syslog_facility specified.
        If so, then re-open the syslog with the new name.       */
     if ((!debug) &&
-        ((server_context->syslog_ident != NULL) ||
-         (server_context->syslog_facility != LOG_DAEMON))) {
+        ((new->syslog_ident != NULL) ||
+         (new->syslog_facility != LOG_DAEMON))) {
         closelog();
-        if (server_context->syslog_ident != NULL) {
-            myproxy_log_use_syslog(server_context->syslog_facility,
-                                   server_context->syslog_ident);
+        if (new->syslog_ident != NULL) {
+            myproxy_log_use_syslog(new->syslog_facility,
+                                   new->syslog_ident);
         } else {
-            myproxy_log_use_syslog(server_context->syslog_facility,
-                                   server_context->my_name);
+            myproxy_log_use_syslog(new->syslog_facility,
+                                   new->my_name);
         }
     }
 
+    return 1;
+}
+
+/*
+ * handle_config()
+ *
+ * Reload the configuration as read_config() does and, if a new one
+ * was loaded, apply all of it to this process: the CA key, extension
+ * profiles, storage backend, call-out settings and so on.
+ *
+ * The snapshot is not shared between processes.  The main loop and
+ * every reuseport listener call this and build their own, reading
+ * the file and CA files once each; the reaper only uses read_config().
+ * Prefork workers and per-connection children keep the snapshot they
+ * were forked with.
+ *
+ * Returns 1 if a new configuration was loaded, 0 if not, and -1 if
+ * the initial configuration could not be read.
+ */
+int
+handle_config(myproxy_server_context_t **server_context)
+{
+    myproxy_server_context_t *new;
+    int rc;
+
+    if ((rc = read_config(server_context)) <= 0) {
+        return rc;
+    }
+    new = *server_context;
+
+#if defined(HAVE_LIBSASL2)
+    /* the SASL code reads these from the active configuration */
+    myproxy_sasl_mech = new->sasl_mech;
+    myproxy_sasl_serverFQDN = new->sasl_serverFQDN;
+    myproxy_sasl_user_realm = new->sasl_user_realm;
+#endif
+
     /* 
      * set up gridmap file if explicitly defined.
      * if not, default to the usual place, but do not over write
      * the env var if previously defined.
      */
-    if ( server_context->certificate_mapfile != NULL ) {
-      setenv( "GRIDMAP", server_context->certificate_mapfile, 1 );
+    if ( new->certificate_mapfile != NULL ) {
+      setenv( "GRIDMAP", new->certificate_mapfile, 1 );
     } else {
       setenv( "GRIDMAP", "/etc/grid-security/grid-mapfile", 0 );
     }
 
 #ifdef HAVE_GLOBUS_USAGE
-    myproxy_usage_stats_init(server_context);
+    myproxy_usage_stats_init(new);
 #endif
+
+    if (myproxy_creds_set_backend(new->credential_storage) == -1) {
+        myproxy_log_verror();
+        verror_clear();
     }
 
-    return 0;
+    /* Read the CA key, certificates and extension file here, before
+       any fork, so child processes don't read them for each
+       certificate. */
+    if (certauth_load_issuer(new, new->certificate_issuer_reload) == -1) {
+        myproxy_log_verror();
+        verror_clear();
+    }
+    if (certauth_load_extensions(new) == -1) {
+        myproxy_log_verror();
+        verror_clear();
+    }
+
+    /* check_config() validated the cost; setting it here also resets
+       it when the directive is removed on reload. */
+    myproxy_creds_set_verifier_cost(new->passphrase_verifier_cost);
+
+    /* The listen socket is bound once, at startup, with or without
+       SO_REUSEPORT; only the number of listeners can change later. */
+    if (listener_reuseport >= 0 &&
+        (new->reuseport_listeners > 1 && !debug) != listener_reuseport) {
+        myproxy_log("reuseport_listeners change to or from 1 takes "
+                    "effect on restart");
+    }
+
+    /* The ticket keys were made once in main(); this only turns
+       their use on or off, so tickets survive a reload. */
+    if (GSI_SOCKET_set_session_resumption(new->session_resumption)
+        != GSI_SOCKET_SUCCESS) {
+        myproxy_log_verror();
+        myproxy_log("TLS session resumption disabled");
+        verror_clear();
+    }
+
+    return 1;
 }
 
-int
-handle_client(myproxy_socket_attrs_t *attrs,
-	      myproxy_server_context_t *context) 
+/*
+ * wait_for_request()
+ *
+ * Wait up to keepalive_timeout seconds for the next request on a
+ * kept-alive connection.  The request_timeout alarm is suspended
+ * while idle and restarted when the request arrives.
+ *
+ * Returns 1 if the client sent more data, 0 if it closed the
+ * connection, the wait timed out, or the server is shutting down.
+ */
+static int
+wait_for_request(myproxy_socket_attrs_t *attrs,
+                 myproxy_server_context_t *context)
+{
+    struct timeval tv;
+    fd_set rfds;
+    unsigned int alarm_left;
+    int rc;
+    char c;
+
+    /* A pipelined request may already be buffered by TLS or read
+       ahead of its turn; the socket won't become readable for it. */
+    if (GSI_SOCKET_pending(attrs->gsi_socket)) {
+        return 1;
+    }
+
+    alarm_left = alarm(0);
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(attrs->socket_fd, &rfds);
+        tv.tv_sec = context->keepalive_timeout;
+        tv.tv_usec = 0;
+        rc = select(attrs->socket_fd + 1, &rfds, NULL, NULL, &tv);
+    } while (rc < 0 && errno == EINTR && !cleanshutdown);
+
+    if (rc == 0) {
+        myproxy_debug("keep-alive connection idle for %d seconds",
+                      context->keepalive_timeout);
+        return 0;
+    }
+    if (rc < 0 || recv(attrs->socket_fd, &c, 1, MSG_PEEK) <= 0) {
+        return 0;
+    }
+    if (alarm_left) {
+        alarm((context->request_timeout > 0) ?
+              context->request_timeout : MYPROXY_DEFAULT_TIMEOUT);
+    }
+
+    return 1;
+}
+
+/*
+ * handle_request()
+ *
+ * Receive one request from an authenticated client, check it against
+ * the server's policies and carry it out.  Errors that end the
+ * connection don't return.
+ *
+ * Returns 1 if the connection stays open for another request
+ * (keep-alive), 0 otherwise.
+ */
+static int
+handle_request(myproxy_socket_attrs_t *attrs,
+               myproxy_server_context_t *context,
+               myproxy_server_peer_t *client,
+               int requests)
 {
-    myproxy_server_peer_t client;
     char  *client_buffer = NULL;
     int   requestlen;
     int   use_ca_callout = 0;
     int   found_auth_cred = 0;
     int   num_auth_creds = 0;
+    int   keepalive;
     char  *command_name = NULL;
 
     myproxy_creds_t *client_creds;
@@ -513,40 +932,6 @@ handle_client(myproxy_socket_attrs_t *attrs,
     server_response = malloc(sizeof(*server_response));
     memset(server_response, 0, sizeof(*server_response));
 
-    memset(&client, 0, sizeof(client));
-
-    /* Create a new gsi socket */
-    attrs->gsi_socket = GSI_SOCKET_new(attrs->socket_fd);
-    if (attrs->gsi_socket == NULL) {
-        myproxy_log_perror("GSI_SOCKET_new()");
-        return -1;
-    }
-
-    if (context->request_size_limit > 0) {
-        GSI_SOCKET_set_max_token_len(attrs->gsi_socket,
-                                     context->request_size_limit);
-    }
-
-    /* Authenticate server to client and get DN of client */
-    if (myproxy_authenticate_accept_fqans(attrs, client.name,
-	  sizeof(client.name), &client.fqans) < 0) {
-	/* Client_name may not be set on error so don't use it. */
-	myproxy_log_verror();
-	respond_with_error_and_die(attrs, "authentication failed", context);
-    }
-
-    /* Log client name */
-    myproxy_log("Authenticated client %s", client.name); 
-
-    if (client.fqans && *client.fqans) {
-       char **attributes = client.fqans;
-       myproxy_debug("Client's attributes: ");
-       while (attributes && *attributes) {
-	  myproxy_debug("%s", *attributes);
-	  attributes++;
-       }
-    }
-    
     /* Receive client request */
     requestlen = myproxy_recv_ex(attrs, &client_buffer);
     if (requestlen <= 0) {
@@ -586,6 +971,8 @@ handle_client(myproxy_socket_attrs_t *attrs,
         command_name = "STORE"; break;
     case MYPROXY_GET_TRUSTROOTS:
         command_name = "GET TRUSTROOTS"; break;
+    case MYPROXY_BULK_GET_PROXY:
+        command_name = "BULK GET"; break;
     default:
         myproxy_log("Received UNKNOWN command: %d",
                     client_request->command_type);
@@ -600,6 +987,15 @@ handle_client(myproxy_socket_attrs_t *attrs,
     if (client_request->credname != NULL) {
         myproxy_debug("  Credname: %s", client_request->credname);
     }
+    if (client_request->bulk_entries != NULL) {
+        myproxy_bulk_entry_t *entry;
+
+        for (entry = client_request->bulk_entries; entry; entry = entry->next) {
+            myproxy_debug("  Bulk entry: username %s credname %s",
+                          entry->username,
+                          entry->credname ? entry->credname : "<default>");
+        }
+    }
     if (client_request->proxy_lifetime) {
         myproxy_debug("  Requested lifetime: %d seconds",
                       client_request->proxy_lifetime);
@@ -622,18 +1018,19 @@ handle_client(myproxy_socket_attrs_t *attrs,
     /* Check client version */
     if (strcmp(client_request->version, MYPROXY_VERSION) != 0) {
         myproxy_log("client %s Invalid version number (%s) received",
-                    client.name, client_request->version);
+                    client->name, client_request->version);
         respond_with_error_and_die(attrs,
                                    "Invalid version number received.\n", context);
     }
 
-    if (client_request->command_type != MYPROXY_GET_TRUSTROOTS) {
+    if (client_request->command_type != MYPROXY_GET_TRUSTROOTS &&
+        client_request->command_type != MYPROXY_BULK_GET_PROXY) {
         /* Check client username */
         if ((client_request->username == NULL) ||
             (strlen(client_request->username) == 0)) 
         {
             myproxy_log("client %s Invalid username (%s) received",
-                        client.name,
+                        client->name,
                         (client_request->username == NULL ? "<NULL>" :
                          client_request->username));
             respond_with_error_and_die(attrs,
@@ -655,7 +1052,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
             (client_request->credname == NULL) &&
             /* Do an initial check for authz of "default" credential */
             (myproxy_authorize_accept(context,attrs,
-                                      client_request,&client) != 0)) {
+                                      client_request,client) != 0)) {
 
             /* Create a new temp cred struct pointer to fetch all creds */
             all_creds = malloc(sizeof(*all_creds));
@@ -676,7 +1073,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
                         client_request->credname = strdup(cur_cred->credname);
                     /* Check to see if the credname is authorized */
                     if (myproxy_authorize_accept(context,attrs,client_request,
-                                                 &client) == 0) {
+                                                 client) == 0) {
                         found_auth_cred = 1;  /* Good! Authz success! */
                     } else {
                         /* Free up char memory allocated by strdup earlier */
@@ -693,11 +1090,33 @@ handle_client(myproxy_socket_attrs_t *attrs,
         } /*** END check_multiple_credentials ***/
     }
 
-    /* All authorization policies are enforced in this function. */
-    if (myproxy_authorize_accept(context, attrs, 
-                                 client_request, &client) < 0) {
+    if (client_request->command_type == MYPROXY_BULK_GET_PROXY) {
+        int count = 0;
+        myproxy_bulk_entry_t *entry;
+
+        for (entry = client_request->bulk_entries; entry; entry = entry->next) {
+            count++;
+        }
+        if (caonly) {
+            respond_with_error_and_die(attrs,
+                                       "command not supported by MyProxy CA",
+                                       context);
+        }
+        if (count == 0 || count > MYPROXY_BULK_MAX_ENTRIES) {
+            myproxy_log("client %s sent %d bulk entries", client->name, count);
+            respond_with_error_and_die(attrs,
+                                       "Invalid number of bulk entries.\n",
+                                       context);
+        }
+    }
+
+    /* All authorization policies are enforced in this function.
+       Bulk requests are authorized entry by entry in bulk_get_proxy(). */
+    if (client_request->command_type != MYPROXY_BULK_GET_PROXY &&
+        myproxy_authorize_accept(context, attrs, 
+                                 client_request, client) < 0) {
         myproxy_log("authorization failed");
-        myproxy_send_usage_metrics(attrs, &client, context, client_request,
+        myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
         myproxy_free(NULL, client_request, server_response);
         respond_with_error_and_die(attrs, verror_get_string(), context);
@@ -706,7 +1125,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
     /* Fill in client_creds with info from the request that describes
        the credentials the request applies to.
        We must do this *after* processing check_multiple_credentials above. */
-    client_creds->owner_name     = strdup(client.name);
+    client_creds->owner_name     = strdup(client->name);
     client_creds->username       = strdup(client_request->username);
     client_creds->passphrase     = strdup(client_request->passphrase);
     client_creds->lifetime 	 = client_request->proxy_lifetime;
@@ -740,7 +1159,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
 	if (!use_ca_callout) {
 	  /* Retrieve the credentials from the repository */
 	  if (myproxy_creds_retrieve(client_creds) < 0) {
-            myproxy_send_usage_metrics(attrs, &client, context, client_request,
+            myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
 	    respond_with_error_and_die(attrs, verror_get_string(), context);
 	  }
@@ -760,13 +1179,13 @@ handle_client(myproxy_socket_attrs_t *attrs,
 	    error = malloc(strlen(msg)+strlen(client_creds->lockmsg)+1);
 	    strcpy(error, msg);
 	    strcat(error, client_creds->lockmsg);
-            myproxy_send_usage_metrics(attrs, &client, context, client_request,
+            myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
 	    respond_with_error_and_die(attrs, error, context);
 	  }
 
       if (myproxy_creds_verify(client_creds) < 0) {
-            myproxy_send_usage_metrics(attrs, &client, context, client_request,
+            myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
         myproxy_creds_free(client_creds);
         myproxy_free(NULL, client_request, server_response);
@@ -781,7 +1200,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
 		server_response->trusted_certs =
 		    myproxy_get_certs(context->cert_dir);
         if (server_response->trusted_certs) {
-            myproxy_log("Sending trust roots to %s", client.name);
+            myproxy_log("Sending trust roots to %s", client->name);
         } else {
             myproxy_log("myproxy_get_certs() failed");
             myproxy_log_verror();
@@ -794,7 +1213,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
 
 	/* Send initial OK response */
         if (client_request->command_type != MYPROXY_GET_TRUSTROOTS) {
-            send_response(attrs, server_response, client.name, 0);
+            send_response(attrs, server_response, client->name, 0);
             /* Any trustroots wanted as addl. info would have been sent
                in this send.  No need to send them again later. */
             if (server_response->trusted_certs) {
@@ -854,8 +1273,8 @@ handle_client(myproxy_socket_attrs_t *attrs,
 					    client_request->credname,
 					    client_request->retrievers,
 					    client_request->renewers,
-					    client.name) < 0) {
-            myproxy_send_usage_metrics(attrs, &client, context, client_request,
+					    client->name) < 0) {
+            myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
         myproxy_creds_free(client_creds);
         myproxy_free(NULL, client_request, server_response);
@@ -863,7 +1282,7 @@ handle_client(myproxy_socket_attrs_t *attrs,
 	}
 
 	/* Send initial OK response */
-	send_response(attrs, server_response, client.name, 0);
+	send_response(attrs, server_response, client->name, 0);
 
 	/* Store the credentials in the repository and
 	   set final server_response */
@@ -889,8 +1308,8 @@ handle_client(myproxy_socket_attrs_t *attrs,
 					    client_request->credname,
 					    client_request->retrievers,
 					    client_request->renewers,
-					    client.name) < 0) {
-            myproxy_send_usage_metrics(attrs, &client, context, client_request,
+					    client->name) < 0) {
+            myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 0 /* FAILURE */);
         myproxy_creds_free(client_creds);
         myproxy_free(NULL, client_request, server_response);
@@ -901,10 +1320,18 @@ handle_client(myproxy_socket_attrs_t *attrs,
 		      server_response);
         break;
 
+    case MYPROXY_BULK_GET_PROXY:
+	/* Send initial OK response */
+	send_response(attrs, server_response, client->name, 0);
+
+	/* Delegate each credential; the final response is sent below */
+	bulk_get_proxy(attrs, context, client, client_request);
+	break;
+
     case MYPROXY_STORE_CERT:
         /* Store the end-entity credential */
           /* Send initial OK response */
-          send_response(attrs, server_response, client.name, 0);
+          send_response(attrs, server_response, client->name, 0);
  
           /* Store the credentials in the repository and
              set final server_response */
@@ -917,28 +1344,93 @@ handle_client(myproxy_socket_attrs_t *attrs,
         break;
     }
 
+    /* Offer to keep the connection open for another request if the
+       client asked for it and this one succeeded. */
+    keepalive = (client_request->keepalive &&
+                 server_response->response_type == MYPROXY_OK_RESPONSE &&
+                 requests < context->keepalive_requests);
+    server_response->keepalive = keepalive;
+
     /* return server response */
     /* ignore any send errors for this final OK message since currently some clients
        may close without waiting for this terminating message to be received
        due to a timing issue */
-    send_response(attrs, server_response, client.name, 1 /* ignore net errors */);
+    send_response(attrs, server_response, client->name, 1 /* ignore net errors */);
 
     if (server_response->trusted_certs) {
         context->usage.trustroots_sent = 1;
     }
 
-    /* Log request */
-    myproxy_log("Client %s disconnected", client.name);
-
     /* Send metrics */
-    myproxy_send_usage_metrics(attrs, &client, context, client_request,
+    myproxy_send_usage_metrics(attrs, client, context, client_request,
 			       client_creds, server_response, 1 /* SUCCESS */);
    
     /* free stuff up */
 	myproxy_creds_free(client_creds);
-    myproxy_free(attrs, client_request, server_response);
+    myproxy_free(NULL, client_request, server_response);
     myproxy_free_extensions();
 
+    return keepalive;
+}
+
+int
+handle_client(myproxy_socket_attrs_t *attrs,
+	      myproxy_server_context_t *context) 
+{
+    myproxy_server_peer_t client;
+    int   requests = 0;
+
+    memset(&client, 0, sizeof(client));
+
+    /* Create a new gsi socket */
+    attrs->gsi_socket = GSI_SOCKET_new(attrs->socket_fd);
+    if (attrs->gsi_socket == NULL) {
+        myproxy_log_perror("GSI_SOCKET_new()");
+        return -1;
+    }
+
+    if (context->request_size_limit > 0) {
+        GSI_SOCKET_set_max_token_len(attrs->gsi_socket,
+                                     context->request_size_limit);
+    }
+
+    /* Authenticate server to client and get DN of client */
+    if (myproxy_authenticate_accept_fqans(attrs, client.name,
+	  sizeof(client.name), &client.fqans) < 0) {
+	/* Client_name may not be set on error so don't use it. */
+	myproxy_log_verror();
+	respond_with_error_and_die(attrs, "authentication failed", context);
+    }
+
+    /* Log client name */
+    myproxy_log("Authenticated client %s", client.name); 
+
+    if (client.fqans && *client.fqans) {
+       char **attributes = client.fqans;
+       myproxy_debug("Client's attributes: ");
+       while (attributes && *attributes) {
+	  myproxy_debug("%s", *attributes);
+	  attributes++;
+       }
+    }
+    
+    /* Service requests until the client is done with the connection.
+       Without keep-alive, that is after the first one. */
+    while (handle_request(attrs, context, &client, ++requests) &&
+           wait_for_request(attrs, context)) {
+        char client_ip[sizeof(context->usage.client_ip)];
+
+        /* reset per-request state, keeping the client address */
+        verror_clear();
+        strcpy(client_ip, context->usage.client_ip);
+        memset(&context->usage, 0, sizeof(context->usage));
+        strcpy(context->usage.client_ip, client_ip);
+    }
+
+    myproxy_log("Client %s disconnected", client.name);
+
+    myproxy_free(attrs, NULL, NULL);
+
     if (client.fqans) {
        char **p;
        for (p = client.fqans; p && *p; p++)
@@ -946,10 +1438,6 @@ handle_client(myproxy_socket_attrs_t *attrs,
        free(client.fqans);
     }
 
-#ifdef HAVE_GLOBUS_USAGE
-    myproxy_usage_stats_close(context);
-#endif
-
     return 0;
 }
 
@@ -1046,7 +1534,7 @@ init_arguments(int argc, char *argv[],
 }
 
 static int
-bind_socket(const char *hostname, int port)
+bind_socket(const char *hostname, int port, int reuseport)
 {
     int sock=-1;
     struct addrinfo hints, *res, *ressave;
@@ -1091,6 +1579,12 @@ bind_socket(const char *hostname, int port)
             /* Allow reuse of socket */
             setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
             setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&lin, sizeof(lin));
+#ifdef SO_REUSEPORT
+            if (reuseport) {
+                setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                           (void *)&on, sizeof(on));
+            }
+#endif
 
             if (bind(sock, res->ai_addr, res->ai_addrlen) == 0) {
                 myproxy_log("Socket bound to %s:%s", chosenhost, chosenport);
@@ -1124,11 +1618,13 @@ bind_socket(const char *hostname, int port)
  * myproxy_init_server()
  *
  * Create a generic server socket ready on the given port ready to accept.
+ * If reuseport is set, other sockets may later be bound to the same
+ * port with SO_REUSEPORT (see reuseport_listeners).
  *
  * returns the listener fd on success 
  */
 int 
-myproxy_init_server(myproxy_socket_attrs_t *attrs) 
+myproxy_init_server(myproxy_socket_attrs_t *attrs, int reuseport) 
 {
     int listen_sock=-1;
 #if GLOBUS_TODO
@@ -1150,7 +1646,7 @@ myproxy_init_server(myproxy_socket_attrs_t *attrs)
     
     if (attrs->pshost || attrs->psport) {
         myproxy_debug("using getaddrinfo() to configure listen socket");
-        listen_sock = bind_socket(attrs->pshost, attrs->psport);
+        listen_sock = bind_socket(attrs->pshost, attrs->psport, reuseport);
     } else { /* just create unbound IPv4 socket for now */
         int on = 1;
         struct linger lin = {0,0};
@@ -1163,6 +1659,12 @@ myproxy_init_server(myproxy_socket_attrs_t *attrs)
                    SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
         setsockopt(listen_sock,
                    SOL_SOCKET, SO_LINGER, (char *)&lin, sizeof(lin));
+#ifdef SO_REUSEPORT
+        if (reuseport) {
+            setsockopt(listen_sock,
+                       SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on));
+        }
+#endif
     }
     if (listen_sock == -1) {
         failure("Error creating server socket");
@@ -1285,12 +1787,12 @@ void send_response(myproxy_socket_attrs_t *attrs, myproxy_response_t *response,
  *
  */
 
-/* Delegate requested credentials to the client */
-void get_proxy(myproxy_socket_attrs_t *attrs, 
-	       myproxy_creds_t *creds,
-	       myproxy_request_t *request,
-	       myproxy_response_t *response,
-               int max_proxy_lifetime)
+/* Lifetime of a proxy delegated from creds: the shortest of the
+   requested, credential and server limits that are set. */
+static int
+delegation_lifetime(myproxy_creds_t *creds,
+                    myproxy_request_t *request,
+                    int max_proxy_lifetime)
 {
     int lifetime = 0;
 
@@ -1312,14 +1814,28 @@ void get_proxy(myproxy_socket_attrs_t *attrs,
 	}
     }
 
-    if (myproxy_init_delegation(attrs, creds->location, lifetime,
-				request->passphrase) < 0) {
-        myproxy_log_verror();
-	response->response_type =  MYPROXY_ERROR_RESPONSE; 
-	response->error_string = strdup("Unable to delegate credentials.\n");
-    } else {
-        myproxy_log("Delegating credentials for %s lifetime=%d",
-		    creds->owner_name, lifetime);
+    return lifetime;
+}
+
+/* Delegate requested credentials to the client */
+void get_proxy(myproxy_socket_attrs_t *attrs, 
+	       myproxy_creds_t *creds,
+	       myproxy_request_t *request,
+	       myproxy_response_t *response,
+               int max_proxy_lifetime)
+{
+    int lifetime;
+
+    lifetime = delegation_lifetime(creds, request, max_proxy_lifetime);
+
+    if (myproxy_init_delegation(attrs, creds->location, lifetime,
+				request->passphrase) < 0) {
+        myproxy_log_verror();
+	response->response_type =  MYPROXY_ERROR_RESPONSE; 
+	response->error_string = strdup("Unable to delegate credentials.\n");
+    } else {
+        myproxy_log("Delegating credentials for %s lifetime=%d",
+		    creds->owner_name, lifetime);
 	response->response_type = MYPROXY_OK_RESPONSE;
     } 
 }
@@ -1342,6 +1858,171 @@ void get_credentials(myproxy_socket_attrs_t *attrs,
 }
 
 
+/* Authorize one bulk GET entry and sign its certificate request.
+   Returns 0 with the chain to send, or -1 with verror set. */
+static int
+bulk_get_entry(myproxy_socket_attrs_t *attrs,
+               myproxy_server_context_t *context,
+               myproxy_server_peer_t *client,
+               myproxy_request_t *request,
+               const char *certreq,
+               int certreq_len,
+               char **chain,
+               int *chain_len)
+{
+    myproxy_creds_t creds = { 0 };
+    int lifetime, return_status = -1;
+
+    /* Check here, as the CA fallback and the missing credential
+       handling in myproxy_authorize_accept() end the connection. */
+    if (myproxy_creds_exist(request->username, request->credname) != 1) {
+        verror_clear();
+        if (!request->credname) {
+            verror_put_string("No credentials exist for username \"%s\".",
+                              request->username);
+        } else {
+            verror_put_string("No credentials exist with username \"%s\" and credential name \"%s\".", request->username, request->credname);
+        }
+        return -1;
+    }
+
+    if (myproxy_authorize_accept(context, attrs, request, client) < 0) {
+        myproxy_log("authorization failed for username %s",
+                    request->username);
+        return -1;
+    }
+
+    creds.username = strdup(request->username);
+    if (request->credname != NULL)
+        creds.credname = strdup(request->credname);
+
+    if (myproxy_creds_retrieve(&creds) < 0) {
+        goto end;
+    }
+    if (creds.lockmsg) {
+        verror_put_string("credential locked\n%s", creds.lockmsg);
+        goto end;
+    }
+    if (myproxy_creds_verify(&creds) < 0) {
+        goto end;
+    }
+
+    if (context->proxy_extfile) {
+        if (myproxy_set_extensions_from_file(context->proxy_extfile) < 0) {
+            myproxy_log("myproxy_set_extensions_from_file() failed");
+            myproxy_log_verror(); verror_clear();
+        }                
+    } else if (context->proxy_extapp) {
+        if (myproxy_set_extensions_from_callout(context->proxy_extapp,
+                    request->username, creds.location) < 0) {
+            myproxy_log("myproxy_set_extensions_from_callout() failed");
+            myproxy_log_verror(); verror_clear();
+        }
+    }
+
+    lifetime = delegation_lifetime(&creds, request,
+                                   context->max_proxy_lifetime);
+
+    if (myproxy_sign_delegation(attrs, creds.location, lifetime,
+                                request->passphrase, certreq, certreq_len,
+                                chain, chain_len) < 0) {
+        myproxy_log_verror();
+        verror_clear();
+        verror_put_string("Unable to delegate credentials.");
+        goto end;
+    }
+    myproxy_log("Delegating credentials for %s lifetime=%d",
+                creds.owner_name, lifetime);
+
+    return_status = 0;
+
+ end:
+    myproxy_free_extensions();
+    myproxy_creds_free_contents(&creds);
+    return return_status;
+}
+
+/* Delegate a proxy for each credential named in a bulk GET request.
+   All the certificate requests are read before any answer is sent.
+   Each entry then gets its own OK or ERROR response, an OK response
+   being followed by the signed certificate chain. */
+static void
+bulk_get_proxy(myproxy_socket_attrs_t *attrs,
+               myproxy_server_context_t *context,
+               myproxy_server_peer_t *client,
+               myproxy_request_t *request)
+{
+    myproxy_bulk_entry_t *entry;
+    myproxy_request_t entry_request;
+    myproxy_response_t entry_response;
+    char **certreqs;
+    int *certreq_lens;
+    char *chain;
+    int chain_len, count = 0, delegated = 0, i;
+
+    for (entry = request->bulk_entries; entry; entry = entry->next) {
+        count++;
+    }
+    certreqs = calloc(count, sizeof(*certreqs));
+    certreq_lens = calloc(count, sizeof(*certreq_lens));
+    if (certreqs == NULL || certreq_lens == NULL) {
+        respond_with_error_and_die(attrs, "Out of memory.\n", context);
+    }
+
+    for (i = 0; i < count; i++) {
+        certreq_lens[i] = myproxy_recv_ex(attrs, &certreqs[i]);
+        if (certreq_lens[i] <= 0) {
+            myproxy_log_verror();
+            respond_with_error_and_die(attrs, "Error in myproxy_recv_ex()",
+                                       context);
+        }
+    }
+
+    for (entry = request->bulk_entries, i = 0; entry;
+         entry = entry->next, i++) {
+        entry_request = *request;
+        entry_request.username = entry->username;
+        entry_request.credname = entry->credname;
+        strcpy(entry_request.passphrase, entry->passphrase);
+        entry_request.bulk_entries = NULL;
+        memset(&entry_response, 0, sizeof(entry_response));
+        chain = NULL;
+        verror_clear();
+
+        if (bulk_get_entry(attrs, context, client, &entry_request,
+                           certreqs[i], certreq_lens[i],
+                           &chain, &chain_len) < 0) {
+            myproxy_log_verror();
+            entry_response.response_type = MYPROXY_ERROR_RESPONSE;
+            entry_response.error_string = strdup(verror_is_error() ?
+                                                 verror_get_string() :
+                                                 "Unable to delegate credentials.\n");
+            send_response(attrs, &entry_response, client->name, 0);
+            free(entry_response.error_string);
+        } else {
+            entry_response.response_type = MYPROXY_OK_RESPONSE;
+            send_response(attrs, &entry_response, client->name, 0);
+            if (myproxy_send(attrs, chain, chain_len) < 0) {
+                myproxy_log_verror();
+                respond_with_error_and_die(attrs,
+                                           "Unable to delegate credentials.\n",
+                                           context);
+            }
+            free(chain);
+            delegated++;
+        }
+        memset(entry_request.passphrase, 0, sizeof(entry_request.passphrase));
+        free(certreqs[i]);
+    }
+    verror_clear();
+
+    myproxy_log("Delegated %d of %d bulk credentials to %s",
+                delegated, count, client->name);
+
+    free(certreqs);
+    free(certreq_lens);
+}
+
 /* Accept delegated credentials from client */
 void put_proxy(myproxy_socket_attrs_t *attrs, 
                myproxy_creds_t *creds, 
@@ -1528,8 +2209,34 @@ void
 sig_chld(int signo) {
     pid_t pid;
     int   stat;
+    int   i;
     
-    while ( (pid = waitpid(-1, &stat, WNOHANG)) > 0);
+    while ( (pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        if (pid == reaper_pid) {
+            reaper_pid = 0;
+            reaper_failed = !WIFEXITED(stat) || WEXITSTATUS(stat) != 0;
+            continue;
+        }
+        if (myproxy_coproc_reaped(pid)) {
+            continue;
+        }
+        for (i = 0; i < MYPROXY_MAX_LISTENERS; i++) {
+            if (listener_pids[i] == pid) {
+                listener_pids[i] = 0;
+                break;
+            }
+        }
+        if (scoreboard == NULL) continue;
+        for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+            if (scoreboard[i].pid == pid) {
+                scoreboard[i].pid = 0; /* free the worker slot */
+                if (!WIFEXITED(stat) || WEXITSTATUS(stat) != 0) {
+                    prefork_failed++;
+                }
+                break;
+            }
+        }
+    }
     return;
 } 
 
@@ -1688,6 +2395,1179 @@ write_pfile(const char path[], long val)
     }
 }
 
+/*
+ * Counts kept by the credential reaper since it started, on top of
+ * those myproxy_creds_reap() keeps for the current pass.
+ */
+typedef struct {
+    time_t started;             /* when the reaper started */
+    time_t last_pass;           /* when the last pass finished, or 0 */
+    long   examined;            /* credentials examined in finished passes */
+    long   removed;             /* credentials removed in finished passes */
+    long   errors;              /* removals that failed in finished passes */
+    int    abandoned;           /* passes abandoned on error */
+} reaper_totals_t;
+
+/*
+ * reaper_write_status()
+ *
+ * Write the reaper's counters to path, one "name value" pair per
+ * line, replacing the file atomically so readers never see it half
+ * written.  in_pass is true while a pass is under way.
+ */
+static void
+reaper_write_status(const char *path, const myproxy_creds_reap_stats_t *stats,
+                    const reaper_totals_t *totals, int in_pass)
+{
+    char tmp[MAXPATHLEN];
+    FILE *f;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        return;
+    }
+    if ((f = fopen(tmp, "w")) == NULL) {
+        myproxy_log("Couldn't create \"%s\": %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, "pid %ld\n", (long)getpid());
+    fprintf(f, "started %ld\n", (long)totals->started);
+    fprintf(f, "updated %ld\n", (long)time(NULL));
+    fprintf(f, "passes %d\n", stats->passes);
+    fprintf(f, "passes_abandoned %d\n", totals->abandoned);
+    fprintf(f, "last_pass %ld\n", (long)totals->last_pass);
+    fprintf(f, "examined %ld\n", totals->examined);
+    fprintf(f, "removed %ld\n", totals->removed);
+    fprintf(f, "errors %ld\n", totals->errors);
+    fprintf(f, "pass_in_progress %d\n", in_pass);
+    fprintf(f, "pass_start %ld\n", in_pass ? (long)stats->pass_start : 0L);
+    fprintf(f, "pass_examined %d\n", in_pass ? stats->examined : 0);
+    fprintf(f, "pass_removed %d\n", in_pass ? stats->removed : 0);
+    fprintf(f, "pass_errors %d\n", in_pass ? stats->errors : 0);
+    if (fclose(f) != 0 || rename(tmp, path) < 0) {
+        myproxy_log("Couldn't write \"%s\": %s", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/*
+ * reaper_main()
+ *
+ * Body of the credential reaper process.  Walks the credential
+ * repository at credential_reaper_rate credentials per second,
+ * removing those that expired more than credential_reaper_grace
+ * seconds ago, then waits credential_reaper_interval seconds before
+ * the next pass.  Runs at the lowest CPU priority, rereads the
+ * configuration when the file changes but applies only the storage
+ * settings it needs, and exits when the reaper is disabled, on
+ * SIGTERM, or when the server goes away.
+ */
+static void
+reaper_main(myproxy_server_context_t **server_context)
+{
+    myproxy_server_context_t *context;
+    myproxy_creds_reap_stats_t stats;
+    reaper_totals_t totals;
+    pid_t parent = getppid();
+    time_t now, next_pass = 0, next_report = 0;
+    int rc;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&totals, 0, sizeof(totals));
+    totals.started = time(NULL);
+    if (setpriority(PRIO_PROCESS, 0, 19) < 0) {
+        myproxy_log_perror("setpriority() failed for credential reaper");
+    }
+    myproxy_log("Credential reaper started");
+
+    while (!cleanshutdown && getppid() == parent) {
+        /* not handle_config(): the CA key, extensions and so on
+           are of no use here */
+        if (read_config(server_context) > 0 &&
+            myproxy_creds_set_backend((*server_context)->credential_storage)
+            == -1) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+        context = *server_context;
+        if (!context->credential_reaper) {
+            break;
+        }
+
+        now = time(NULL);
+        if (now < next_pass) {
+            sleep(1);
+            continue;
+        }
+
+        rc = myproxy_creds_reap(context->credential_reaper_grace,
+                                context->credential_reaper_rate, &stats);
+        now = time(NULL);
+        if (rc < 0) {
+            myproxy_log_verror();
+            verror_clear();
+            myproxy_log("Credential reaper pass abandoned; retrying in "
+                        "%d seconds", context->credential_reaper_interval);
+            next_pass = now + context->credential_reaper_interval;
+            totals.abandoned++;
+        } else if (rc == 1) {
+            myproxy_log("Credential reaper pass %d done in %ld seconds: "
+                        "%d examined, %d removed, %d errors",
+                        stats.passes, (long)(now - stats.pass_start),
+                        stats.examined, stats.removed, stats.errors);
+            next_pass = now + context->credential_reaper_interval;
+            next_report = next_pass + MYPROXY_REAPER_REPORT;
+            totals.examined += stats.examined;
+            totals.removed += stats.removed;
+            totals.errors += stats.errors;
+            totals.last_pass = now;
+        } else if (next_report == 0) {
+            next_report = now + MYPROXY_REAPER_REPORT;
+        } else if (now >= next_report) {
+            myproxy_log("Credential reaper pass %d in progress: "
+                        "%d examined, %d removed, %d errors",
+                        stats.passes + 1, stats.examined, stats.removed,
+                        stats.errors);
+            next_report = now + MYPROXY_REAPER_REPORT;
+        }
+        if (context->credential_reaper_status) {
+            reaper_write_status(context->credential_reaper_status,
+                                &stats, &totals, rc == 0);
+        }
+
+        sleep(1);
+    }
+
+    myproxy_log("Credential reaper exiting");
+    _exit(0);
+}
+
+/*
+ * callout_check()
+ *
+ * Start, stop or restart the persistent helpers for the CA call-outs
+ * and OpenSSL engine signing when their settings change, and look
+ * after the running helpers.  Does nothing except in the process
+ * that owns them.
+ */
+static void
+callout_check(myproxy_server_context_t *context)
+{
+    if (!callout_parent) {
+        return;
+    }
+    if (callout_generation != config_generation) {
+        callout_generation = config_generation;
+        if (myproxy_coproc_configure(MYPROXY_COPROC_ISSUER,
+                                     context->certificate_issuer_program,
+                                     context->certificate_callout_coprocesses,
+                                     context->certificate_callout_timeout) < 0) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+        if (myproxy_coproc_configure(MYPROXY_COPROC_EXTAPP,
+                                     context->certificate_extapp,
+                                     context->certificate_callout_coprocesses,
+                                     context->certificate_callout_timeout) < 0) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+        if (certauth_configure_signers(context) < 0) {
+            myproxy_log_verror();
+            verror_clear();
+        }
+    }
+    myproxy_coproc_check();
+}
+
+/*
+ * reaper_check()
+ *
+ * Start the credential reaper process if credential_reaper is set and
+ * it isn't running.  If it failed, wait until MYPROXY_REAPER_RESTART
+ * seconds after it was last started, in case it keeps failing.  The
+ * reaper stops itself when disabled.
+ * Does nothing except in the process that owns the reaper.
+ */
+static void
+reaper_check(myproxy_server_context_t **server_context, struct pidfh *pfh)
+{
+    sigset_t chldset, oldset;
+    time_t now;
+    pid_t pid;
+    int i;
+
+    if (!reaper_parent || reaper_pid != 0 ||
+        !(*server_context)->credential_reaper) {
+        return;
+    }
+    now = time(NULL);
+    if (reaper_failed && now - reaper_started < MYPROXY_REAPER_RESTART) {
+        return;
+    }
+    reaper_started = now;
+    reaper_failed = 0;
+
+    /* don't let sig_chld() run before we record the pid */
+    sigemptyset(&chldset);
+    sigaddset(&chldset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldset, &oldset);
+    pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        my_signal(SIGCHLD, SIG_DFL);
+        memset(listener_pids, 0, sizeof(listener_pids));
+        reaper_parent = 0;
+        if (listenfd >= 0) {
+            close(listenfd);
+            listenfd = -1;
+        }
+        if (reactor_epfd >= 0) {
+            /* only the parent's reactor uses these */
+            for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+                if (prefork_chan[i] >= 0) close(prefork_chan[i]);
+            }
+            for (i = 0; i < reactor_size; i++) {
+                if (reactor_conns[i].fd >= 0) close(reactor_conns[i].fd);
+            }
+            close(reactor_epfd);
+            reactor_epfd = -1;
+        }
+        if (pfh) pidfile_close(pfh);
+        reaper_main(server_context);
+    }
+    if (pid < 0) {
+        myproxy_log_perror("Error forking credential reaper");
+    } else {
+        reaper_pid = pid;
+    }
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+}
+
+/*
+ * listener_socket()
+ *
+ * Create another listen socket bound with SO_REUSEPORT to the same
+ * address as the original one, so the kernel spreads connections
+ * across listener processes.  Returns the socket, or -1 on error.
+ */
+static int
+listener_socket()
+{
+    int sock, on = 1;
+    struct linger lin = {0,0};
+
+    sock = socket(listener_addr.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        myproxy_log_perror("Error creating listener socket");
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&lin, sizeof(lin));
+#ifdef SO_REUSEPORT
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on));
+#endif
+    if (bind(sock, (struct sockaddr *)&listener_addr, listener_addrlen) < 0 ||
+        listen(sock, INT_MAX) < 0) {
+        myproxy_log_perror("Error binding listener socket");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * listener_supervisor()
+ *
+ * Parent side of reuseport_listeners mode.  Forks the listener
+ * processes and replaces them if they exit.  The first one inherits
+ * the original listen socket; the rest (and any replacements) bind
+ * their own with listener_socket().  SIGHUP is passed on to the
+ * listeners, which each read and apply the configuration themselves
+ * with handle_config(), as this process does for the settings it
+ * uses.  The supervisor holds the pidfile and stops the listeners on
+ * shutdown.
+ *
+ * Returns 0 in the supervisor on shutdown, 1 in a listener process,
+ * which then continues into the normal server loop.
+ */
+static int
+listener_supervisor(myproxy_server_context_t **server_context,
+                    struct pidfh **pfh, sigset_t *mysigset)
+{
+    int i, count, forward;
+    pid_t pid;
+    sigset_t chldset, oldset;
+
+    listener_addrlen = sizeof(listener_addr);
+    if (getsockname(listenfd, (struct sockaddr *)&listener_addr,
+                    &listener_addrlen) < 0) {
+        myproxy_log_perror("Error in getsockname()");
+        return 1;               /* run as a single listener */
+    }
+
+    myproxy_log("Starting %d listener processes",
+                (*server_context)->reuseport_listeners);
+
+    while (1) {
+
+	/* make sure Globus hasn't blocked signals we care about */
+#ifdef HAVE_PTHREAD_SIGMASK
+	pthread_sigmask(SIG_UNBLOCK, mysigset, NULL);
+#else
+	sigprocmask(SIG_UNBLOCK, mysigset, NULL);
+#endif
+
+        if (cleanshutdown) break;
+
+        forward = readconfig;
+        handle_config(server_context);
+        reaper_check(server_context, *pfh);
+        callout_check(*server_context);
+        count = MIN((*server_context)->reuseport_listeners,
+                    MYPROXY_MAX_LISTENERS);
+        if (count < 1) count = 1;
+
+        sigemptyset(&chldset);
+        sigaddset(&chldset, SIGCHLD);
+        for (i = 0; i < MYPROXY_MAX_LISTENERS; i++) {
+            if (listener_pids[i] != 0) {
+                if (i >= count) {
+                    kill(listener_pids[i], SIGTERM);
+                } else if (forward) {
+                    kill(listener_pids[i], SIGHUP);
+                }
+                continue;
+            }
+            if (i >= count) continue;
+
+            /* don't let sig_chld() run before we record the pid */
+            sigprocmask(SIG_BLOCK, &chldset, &oldset);
+            pid = fork();
+            if (pid == 0) {
+                sigprocmask(SIG_SETMASK, &oldset, NULL);
+                memset(listener_pids, 0, sizeof(listener_pids));
+                reaper_parent = 0;
+                reaper_pid = 0;
+                callout_parent = 0;
+                listener_reuseport = -1;
+                if (*pfh) pidfile_close(*pfh);
+                *pfh = NULL;
+                if (listenfd < 0) {
+                    if ((listenfd = listener_socket()) < 0) {
+                        _exit(1);
+                    }
+                }
+                return 1;
+            }
+            if (pid < 0) {
+                myproxy_log_perror("Error in fork");
+            } else {
+                listener_pids[i] = pid;
+            }
+            sigprocmask(SIG_SETMASK, &oldset, NULL);
+
+            /* first listener took over the original socket */
+            if (pid > 0 && listenfd >= 0) {
+                close(listenfd);
+                listenfd = -1;
+            }
+        }
+
+        sleep(1);               /* interrupted by SIGCHLD and SIGHUP */
+    }
+
+    for (i = 0; i < MYPROXY_MAX_LISTENERS; i++) {
+        if (listener_pids[i] != 0) {
+            kill(listener_pids[i], SIGTERM);
+        }
+    }
+    return 0;
+}
+
+#define REACTOR_LISTEN 0
+#define REACTOR_WORKER 1
+#define REACTOR_CLIENT 2
+
+#if HAVE_SYS_EPOLL_H
+
+/*
+ * prefork_send_fd()
+ *
+ * Pass a connected socket to a worker over its channel.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+prefork_send_fd(int chan, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char byte = 'C';
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return (sendmsg(chan, &msg, 0) == 1) ? 0 : -1;
+}
+
+/*
+ * prefork_recv_fd()
+ *
+ * Receive a connected socket from the parent.
+ * Returns the socket, or -1 on error or when the channel is closed.
+ */
+static int
+prefork_recv_fd(int chan)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char byte;
+    int fd = -1;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        n = recvmsg(chan, &msg, 0);
+    } while (n < 0 && errno == EINTR && !cleanshutdown);
+    if (n <= 0) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return fd;
+}
+
+#define REACTOR_EVENTS 256
+
+/*
+ * reactor_watch()
+ *
+ * Add fd to the reactor's epoll set, tagged with its kind and index.
+ */
+static int
+reactor_watch(int fd, int kind, int index)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)kind << 32) | (uint32_t)index;
+    if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        myproxy_log_perror("Error in epoll_ctl()");
+        return -1;
+    }
+    return 0;
+}
+
+static void
+reactor_unwatch(int fd)
+{
+    struct epoll_event ev;      /* ignored, but required before 2.6.9 */
+
+    if (reactor_epfd >= 0) {
+        epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+}
+
+/* Start or stop watching the listen socket (back-pressure). */
+static void
+reactor_listen(int on)
+{
+    if (on && !reactor_listening) {
+        if (reactor_watch(listenfd, REACTOR_LISTEN, 0) == 0) {
+            reactor_listening = 1;
+        }
+    } else if (!on && reactor_listening) {
+        reactor_unwatch(listenfd);
+        reactor_listening = 0;
+    }
+}
+
+/* Close a held connection and return its slot to the free list. */
+static void
+reactor_drop(int index)
+{
+    reactor_unwatch(reactor_conns[index].fd);
+    close(reactor_conns[index].fd);
+    reactor_conns[index].fd = -1;
+    reactor_conns[index].queued = 0;
+    reactor_free[reactor_size - reactor_count] = index;
+    reactor_count--;
+}
+
+/*
+ * reactor_accept()
+ *
+ * Accept as many pending connections as there is room for.  Once the
+ * reactor is full, stop watching the listen socket and let further
+ * connections wait in the kernel backlog.
+ */
+static void
+reactor_accept(myproxy_server_context_t *context)
+{
+    int fd, index;
+    time_t deadline = 0;
+
+    if (context->request_timeout == 0) {
+        deadline = time(NULL) + MYPROXY_DEFAULT_TIMEOUT;
+    } else if (context->request_timeout > 0) {
+        deadline = time(NULL) + context->request_timeout;
+    }
+
+    while (reactor_count < reactor_size) {
+        fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNABORTED) {
+                myproxy_log_perror("Error in accept()");
+            }
+            break;
+        }
+        index = reactor_free[reactor_size - reactor_count - 1];
+        if (reactor_watch(fd, REACTOR_CLIENT, index) < 0) {
+            close(fd);
+            continue;
+        }
+        reactor_conns[index].fd = fd;
+        reactor_conns[index].deadline = deadline;
+        reactor_conns[index].queued = 0;
+        reactor_count++;
+    }
+
+    if (reactor_count >= reactor_size) {
+        reactor_listen(0);
+    }
+}
+
+/*
+ * reactor_dispatch()
+ *
+ * Hand connections that have data waiting to workers that have asked
+ * for one, oldest first.
+ */
+static void
+reactor_dispatch()
+{
+    int index, slot = 0;
+
+    while (reactor_ready_len > 0) {
+        for (; slot < MYPROXY_PREFORK_WORKER_LIMIT; slot++) {
+            if (prefork_chan[slot] >= 0 && prefork_wants_conn[slot] &&
+                scoreboard[slot].generation == prefork_generation) {
+                break;
+            }
+        }
+        if (slot == MYPROXY_PREFORK_WORKER_LIMIT) {
+            return;             /* no worker available */
+        }
+        prefork_wants_conn[slot] = 0;
+        index = reactor_ready[reactor_ready_head];
+        if (prefork_send_fd(prefork_chan[slot], reactor_conns[index].fd) < 0) {
+            continue;           /* worker went away, try the next one */
+        }
+        scoreboard[slot].state = PREFORK_SLOT_BUSY;
+        reactor_ready_head = (reactor_ready_head + 1) % reactor_size;
+        reactor_ready_len--;
+        reactor_drop(index);
+    }
+}
+
+/* Close connections that never sent anything before their deadline. */
+static void
+reactor_expire(time_t now)
+{
+    int i;
+
+    for (i = 0; i < reactor_size; i++) {
+        if (reactor_conns[i].fd >= 0 && !reactor_conns[i].queued &&
+            reactor_conns[i].deadline && reactor_conns[i].deadline <= now) {
+            reactor_drop(i);
+        }
+    }
+}
+
+/*
+ * reactor_poll()
+ *
+ * Wait up to one second for reactor events and handle them.
+ */
+static void
+reactor_poll(myproxy_server_context_t *context)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    static time_t last_sweep = 0;
+    time_t now;
+    int i, n, kind, index;
+    char buf[16];
+
+    n = epoll_wait(reactor_epfd, events, REACTOR_EVENTS, 1000);
+    for (i = 0; i < n; i++) {
+        kind = (int)(events[i].data.u64 >> 32);
+        index = (int)(events[i].data.u64 & 0xffffffff);
+        switch (kind) {
+        case REACTOR_LISTEN:
+            reactor_accept(context);
+            break;
+        case REACTOR_WORKER:
+            /* a worker is ready for a connection, or has exited */
+            if (prefork_chan[index] < 0) break;
+            if (read(prefork_chan[index], buf, sizeof(buf)) > 0) {
+                prefork_wants_conn[index] = 1;
+            } else {
+                reactor_unwatch(prefork_chan[index]);
+                close(prefork_chan[index]);
+                prefork_chan[index] = -1;
+                prefork_wants_conn[index] = 0;
+            }
+            break;
+        case REACTOR_CLIENT:
+            /* client sent data (or hung up): ready for a worker */
+            if (reactor_conns[index].fd < 0 || reactor_conns[index].queued) {
+                break;
+            }
+            reactor_unwatch(reactor_conns[index].fd);
+            reactor_conns[index].queued = 1;
+            reactor_ready[(reactor_ready_head + reactor_ready_len) %
+                          reactor_size] = index;
+            reactor_ready_len++;
+            break;
+        }
+    }
+
+    reactor_dispatch();
+
+    now = time(NULL);
+    if (now != last_sweep) {
+        reactor_expire(now);
+        last_sweep = now;
+    }
+    if (reactor_count < reactor_size) {
+        reactor_listen(1);
+    }
+}
+
+/*
+ * reactor_start()
+ *
+ * Set up the connection reactor.  Returns 0 on success, -1 on error
+ * setting verror.
+ */
+static int
+reactor_start(myproxy_server_context_t *context)
+{
+    struct rlimit rl;
+    int i, flags;
+
+    reactor_size = context->prefork_reactor_connections;
+    reactor_conns = malloc(reactor_size * sizeof(*reactor_conns));
+    reactor_free = malloc(reactor_size * sizeof(*reactor_free));
+    reactor_ready = malloc(reactor_size * sizeof(*reactor_ready));
+    if (!reactor_conns || !reactor_free || !reactor_ready) {
+        verror_put_string("malloc() failed");
+        goto error;
+    }
+    for (i = 0; i < reactor_size; i++) {
+        reactor_conns[i].fd = -1;
+        reactor_conns[i].queued = 0;
+        reactor_free[i] = reactor_size - i - 1;
+    }
+    reactor_count = reactor_ready_head = reactor_ready_len = 0;
+
+    reactor_epfd = epoll_create(reactor_size);
+    if (reactor_epfd < 0) {
+        verror_put_errno(errno);
+        verror_put_string("epoll_create() failed");
+        goto error;
+    }
+
+    flags = fcntl(listenfd, F_GETFL, 0);
+    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    reactor_listen(1);
+
+    /* make sure we can hold the requested number of connections */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        rl.rlim_cur < (rlim_t)reactor_size + 2*MYPROXY_PREFORK_WORKER_LIMIT) {
+        rl.rlim_cur = (rlim_t)reactor_size + 2*MYPROXY_PREFORK_WORKER_LIMIT;
+        if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    myproxy_log("Connection reactor holding up to %d connections",
+                reactor_size);
+    return 0;
+
+  error:
+    free(reactor_conns);
+    free(reactor_free);
+    free(reactor_ready);
+    reactor_conns = NULL;
+    reactor_free = reactor_ready = NULL;
+    reactor_size = 0;
+    return -1;
+}
+
+/*
+ * reactor_stop()
+ *
+ * Tear down the connection reactor, closing any connections it holds.
+ */
+static void
+reactor_stop()
+{
+    int i, flags;
+
+    if (reactor_epfd < 0) return;
+
+    for (i = 0; i < reactor_size; i++) {
+        if (reactor_conns[i].fd >= 0) close(reactor_conns[i].fd);
+    }
+    close(reactor_epfd);
+    reactor_epfd = -1;
+    reactor_listening = 0;
+    free(reactor_conns);
+    free(reactor_free);
+    free(reactor_ready);
+    reactor_conns = NULL;
+    reactor_free = reactor_ready = NULL;
+    reactor_size = reactor_count = 0;
+
+    if (listenfd >= 0) {
+        flags = fcntl(listenfd, F_GETFL, 0);
+        fcntl(listenfd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* without the reactor, workers never get a channel */
+static int
+prefork_recv_fd(int chan)
+{
+    return -1;
+}
+
+static int
+reactor_watch(int fd, int kind, int index)
+{
+    return -1;
+}
+
+static void
+reactor_unwatch(int fd)
+{
+}
+
+static void
+reactor_poll(myproxy_server_context_t *context)
+{
+    sleep(1);
+}
+
+static int
+reactor_start(myproxy_server_context_t *context)
+{
+    verror_put_string("prefork_reactor not supported on this platform");
+    return -1;
+}
+
+static void
+reactor_stop()
+{
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ * prefork_worker_surplus()
+ *
+ * Called by a worker between requests.  Returns 1 if the pool has
+ * grown beyond prefork_min_workers and another worker is already
+ * waiting for a connection, so this one can exit.
+ */
+static int
+prefork_worker_surplus(int slot, myproxy_server_context_t *context)
+{
+    int i, live = 0, idle = 0;
+
+    for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+        if (scoreboard[i].pid == 0 ||
+            scoreboard[i].generation != prefork_generation) {
+            continue;
+        }
+        live++;
+        if (i != slot && scoreboard[i].state == PREFORK_SLOT_IDLE) {
+            idle++;
+        }
+    }
+
+    return (live > context->prefork_min_workers && idle > 0);
+}
+
+/*
+ * prefork_worker()
+ *
+ * Main loop of a prefork worker: take connections, either with accept()
+ * on the shared listen socket or from the parent's reactor over
+ * worker_chan, and service them with handle_client() until the
+ * worker is recycled, becomes surplus, or is told to shut down.
+ * A request that fails ends the worker through
+ * respond_with_error_and_die(), which is intended; the parent replaces
+ * it.  Never returns.
+ */
+static void
+prefork_worker(int slot, myproxy_server_context_t *context,
+               struct pidfh *pfh)
+{
+    myproxy_socket_attrs_t *attrs;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    int fd, served = 0;
+
+    if (pfh) pidfile_close(pfh);
+    my_signal(SIGCHLD, SIG_DFL);
+    my_signal(SIGHUP, SIG_IGN);     /* parent recycles us on reload */
+
+    while (!cleanshutdown) {
+        scoreboard[slot].state = PREFORK_SLOT_IDLE;
+        memset(&client_addr, 0, sizeof(client_addr));
+        client_addr_len = sizeof(client_addr);
+        if (worker_chan >= 0) {
+            /* ask the reactor for the next connection with data */
+            if (write(worker_chan, "R", 1) != 1) break;
+            fd = prefork_recv_fd(worker_chan);
+            if (fd < 0) break;  /* parent closed our channel */
+            getpeername(fd, (struct sockaddr *) &client_addr,
+                        &client_addr_len);
+        } else {
+            fd = accept(listenfd, (struct sockaddr *) &client_addr,
+                        &client_addr_len);
+            if (fd < 0) {
+                if (cleanshutdown) break;
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    myproxy_log_perror("Error in accept()");
+                }
+                continue;
+            }
+        }
+        scoreboard[slot].state = PREFORK_SLOT_BUSY;
+
+        /* reset per-request state left over from the last client */
+        verror_clear();
+        memset(&context->usage, 0, sizeof(context->usage));
+        getnameinfo((struct sockaddr *)&client_addr,
+                    sizeof(client_addr),
+                    context->usage.client_ip,
+                    sizeof(context->usage.client_ip),
+                    NULL, 0,
+                    NI_NUMERICHOST);
+        myproxy_log("Connection from %s", context->usage.client_ip);
+
+        /* handle_client() frees attrs when done */
+        attrs = malloc(sizeof(*attrs));
+        memset(attrs, 0, sizeof(*attrs));
+        attrs->socket_fd = fd;
+
+        if (context->request_timeout == 0) {
+            alarm(MYPROXY_DEFAULT_TIMEOUT);
+        } else if (context->request_timeout > 0) {
+            alarm(context->request_timeout);
+        }
+        if (handle_client(attrs, context) < 0) {
+            my_failure_chld("error in handle_client()");
+        }
+        alarm(0);
+
+        served++;
+        if (context->prefork_max_requests > 0 &&
+            served >= context->prefork_max_requests) {
+            myproxy_debug("worker recycled after %d requests", served);
+            break;
+        }
+        if (prefork_worker_surplus(slot, context)) {
+            break;
+        }
+    }
+
+#ifdef HAVE_GLOBUS_USAGE
+    myproxy_usage_stats_close(context);
+#endif
+    _exit(0);
+}
+
+/*
+ * prefork_spawn_worker()
+ *
+ * Fork a new worker into a free scoreboard slot.  When the reactor is
+ * running, the worker gets a channel to receive connections on.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+prefork_spawn_worker(myproxy_server_context_t *context, struct pidfh *pfh)
+{
+    int slot, i;
+    int sv[2] = { -1, -1 };
+    pid_t pid;
+    sigset_t chldset, oldset;
+
+    for (slot = 0; slot < MYPROXY_PREFORK_WORKER_LIMIT; slot++) {
+        if (scoreboard[slot].pid == 0) break;
+    }
+    if (slot == MYPROXY_PREFORK_WORKER_LIMIT) {
+        return -1;
+    }
+    if (prefork_chan[slot] >= 0) {  /* exited worker's channel */
+        reactor_unwatch(prefork_chan[slot]);
+        close(prefork_chan[slot]);
+        prefork_chan[slot] = -1;
+    }
+    if (reactor_epfd >= 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        myproxy_log_perror("Error in socketpair");
+        return -1;
+    }
+    scoreboard[slot].generation = prefork_generation;
+    scoreboard[slot].state = PREFORK_SLOT_STARTING;
+
+    /* don't let sig_chld() run before the slot has our pid */
+    sigemptyset(&chldset);
+    sigaddset(&chldset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chldset, &oldset);
+
+    pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        if (sv[1] >= 0) {
+            /* only the parent's reactor uses these */
+            close(sv[0]);
+            worker_chan = sv[1];
+            for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+                if (prefork_chan[i] >= 0) close(prefork_chan[i]);
+            }
+            for (i = 0; i < reactor_size; i++) {
+                if (reactor_conns[i].fd >= 0) close(reactor_conns[i].fd);
+            }
+            close(reactor_epfd);
+            close(listenfd);
+            listenfd = -1;
+        }
+        prefork_worker(slot, context, pfh);
+    }
+    if (sv[1] >= 0) close(sv[1]);
+    if (pid < 0) {
+        myproxy_log_perror("Error in fork");
+        if (sv[0] >= 0) close(sv[0]);
+    } else {
+        scoreboard[slot].pid = pid;
+        if (sv[0] >= 0) {
+            prefork_chan[slot] = sv[0];
+            prefork_wants_conn[slot] = 0;
+            reactor_watch(sv[0], REACTOR_WORKER, slot);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+
+    return (pid < 0) ? -1 : 0;
+}
+
+/*
+ * prefork_retire_workers()
+ *
+ * Ask all current workers to exit.  Idle workers leave accept() (or
+ * see their channel close) right away; busy workers finish their
+ * current request first.
+ */
+static void
+prefork_retire_workers()
+{
+    int i;
+
+    for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+        if (scoreboard[i].pid != 0 &&
+            scoreboard[i].generation == prefork_generation) {
+            kill(scoreboard[i].pid, SIGTERM);
+        }
+        if (prefork_chan[i] >= 0) {
+            reactor_unwatch(prefork_chan[i]);
+            close(prefork_chan[i]);
+            prefork_chan[i] = -1;
+            prefork_wants_conn[i] = 0;
+        }
+    }
+    prefork_generation++;
+}
+
+/*
+ * prefork_server()
+ *
+ * Parent side of prefork mode.  Keeps at least prefork_min_workers
+ * workers running, grows the pool up to prefork_max_workers when
+ * every worker is busy, and replaces workers as they exit.  With
+ * prefork_reactor, also runs the connection reactor.  When a new
+ * configuration is loaded (on SIGHUP or when the file changes), the
+ * pool is replaced so workers pick it up.
+ *
+ * Returns 0 on shutdown, 1 if prefork mode was disabled by a
+ * configuration change (or could not be set up).
+ */
+static int
+prefork_server(myproxy_server_context_t **server_context, struct pidfh *pfh,
+               sigset_t *mysigset)
+{
+    myproxy_server_context_t *context = *server_context;
+    int i, live, idle, spawn, respawns = 0, failing = 0;
+    time_t now, respawn_second = 0;
+
+    if (scoreboard == NULL) {
+        scoreboard = mmap(NULL,
+                          MYPROXY_PREFORK_WORKER_LIMIT * sizeof(*scoreboard),
+                          PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+                          -1, 0);
+        if (scoreboard == MAP_FAILED) {
+            scoreboard = NULL;
+            myproxy_log_perror("Failed to map prefork scoreboard; "
+                               "forking per connection instead");
+            context->prefork_min_workers = 0;
+            return 1;
+        }
+        memset(scoreboard, 0,
+               MYPROXY_PREFORK_WORKER_LIMIT * sizeof(*scoreboard));
+        for (i = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+            prefork_chan[i] = -1;
+        }
+    }
+
+    myproxy_log("Starting prefork worker pool (%d to %d workers)",
+                context->prefork_min_workers, context->prefork_max_workers);
+    if (context->prefork_reactor && reactor_start(context) < 0) {
+        myproxy_log_verror();
+        verror_clear();
+        myproxy_log("Connection reactor disabled");
+    }
+
+    while (1) {
+
+	/* make sure Globus hasn't blocked signals we care about */
+#ifdef HAVE_PTHREAD_SIGMASK
+	pthread_sigmask(SIG_UNBLOCK, mysigset, NULL);
+#else
+	sigprocmask(SIG_UNBLOCK, mysigset, NULL);
+#endif
+
+        if (cleanshutdown) break;
+
+        i = handle_config(server_context);
+        reaper_check(server_context, pfh);
+        callout_check(*server_context);
+        if (i > 0) {
+            context = *server_context;
+            prefork_retire_workers();
+            if (context->prefork_min_workers <= 0) {
+                reactor_stop();
+                myproxy_log("Prefork mode disabled");
+                return 1;
+            }
+            myproxy_log("Restarting prefork worker pool (%d to %d workers)",
+                        context->prefork_min_workers,
+                        context->prefork_max_workers);
+            if (!context->prefork_reactor) {
+                reactor_stop();
+            } else if (reactor_epfd < 0) {
+                if (reactor_start(context) < 0) {
+                    myproxy_log_verror();
+                    verror_clear();
+                    myproxy_log("Connection reactor disabled");
+                }
+            } else if (reactor_size != context->prefork_reactor_connections) {
+                myproxy_log("prefork_reactor_connections change takes "
+                            "effect on restart");
+            }
+        }
+
+        for (i = live = idle = 0; i < MYPROXY_PREFORK_WORKER_LIMIT; i++) {
+            if (scoreboard[i].pid == 0 ||
+                scoreboard[i].generation != prefork_generation) {
+                continue;
+            }
+            live++;
+            if (scoreboard[i].state != PREFORK_SLOT_BUSY) {
+                idle++;
+            }
+        }
+
+        spawn = 0;
+        if (live < context->prefork_min_workers) {
+            spawn = context->prefork_min_workers - live;
+        } else if (idle == 0 && live < context->prefork_max_workers) {
+            /* all busy: double the pool, up to the maximum */
+            spawn = MIN(live, context->prefork_max_workers - live);
+        }
+        now = time(NULL);
+        if (now != respawn_second) {
+            respawn_second = now;
+            respawns = 0;
+            failing = prefork_failed;   /* in the second just ended */
+            prefork_failed = 0;
+        }
+        if ((failing || prefork_failed) &&
+            spawn > MYPROXY_PREFORK_RESPAWN_RATE - respawns) {
+            if (respawns < MYPROXY_PREFORK_RESPAWN_RATE) {
+                myproxy_debug("workers failing; replacing at most %d a second",
+                              MYPROXY_PREFORK_RESPAWN_RATE);
+            }
+            spawn = MYPROXY_PREFORK_RESPAWN_RATE - respawns;
+        }
+        while (spawn-- > 0) {
+            if (prefork_spawn_worker(context, pfh) < 0) break;
+            respawns++;
+        }
+
+        if (reactor_epfd >= 0) {
+            reactor_poll(context);  /* returns within a second */
+        } else {
+            sleep(1);           /* interrupted by SIGCHLD and SIGHUP */
+        }
+    }
+
+    prefork_retire_workers();
+    reactor_stop();
+    return 0;
+}
+
 /*
  * check that all following conditions hold:
  * (1) the client_name matches the server-wide policy (eg authorized_retrievers)
@@ -1764,7 +3644,9 @@ check_self_authz(myproxy_server_context_t *context,
     int rval = 1;               /* default allow */
 
     if (context->allow_self_authz == 0) {
-        if (creds->location) {
+        if (creds->subject) {
+            subject = strdup(creds->subject);
+        } else if (creds->location) {
             if (ssl_get_base_subject_file(creds->location, &subject)) {
                 verror_put_string("internal error: ssl_get_base_subject_file(%s) failed in check_self_authz()", creds->location);
                 return -1;          /* error */
@@ -1906,6 +3788,7 @@ myproxy_authorize_accept(myproxy_server_context_t *context,
        /* fall through to MYPROXY_GET_PROXY */
 
    case MYPROXY_GET_PROXY:
+   case MYPROXY_BULK_GET_PROXY: /* one entry at a time */
        /* check trusted_retrievers */
        authorization_ok =
 	       myproxy_check_policy(context, attrs, client,
@@ -2155,6 +4038,13 @@ do_authz_handshake(myproxy_socket_attrs_t *attrs,
    
    memset(&server_response, 0, sizeof(server_response));
 
+   /* A bulk request has no room in its message flow for a challenge. */
+   if (client_request->command_type == MYPROXY_BULK_GET_PROXY) {
+       verror_put_string("bulk requests support passphrase and "
+                         "trusted retriever authorization only");
+       return -1;
+   }
+
    myproxy_debug("sending MYPROXY_AUTHORIZATION_RESPONSE");
    authorization_init_server(&server_response.authorization_data, methods);
    server_response.response_type = MYPROXY_AUTHORIZATION_RESPONSE;
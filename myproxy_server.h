@@ -48,6 +48,9 @@ typedef struct myproxy_server_context_s
   char *pam_policy;                 /* How we depend on PAM for passwd auth */
   char *pam_id;                     /* Application name we present to PAM */
   char *sasl_policy;                /* SASL required, sufficient, disabled */
+  char *sasl_mech;                  /* force a SASL mechanism */
+  char *sasl_serverFQDN;            /* for sasl_server_new(3) */
+  char *sasl_user_realm;            /* for sasl_server_new(3) */
   char *certificate_issuer_program; /* CA callout external program */
   char *certificate_issuer_cert;    /* CA certificate */
   char *certificate_issuer_key;     /* CA signing key */
@@ -58,17 +61,24 @@ typedef struct myproxy_server_context_s
   char *certificate_openssl_engine_lockfile; /* synchronize engine calls */
   char **certificate_openssl_engine_pre; /* Which 'pre' commands to use */
   char **certificate_openssl_engine_post;/* Which 'post' commands to use */
+  int   certificate_openssl_engine_sessions; /* engine signing helpers */
   char *certificate_issuer_key_passphrase; /* CA signing key passphrase */
   char *certificate_issuer_subca_certfile; /* Sub-CA certs to be sent with CA-GET */
+  int   certificate_issuer_reload;  /* re-read CA key and certs on reload? */
   char *certificate_issuer_email_domain; /* CA email domain for alt name */
   char *certificate_extfile;        /* CA extension file */
   char *certificate_extapp;         /* CA extension call-out */
+  int   certificate_callout_coprocesses; /* persistent call-out helpers */
+  int   certificate_callout_timeout;  /* seconds per helper call */
   char *certificate_mapfile;        /* CA gridmap file if not the default */
   char *certificate_mapapp;         /* gridmap call-out */
   int   max_cert_lifetime;          /* like proxy_lifetime for the CA */
-  int   min_keylen;                 /* minimum keylength for the CA */
+  int   min_keylen;                 /* minimum RSA keylength for the CA */
+  int   min_ec_keylen;              /* minimum EC keylength for the CA */
+  char **accepted_key_types;        /* key types the CA will certify */
   char *certificate_serialfile;     /* path to serialnumber file for CA */
   int   certificate_serial_skip;    /* CA serial number increment */
+  int   certificate_serial_block;   /* CA serial numbers reserved at once */
   char *certificate_out_dir;        /* path to certificate directory */
   char *ca_ldap_server;             /* URL to CA ldap user DN server */
   char *ca_ldap_uid_attribute;      /* Username attribute name */
@@ -80,11 +90,33 @@ typedef struct myproxy_server_context_s
   char *accepted_credentials_mapfile; /* Force username/userDN gridmap lookup */
   char *accepted_credentials_mapapp;/* gridmap call-out */
   int check_multiple_credentials;   /* Check multiple creds for U/P match */
+  int credential_catalog;          /* Keep indexed credential catalog? */
+  char *credential_storage;         /* Credential storage backend */
+  int storage_journal;             /* Journal credential storage changes? */
+  int credential_cache_size;       /* Credentials in metadata cache, or 0 */
+  int coalesce_get_requests;       /* Share concurrent credential loads? */
+  int signing_key_cache_size;      /* Decrypted keys kept in memory, or 0 */
+  int signing_key_cache_ttl;       /* Seconds a decrypted key is kept */
+  int credential_reaper;           /* Remove expired credentials? */
+  int credential_reaper_grace;     /* Seconds past expiration to keep them */
+  int credential_reaper_rate;      /* Credentials examined per second */
+  int credential_reaper_interval;  /* Seconds between reaper passes */
+  char *credential_reaper_status;   /* File the reaper writes its counts to */
+  int passphrase_verifier_cost;     /* log2 scrypt N for verifiers, or 0 */
   char *syslog_ident;               /* Identity for logging to syslog */
   int syslog_facility;              /* syslog facility */
   int limited_proxy;                /* Should we delegate a limited proxy? */
   int request_timeout;              /* Timeout for child processes */
   int request_size_limit;           /* Size limit for incoming requests */
+  int prefork_min_workers;          /* Prefork workers kept running */
+  int prefork_max_workers;          /* Upper bound on prefork workers */
+  int prefork_max_requests;         /* Requests before worker is recycled */
+  int prefork_reactor;              /* Hold connections in epoll reactor? */
+  int prefork_reactor_connections;  /* Max connections held by reactor */
+  int reuseport_listeners;          /* SO_REUSEPORT listener processes */
+  int session_resumption;           /* Issue TLS session tickets? */
+  int keepalive_requests;           /* Max requests per connection */
+  int keepalive_timeout;            /* Idle wait between requests */
   int allow_self_authz;             /* Allow client subject to match cert? */
   char *proxy_extfile;              /* Extensions for issued proxies */
   char *proxy_extapp;               /* proxy extension call-out */
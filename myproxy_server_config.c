@@ -93,19 +93,26 @@ static struct config_directives our_conf[] = {
 	{"certificate_issuer_checker", 1, 1},
 	{"certificate_issuer_key_passphrase", 1, 1},
 	{"certificate_issuer_subca_certfile", 1, 1},
+	{"certificate_issuer_reload", 1, 1},
 	{"certificate_openssl_engine_id", 1, 1},
 	{"certificate_openssl_engine_lockfile", 1, 1},
 	{"certificate_openssl_engine_pre", 0, NARGS_DONTCHECK},
 	{"certificate_openssl_engine_post", 0, NARGS_DONTCHECK},
+	{"certificate_openssl_engine_sessions", 1, 1},
 	{"certificate_issuer_email_domain", 1, 1},
 	{"certificate_extfile", 1, 1},
 	{"certificate_extapp", 1, 1},
+	{"certificate_callout_coprocesses", 1, 1},
+	{"certificate_callout_timeout", 1, 1},
 	{"certificate_mapfile", 1, 1},
 	{"certificate_mapap", 1, 1},
 	{"max_cert_lifetime", 1, 1},
 	{"min_keylen", 1, 1},
+	{"min_ec_keylen", 1, 1},
+	{"accepted_key_types", 1, NARGS_DONTCHECK},
 	{"certificate_serialfile", 1, 1},
 	{"certificate_serial_skip", 1, 1},
+	{"certificate_serial_block", 1, 1},
 	{"certificate_out_dir", 1, 1},
 	{"ca_ldap_server", 1, 1},
 	{"ca_ldap_searchbase", 1, 1},
@@ -117,6 +124,19 @@ static struct config_directives our_conf[] = {
 	{"accepted_credentials_mapfile", 1, 1},
 	{"accepted_credentials_mapapp", 1, 1},
 	{"check_multiple_credentials", 1, 1},
+	{"credential_catalog", 1, 1},
+	{"credential_storage", 1, 1},
+	{"storage_journal", 1, 1},
+	{"credential_cache_size", 1, 1},
+	{"coalesce_get_requests", 1, 1},
+	{"signing_key_cache_size", 1, 1},
+	{"signing_key_cache_ttl", 1, 1},
+	{"credential_reaper", 1, 1},
+	{"credential_reaper_grace", 1, 1},
+	{"credential_reaper_rate", 1, 1},
+	{"credential_reaper_interval", 1, 1},
+	{"credential_reaper_status", 1, 1},
+	{"passphrase_verifier_cost", 1, 1},
 #if defined(HAVE_OCSP)
 	{"ocsp_policy", 1, 1},
 	{"ocsp_responder_url", 1, 1},
@@ -127,6 +147,15 @@ static struct config_directives our_conf[] = {
 	{"slave_servers", 0, NARGS_DONTCHECK},
 	{"request_timeout", 1, 1},
 	{"request_size_limit", 1, 1},
+	{"prefork_min_workers", 1, 1},
+	{"prefork_max_workers", 1, 1},
+	{"prefork_max_requests", 1, 1},
+	{"prefork_reactor", 1, 1},
+	{"prefork_reactor_connections", 1, 1},
+	{"reuseport_listeners", 1, 1},
+	{"session_resumption", 1, 1},
+	{"keepalive_requests", 1, 1},
+	{"keepalive_timeout", 1, 1},
 	{"proxy_extfile", 1, 1},
 	{"proxy_extapp", 1, 1},
 	{"disable_usage_stats", 1, 1},
@@ -248,6 +277,15 @@ clear_server_context(myproxy_server_context_t *context)
     context->max_cred_lifetime = 0;
     context->limited_proxy = 0;
     context->request_size_limit = 0x100000; /* 1MB default */
+    context->prefork_min_workers = 0;
+    context->prefork_max_workers = 0;
+    context->prefork_max_requests = MYPROXY_PREFORK_MAX_REQUESTS;
+    context->prefork_reactor = 0;
+    context->prefork_reactor_connections = MYPROXY_REACTOR_CONNECTIONS;
+    context->reuseport_listeners = 1;
+    context->session_resumption = 0;
+    context->keepalive_requests = MYPROXY_KEEPALIVE_REQUESTS;
+    context->keepalive_timeout = MYPROXY_KEEPALIVE_TIMEOUT;
     free_ptr(&context->cert_dir);
     free_ptr(&context->pam_policy);
     free_ptr(&context->pam_id);
@@ -260,19 +298,26 @@ clear_server_context(myproxy_server_context_t *context)
     free_ptr(&context->certificate_issuer_checker);
     free_ptr(&context->certificate_issuer_key_passphrase);
     free_ptr(&context->certificate_issuer_subca_certfile);
+    context->certificate_issuer_reload = 0;
     free_ptr(&context->certificate_openssl_engine_id);
     free_ptr(&context->certificate_openssl_engine_lockfile);
     free_array_list(&context->certificate_openssl_engine_pre);
     free_array_list(&context->certificate_openssl_engine_post);
+    context->certificate_openssl_engine_sessions = 0;
     free_ptr(&context->certificate_issuer_email_domain);
     free_ptr(&context->certificate_extfile);
     free_ptr(&context->certificate_extapp);
+    context->certificate_callout_coprocesses = 0;
+    context->certificate_callout_timeout = MYPROXY_COPROC_TIMEOUT;
     free_ptr(&context->certificate_mapfile);
     free_ptr(&context->certificate_mapapp);
     context->max_cert_lifetime = 0;
     context->min_keylen = 0;
+    context->min_ec_keylen = 0;
+    free_array_list(&context->accepted_key_types);
     free_ptr(&context->certificate_serialfile);
     context->certificate_serial_skip = 1;
+    context->certificate_serial_block = 1;
     free_ptr(&context->certificate_out_dir);
     free_ptr(&context->ca_ldap_server);
     free_ptr(&context->ca_ldap_searchbase);
@@ -284,13 +329,24 @@ clear_server_context(myproxy_server_context_t *context)
     free_ptr(&context->accepted_credentials_mapfile);
     free_ptr(&context->accepted_credentials_mapapp);
     context->check_multiple_credentials = 0;
+    context->credential_catalog = 0;
+    free_ptr(&context->credential_storage);
+    context->storage_journal = 0;
+    context->credential_cache_size = 0;
+    context->coalesce_get_requests = 0;
+    context->signing_key_cache_size = 0;
+    context->signing_key_cache_ttl = MYPROXY_KEY_CACHE_TTL;
+    context->credential_reaper = 0;
+    context->credential_reaper_grace = 0;
+    context->credential_reaper_rate = MYPROXY_REAPER_RATE;
+    context->credential_reaper_interval = MYPROXY_REAPER_INTERVAL;
+    free_ptr(&context->credential_reaper_status);
+    context->passphrase_verifier_cost = 0;
     free_ptr(&context->syslog_ident);
     context->syslog_facility = LOG_DAEMON;
-#if defined(HAVE_LIBSASL2)
-    free_ptr(&myproxy_sasl_mech);
-    free_ptr(&myproxy_sasl_serverFQDN);
-    free_ptr(&myproxy_sasl_user_realm);
-#endif
+    free_ptr(&context->sasl_mech);
+    free_ptr(&context->sasl_serverFQDN);
+    free_ptr(&context->sasl_user_realm);
     context->disable_usage_stats = 0;
     free_ptr(&context->usage_stats_target);
     memset(&context->usage, 0, sizeof(context->usage));
@@ -498,13 +554,13 @@ line_parse_callback(void *context_arg,
     }
 #if defined(HAVE_LIBSASL2)
     else if (strcmp(directive, "sasl_mech") == 0) {
-	myproxy_sasl_mech = strdup(tokens[1]);
+	context->sasl_mech = strdup(tokens[1]);
     }
     else if (strcmp(directive, "sasl_serverFQDN") == 0) {
-	myproxy_sasl_serverFQDN = strdup(tokens[1]);
+	context->sasl_serverFQDN = strdup(tokens[1]);
     }
     else if (strcmp(directive, "sasl_user_realm") == 0) {
-	myproxy_sasl_user_realm = strdup(tokens[1]);
+	context->sasl_user_realm = strdup(tokens[1]);
     }
 #endif
 
@@ -540,6 +596,15 @@ line_parse_callback(void *context_arg,
     else if (strcmp(directive, "certificate_issuer_subca_certfile") == 0) {
 	context->certificate_issuer_subca_certfile = strdup(tokens[1]);
     }
+    else if (strcmp(directive, "certificate_issuer_reload") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->certificate_issuer_reload = 1;
+        }
+    }
     else if (strcmp(directive, "certificate_openssl_engine_id") == 0) {
         context->certificate_openssl_engine_id = strdup(tokens[1]);
     }
@@ -566,6 +631,9 @@ line_parse_callback(void *context_arg,
             }
         }
     }
+    else if (strcmp(directive, "certificate_openssl_engine_sessions") == 0) {
+        context->certificate_openssl_engine_sessions = atoi(tokens[1]);
+    }
     else if (strcmp(directive, "certificate_issuer_email_domain") == 0) {
 	context->certificate_issuer_email_domain = strdup(tokens[1]);
     }
@@ -575,6 +643,12 @@ line_parse_callback(void *context_arg,
     else if (strcmp(directive, "certificate_extapp") == 0) {
 	context->certificate_extapp = strdup(tokens[1]);
     }
+    else if (strcmp(directive, "certificate_callout_coprocesses") == 0) {
+        context->certificate_callout_coprocesses = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "certificate_callout_timeout") == 0) {
+        context->certificate_callout_timeout = atoi(tokens[1]);
+    }
     else if (strcmp(directive, "certificate_mapfile") == 0) {
 	context->certificate_mapfile = strdup(tokens[1]);
     }
@@ -587,12 +661,34 @@ line_parse_callback(void *context_arg,
     else if (strcmp(directive, "min_keylen") == 0) {
 	context->min_keylen = atoi(tokens[1]);
     }
+    else if (strcmp(directive, "min_ec_keylen") == 0) {
+	context->min_ec_keylen = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "accepted_key_types") == 0) {
+        for (index=1; tokens[index] != NULL; index++) {
+            if (strcasecmp(tokens[index], "rsa") &&
+                strcasecmp(tokens[index], "ec") &&
+                strcasecmp(tokens[index], "ed25519")) {
+                verror_put_string("unknown key type \"%s\" in "
+                                  "accepted_key_types", tokens[index]);
+                goto error;
+            }
+            context->accepted_key_types =
+                add_entry(context->accepted_key_types, tokens[index]);
+            if (context->accepted_key_types == NULL) {
+                goto error;
+            }
+        }
+    }
     else if (strcmp(directive, "certificate_serialfile") == 0) {
 	context->certificate_serialfile = strdup(tokens[1]);
     }
     else if (strcmp(directive, "certificate_serial_skip") == 0) {
 	context->certificate_serial_skip = atoi(tokens[1]);
     }
+    else if (strcmp(directive, "certificate_serial_block") == 0) {
+	context->certificate_serial_block = atoi(tokens[1]);
+    }
     else if (strcmp(directive, "certificate_out_dir") == 0) {
 	context->certificate_out_dir = strdup(tokens[1]);
     }
@@ -643,6 +739,69 @@ line_parse_callback(void *context_arg,
             context->check_multiple_credentials = 1;
         }
     }
+    else if (strcmp(directive, "credential_catalog") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->credential_catalog = 1;
+        }
+    }
+    else if (strcmp(directive, "credential_storage") == 0) {
+        context->credential_storage = strdup(tokens[1]);
+    }
+    else if (strcmp(directive, "storage_journal") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->storage_journal = 1;
+        }
+    }
+    else if (strcmp(directive, "credential_cache_size") == 0) {
+        context->credential_cache_size = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "coalesce_get_requests") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->coalesce_get_requests = 1;
+        }
+    }
+    else if (strcmp(directive, "signing_key_cache_size") == 0) {
+        context->signing_key_cache_size = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "signing_key_cache_ttl") == 0) {
+        context->signing_key_cache_ttl = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "credential_reaper") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->credential_reaper = 1;
+        }
+    }
+    else if (strcmp(directive, "credential_reaper_grace") == 0) {
+        context->credential_reaper_grace = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "credential_reaper_rate") == 0) {
+        context->credential_reaper_rate = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "credential_reaper_interval") == 0) {
+        context->credential_reaper_interval = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "credential_reaper_status") == 0) {
+        context->credential_reaper_status = strdup(tokens[1]);
+    }
+    else if (strcmp(directive, "passphrase_verifier_cost") == 0) {
+        context->passphrase_verifier_cost = atoi(tokens[1]);
+    }
 
     /* OCSP stuff */
     else if (strcmp(directive, "ocsp_policy") == 0) {
@@ -690,6 +849,46 @@ line_parse_callback(void *context_arg,
 	context->request_size_limit = atoi(tokens[1]);
     }
 
+    else if (strcmp(directive, "prefork_min_workers") == 0) {
+	context->prefork_min_workers = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "prefork_max_workers") == 0) {
+	context->prefork_max_workers = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "prefork_max_requests") == 0) {
+	context->prefork_max_requests = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "prefork_reactor") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->prefork_reactor = 1;
+        }
+    }
+    else if (strcmp(directive, "prefork_reactor_connections") == 0) {
+	context->prefork_reactor_connections = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "reuseport_listeners") == 0) {
+	context->reuseport_listeners = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "session_resumption") == 0) {
+        if ((!strcasecmp(tokens[1], "true")) ||
+            (!strcasecmp(tokens[1], "enabled")) ||
+            (!strcasecmp(tokens[1], "yes")) ||
+            (!strcasecmp(tokens[1], "on")) ||
+            (!strcmp(tokens[1], "1"))) {
+            context->session_resumption = 1;
+        }
+    }
+    else if (strcmp(directive, "keepalive_requests") == 0) {
+	context->keepalive_requests = atoi(tokens[1]);
+    }
+    else if (strcmp(directive, "keepalive_timeout") == 0) {
+	context->keepalive_timeout = atoi(tokens[1]);
+    }
+
     else if (strcmp(directive, "proxy_extfile") == 0) {
 #if defined(HAVE_GLOBUS_GSI_PROXY_HANDLE_SET_EXTENSIONS)
         context->proxy_extfile = strdup(tokens[1]);
@@ -1092,6 +1291,45 @@ check_config(myproxy_server_context_t *context)
 	    verror_put_errno(errno);
 	    rval = -1;
 	}
+    if (context->certificate_callout_coprocesses < 0 ||
+        context->certificate_callout_coprocesses > MYPROXY_COPROC_LIMIT) {
+        verror_put_string("certificate_callout_coprocesses (%d) must be "
+                          "between 0 and %d",
+                          context->certificate_callout_coprocesses,
+                          MYPROXY_COPROC_LIMIT);
+        rval = -1;
+    } else if (context->certificate_callout_coprocesses &&
+               context->certificate_callout_timeout <= 0) {
+        verror_put_string("certificate_callout_timeout (%d) <= 0",
+                          context->certificate_callout_timeout);
+        rval = -1;
+    } else if (context->certificate_callout_coprocesses &&
+               (context->certificate_issuer_program ||
+                context->certificate_extapp)) {
+        myproxy_log("Running %d persistent helpers per CA call-out",
+                    context->certificate_callout_coprocesses);
+    }
+    if (context->certificate_openssl_engine_sessions < 0 ||
+        context->certificate_openssl_engine_sessions > MYPROXY_COPROC_LIMIT) {
+        verror_put_string("certificate_openssl_engine_sessions (%d) must be "
+                          "between 0 and %d",
+                          context->certificate_openssl_engine_sessions,
+                          MYPROXY_COPROC_LIMIT);
+        rval = -1;
+    } else if (context->certificate_openssl_engine_sessions &&
+               !context->certificate_openssl_engine_id) {
+        verror_put_string("certificate_openssl_engine_sessions requires "
+                          "certificate_openssl_engine_id");
+        rval = -1;
+    } else if (context->certificate_openssl_engine_sessions &&
+               context->certificate_callout_timeout <= 0) {
+        verror_put_string("certificate_callout_timeout (%d) <= 0",
+                          context->certificate_callout_timeout);
+        rval = -1;
+    } else if (context->certificate_openssl_engine_sessions) {
+        myproxy_log("Signing with %d OpenSSL engine sessions",
+                    context->certificate_openssl_engine_sessions);
+    }
 	if (context->certificate_mapfile &&
 	    access(context->certificate_mapfile, R_OK) < 0) {
 	    verror_put_string("certificate_mapfile %s not readable",
@@ -1123,6 +1361,14 @@ check_config(myproxy_server_context_t *context)
                           context->certificate_serial_skip);
         verror_put_errno(errno);
         rval = -1;
+    }
+    if (context->certificate_serial_block <= 0) {
+        verror_put_string("certificate_serial_block (%d) <= 0",
+                          context->certificate_serial_block);
+        rval = -1;
+    } else if (context->certificate_serial_block > 1) {
+        myproxy_log("Reserving CA serial numbers %d at a time",
+                    context->certificate_serial_block);
     }
 	if (context->certificate_out_dir &&
 	    access(context->certificate_out_dir, W_OK) < 0) {
@@ -1138,9 +1384,20 @@ check_config(myproxy_server_context_t *context)
 			    context->max_cert_lifetime);
 	    }
 	    if (context->min_keylen) {
-		myproxy_log("minimum key length: %d bits",
+		myproxy_log("minimum RSA key length: %d bits",
                     context->min_keylen);
 	    }
+	    if (context->min_ec_keylen) {
+		myproxy_log("minimum EC key length: %d bits",
+                    context->min_ec_keylen);
+	    }
+	    if (context->accepted_key_types) {
+		int i;
+		for (i=0; context->accepted_key_types[i]; i++) {
+		    myproxy_log("accepted key type: %s",
+				context->accepted_key_types[i]);
+		}
+	    }
 	    if (context->ca_ldap_server) {
 		if (!context->ca_ldap_searchbase) {
 		    verror_put_string("ca_ldap_server requires ca_ldap_searchbase");
@@ -1194,6 +1451,175 @@ check_config(myproxy_server_context_t *context)
     if (context->check_multiple_credentials) {
         myproxy_log("Checking multiple credentials during authorization");
     }
+    if (context->credential_storage) {
+        size_t len = strcspn(context->credential_storage, ":");
+        if ((len == strlen("files") &&
+             !strncmp(context->credential_storage, "files", len)) ||
+#if defined(HAVE_LIBSQLITE3)
+            (len == strlen("sqlite") &&
+             !strncmp(context->credential_storage, "sqlite", len)) ||
+#endif
+            0) {
+            myproxy_log("Using %s credential storage",
+                        context->credential_storage);
+        } else {
+            verror_put_string("unsupported credential_storage: %s",
+                              context->credential_storage);
+            rval = -1;
+        }
+    }
+    if (context->credential_catalog) {
+        myproxy_log("Using indexed credential catalog");
+    }
+    if (context->storage_journal) {
+        myproxy_log("Journaling credential storage changes");
+    }
+    if (context->credential_cache_size < 0) {
+        verror_put_string("credential_cache_size (%d) < 0",
+                          context->credential_cache_size);
+        rval = -1;
+    } else if (context->credential_cache_size) {
+#if HAVE_SYS_INOTIFY_H
+        myproxy_log("Caching metadata for up to %d credentials",
+                    context->credential_cache_size);
+#else
+        myproxy_log("credential_cache_size ignored: "
+                    "inotify not available on this platform");
+#endif
+    }
+    if (context->coalesce_get_requests) {
+        myproxy_log("Coalescing concurrent loads of the same credential");
+    }
+    if (context->signing_key_cache_size < 0 ||
+        context->signing_key_cache_size > MYPROXY_KEY_CACHE_LIMIT) {
+        verror_put_string("signing_key_cache_size (%d) must be between "
+                          "0 and %d", context->signing_key_cache_size,
+                          MYPROXY_KEY_CACHE_LIMIT);
+        rval = -1;
+    } else if (context->signing_key_cache_size &&
+               context->signing_key_cache_ttl <= 0) {
+        verror_put_string("signing_key_cache_ttl (%d) <= 0",
+                          context->signing_key_cache_ttl);
+        rval = -1;
+    } else if (context->signing_key_cache_size) {
+        myproxy_log("Caching up to %d decrypted signing keys for %d seconds",
+                    context->signing_key_cache_size,
+                    context->signing_key_cache_ttl);
+    }
+    if (context->credential_reaper) {
+        if (context->credential_reaper_grace < 0) {
+            verror_put_string("credential_reaper_grace (%d) < 0",
+                              context->credential_reaper_grace);
+            rval = -1;
+        } else if (context->credential_reaper_rate <= 0) {
+            verror_put_string("credential_reaper_rate (%d) <= 0",
+                              context->credential_reaper_rate);
+            rval = -1;
+        } else if (context->credential_reaper_interval < 0) {
+            verror_put_string("credential_reaper_interval (%d) < 0",
+                              context->credential_reaper_interval);
+            rval = -1;
+        } else {
+            myproxy_log("Removing credentials %d seconds after they expire, "
+                        "checking %d per second every %d seconds",
+                        context->credential_reaper_grace,
+                        context->credential_reaper_rate,
+                        context->credential_reaper_interval);
+        }
+    }
+    if (context->passphrase_verifier_cost &&
+        (context->passphrase_verifier_cost < 10 ||
+         context->passphrase_verifier_cost > 22)) {
+        verror_put_string("passphrase_verifier_cost (%d) must be between "
+                          "10 and 22", context->passphrase_verifier_cost);
+        rval = -1;
+    } else if (context->passphrase_verifier_cost) {
+        myproxy_log("Using passphrase verifiers with scrypt cost 2^%d",
+                    context->passphrase_verifier_cost);
+    }
+    if (context->prefork_min_workers < 0) {
+        verror_put_string("prefork_min_workers (%d) < 0",
+                          context->prefork_min_workers);
+        rval = -1;
+    } else if (context->prefork_min_workers > 0) {
+        if (context->prefork_max_workers == 0) {
+            context->prefork_max_workers = context->prefork_min_workers;
+        }
+        if (context->prefork_max_workers < context->prefork_min_workers) {
+            verror_put_string("prefork_max_workers (%d) < prefork_min_workers (%d)",
+                              context->prefork_max_workers,
+                              context->prefork_min_workers);
+            rval = -1;
+        } else if (context->prefork_max_workers >
+                   MYPROXY_PREFORK_WORKER_LIMIT) {
+            verror_put_string("prefork_max_workers (%d) > %d",
+                              context->prefork_max_workers,
+                              MYPROXY_PREFORK_WORKER_LIMIT);
+            rval = -1;
+        } else {
+            myproxy_log("prefork mode enabled: %d to %d workers",
+                        context->prefork_min_workers,
+                        context->prefork_max_workers);
+            if (context->prefork_max_requests > 0) {
+                myproxy_log("workers recycled after %d requests",
+                            context->prefork_max_requests);
+            }
+        }
+    }
+    if (context->prefork_reactor) {
+#if HAVE_SYS_EPOLL_H
+        if (context->prefork_min_workers <= 0) {
+            verror_put_string("prefork_reactor requires prefork_min_workers");
+            rval = -1;
+        } else if (context->prefork_reactor_connections <= 0) {
+            verror_put_string("prefork_reactor_connections (%d) <= 0",
+                              context->prefork_reactor_connections);
+            rval = -1;
+        } else {
+            myproxy_log("prefork reactor enabled: up to %d connections",
+                        context->prefork_reactor_connections);
+        }
+#else
+        verror_put_string("prefork_reactor is configured in myproxy-server.config but epoll is not available on this platform.");
+        rval = -1;
+#endif
+    }
+    if (context->reuseport_listeners > 1) {
+#ifdef SO_REUSEPORT
+        if (context->reuseport_listeners > MYPROXY_MAX_LISTENERS) {
+            verror_put_string("reuseport_listeners (%d) > %d",
+                              context->reuseport_listeners,
+                              MYPROXY_MAX_LISTENERS);
+            rval = -1;
+        } else {
+            myproxy_log("reuseport_listeners: %d listener processes",
+                        context->reuseport_listeners);
+        }
+#else
+        verror_put_string("reuseport_listeners is configured in myproxy-server.config but SO_REUSEPORT is not available on this platform.");
+        rval = -1;
+#endif
+    }
+    if (context->session_resumption) {
+#if GLOBUS
+        verror_put_string("session_resumption is configured in myproxy-server.config but is not supported by GSSAPI MyProxy.");
+        rval = -1;
+#else
+        myproxy_log("TLS session resumption enabled");
+#endif
+    }
+    if (context->keepalive_requests > 1) {
+        if (context->keepalive_timeout <= 0) {
+            verror_put_string("keepalive_timeout (%d) <= 0",
+                              context->keepalive_timeout);
+            rval = -1;
+        } else {
+            myproxy_debug("keep-alive: up to %d requests per connection, "
+                          "%d second idle timeout",
+                          context->keepalive_requests,
+                          context->keepalive_timeout);
+        }
+    }
 
     if (context->proxy_extfile &&
         context->proxy_extapp) {
@@ -237,6 +237,118 @@ ssl_cert_chain_free(STACK_OF(X509)			*cert_chain)
     }
 }
 
+/*
+ * ssl_private_key_pem_string()
+ *
+ * Return the PEM header string to use when writing the given private
+ * key.  RSA, DSA, and EC keys have traditional encodings; other key
+ * types (e.g. Ed25519) are written by i2d_PrivateKey() as PKCS#8.
+ */
+static const char *
+ssl_private_key_pem_string(EVP_PKEY			*key)
+{
+    switch (EVP_PKEY_id(key)) {
+    case EVP_PKEY_RSA:
+	return PEM_STRING_RSA;
+    case EVP_PKEY_DSA:
+	return PEM_STRING_DSA;
+#if !defined(OPENSSL_NO_EC)
+    case EVP_PKEY_EC:
+	return PEM_STRING_ECPRIVATEKEY;
+#endif
+    default:
+	return PEM_STRING_PKCS8INF;
+    }
+}
+
+/*
+ * ssl_generate_private_key()
+ *
+ * Generate a new private key of the given type: "rsa" (using keybits),
+ * "ec" or "p256" (NIST P-256), "p384" (NIST P-384), or "ed25519".
+ *
+ * Returns SSL_SUCCESS or SSL_ERROR, setting verror.
+ */
+static int
+ssl_generate_private_key(EVP_PKEY			**key,
+			 const char			*keytype,
+			 int				keybits)
+{
+    EVP_PKEY_CTX		*ctx = NULL;
+    int				id = EVP_PKEY_RSA;
+    int				curve = NID_undef;
+    int				return_status = SSL_ERROR;
+
+    if (strcasecmp(keytype, "rsa") == 0) {
+	id = EVP_PKEY_RSA;
+#if !defined(OPENSSL_NO_EC)
+    } else if (strcasecmp(keytype, "ec") == 0 ||
+	       strcasecmp(keytype, "p256") == 0) {
+	id = EVP_PKEY_EC;
+	curve = NID_X9_62_prime256v1;
+    } else if (strcasecmp(keytype, "p384") == 0) {
+	id = EVP_PKEY_EC;
+	curve = NID_secp384r1;
+#endif
+#if defined(EVP_PKEY_ED25519)
+    } else if (strcasecmp(keytype, "ed25519") == 0) {
+	id = EVP_PKEY_ED25519;
+#endif
+    } else {
+	verror_put_string("Unsupported key type \"%s\"", keytype);
+	goto error;
+    }
+
+    ctx = EVP_PKEY_CTX_new_id(id, NULL);
+    if (!ctx) {
+        verror_put_string("EVP_PKEY_CTX_new_id() failed");
+	ssl_error_to_verror();
+        goto error;
+    }
+    if (EVP_PKEY_keygen_init(ctx) <= 0) {
+        verror_put_string("EVP_PKEY_keygen_init() failed");
+	ssl_error_to_verror();
+        goto error;
+    }
+    if (id == EVP_PKEY_RSA &&
+	EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, keybits) <= 0) {
+        verror_put_string("EVP_PKEY_CTX_set_rsa_keygen_bits() failed");
+	ssl_error_to_verror();
+        goto error;
+    }
+#if !defined(OPENSSL_NO_EC)
+    if (id == EVP_PKEY_EC) {
+	if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, curve) <= 0) {
+	    verror_put_string("EVP_PKEY_CTX_set_ec_paramgen_curve_nid() failed");
+	    ssl_error_to_verror();
+	    goto error;
+	}
+	/* Peers expect named curves, not explicit parameters. */
+	if (EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE) <= 0) {
+	    verror_put_string("EVP_PKEY_CTX_set_ec_param_enc() failed");
+	    ssl_error_to_verror();
+	    goto error;
+	}
+    }
+#endif
+
+    /* Generate key */
+    if (EVP_PKEY_keygen(ctx, key) <= 0) {
+        verror_put_string("EVP_PKEY_keygen() failed");
+	ssl_error_to_verror();
+        goto error;
+    }
+
+    return_status = SSL_SUCCESS;
+
+  error:
+    if (ctx) {
+	EVP_PKEY_CTX_free(ctx);
+    }
+
+    return return_status;
+}
+
 /*
  * ssl_credentials_free_contents()
  *
@@ -833,8 +945,7 @@ ssl_private_key_store_to_file(SSL_CREDENTIALS *creds,
        PKCS#8 private key format with a high iteration count" per the CHANGES
        file in the openssl tree */
     if (PEM_ASN1_write_bio((int (*)())i2d_PrivateKey,
-		((EVP_PKEY_id(creds->private_key) == EVP_PKEY_DSA)?
-				PEM_STRING_DSA:PEM_STRING_RSA),
+		ssl_private_key_pem_string(creds->private_key),
                            keybio, (void *)creds->private_key, cipher,
                                  (unsigned char *) pass_phrase,
                                  pass_phrase_len,
@@ -1059,14 +1170,416 @@ ssl_proxy_from_pem(SSL_CREDENTIALS		*creds,
     return return_status;
 }
 
-    
+
+/*
+ * Shared credential loads.  When several server processes load the
+ * same credential file with the same pass phrase at once (a burst of
+ * GET requests for one stored credential), the first one reads the
+ * file and decrypts the key, and the others wait for it and parse an
+ * unencrypted copy it leaves in memory shared by the server processes.
+ * A copy is handed out for share_ttl seconds after it is loaded (just
+ * SHARE_WINDOW unless configured as a signing key cache) and wiped by
+ * the next load after that, or when the file is invalidated.  Slots
+ * are found by a salted hash of the file's identity and the pass
+ * phrase, which serves as the verifier for the copy, so a changed file
+ * or a different pass phrase never matches; each hash may use any of
+ * SHARE_WAYS neighbouring slots.  The slots
+ * are locked into memory and left out of core dumps.
+ */
+#define SHARE_EMPTY		0
+#define SHARE_LOADING		1
+#define SHARE_READY		2
+#define SHARE_PEM_MAX		16000	/* larger credentials aren't shared */
+#define SHARE_WINDOW		1	/* seconds a loaded copy is shared */
+#define SHARE_WAIT		5	/* seconds to wait for another load */
+#define SHARE_WAYS		4	/* slots a credential may use */
+
+typedef struct {
+    volatile unsigned int	seq;	/* odd while the slot is changing */
+    volatile int		state;
+    volatile pid_t		pid;	/* process loading the credential */
+    volatile time_t		time;	/* when loading started or ended */
+    unsigned char		hash[SHA256_DIGEST_LENGTH];
+    unsigned char		path_hash[SHA256_DIGEST_LENGTH];
+    int				len;
+    unsigned char		pem[SHARE_PEM_MAX];
+} share_slot_t;
+
+static share_slot_t *share_slots = NULL;
+static int share_nslots = 0;
+static int share_ttl = SHARE_WINDOW;
+static unsigned char share_salt[32];
+
+static int
+share_lock(share_slot_t *slot, unsigned int seq)
+{
+    return !(seq & 1) &&
+	__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1);
+}
+
+static void
+share_unlock(share_slot_t *slot)
+{
+    __sync_fetch_and_add(&slot->seq, 1);
+}
+
+/* Empty the slot, which the caller has locked. */
+static void
+share_wipe(share_slot_t *slot)
+{
+    OPENSSL_cleanse(slot->pem, sizeof(slot->pem));
+    slot->len = 0;
+    slot->state = SHARE_EMPTY;
+}
+
+/* Is the process loading into the slot still there? */
+static int
+share_loader_alive(const share_slot_t *slot, time_t now)
+{
+    return (now - slot->time < SHARE_WAIT &&
+	    (kill(slot->pid, 0) == 0 || errno == EPERM));
+}
+
+/* Is the slot free to be taken? */
+static int
+share_stale(const share_slot_t *slot, time_t now)
+{
+    return (slot->state == SHARE_EMPTY ||
+	    (slot->state == SHARE_READY && now - slot->time > share_ttl) ||
+	    (slot->state == SHARE_LOADING && !share_loader_alive(slot, now)));
+}
+
+/*
+ * share_path_hash()
+ *
+ * Hash the path, to find the slots holding copies of a file.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+share_path_hash(const char *path, unsigned char *path_hash)
+{
+    EVP_MD_CTX		*ctx;
+    unsigned int	hash_len;
+    int			ok;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL) {
+	return -1;
+    }
+    ok = (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+	  EVP_DigestUpdate(ctx, share_salt, sizeof(share_salt)) == 1 &&
+	  EVP_DigestUpdate(ctx, path, strlen(path) + 1) == 1 &&
+	  EVP_DigestFinal_ex(ctx, path_hash, &hash_len) == 1);
+    EVP_MD_CTX_free(ctx);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * share_hash()
+ *
+ * Hash the path, the identity of the file (so a replaced or rewritten
+ * file gets a new hash) and the pass phrase.
+ *
+ * Returns 0 on success, -1 if the file can't be examined.
+ */
+static int
+share_hash(const char *path, const char *pass_phrase, unsigned char *hash)
+{
+    struct stat		s;
+    EVP_MD_CTX		*ctx;
+    unsigned int	hash_len;
+    int			ok;
+
+    if (stat(path, &s) < 0 || (ctx = EVP_MD_CTX_new()) == NULL) {
+	return -1;
+    }
+    ok = (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) == 1 &&
+	  EVP_DigestUpdate(ctx, share_salt, sizeof(share_salt)) == 1 &&
+	  EVP_DigestUpdate(ctx, path, strlen(path) + 1) == 1 &&
+	  EVP_DigestUpdate(ctx, &s.st_dev, sizeof(s.st_dev)) == 1 &&
+	  EVP_DigestUpdate(ctx, &s.st_ino, sizeof(s.st_ino)) == 1 &&
+	  EVP_DigestUpdate(ctx, &s.st_size, sizeof(s.st_size)) == 1 &&
+	  EVP_DigestUpdate(ctx, &s.st_mtime, sizeof(s.st_mtime)) == 1 &&
+	  EVP_DigestUpdate(ctx, &s.st_ctime, sizeof(s.st_ctime)) == 1 &&
+	  (pass_phrase == NULL ||
+	   EVP_DigestUpdate(ctx, pass_phrase, strlen(pass_phrase) + 1) == 1) &&
+	  EVP_DigestFinal_ex(ctx, hash, &hash_len) == 1);
+    EVP_MD_CTX_free(ctx);
+
+    return ok ? 0 : -1;
+}
+
+/*
+ * share_sweep()
+ *
+ * Wipe copies past their time, and free slots whose loader died.
+ */
+static void
+share_sweep(time_t now)
+{
+    share_slot_t	*slot;
+    unsigned int	seq;
+    int			i;
+
+    for (i = 0; i < share_nslots; i++) {
+	slot = &share_slots[i];
+	if (slot->state == SHARE_EMPTY || !share_stale(slot, now)) {
+	    continue;
+	}
+	seq = slot->seq;
+	if (share_lock(slot, seq)) {
+	    if (share_stale(slot, now)) {
+		share_wipe(slot);
+	    }
+	    share_unlock(slot);
+	}
+    }
+}
+
+/*
+ * share_get()
+ *
+ * Look for a copy of the credentials with the given hash, waiting
+ * while another process loads them.
+ *
+ * Returns 1 with an allocated unencrypted copy in *buffer, 0 if the
+ * caller should load the credentials and then call share_put() with
+ * *pslot, or -1 if they can't be shared.
+ */
+static int
+share_get(const unsigned char *hash, const unsigned char *path_hash,
+	  unsigned char **buffer, int *buffer_len, share_slot_t **pslot)
+{
+    share_slot_t	*slot, *victim;
+    unsigned int	seq, victim_seq = 0;
+    time_t		now, deadline, victim_time = 0;
+    int			base, i, same, len, waiting;
+
+    now = time(NULL);
+    deadline = now + SHARE_WAIT;
+    share_sweep(now);
+    base = ((unsigned int)hash[0] | (hash[1] << 8) |
+	    (hash[2] << 16)) % share_nslots;
+
+    while (now < deadline) {
+	victim = NULL;
+	waiting = 0;
+	for (i = 0; i < SHARE_WAYS && i < share_nslots; i++) {
+	    slot = &share_slots[(base + i) % share_nslots];
+	    seq = slot->seq;
+	    if (seq & 1) {
+		continue;	/* being changed */
+	    }
+	    __sync_synchronize();
+	    same = (memcmp(slot->hash, hash, SHA256_DIGEST_LENGTH) == 0);
+	    len = slot->len;
+
+	    if (slot->state == SHARE_READY && same &&
+		now - slot->time <= share_ttl &&
+		len > 0 && len <= SHARE_PEM_MAX) {
+		if ((*buffer = malloc(len)) == NULL) {
+		    return -1;
+		}
+		memcpy(*buffer, slot->pem, len);
+		__sync_synchronize();
+		if (slot->seq == seq) {
+		    *buffer_len = len;
+		    return 1;
+		}
+		OPENSSL_cleanse(*buffer, len);
+		free(*buffer);
+		*buffer = NULL;
+		waiting = 1;	/* changed while we copied it */
+		break;
+	    }
+
+	    if (slot->state == SHARE_LOADING && share_loader_alive(slot, now)) {
+		if (same) {
+		    waiting = 1;
+		    break;
+		}
+		continue;	/* busy with other credentials */
+	    }
+
+	    /* prefer a free slot, else evict the oldest copy */
+	    if (share_stale(slot, now)) {
+		if (victim == NULL || victim_time > 0) {
+		    victim = slot;
+		    victim_seq = seq;
+		    victim_time = 0;
+		}
+	    } else if (victim == NULL ||
+		       (victim_time > 0 && slot->time < victim_time)) {
+		victim = slot;
+		victim_seq = seq;
+		victim_time = slot->time;
+	    }
+	}
+
+	if (waiting) {
+	    usleep(10000);	/* wait for it */
+	    now = time(NULL);
+	    continue;
+	}
+	if (victim == NULL) {
+	    return -1;		/* all busy */
+	}
+	if (share_lock(victim, victim_seq)) {
+	    share_wipe(victim);
+	    memcpy(victim->hash, hash, SHA256_DIGEST_LENGTH);
+	    memcpy(victim->path_hash, path_hash, SHA256_DIGEST_LENGTH);
+	    victim->pid = getpid();
+	    victim->time = now;
+	    victim->state = SHARE_LOADING;
+	    share_unlock(victim);
+	    *pslot = victim;
+	    return 0;
+	}
+	now = time(NULL);	/* lost a race; look again */
+    }
+
+    return -1;
+}
+
+/*
+ * share_put()
+ *
+ * Publish the credentials we loaded into a slot from share_get(), or
+ * give the slot up if creds is NULL (the load failed).
+ */
+static void
+share_put(share_slot_t *slot, const unsigned char *hash,
+	  SSL_CREDENTIALS *creds)
+{
+    unsigned char	*pem = NULL;
+    int			pem_len = 0;
+    int			tries;
+
+    if (creds && ssl_proxy_to_pem(creds, &pem, &pem_len,
+				  NULL) == SSL_ERROR) {
+	verror_clear();
+	pem = NULL;
+    }
+
+    for (tries = 0; !share_lock(slot, slot->seq); tries++) {
+	if (tries > 1000) goto done;
+	usleep(1000);
+    }
+    if (slot->state == SHARE_LOADING && slot->pid == getpid() &&
+	memcmp(slot->hash, hash, SHA256_DIGEST_LENGTH) == 0) {
+	if (pem && pem_len <= SHARE_PEM_MAX) {
+	    memcpy(slot->pem, pem, pem_len);
+	    slot->len = pem_len;
+	    slot->time = time(NULL);
+	    slot->state = SHARE_READY;
+	} else {
+	    share_wipe(slot);
+	}
+    }
+    share_unlock(slot);
+
+  done:
+    if (pem) {
+	OPENSSL_cleanse(pem, pem_len);
+	free(pem);
+    }
+}
+
+int
+ssl_proxy_share_init(int slots, int ttl)
+{
+    size_t			size;
+
+    if (share_slots) {
+	size = share_nslots * sizeof(share_slot_t);
+	OPENSSL_cleanse(share_slots, size);
+	munlock(share_slots, size);
+	munmap(share_slots, size);
+	share_slots = NULL;
+	share_nslots = 0;
+    }
+    if (slots <= 0) {
+	return SSL_SUCCESS;
+    }
+
+    my_init();
+
+    if (RAND_bytes(share_salt, sizeof(share_salt)) != 1) {
+	verror_put_string("Failed to generate salt for shared credentials");
+	ssl_error_to_verror();
+	return SSL_ERROR;
+    }
+    size = slots * sizeof(share_slot_t);
+    share_slots = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (share_slots == MAP_FAILED) {
+	share_slots = NULL;
+	verror_put_errno(errno);
+	verror_put_string("Failed to map shared credential slots");
+	return SSL_ERROR;
+    }
+    if (mlock(share_slots, size) < 0) {
+	verror_put_errno(errno);
+	verror_put_string("Failed to lock %lu bytes of shared credential "
+			  "slots in memory (check RLIMIT_MEMLOCK)",
+			  (unsigned long)size);
+	munmap(share_slots, size);
+	share_slots = NULL;
+	return SSL_ERROR;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(share_slots, size, MADV_DONTDUMP);
+#endif
+    memset(share_slots, 0, size);
+    share_nslots = slots;
+    share_ttl = (ttl > SHARE_WINDOW) ? ttl : SHARE_WINDOW;
+
+    return SSL_SUCCESS;
+}
+
+void
+ssl_proxy_share_invalidate(const char *path)
+{
+    unsigned char	path_hash[SHA256_DIGEST_LENGTH];
+    share_slot_t	*slot;
+    int			i, tries;
+
+    if (share_slots == NULL || path == NULL ||
+	share_path_hash(path, path_hash) == -1) {
+	return;
+    }
+    for (i = 0; i < share_nslots; i++) {
+	slot = &share_slots[i];
+	if (slot->state == SHARE_EMPTY ||
+	    memcmp(slot->path_hash, path_hash, SHA256_DIGEST_LENGTH) != 0) {
+	    continue;
+	}
+	for (tries = 0; !share_lock(slot, slot->seq); tries++) {
+	    if (tries > 1000) break;
+	    usleep(1000);
+	}
+	if (tries > 1000) {
+	    continue;
+	}
+	if (memcmp(slot->path_hash, path_hash, SHA256_DIGEST_LENGTH) == 0) {
+	    /* a load in progress publishes nothing once its slot is gone */
+	    share_wipe(slot);
+	}
+	share_unlock(slot);
+    }
+}
+
 int
 ssl_proxy_load_from_file(SSL_CREDENTIALS	*creds,
 			 const char		*path,
 			 const char		*pass_phrase)
 {
     unsigned char	*buffer = NULL;
-    int			buffer_len;
+    int			buffer_len = 0;
+    unsigned char	hash[SHA256_DIGEST_LENGTH];
+    unsigned char	path_hash[SHA256_DIGEST_LENGTH];
+    share_slot_t	*slot = NULL;
     int			return_status = SSL_ERROR;
     
     assert(creds != NULL);
@@ -1074,6 +1587,22 @@ ssl_proxy_load_from_file(SSL_CREDENTIALS	*creds,
 
     my_init();
 
+    /* Another process may have loaded these, or be loading them. */
+    if (share_slots && share_hash(path, pass_phrase, hash) == 0 &&
+	share_path_hash(path, path_hash) == 0 &&
+	share_get(hash, path_hash, &buffer, &buffer_len, &slot) == 1)
+    {
+	return_status = ssl_proxy_from_pem(creds, buffer, buffer_len, NULL);
+	OPENSSL_cleanse(buffer, buffer_len);
+	free(buffer);
+	buffer = NULL;
+	if (return_status == SSL_SUCCESS)
+	{
+	    return SSL_SUCCESS;
+	}
+	verror_clear();		/* load it ourselves */
+    }
+
     /* Read the whole contents of the given file */
     if (buffer_from_file(path, &buffer, &buffer_len) == -1)
     {
@@ -1090,6 +1619,11 @@ ssl_proxy_load_from_file(SSL_CREDENTIALS	*creds,
     return_status = SSL_SUCCESS;
     
   error:
+    if (slot != NULL)
+    {
+	share_put(slot, hash, (return_status == SSL_SUCCESS) ? creds : NULL);
+    }
+
     if (buffer != NULL)
     {
 	free(buffer);
@@ -1168,8 +1702,7 @@ ssl_proxy_to_pem(SSL_CREDENTIALS		*creds,
        PKCS#8 private key format with a high iteration count" per the CHANGES
        file in the openssl tree */
     if (PEM_ASN1_write_bio((int (*)())i2d_PrivateKey,
-		((EVP_PKEY_id(creds->private_key) == EVP_PKEY_DSA)?
-				PEM_STRING_DSA:PEM_STRING_RSA),
+		ssl_private_key_pem_string(creds->private_key),
                            bio, (void *)creds->private_key, cipher,
 				 (unsigned char *) pass_phrase,
 				 pass_phrase_len,
@@ -1365,6 +1898,254 @@ ssl_certreq_pem_to_der(char *certreq,
     
 }
 
+/*
+ * ssl_keypool_prefix()
+ *
+ * Fill in the file name prefix used for pooled keys of the given type
+ * and size, e.g. "rsa2048-" or "p256-".
+ *
+ * Returns SSL_SUCCESS or SSL_ERROR, setting verror.
+ */
+static int
+ssl_keypool_prefix(const char			*keytype,
+		   int				keybits,
+		   char				*prefix,
+		   size_t			prefix_len)
+{
+    if (strcasecmp(keytype, "rsa") == 0) {
+	snprintf(prefix, prefix_len, "rsa%d-", keybits);
+    } else if (strcasecmp(keytype, "ec") == 0 ||
+	       strcasecmp(keytype, "p256") == 0) {
+	snprintf(prefix, prefix_len, "p256-");
+    } else if (strcasecmp(keytype, "p384") == 0) {
+	snprintf(prefix, prefix_len, "p384-");
+    } else if (strcasecmp(keytype, "ed25519") == 0) {
+	snprintf(prefix, prefix_len, "ed25519-");
+    } else {
+	verror_put_string("Unsupported key type \"%s\"", keytype);
+	return SSL_ERROR;
+    }
+
+    return SSL_SUCCESS;
+}
+
+/*
+ * ssl_keypool_check_dir()
+ *
+ * Verify that the key pool directory is a directory owned by us and
+ * not accessible to anyone else, since it holds unencrypted keys.
+ *
+ * Returns SSL_SUCCESS or SSL_ERROR, setting verror.
+ */
+static int
+ssl_keypool_check_dir(const char		*pooldir)
+{
+    struct stat			s;
+
+    if (lstat(pooldir, &s) < 0) {
+	verror_put_string("key pool %s: %s", pooldir, strerror(errno));
+	return SSL_ERROR;
+    }
+    if (!S_ISDIR(s.st_mode)) {
+	verror_put_string("key pool %s is not a directory", pooldir);
+	return SSL_ERROR;
+    }
+    if (s.st_uid != geteuid()) {
+	verror_put_string("key pool %s is not owned by the current user",
+			  pooldir);
+	return SSL_ERROR;
+    }
+    if (s.st_mode & (S_IRWXG | S_IRWXO)) {
+	verror_put_string("key pool %s must not be accessible by group "
+			  "or other (mode 0700)", pooldir);
+	return SSL_ERROR;
+    }
+
+    return SSL_SUCCESS;
+}
+
+int
+ssl_keypool_count(const char			*pooldir,
+		  const char			*keytype,
+		  int				keybits)
+{
+    DIR				*dir = NULL;
+    struct dirent		*de;
+    char			prefix[32];
+    int				count = 0;
+
+    if (ssl_keypool_prefix(keytype, keybits, prefix,
+			   sizeof(prefix)) == SSL_ERROR ||
+	ssl_keypool_check_dir(pooldir) == SSL_ERROR) {
+	return -1;
+    }
+    if ((dir = opendir(pooldir)) == NULL) {
+	verror_put_string("opendir(%s): %s", pooldir, strerror(errno));
+	return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+	if (strncmp(de->d_name, prefix, strlen(prefix)) == 0) {
+	    count++;
+	}
+    }
+    closedir(dir);
+
+    return count;
+}
+
+int
+ssl_keypool_fill(const char			*pooldir,
+		 const char			*keytype,
+		 int				keybits,
+		 int				count)
+{
+    static int			serial = 0;
+    EVP_PKEY			*key = NULL;
+    BIO				*bio = NULL;
+    char			prefix[32];
+    char			tmppath[MAXPATHLEN], path[MAXPATHLEN];
+    int				have, added = 0, fd;
+    mode_t			oldumask;
+
+    have = ssl_keypool_count(pooldir, keytype, keybits);
+    if (have < 0) {
+	return -1;
+    }
+    ssl_keypool_prefix(keytype, keybits, prefix, sizeof(prefix));
+
+    for (; have < count; have++) {
+	if (ssl_generate_private_key(&key, keytype, keybits) == SSL_ERROR) {
+	    goto error;
+	}
+	serial++;
+	snprintf(path, sizeof(path), "%s/%s%ld-%ld-%d.pem", pooldir,
+		 prefix, (long)time(NULL), (long)getpid(), serial);
+	/* Write under a dot-name so the key can't be claimed half-written. */
+	snprintf(tmppath, sizeof(tmppath), "%s/.%s%ld-%ld-%d.tmp", pooldir,
+		 prefix, (long)time(NULL), (long)getpid(), serial);
+	oldumask = umask(0077);
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	umask(oldumask);
+	if (fd < 0) {
+	    verror_put_string("open(%s): %s", tmppath, strerror(errno));
+	    goto error;
+	}
+	bio = BIO_new_fd(fd, BIO_CLOSE);
+	if (bio == NULL) {
+	    verror_put_string("BIO_new_fd() failed");
+	    ssl_error_to_verror();
+	    close(fd);
+	    unlink(tmppath);
+	    goto error;
+	}
+	if (PEM_ASN1_write_bio((int (*)())i2d_PrivateKey,
+			       ssl_private_key_pem_string(key),
+			       bio, (void *)key, NULL, NULL, 0,
+			       PEM_NO_CALLBACK) == SSL_ERROR) {
+	    verror_put_string("Error writing private key to %s", tmppath);
+	    ssl_error_to_verror();
+	    unlink(tmppath);
+	    goto error;
+	}
+	BIO_free(bio);
+	bio = NULL;
+	EVP_PKEY_free(key);
+	key = NULL;
+	if (rename(tmppath, path) < 0) {
+	    verror_put_string("rename(%s, %s): %s", tmppath, path,
+			      strerror(errno));
+	    unlink(tmppath);
+	    goto error;
+	}
+	added++;
+    }
+
+    return added;
+
+  error:
+    if (bio) {
+	BIO_free(bio);
+    }
+    if (key) {
+	EVP_PKEY_free(key);
+    }
+    return -1;
+}
+
+#if !GLOBUS
+/*
+ * ssl_keypool_take()
+ *
+ * Claim a pre-generated private key of the given type and size from
+ * the key pool directory, removing it from the pool.  Keys are claimed
+ * by renaming them, so concurrent clients never share a key.
+ *
+ * Returns SSL_SUCCESS, or SSL_ERROR if no usable key was found, in
+ * which case the caller should generate one.  Does not set verror.
+ */
+static int
+ssl_keypool_take(const char			*pooldir,
+		 const char			*keytype,
+		 int				keybits,
+		 EVP_PKEY			**key)
+{
+    DIR				*dir = NULL;
+    struct dirent		*de;
+    BIO				*bio = NULL;
+    char			prefix[32];
+    char			path[MAXPATHLEN], claimed[MAXPATHLEN];
+    int				return_status = SSL_ERROR;
+
+    /* An unsupported key type is reported by ssl_generate_private_key(). */
+    if (ssl_keypool_prefix(keytype, keybits, prefix,
+			   sizeof(prefix)) == SSL_ERROR) {
+	verror_clear();
+	return SSL_ERROR;
+    }
+    if (ssl_keypool_check_dir(pooldir) == SSL_ERROR) {
+	myproxy_log("not using key pool: %s", verror_get_string());
+	verror_clear();
+	return SSL_ERROR;
+    }
+    if ((dir = opendir(pooldir)) == NULL) {
+	myproxy_debug("opendir(%s): %s", pooldir, strerror(errno));
+	return SSL_ERROR;
+    }
+    while (return_status == SSL_ERROR && (de = readdir(dir)) != NULL) {
+	if (strncmp(de->d_name, prefix, strlen(prefix)) != 0) {
+	    continue;
+	}
+	snprintf(path, sizeof(path), "%s/%s", pooldir, de->d_name);
+	snprintf(claimed, sizeof(claimed), "%s/.claimed-%ld-%s", pooldir,
+		 (long)getpid(), de->d_name);
+	if (rename(path, claimed) < 0) {
+	    continue;		/* another client got it first */
+	}
+	bio = BIO_new_file(claimed, "r");
+	if (bio != NULL) {
+	    *key = PEM_read_bio_PrivateKey(bio, NULL, PEM_NO_CALLBACK);
+	    BIO_free(bio);
+	}
+	if (ssl_proxy_file_destroy(claimed) == SSL_ERROR) {
+	    unlink(claimed);
+	    verror_clear();
+	}
+	if (*key != NULL) {
+	    myproxy_debug("using pre-generated key %s", de->d_name);
+	    return_status = SSL_SUCCESS;
+	}
+    }
+    closedir(dir);
+    ERR_clear_error();
+
+    if (return_status == SSL_ERROR) {
+	myproxy_debug("no %s keys available in key pool %s", keytype, pooldir);
+    }
+
+    return return_status;
+}
+#endif /* !GLOBUS */
+
 int
 ssl_proxy_delegation_init(SSL_CREDENTIALS	**new_creds,
 			  unsigned char		**buffer,
@@ -1383,6 +2164,10 @@ ssl_proxy_delegation_init(SSL_CREDENTIALS	**new_creds,
 #endif
     char                *keybitsenv = NULL;
     int                 keybits = MYPROXY_DEFAULT_KEYBITS;
+#if !GLOBUS
+    const char          *keytype = NULL;
+    const char          *keypool = NULL;
+#endif
 
     my_init();
     
@@ -1393,6 +2178,11 @@ ssl_proxy_delegation_init(SSL_CREDENTIALS	**new_creds,
     if ((keybitsenv = getenv("MYPROXY_KEYBITS")) != NULL) {
         keybits = atoi(keybitsenv);
     }
+#if !GLOBUS
+    if ((keytype = getenv("MYPROXY_KEYTYPE")) == NULL) {
+        keytype = MYPROXY_DEFAULT_KEYTYPE;
+    }
+#endif
 
     *new_creds = ssl_credentials_new();
 
@@ -1451,29 +2241,12 @@ ssl_proxy_delegation_init(SSL_CREDENTIALS	**new_creds,
 	goto error;
     }
 #else
-    EVP_PKEY_CTX *ctx;
-    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
-    if (!ctx) {
-        verror_put_string("EVP_PKEY_CTX_new_id() failed");
-	ssl_error_to_verror();
-        goto error;
-    }
-    if (EVP_PKEY_keygen_init(ctx) <= 0) {
-        verror_put_string("EVP_PKEY_keygen_init() failed");
-	ssl_error_to_verror();
-        goto error;
-    }
-    if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, keybits) <= 0) {
-        verror_put_string("EVP_PKEY_CTX_set_rsa_keygen_bits() failed");
-	ssl_error_to_verror();
-        goto error;
-    }
-
-    /* Generate key */
-    if (EVP_PKEY_keygen(ctx, &((*new_creds)->private_key)) <= 0) {
-        verror_put_string("EVP_PKEY_keygen() failed");
-	ssl_error_to_verror();
-        goto error;
+    if (((keypool = getenv("MYPROXY_KEYPOOL")) == NULL ||
+	 ssl_keypool_take(keypool, keytype, keybits,
+			  &((*new_creds)->private_key)) == SSL_ERROR) &&
+	ssl_generate_private_key(&((*new_creds)->private_key),
+				 keytype, keybits) == SSL_ERROR) {
+	goto error;
     }
 
     X509_REQ *req = X509_REQ_new();
@@ -2520,6 +3293,115 @@ ssl_get_times(const char *path, time_t *not_before, time_t *not_after)
    return 0;
 }
 
+/*
+ * Convert an ASN1_TIME to seconds since the epoch.
+ */
+static int
+ssl_asn1_time_to_time_t(const ASN1_TIME *t, time_t *result)
+{
+    ASN1_TIME *epoch = NULL;
+    int days, secs, return_value = -1;
+
+    if ((epoch = ASN1_TIME_set(NULL, 0)) != NULL &&
+        ASN1_TIME_diff(&days, &secs, epoch, t)) {
+        *result = (time_t)days * 86400 + secs;
+        return_value = 0;
+    }
+    if (epoch) ASN1_TIME_free(epoch);
+
+    return return_value;
+}
+
+int
+ssl_get_cert_info(const char *path, time_t *not_before, time_t *not_after,
+                  char **subject, char **fingerprint)
+{
+    SSL_CREDENTIALS *creds = NULL;
+    EVP_MD_CTX      *ctx = NULL;
+    X509            *cert = NULL;
+    unsigned char   *der = NULL;
+    unsigned char   md[EVP_MAX_MD_SIZE];
+    unsigned int    md_len = 0, i;
+    int             der_len, n, return_value = -1;
+
+    assert(path != NULL);
+
+    if (not_before) *not_before = 0;
+    if (not_after) *not_after = 0;
+    if (subject) *subject = NULL;
+    if (fingerprint) *fingerprint = NULL;
+
+    creds = ssl_credentials_new();
+    if (ssl_certificate_load_from_file(creds, path) != SSL_SUCCESS) {
+        goto error;
+    }
+
+    if ((ctx = EVP_MD_CTX_create()) == NULL ||
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1) {
+        verror_put_string("Error computing certificate fingerprint");
+        ssl_error_to_verror();
+        goto error;
+    }
+
+    /* Walk the certificate followed by the rest of the chain. */
+    for (n = -1; n < sk_X509_num(creds->certificate_chain); n++) {
+        time_t t;
+
+        cert = (n < 0) ? creds->certificate :
+            sk_X509_value(creds->certificate_chain, n);
+
+        if (not_before &&
+            ssl_asn1_time_to_time_t(X509_get0_notBefore(cert), &t) == 0 &&
+            (*not_before == 0 || *not_before < t)) {
+            *not_before = t;
+        }
+        if (not_after &&
+            ssl_asn1_time_to_time_t(X509_get0_notAfter(cert), &t) == 0 &&
+            (*not_after == 0 || *not_after > t)) {
+            *not_after = t;
+        }
+
+        der = NULL;
+        if ((der_len = i2d_X509(cert, &der)) < 0 ||
+            EVP_DigestUpdate(ctx, der, der_len) != 1) {
+            verror_put_string("Error computing certificate fingerprint");
+            ssl_error_to_verror();
+            goto error;
+        }
+        OPENSSL_free(der);
+        der = NULL;
+    }
+
+    if (EVP_DigestFinal_ex(ctx, md, &md_len) != 1) {
+        verror_put_string("Error computing certificate fingerprint");
+        ssl_error_to_verror();
+        goto error;
+    }
+    if (fingerprint) {
+        *fingerprint = malloc(md_len*2+1);
+        for (i = 0; i < md_len; i++) {
+            sprintf(*fingerprint+i*2, "%02x", md[i]);
+        }
+    }
+
+    if (subject && ssl_get_base_subject(creds, subject) != SSL_SUCCESS) {
+        goto error;
+    }
+
+    return_value = 0;
+
+  error:
+    if (der) OPENSSL_free(der);
+    if (ctx) EVP_MD_CTX_destroy(ctx);
+    if (creds) ssl_credentials_destroy(creds);
+    if (return_value == -1 && fingerprint && *fingerprint) {
+        free(*fingerprint);
+        *fingerprint = NULL;
+    }
+
+    return return_value;
+}
+
 int
 ssl_verify_cred(const char path[])
 {
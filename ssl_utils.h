@@ -147,6 +147,29 @@ int ssl_proxy_load_from_file(SSL_CREDENTIALS		*creds,
 			     const char			*path,
 			     const char			*pass_phrase);
 
+/*
+ * ssl_proxy_share_init()
+ *
+ * Let processes forked after this call share the credentials they
+ * load with ssl_proxy_load_from_file(), so a file wanted by many
+ * processes at once is read and decrypted only once.  With a ttl of
+ * more than a second, a loaded copy also serves later loads with the
+ * same pass phrase for ttl seconds.  slots bounds the number of
+ * credentials kept at once; a value of 0 stops sharing.  Copies are
+ * kept in locked memory and wiped when they expire.
+ *
+ * Returns SSL_SUCCESS or SSL_ERROR, setting verror.
+ */
+int ssl_proxy_share_init(int slots, int ttl);
+
+/*
+ * ssl_proxy_share_invalidate()
+ *
+ * Wipe any shared copies of the credentials in the file at path, for
+ * when the file is replaced or removed.
+ */
+void ssl_proxy_share_invalidate(const char *path);
+
 /*
  * ssl_proxy_to_pem()
  *
@@ -216,6 +239,10 @@ int ssl_certreq_pem_to_der(char *certreq,
  * requested_bits will be used as the key length for the
  * new proxy. If 0 then the length of user_certificate key
  * will be used.
+ * The MYPROXY_KEYTYPE environment variable selects an RSA
+ * (default), EC P-256/P-384, or Ed25519 key.  If MYPROXY_KEYPOOL
+ * is set, a pre-generated key is taken from that directory when
+ * one is available (see ssl_keypool_fill()).
  *
  * callback can point to a function that will be called
  * during key generation - see SSLeay's doc/rsa.doc
@@ -230,6 +257,33 @@ int ssl_proxy_delegation_init(SSL_CREDENTIALS	**new_creds,
 			      void		(*callback)(int,int,void *));
 
 
+/*
+ * ssl_keypool_count()
+ *
+ * Return the number of pre-generated keys of the given type ("rsa",
+ * "p256", "p384", or "ed25519") and size (RSA only) waiting in the
+ * key pool directory, or -1 on error, setting verror.  The directory
+ * must be owned by the current user with mode 0700.
+ */
+int ssl_keypool_count(const char		*pooldir,
+		      const char		*keytype,
+		      int			keybits);
+
+/*
+ * ssl_keypool_fill()
+ *
+ * Generate keys into the key pool directory until it holds count
+ * keys of the given type and size.  When MYPROXY_KEYPOOL names the
+ * directory, ssl_proxy_delegation_init() takes its keys from the pool
+ * instead of generating them.
+ *
+ * Returns the number of keys added, or -1 on error, setting verror.
+ */
+int ssl_keypool_fill(const char			*pooldir,
+		     const char			*keytype,
+		     int			keybits,
+		     int			count);
+
 /*
  * ssl_proxy_delegation_finalize()
  *
@@ -434,6 +488,21 @@ int ssl_limited_proxy_file(const char path[]);
  */
 int ssl_get_times(const char *proxyfile, time_t *not_before, time_t *not_after);
 
+/*
+ * ssl_get_cert_info()
+ *
+ * Read the certificate chain in path and return its validity period
+ * (the intersection of the validity periods of all certificates in the
+ * chain), the base subject of the first certificate, and a fingerprint
+ * of the chain (hex-encoded SHA-256 over the DER encoding of each
+ * certificate in order).  Any of the output parameters may be NULL.
+ * The caller should free subject and fingerprint.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ssl_get_cert_info(const char *path, time_t *not_before, time_t *not_after,
+                      char **subject, char **fingerprint);
+
 /*
  * ssl_error_to_verror()
  *